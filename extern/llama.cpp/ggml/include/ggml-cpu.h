@@ -34,6 +34,17 @@ extern "C" {
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // copy a read-only buffer (e.g. model weights) to every NUMA node when the strategy is GGML_NUMA_STRATEGY_MIRROR
+    // matrix multiplications then read src0 from the copy on the node of the computing thread
+    // returns false if replication is not enabled or failed, in which case the original memory is used
+    // must not be called while a graph using the buffer is being computed
+    GGML_BACKEND_API bool    ggml_numa_replicate(const void * data, size_t size);
+    GGML_BACKEND_API void    ggml_numa_replicate_free(const void * data);
+
+    // buffer of the CPU repack buffer type wrapping memory that already contains repacked weights (e.g. a memory mapped cache file)
+    // the memory is not owned by the buffer and tensors allocated in it are not repacked again
+    GGML_BACKEND_API ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_from_ptr(void * ptr, size_t size);
+
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
@@ -115,6 +126,7 @@ extern "C" {
         ggml_vec_dot_t           vec_dot;
         enum ggml_type           vec_dot_type;
         int64_t                  nrows; // number of rows to process simultaneously
+        ggml_to_float_t          to_float; // SIMD dequantization, NULL = use ggml_get_type_traits()->to_float
     };
 
     GGML_BACKEND_API const struct ggml_type_traits_cpu * ggml_get_type_traits_cpu(enum ggml_type type);
@@ -1371,7 +1371,7 @@ struct tinygemm_kernel_avx<float, ggml_fp16_t, float, BLOCK_M, BLOCK_N, BLOCK_K>
 #define LAUNCH_TINYGEMM_KERNEL_AVX(MB_SIZE, NB_SIZE)                                \
     tinygemm_kernel_avx<float, type, float, MB_SIZE, NB_SIZE, blck_size>::apply(    \
         K, (const float *)src1->data + mb_start * K,                                \
-        (const type *)src0->data + nb_start * K,                                    \
+        (const type *)ggml_numa_tensor_data(params, src0) + nb_start * K,          \
         (float *)dst->data + mb_start * ldc + nb_start, ldc);
 
 
@@ -2022,7 +2022,7 @@ struct tinygemm_kernel_vnni<block_q8_K, block_iq4_xs, float, BLOCK_M, BLOCK_N, B
 #define LAUNCH_TINYGEMM_KERNEL_VNNI(NB_SIZE)                                         \
     tinygemm_kernel_vnni<vec_dot_type, type, float, 1, NB_SIZE, blck_size>::apply(   \
         KB, (const char *)wdata + 0 * row_size_A,                                    \
-        (const char *)src0->data + PACKED_INDEX(nb * kTilesN, 0, KB, TILE_SIZE),     \
+        (const char *)ggml_numa_tensor_data(params, src0) + PACKED_INDEX(nb * kTilesN, 0, KB, TILE_SIZE), \
         (float *) dst->data + 0 * N + nb_start, ldc)
 
 template <typename TA, typename TB, typename TC, int BLOCK_K,
@@ -2502,7 +2502,7 @@ void ggml_backend_amx_mul_mat(const ggml_compute_params * params, struct ggml_te
                 tinygemm_kernel_amx<vec_dot_type, type, float, blck_size>(
                     mb_size, nb_size, KB,
                     (const char *)wdata + mb_start * row_size_A,
-                    (const char *)src0->data + PACKED_INDEX(nb * 2, 0, KB, TILE_SIZE),
+                    (const char *)ggml_numa_tensor_data(params, src0) + PACKED_INDEX(nb * 2, 0, KB, TILE_SIZE),
                     (float *) dst->data + mb_start * N + nb_start, ldc);
             }
         });
@@ -0,0 +1,18 @@
+#pragma once
+
+// integer multiply-add helpers shared by the x86 quants.c and repack.cpp
+
+#include <immintrin.h>
+
+#if defined(__AVX2__)
+// multiply int16_t, add results pairwise and accumulate into the int32_t vector
+static inline __m256i mul_add_i16_pairs_acc_int32x8(const __m256i acc, const __m256i x, const __m256i y) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpwssd_epi32(acc, x, y);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpwssd_avx_epi32(acc, x, y);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+#endif
+}
+#endif
@@ -7,6 +7,7 @@
 
 #include "../../quants.h"
 #include "../../ggml-cpu-impl.h"
+#include "int-dot.h"
 
 #include <math.h>
 #include <string.h>
@@ -287,6 +288,73 @@ static inline float hsum_float_4x4(const __m128 a, const __m128 b, const __m128
 #endif // __AVX__ || __AVX2__ || __AVX512F__
 #endif // defined(__AVX__) || defined(__AVX2__) || defined(__AVX512F__) || defined(__SSSE3__)
 
+void quantize_row_q4_0(const float * GGML_RESTRICT x, void * GGML_RESTRICT vy, int64_t k) {
+    assert(QK4_0 == 32);
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    block_q4_0 * GGML_RESTRICT y = vy;
+
+#if defined(__AVX2__)
+    const __m256 signBit = _mm256_set1_ps( -0.0f );
+    const __m256 off     = _mm256_set1_ps( 8.5f );
+    const __m256i fifteen = _mm256_set1_epi32( 15 );
+    const __m256i perm   = _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 );
+
+    for (int i = 0; i < nb; i++) {
+        __m256 v0 = _mm256_loadu_ps( x );
+        __m256 v1 = _mm256_loadu_ps( x + 8 );
+        __m256 v2 = _mm256_loadu_ps( x + 16 );
+        __m256 v3 = _mm256_loadu_ps( x + 24 );
+
+        __m256 maxAbs = _mm256_andnot_ps( signBit, v0 );
+        maxAbs = _mm256_max_ps( maxAbs, _mm256_andnot_ps( signBit, v1 ) );
+        maxAbs = _mm256_max_ps( maxAbs, _mm256_andnot_ps( signBit, v2 ) );
+        maxAbs = _mm256_max_ps( maxAbs, _mm256_andnot_ps( signBit, v3 ) );
+
+        __m128 max4 = _mm_max_ps( _mm256_extractf128_ps( maxAbs, 1 ), _mm256_castps256_ps128( maxAbs ) );
+        max4 = _mm_max_ps( max4, _mm_movehl_ps( max4, max4 ) );
+        max4 = _mm_max_ss( max4, _mm_movehdup_ps( max4 ) );
+        const float amax = _mm_cvtss_f32( max4 );
+
+        // the scale keeps the sign of the first element of largest magnitude, as in the reference
+        float max = 0.0f;
+        for (int j = 0; j < QK4_0; j++) {
+            if (fabsf(x[j]) == amax) {
+                max = x[j];
+                break;
+            }
+        }
+
+        const float d  = max / -8;
+        const float id = d ? 1.0f/d : 0.0f;
+        y[i].d = GGML_CPU_FP32_TO_FP16(d);
+
+        // x*id is in [-8, 8], so truncating x*id + 8.5 rounds to the nearest level
+        const __m256 mul = _mm256_set1_ps( id );
+        __m256i i0 = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( v0, mul ), off ) ), fifteen );
+        __m256i i1 = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( v1, mul ), off ) ), fifteen );
+        __m256i i2 = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( v2, mul ), off ) ), fifteen );
+        __m256i i3 = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( v3, mul ), off ) ), fifteen );
+
+        // pack to 32 bytes in element order, then fold the upper 16 into the high nibbles
+        i0 = _mm256_packs_epi32( i0, i1 );
+        i2 = _mm256_packs_epi32( i2, i3 );
+        i0 = _mm256_permutevar8x32_epi32( _mm256_packs_epi16( i0, i2 ), perm );
+
+        const __m128i lo = _mm256_castsi256_si128( i0 );
+        const __m128i hi = _mm256_extracti128_si256( i0, 1 );
+        _mm_storeu_si128((__m128i *) y[i].qs, _mm_or_si128( lo, _mm_slli_epi16( hi, 4 ) ));
+
+        x += QK4_0;
+    }
+#else
+    GGML_UNUSED(nb);
+    // scalar
+    quantize_row_q4_0_ref(x, y, k);
+#endif
+}
+
 void quantize_row_q8_0(const float * GGML_RESTRICT x, void * GGML_RESTRICT vy, int64_t k) {
     assert(QK8_0 == 32);
     assert(k % QK8_0 == 0);
@@ -385,6 +453,63 @@ void quantize_row_q8_0(const float * GGML_RESTRICT x, void * GGML_RESTRICT vy, i
 #endif
 }
 
+void dequantize_row_q4_0_cpu(const void * GGML_RESTRICT vx, float * GGML_RESTRICT y, int64_t k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    const block_q4_0 * GGML_RESTRICT x = vx;
+
+#if defined(__AVX2__)
+    const __m128i m4 = _mm_set1_epi8( 0x0F );
+    const __m128i m8 = _mm_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps( GGML_CPU_FP16_TO_FP32(x[i].d) );
+
+        const __m128i qs = _mm_loadu_si128((const __m128i *) x[i].qs);
+        const __m128i lo = _mm_sub_epi8( _mm_and_si128( qs, m4 ), m8 );
+        const __m128i hi = _mm_sub_epi8( _mm_and_si128( _mm_srli_epi16( qs, 4 ), m4 ), m8 );
+
+        _mm256_storeu_ps(y +  0, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( lo ) ) ));
+        _mm256_storeu_ps(y +  8, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_srli_si128( lo, 8 ) ) ) ));
+        _mm256_storeu_ps(y + 16, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( hi ) ) ));
+        _mm256_storeu_ps(y + 24, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_srli_si128( hi, 8 ) ) ) ));
+
+        y += QK4_0;
+    }
+#else
+    GGML_UNUSED(nb);
+    dequantize_row_q4_0(x, y, k);
+#endif
+}
+
+void dequantize_row_q8_0_cpu(const void * GGML_RESTRICT vx, float * GGML_RESTRICT y, int64_t k) {
+    assert(k % QK8_0 == 0);
+    const int nb = k / QK8_0;
+
+    const block_q8_0 * GGML_RESTRICT x = vx;
+
+#if defined(__AVX2__)
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps( GGML_CPU_FP16_TO_FP32(x[i].d) );
+
+        const __m256i qs = _mm256_loadu_si256((const __m256i *) x[i].qs);
+        const __m128i q0 = _mm256_castsi256_si128( qs );
+        const __m128i q1 = _mm256_extracti128_si256( qs, 1 );
+
+        _mm256_storeu_ps(y +  0, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( q0 ) ) ));
+        _mm256_storeu_ps(y +  8, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_srli_si128( q0, 8 ) ) ) ));
+        _mm256_storeu_ps(y + 16, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( q1 ) ) ));
+        _mm256_storeu_ps(y + 24, _mm256_mul_ps( d, _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_srli_si128( q1, 8 ) ) ) ));
+
+        y += QK8_0;
+    }
+#else
+    GGML_UNUSED(nb);
+    dequantize_row_q8_0(x, y, k);
+#endif
+}
+
 void quantize_row_q8_1(const float * GGML_RESTRICT x, void * GGML_RESTRICT vy, int64_t k) {
     assert(k % QK8_1 == 0);
     const int nb = k / QK8_1;
@@ -1335,15 +1460,10 @@ void ggml_vec_dot_q2_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
             __m256i p2 = _mm256_maddubs_epi16(q2_2, q8_2);
             __m256i p3 = _mm256_maddubs_epi16(q2_3, q8_3);
 
-            p0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(0)), p0);
-            p1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
-            p2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(2)), p2);
-            p3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
-
-            p0 = _mm256_add_epi32(p0, p1);
-            p2 = _mm256_add_epi32(p2, p3);
-
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p0, p2));
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(0)), p0);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(2)), p2);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
         }
 
         acc = _mm256_fmadd_ps(_mm256_broadcast_ss(&d), _mm256_cvtepi32_ps(sumi), acc);
@@ -1566,16 +1686,11 @@ void ggml_vec_dot_q3_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
-            // multiply with scales
-            p16_0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 0)), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
-            p16_2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 2)), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
-
-            // accumulate
-            p16_0 = _mm256_add_epi32(p16_0, p16_1);
-            p16_2 = _mm256_add_epi32(p16_2, p16_3);
-            sumi  = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_2));
+            // multiply with scales and accumulate
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 0)), p16_0);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 2)), p16_2);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
 
         }
 
@@ -1801,15 +1916,12 @@ void ggml_vec_dot_q4_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
             const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
 
             const __m256i q8l = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
-            __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
-            p16l = _mm256_madd_epi16(scale_l, p16l);
+            const __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, scale_l, p16l);
 
             const __m256i q8h = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
-            __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
-            p16h = _mm256_madd_epi16(scale_h, p16h);
-            const __m256i sumj = _mm256_add_epi32(p16l, p16h);
-
-            sumi = _mm256_add_epi32(sumi, sumj);
+            const __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, scale_h, p16h);
         }
 
         __m256 vd = _mm256_set1_ps(d);
@@ -1997,13 +2109,11 @@ void ggml_vec_dot_q5_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
             const __m256i q8_0 = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
             const __m256i q8_1 = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
 
-            __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
-            __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
+            const __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
+            const __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
 
-            p16_0 = _mm256_madd_epi16(scale_0, p16_0);
-            p16_1 = _mm256_madd_epi16(scale_1, p16_1);
-
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, scale_0, p16_0);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, scale_1, p16_1);
 
         }
 
@@ -2203,13 +2313,10 @@ void ggml_vec_dot_q6_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
-            p16_0 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_0), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_1), p16_1);
-            p16_2 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_2), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_3), p16_3);
-
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_2, p16_3));
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_cvtepi8_epi16(scale_0), p16_0);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_cvtepi8_epi16(scale_1), p16_1);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_cvtepi8_epi16(scale_2), p16_2);
+            sumi = mul_add_i16_pairs_acc_int32x8(sumi, _mm256_cvtepi8_epi16(scale_3), p16_3);
 
         }
 
@@ -17,6 +17,7 @@
 
 #define GGML_CPU_CLANG_WORKAROUND
 #include "../../repack.h"
+#include "int-dot.h"
 
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
@@ -1547,6 +1548,41 @@ void ggml_gemv_q4_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
                     // B0(28-31) B4(28-31) B1(28-31) B5(28-31) B2(28-31) B6(28-31) B3(28-31) B7(28-31) with A0(28-31)
 
 
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+                    // vpdpbusd sums the four products of a 32 bit lane straight into int32, the lane belongs to a single column
+                    // (both 16 bit scales of a lane are equal), so the scale is applied once per sub block
+                    __m256i iacc_0 = _mm256_setzero_si256();
+                    __m256i iacc_1 = _mm256_setzero_si256();
+
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(rhs_vec_0123_00 ,_mm256_shuffle_epi32(rhs_vec_4567_00, 177), 170), _mm256_shuffle_epi32(lhs_vec_00, 0));
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_00, 177) ,rhs_vec_4567_00, 170), _mm256_shuffle_epi32(lhs_vec_00, 85));
+
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(rhs_vec_0123_01 ,_mm256_shuffle_epi32(rhs_vec_4567_01, 177), 170), _mm256_shuffle_epi32(lhs_vec_00, 170));
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_01, 177) ,rhs_vec_4567_01, 170), _mm256_shuffle_epi32(lhs_vec_00, 255));
+
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(rhs_vec_0123_02 ,_mm256_shuffle_epi32(rhs_vec_4567_02, 177), 170), _mm256_shuffle_epi32(lhs_vec_01, 0));
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_02, 177) ,rhs_vec_4567_02, 170), _mm256_shuffle_epi32(lhs_vec_01, 85));
+
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(rhs_vec_0123_03 ,_mm256_shuffle_epi32(rhs_vec_4567_03, 177), 170), _mm256_shuffle_epi32(lhs_vec_01, 170));
+                    iacc_0 = mul_sum_us8_pairs_acc_int32x8(iacc_0, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_03, 177) ,rhs_vec_4567_03, 170), _mm256_shuffle_epi32(lhs_vec_01, 255));
+
+                    iacc_0 = _mm256_mullo_epi32(iacc_0, _mm256_srli_epi32(scales_0, 16));
+
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(rhs_vec_0123_10 ,_mm256_shuffle_epi32(rhs_vec_4567_10, 177), 170), _mm256_shuffle_epi32(lhs_vec_10, 0));
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_10, 177) ,rhs_vec_4567_10, 170), _mm256_shuffle_epi32(lhs_vec_10, 85));
+
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(rhs_vec_0123_11 ,_mm256_shuffle_epi32(rhs_vec_4567_11, 177), 170), _mm256_shuffle_epi32(lhs_vec_10, 170));
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_11, 177) ,rhs_vec_4567_11, 170), _mm256_shuffle_epi32(lhs_vec_10, 255));
+
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(rhs_vec_0123_12 ,_mm256_shuffle_epi32(rhs_vec_4567_12, 177), 170), _mm256_shuffle_epi32(lhs_vec_11, 0));
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_12, 177) ,rhs_vec_4567_12, 170), _mm256_shuffle_epi32(lhs_vec_11, 85));
+
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(rhs_vec_0123_13 ,_mm256_shuffle_epi32(rhs_vec_4567_13, 177), 170), _mm256_shuffle_epi32(lhs_vec_11, 170));
+                    iacc_1 = mul_sum_us8_pairs_acc_int32x8(iacc_1, _mm256_blend_epi32(_mm256_shuffle_epi32(rhs_vec_0123_13, 177) ,rhs_vec_4567_13, 170), _mm256_shuffle_epi32(lhs_vec_11, 255));
+
+                    iacc_1 = _mm256_mullo_epi32(iacc_1, _mm256_srli_epi32(scales_1, 16));
+
+#else
                     __m256i iacc_0 = _mm256_setzero_si256();
                     __m256i iacc_1 = _mm256_setzero_si256();
 
@@ -1578,18 +1614,18 @@ void ggml_gemv_q4_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
 
                     iacc_1 = _mm256_madd_epi16(iacc_1, scales_1);
 
+#endif
                     // Accumulate the iacc value for one sb
                     __m256i iacc_sb = _mm256_add_epi32(iacc_0, iacc_1);
 
                     // Broadcast the bsums of the two sub blocks  of the iteration of Q8_K across the vector
                     // Multiply-Add with corresponding mins of Q4_Kx8 with bsums
                     __m256i q8s_sb = _mm256_shuffle_epi32(q8s, 0);
-                    __m256i iacc_min_sb = _mm256_madd_epi16(q8s_sb, mins_01);
                     q8s = _mm256_bsrli_epi128(q8s, 4);
 
                     // Accumulate for the complete block
                     iacc_b = _mm256_add_epi32(iacc_b, iacc_sb);
-                    iacc_min_b = _mm256_add_epi32(iacc_min_b, iacc_min_sb);
+                    iacc_min_b = mul_add_i16_pairs_acc_int32x8(iacc_min_b, q8s_sb, mins_01);
                 }
 
                 // Multiply-Add with scale values for the complete super block
@@ -1938,6 +1974,188 @@ void ggml_gemv_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
 #endif
 }
 
+#if defined(__AVX2__)
+// Unpack chunk c of the Q5_Kx8/Q6_Kx8 layouts into unsigned bytes
+// lo holds 8 quants of each of the rows 0, 1, 4, 5 and hi of the rows 2, 3, 6, 7, see repack.h
+static inline void q5_Kx8_load_chunk(const block_q5_Kx8 * b, int c, __m256i & lo, __m256i & hi) {
+    const __m256i m4b   = _mm256_set1_epi8(0x0F);
+    const __m256i bit4  = _mm256_set1_epi8(0x10);
+    const __m256i hmask_lo = _mm256_set_epi64x(0x0808080808080808, 0x0404040404040404, 0x0202020202020202, 0x0101010101010101);
+    const __m256i hmask_hi = _mm256_slli_epi16(hmask_lo, 4);
+
+    const __m256i ql = _mm256_loadu_si256((const __m256i *)(b->qs + c * 32));
+    int64_t qh_64;
+    memcpy(&qh_64, b->qh + c * 8, sizeof(qh_64));
+    const __m256i qh = _mm256_set1_epi64x(qh_64);
+
+    lo = _mm256_or_si256(_mm256_and_si256(ql, m4b),
+                         _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(qh, hmask_lo), hmask_lo), bit4));
+    hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql, 4), m4b),
+                         _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(qh, hmask_hi), hmask_hi), bit4));
+}
+
+static inline void q6_Kx8_load_chunk(const block_q6_Kx8 * b, int c, __m256i & lo, __m256i & hi) {
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+    const __m256i m2b = _mm256_set1_epi8(0x03);
+
+    const __m256i ql     = _mm256_loadu_si256((const __m256i *)(b->ql + c * 32));
+    const __m128i qh_128 = _mm_loadu_si128((const __m128i *)(b->qh + c * 16));
+    const __m256i qh     = _mm256_set_m128i(_mm_srli_epi16(qh_128, 2), qh_128);
+
+    lo = _mm256_or_si256(_mm256_and_si256(ql, m4b),
+                         _mm256_slli_epi16(_mm256_and_si256(qh, m2b), 4));
+    hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql, 4), m4b),
+                         _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 4), m2b), 4));
+}
+
+// Scales and mins of sub-block sb of the Q5_Kx8 block, one int32 per row
+static inline void q5_Kx8_load_scales_mins(const block_q5_Kx8 * b, int sb, __m256i & scales, __m256i & mins) {
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+    memcpy(utmp, b->scales + sb * 12, 12);
+    utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+    const uint32_t uaux = utmp[1] & kmask1;
+    utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+    utmp[2] = uaux;
+    utmp[0] &= kmask1;
+
+    const __m128i scales_mins = _mm_loadu_si128((const __m128i *) utmp);
+    scales = _mm256_cvtepu8_epi32(scales_mins);
+    mins   = _mm256_cvtepu8_epi32(_mm_unpackhi_epi64(scales_mins, scales_mins));
+}
+
+// 8 consecutive Q8_K quants repeated in each 64-bit lane
+static inline __m256i q8_K_repeat_load_8(const int8_t * qs) {
+    int64_t v;
+    memcpy(&v, qs, sizeof(v));
+    return _mm256_set1_epi64x(v);
+}
+
+// Sum the int16 pair products of the lo and hi halves into one int32 per row, in natural row order
+static inline __m256i q_Kx8_row_sums(const __m256i sum_lo, const __m256i sum_hi) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    return _mm256_hadd_epi32(_mm256_madd_epi16(sum_lo, ones), _mm256_madd_epi16(sum_hi, ones));
+}
+#endif
+
+void ggml_gemv_q5_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+#if defined(__AVX2__)
+    const int nb = n / QK_K;
+
+    assert (n % QK_K == 0);
+    assert (nc % 8 == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+    for (int x = 0; x < nc / 8; x++) {
+        const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+
+        for (int l = 0; l < nb; l++) {
+            __m256i iacc     = _mm256_setzero_si256();
+            __m256i iacc_min = _mm256_setzero_si256();
+
+            for (int sb = 0; sb < 8; sb++) {
+                // the hardware prefetcher falls behind on the qs/qh streams, fetch the next block ahead
+                _mm_prefetch((const char *)(b_ptr + l + 1) + sb * 192,       _MM_HINT_T0);
+                _mm_prefetch((const char *)(b_ptr + l + 1) + sb * 192 + 64,  _MM_HINT_T0);
+                _mm_prefetch((const char *)(b_ptr + l + 1) + sb * 192 + 128, _MM_HINT_T0);
+
+                // the int16 sums of the 4 chunks of a sub-block stay below 4 * 2 * 31 * 127
+                __m256i sum_lo = _mm256_setzero_si256();
+                __m256i sum_hi = _mm256_setzero_si256();
+                for (int c = sb * 4; c < sb * 4 + 4; c++) {
+                    __m256i q_lo, q_hi;
+                    q5_Kx8_load_chunk(&b_ptr[l], c, q_lo, q_hi);
+                    const __m256i a = q8_K_repeat_load_8(a_ptr[l].qs + c * 8);
+                    sum_lo = _mm256_add_epi16(sum_lo, _mm256_maddubs_epi16(q_lo, a));
+                    sum_hi = _mm256_add_epi16(sum_hi, _mm256_maddubs_epi16(q_hi, a));
+                }
+
+                __m256i scales, mins;
+                q5_Kx8_load_scales_mins(&b_ptr[l], sb, scales, mins);
+                const int bsum = a_ptr[l].bsums[sb * 2] + a_ptr[l].bsums[sb * 2 + 1];
+
+                iacc     = _mm256_add_epi32(iacc, _mm256_mullo_epi32(q_Kx8_row_sums(sum_lo, sum_hi), scales));
+                iacc_min = _mm256_add_epi32(iacc_min, _mm256_mullo_epi32(mins, _mm256_set1_epi32(bsum)));
+            }
+
+            const __m256 row_scale = _mm256_set1_ps(a_ptr[l].d);
+            const __m256 col_scale = _mm256_mul_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), row_scale);
+            const __m256 col_dmin  = _mm256_mul_ps(GGML_F32Cx8_LOAD(b_ptr[l].dmin), row_scale);
+
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc), col_scale, acc);
+            acc = _mm256_fnmadd_ps(_mm256_cvtepi32_ps(iacc_min), col_dmin, acc);
+        }
+
+        _mm256_storeu_ps(s + x * 8, acc);
+    }
+#else
+    ggml_gemv_q5_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
+
+void ggml_gemv_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+#if defined(__AVX2__)
+    const int nb = n / QK_K;
+
+    assert (n % QK_K == 0);
+    assert (nc % 8 == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+    for (int x = 0; x < nc / 8; x++) {
+        const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+
+        for (int l = 0; l < nb; l++) {
+            __m256i iacc = _mm256_setzero_si256();
+
+            for (int g = 0; g < QK_K / 16; g++) {
+                // the hardware prefetcher falls behind on the ql/qh streams, fetch the next block ahead
+                _mm_prefetch((const char *)(b_ptr + l + 1) + g * 128,      _MM_HINT_T0);
+                _mm_prefetch((const char *)(b_ptr + l + 1) + g * 128 + 64, _MM_HINT_T0);
+
+                // the int16 sums of the 2 chunks of a group stay below 2 * 2 * 63 * 127
+                __m256i sum_lo = _mm256_setzero_si256();
+                __m256i sum_hi = _mm256_setzero_si256();
+                for (int c = g * 2; c < g * 2 + 2; c++) {
+                    __m256i q_lo, q_hi;
+                    q6_Kx8_load_chunk(&b_ptr[l], c, q_lo, q_hi);
+                    const __m256i a = q8_K_repeat_load_8(a_ptr[l].qs + c * 8);
+                    sum_lo = _mm256_add_epi16(sum_lo, _mm256_maddubs_epi16(q_lo, a));
+                    sum_hi = _mm256_add_epi16(sum_hi, _mm256_maddubs_epi16(q_hi, a));
+                }
+
+                // the quants are stored with an offset of 32
+                const __m256i sum    = _mm256_sub_epi32(q_Kx8_row_sums(sum_lo, sum_hi), _mm256_set1_epi32(32 * a_ptr[l].bsums[g]));
+                const __m256i scales = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(b_ptr[l].scales + g * 8)));
+
+                iacc = _mm256_add_epi32(iacc, _mm256_mullo_epi32(sum, scales));
+            }
+
+            const __m256 col_scale = _mm256_mul_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), _mm256_set1_ps(a_ptr[l].d));
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc), col_scale, acc);
+        }
+
+        _mm256_storeu_ps(s + x * 8, acc);
+    }
+#else
+    ggml_gemv_q6_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
+
 void ggml_gemm_q4_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
 #if defined(__AVX2__) || defined(__AVX512F__)
     {
@@ -6305,3 +6523,140 @@ void ggml_gemm_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const vo
 
 #endif
 }
+
+
+void ggml_gemm_q5_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+#if defined(__AVX2__)
+    const int nb = n / QK_K;
+
+    assert (n % QK_K == 0);
+    assert (nr % 4 == 0);
+    assert (nc % 8 == 0);
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+
+        for (int x = 0; x < nc / 8; x++) {
+            const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+            __m256 acc[4];
+            for (int m = 0; m < 4; m++) {
+                acc[m] = _mm256_setzero_ps();
+            }
+
+            for (int l = 0; l < nb; l++) {
+                __m256i iacc[4];
+                __m256i iacc_min[4];
+                for (int m = 0; m < 4; m++) {
+                    iacc[m]     = _mm256_setzero_si256();
+                    iacc_min[m] = _mm256_setzero_si256();
+                }
+
+                for (int sb = 0; sb < 8; sb++) {
+                    // unpack the sub-block once and reuse it for the 4 rows of the LHS
+                    __m256i q_lo[4], q_hi[4];
+                    for (int c = 0; c < 4; c++) {
+                        q5_Kx8_load_chunk(&b_ptr[l], sb * 4 + c, q_lo[c], q_hi[c]);
+                    }
+
+                    __m256i scales, mins;
+                    q5_Kx8_load_scales_mins(&b_ptr[l], sb, scales, mins);
+
+                    for (int m = 0; m < 4; m++) {
+                        __m256i sum_lo = _mm256_setzero_si256();
+                        __m256i sum_hi = _mm256_setzero_si256();
+                        for (int c = 0; c < 4; c++) {
+                            const __m256i a = q8_K_repeat_load_8(a_ptr[l].qs + (sb * 4 + c) * 32 + m * 8);
+                            sum_lo = _mm256_add_epi16(sum_lo, _mm256_maddubs_epi16(q_lo[c], a));
+                            sum_hi = _mm256_add_epi16(sum_hi, _mm256_maddubs_epi16(q_hi[c], a));
+                        }
+
+                        // bsums of the 16-element groups 2*sb and 2*sb + 1 of row m
+                        const int16_t * bsums = a_ptr[l].bsums + (sb / 2) * 16 + m * 4 + (sb % 2) * 2;
+
+                        iacc[m]     = _mm256_add_epi32(iacc[m], _mm256_mullo_epi32(q_Kx8_row_sums(sum_lo, sum_hi), scales));
+                        iacc_min[m] = _mm256_add_epi32(iacc_min[m], _mm256_mullo_epi32(mins, _mm256_set1_epi32(bsums[0] + bsums[1])));
+                    }
+                }
+
+                const __m256 col_scale = GGML_F32Cx8_LOAD(b_ptr[l].d);
+                const __m256 col_dmin  = GGML_F32Cx8_LOAD(b_ptr[l].dmin);
+                for (int m = 0; m < 4; m++) {
+                    const __m256 row_scale = _mm256_set1_ps(a_ptr[l].d[m]);
+                    acc[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc[m]), _mm256_mul_ps(col_scale, row_scale), acc[m]);
+                    acc[m] = _mm256_fnmadd_ps(_mm256_cvtepi32_ps(iacc_min[m]), _mm256_mul_ps(col_dmin, row_scale), acc[m]);
+                }
+            }
+
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * 8, acc[m]);
+            }
+        }
+    }
+#else
+    ggml_gemm_q5_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
+
+void ggml_gemm_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+#if defined(__AVX2__)
+    const int nb = n / QK_K;
+
+    assert (n % QK_K == 0);
+    assert (nr % 4 == 0);
+    assert (nc % 8 == 0);
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+
+        for (int x = 0; x < nc / 8; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+            __m256 acc[4];
+            for (int m = 0; m < 4; m++) {
+                acc[m] = _mm256_setzero_ps();
+            }
+
+            for (int l = 0; l < nb; l++) {
+                __m256i iacc[4];
+                for (int m = 0; m < 4; m++) {
+                    iacc[m] = _mm256_setzero_si256();
+                }
+
+                for (int g = 0; g < QK_K / 16; g++) {
+                    // unpack the group once and reuse it for the 4 rows of the LHS
+                    __m256i q_lo[2], q_hi[2];
+                    q6_Kx8_load_chunk(&b_ptr[l], g * 2 + 0, q_lo[0], q_hi[0]);
+                    q6_Kx8_load_chunk(&b_ptr[l], g * 2 + 1, q_lo[1], q_hi[1]);
+
+                    const __m256i scales = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(b_ptr[l].scales + g * 8)));
+
+                    for (int m = 0; m < 4; m++) {
+                        const __m256i a0 = q8_K_repeat_load_8(a_ptr[l].qs + (g * 2 + 0) * 32 + m * 8);
+                        const __m256i a1 = q8_K_repeat_load_8(a_ptr[l].qs + (g * 2 + 1) * 32 + m * 8);
+                        const __m256i sum_lo = _mm256_add_epi16(_mm256_maddubs_epi16(q_lo[0], a0), _mm256_maddubs_epi16(q_lo[1], a1));
+                        const __m256i sum_hi = _mm256_add_epi16(_mm256_maddubs_epi16(q_hi[0], a0), _mm256_maddubs_epi16(q_hi[1], a1));
+
+                        // the quants are stored with an offset of 32
+                        const int bsum = a_ptr[l].bsums[(g / 4) * 16 + m * 4 + (g % 4)];
+                        const __m256i sum = _mm256_sub_epi32(q_Kx8_row_sums(sum_lo, sum_hi), _mm256_set1_epi32(32 * bsum));
+
+                        iacc[m] = _mm256_add_epi32(iacc[m], _mm256_mullo_epi32(sum, scales));
+                    }
+                }
+
+                const __m256 col_scale = GGML_F32Cx8_LOAD(b_ptr[l].d);
+                for (int m = 0; m < 4; m++) {
+                    acc[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc[m]), _mm256_mul_ps(col_scale, _mm256_set1_ps(a_ptr[l].d[m])), acc[m]);
+                }
+            }
+
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * 8, acc[m]);
+            }
+        }
+    }
+#else
+    ggml_gemm_q6_K_8x8_q8_K_generic(n, s, bs, vx, vy, nr, nc);
+#endif
+}
@@ -24,6 +24,9 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_threadpool * threadpool;
+
+    // src0 data of the node being computed in the replica on the NUMA node of this thread, NULL if not replicated
+    const void * src0_numa;
 };
 
 
@@ -512,6 +515,16 @@ void ggml_barrier(struct ggml_threadpool * tp);
 void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value);
 int  ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value);
 
+// mul_mat quantizes src1 into a part at the end of the work buffer that the other ops do not use
+// returns it, *cached is true when it still holds src1 quantized with the same layout by an earlier mul_mat
+void * ggml_cpu_src1_wdata(const struct ggml_compute_params * params, const struct ggml_tensor * src1, int layout, size_t size, bool * cached);
+// record the quantized src1, called by all threads after the barrier that follows the quantization
+void   ggml_cpu_src1_wdata_set(const struct ggml_compute_params * params, const struct ggml_tensor * src1, int layout);
+
+// data of src0 of the node being computed, in the replica on the NUMA node of the calling thread (GGML_NUMA_STRATEGY_MIRROR)
+// returns tensor->data if src0 is not replicated
+const void * ggml_numa_tensor_data(const struct ggml_compute_params * params, const struct ggml_tensor * tensor);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,8 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -215,6 +217,7 @@ static const struct ggml_type_traits_cpu type_traits_cpu[GGML_TYPE_COUNT] = {
 #else
         .nrows                    = 1,
 #endif
+        .to_float                 = dequantize_row_q4_0_cpu,
     },
     [GGML_TYPE_Q4_1] = {
         .from_float               = quantize_row_q4_1,
@@ -247,6 +250,7 @@ static const struct ggml_type_traits_cpu type_traits_cpu[GGML_TYPE_COUNT] = {
 #else
         .nrows                    = 1,
 #endif
+        .to_float                 = dequantize_row_q8_0_cpu,
     },
     [GGML_TYPE_Q8_1] = {
         .from_float               = quantize_row_q8_1,
@@ -437,7 +441,40 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+// Barrier arrivals go through a combining tree with this fan-in once the thread count reaches GGML_BARRIER_TREE_MIN_THREADS,
+// so that no counter is hit by more than GGML_BARRIER_FANIN threads
+// note: the threshold and the fan-in have not been tuned against the flat counter on a multi-core machine
+#define GGML_BARRIER_FANIN            8
+#define GGML_BARRIER_TREE_MIN_THREADS 64
+#define GGML_BARRIER_TREE_NODES       (GGML_MAX_N_THREADS / GGML_BARRIER_FANIN * 2)
+
+struct ggml_barrier_node {
+    atomic_int GGML_CACHE_ALIGN n;
+};
+
 // Threadpool def
+struct ggml_numa_replica;
+
+// per-node decisions that only depend on the graph
+// they are made once in ggml_graph_compute and reused while the same graph (same uid) is computed again
+struct ggml_graph_info {
+    uint64_t              uid;
+    struct ggml_tensor ** nodes;
+    int                   n_nodes;
+    int                   numa_gen;
+
+    int n_alloc;
+
+    // replica holding src0 of each mul_mat node (GGML_NUMA_STRATEGY_MIRROR), NULL if src0 is not replicated
+    const struct ggml_numa_replica ** src0_replica;
+
+    // node computed together with each node by a fused kernel, -1 if the node is computed on its own
+    int32_t * fused;
+
+    // part at the end of the work buffer that holds the quantized src1 of mul_mat, see ggml_cpu_src1_wdata
+    size_t src1_work_size;
+};
+
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
     ggml_cond_t  cond;        // cond.var for waiting for new work
@@ -451,6 +488,21 @@ struct ggml_threadpool {
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
     atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
+    // threads parked on a futex, the waker skips the syscall when there are none
+    atomic_int GGML_CACHE_ALIGN n_barrier_sleepers; // waiting on n_barrier_passed
+    atomic_int GGML_CACHE_ALIGN n_work_sleepers;    // waiting on n_work_wakeups for new work
+    atomic_int GGML_CACHE_ALIGN n_work_wakeups;     // bumped after n_graph or stop change
+
+    struct ggml_barrier_node barrier_tree[GGML_BARRIER_TREE_NODES];
+
+    // decisions that only depend on the graph, see ggml_graph_info_update
+    struct ggml_graph_info graph_info;
+
+    // src1 of the last mul_mat that quantized it into the src1 part of the work buffer, and the layout it used
+    // the mul_mats that follow with the same src1 (the Q/K/V projections, ffn gate and up) skip the quantization
+    const struct ggml_tensor * src1_cached;
+    int                        src1_cached_layout;
+
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
@@ -463,6 +515,10 @@ struct ggml_threadpool {
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
 
+    uint64_t     barrier_spin; // max relax rounds in ggml_barrier before parking, derived from poll
+    uint64_t     barrier_spin_min;
+    uint64_t     work_spin;    // relax rounds while waiting for new work before parking, derived from poll
+
     enum ggml_status ec;
 };
 
@@ -473,9 +529,15 @@ struct ggml_compute_state {
     bool cpumask[GGML_MAX_N_THREADS];
     int  last_graph;
     bool pending;
+    uint64_t barrier_spin; // current spin budget, between threadpool->barrier_spin_min and barrier_spin
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+
+    // mul_mat chunks [chunk_next, chunk_end) owned by this thread, claimed from the front by the owner
+    // and by threads that ran out of their own chunks
+    atomic_int GGML_CACHE_ALIGN chunk_next;
+    int chunk_end;
 };
 
 // Helpers for polling loops
@@ -491,6 +553,81 @@ static inline void ggml_thread_cpu_relax(void) {
 static inline void ggml_thread_cpu_relax(void) {;}
 #endif
 
+#ifndef GGML_USE_OPENMP
+
+// The cost of ggml_thread_cpu_relax varies by an order of magnitude between CPUs (e.g. PAUSE is ~10 cycles before
+// Skylake and ~140 after), so spin budgets are given in microseconds and converted with a one-time measurement
+static uint64_t ggml_thread_cpu_relax_per_us(void) {
+    static atomic_int relax_per_us = 0;
+
+    int n = atomic_load_explicit(&relax_per_us, memory_order_relaxed);
+    if (n == 0) {
+        const int n_rounds = 4096;
+
+        const int64_t t_start = ggml_time_us();
+        for (int i = 0; i < n_rounds; i++) {
+            ggml_thread_cpu_relax();
+        }
+        const int64_t t_end = ggml_time_us();
+
+        n = MIN(MAX(n_rounds / MAX(t_end - t_start, 1), 1), 1000);
+        atomic_store_explicit(&relax_per_us, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+// Parking for spinning threads that ran out of their budget
+#if defined(__gnu_linux__)
+#define GGML_USE_FUTEX
+
+static inline void ggml_futex_wait(atomic_int * addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void ggml_futex_wake_all(atomic_int * addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+// Wait until *addr != val, spinning for up to n_spin rounds first. Returns false if the thread had to park.
+static bool ggml_thread_wait_while_eq(atomic_int * addr, int val, uint64_t n_spin, atomic_int * n_sleepers) {
+    for (uint64_t i = 0; i < n_spin; i++) {
+        if (atomic_load_explicit(addr, memory_order_relaxed) != val) {
+            return true;
+        }
+        ggml_thread_cpu_relax();
+    }
+
+#ifdef GGML_USE_FUTEX
+    // pairs with the seq-cst update + sleeper check in ggml_thread_wake: either the waker sees us or we see its update
+    atomic_fetch_add_explicit(n_sleepers, 1, memory_order_seq_cst);
+    while (atomic_load_explicit(addr, memory_order_seq_cst) == val) {
+        ggml_futex_wait(addr, val);
+    }
+    atomic_fetch_add_explicit(n_sleepers, -1, memory_order_relaxed);
+#else
+    UNUSED(n_sleepers);
+    while (atomic_load_explicit(addr, memory_order_relaxed) == val) {
+        sched_yield();
+    }
+#endif
+    return false;
+}
+
+// Wake the threads parked on addr, must follow a seq-cst update of *addr
+static inline void ggml_thread_wake(atomic_int * addr, atomic_int * n_sleepers) {
+#ifdef GGML_USE_FUTEX
+    if (atomic_load_explicit(n_sleepers, memory_order_seq_cst) > 0) {
+        ggml_futex_wake_all(addr);
+    }
+#else
+    UNUSED(addr);
+    UNUSED(n_sleepers);
+#endif
+}
+
+#endif // GGML_USE_OPENMP
+
 //
 // NUMA support
 //
@@ -520,12 +657,71 @@ struct ggml_numa_nodes {
 // ggml state
 //
 
+// read-only memory ranges copied to every node with GGML_NUMA_STRATEGY_MIRROR
+struct ggml_numa_replica {
+    const char * base;
+    size_t       size;
+    void *       copies[GGML_NUMA_MAX_NODES];
+
+    struct ggml_numa_replica * next;
+};
+
+struct ggml_numa_replicas {
+    struct ggml_numa_replica * head; // guarded by ggml_critical_section
+    atomic_int gen;                  // changes whenever a replica is added or freed
+};
+
 struct ggml_state {
     struct ggml_numa_nodes numa;
+    struct ggml_numa_replicas replicas;
 };
 
 static struct ggml_state g_state = {0};
 
+#ifndef GGML_USE_OPENMP
+// index of the calling thread in the threadpool, picks its leaf in the barrier tree
+#if defined(_MSC_VER) && !defined(__clang__)
+static __declspec(thread) int ggml_barrier_ith = 0;
+#else
+static _Thread_local int ggml_barrier_ith = 0;
+#endif
+
+// Count the arrival of the calling thread, returns true for the last one.
+// Counters are reset by the last arriving thread before the barrier is released.
+static bool ggml_barrier_arrive(struct ggml_threadpool * tp, int n_threads) {
+    if (n_threads < GGML_BARRIER_TREE_MIN_THREADS) {
+        if (atomic_fetch_add_explicit(&tp->n_barrier, 1, memory_order_seq_cst) != n_threads - 1) {
+            return false;
+        }
+        atomic_store_explicit(&tp->n_barrier, 0, memory_order_relaxed);
+        return true;
+    }
+
+    // the last thread of each group of GGML_BARRIER_FANIN continues to the next level
+    int idx    = ggml_barrier_ith;
+    int n_cur  = n_threads;
+    int offset = 0;
+    while (true) {
+        const int n_groups = (n_cur + GGML_BARRIER_FANIN - 1) / GGML_BARRIER_FANIN;
+        const int group    = idx / GGML_BARRIER_FANIN;
+        const int n_group  = MIN(GGML_BARRIER_FANIN, n_cur - group * GGML_BARRIER_FANIN);
+
+        atomic_int * counter = &tp->barrier_tree[offset + group].n;
+        if (atomic_fetch_add_explicit(counter, 1, memory_order_seq_cst) != n_group - 1) {
+            return false;
+        }
+        atomic_store_explicit(counter, 0, memory_order_relaxed);
+
+        if (n_groups == 1) {
+            return true;
+        }
+        offset += n_groups;
+        n_cur   = n_groups;
+        idx     = group;
+    }
+}
+#endif
+
 void ggml_barrier(struct ggml_threadpool * tp) {
     int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
     if (n_threads == 1) {
@@ -538,20 +734,21 @@ void ggml_barrier(struct ggml_threadpool * tp) {
     int n_passed = atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed);
 
     // enter barrier (full seq-cst fence)
-    int n_barrier = atomic_fetch_add_explicit(&tp->n_barrier, 1, memory_order_seq_cst);
-
-    if (n_barrier == (n_threads - 1)) {
+    if (ggml_barrier_arrive(tp, n_threads)) {
         // last thread
-        atomic_store_explicit(&tp->n_barrier, 0, memory_order_relaxed);
-
         // exit barrier (fill seq-cst fence)
         atomic_fetch_add_explicit(&tp->n_barrier_passed, 1, memory_order_seq_cst);
+        ggml_thread_wake(&tp->n_barrier_passed, &tp->n_barrier_sleepers);
         return;
     }
 
-    // wait for other threads
-    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
-        ggml_thread_cpu_relax();
+    // wait for other threads, spin for a bounded time and then park so that oversubscribed cores are not burned
+    // the budget of each thread adapts: it halves when spinning did not pay off and doubles when it did
+    struct ggml_compute_state * state = &tp->workers[ggml_barrier_ith];
+    if (ggml_thread_wait_while_eq(&tp->n_barrier_passed, n_passed, state->barrier_spin, &tp->n_barrier_sleepers)) {
+        state->barrier_spin = MIN(state->barrier_spin * 2, tp->barrier_spin);
+    } else {
+        state->barrier_spin = MAX(state->barrier_spin / 2, tp->barrier_spin_min);
     }
 
     // exit barrier (full seq-cst fence)
@@ -572,6 +769,61 @@ int ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value) {
     return atomic_fetch_add_explicit(&tp->current_chunk, value, memory_order_relaxed);
 }
 
+// Give the chunks [start, end) to thread ith, a barrier must follow before chunks are claimed
+static void ggml_threadpool_chunks_assign(struct ggml_threadpool * tp, int ith, int start, int end) {
+    struct ggml_compute_state * state = &tp->workers[ith];
+    state->chunk_end = end;
+    atomic_store_explicit(&state->chunk_next, start, memory_order_relaxed);
+}
+
+void * ggml_cpu_src1_wdata(const struct ggml_compute_params * params, const struct ggml_tensor * src1, int layout, size_t size, bool * cached) {
+    const struct ggml_cplan * cplan = params->threadpool->cplan;
+    const size_t src1_work_size = params->threadpool->graph_info.src1_work_size;
+    GGML_ASSERT(size <= src1_work_size);
+
+    *cached = params->threadpool->src1_cached == src1 && params->threadpool->src1_cached_layout == layout;
+
+    return cplan->work_data + cplan->work_size - src1_work_size;
+}
+
+void ggml_cpu_src1_wdata_set(const struct ggml_compute_params * params, const struct ggml_tensor * src1, int layout) {
+    if (params->ith == 0) {
+        params->threadpool->src1_cached        = src1;
+        params->threadpool->src1_cached_layout = layout;
+    }
+}
+
+// a node that writes into the data of the cached src1 (an in-place op, a copy into a view of it) makes the quantized
+// copy stale. mul_mat never does, and its threads may still be reading the cache state when thread 0 gets here
+static void ggml_cpu_src1_wdata_check(struct ggml_threadpool * tp, const struct ggml_tensor * node) {
+    const struct ggml_tensor * src1 = tp->src1_cached;
+
+    if (src1 != NULL && node->op != GGML_OP_MUL_MAT &&
+            (const char *) node->data < (const char *) src1->data + ggml_nbytes(src1) &&
+            (const char *) src1->data < (const char *) node->data + ggml_nbytes(node)) {
+        tp->src1_cached = NULL;
+    }
+}
+
+// Claim the next chunk from the own range, or steal one from the other threads starting with the closest one.
+// Returns -1 once all chunks are taken.
+static int ggml_threadpool_chunk_claim(struct ggml_threadpool * tp, int ith, int nth) {
+    for (int i = 0; i < nth; i++) {
+        struct ggml_compute_state * victim = &tp->workers[(ith + i) % nth];
+
+        // skip exhausted ranges without writing to their cache line
+        if (atomic_load_explicit(&victim->chunk_next, memory_order_relaxed) >= victim->chunk_end) {
+            continue;
+        }
+
+        const int chunk = atomic_fetch_add_explicit(&victim->chunk_next, 1, memory_order_relaxed);
+        if (chunk < victim->chunk_end) {
+            return chunk;
+        }
+    }
+    return -1;
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -679,6 +931,102 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+bool ggml_numa_replicate(const void * data, size_t size) {
+#if defined(__gnu_linux__) && defined(SYS_mbind)
+    if (!ggml_is_numa() || g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR || size == 0) {
+        return false;
+    }
+
+    struct ggml_numa_replica * r = calloc(1, sizeof(struct ggml_numa_replica));
+    GGML_ASSERT(r);
+
+    for (uint32_t node = 0; node < g_state.numa.n_nodes; ++node) {
+        void * copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            GGML_LOG_WARN("%s: failed to allocate %zu bytes on node %u: %s\n", __func__, size, node, strerror(errno));
+            for (uint32_t i = 0; i < node; ++i) {
+                munmap(r->copies[i], size);
+            }
+            free(r);
+            return false;
+        }
+
+        // bind before the pages are touched so that the copy is allocated on the node
+        const int mpol_bind = 2;
+        unsigned long nodemask = 1ul << node;
+        if (syscall(SYS_mbind, copy, size, mpol_bind, &nodemask, sizeof(nodemask)*CHAR_BIT, 0) != 0) {
+            GGML_LOG_WARN("%s: mbind to node %u failed: %s\n", __func__, node, strerror(errno));
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(copy, size, MADV_HUGEPAGE);
+#endif
+        memcpy(copy, data, size);
+        mprotect(copy, size, PROT_READ);
+
+        r->copies[node] = copy;
+    }
+
+    r->base = (const char *) data;
+    r->size = size;
+
+    ggml_critical_section_start();
+    r->next = g_state.replicas.head;
+    g_state.replicas.head = r;
+    atomic_fetch_add(&g_state.replicas.gen, 1);
+    ggml_critical_section_end();
+
+    GGML_LOG_DEBUG("%s: replicated %zu KiB on %u NUMA nodes\n", __func__, size/1024, g_state.numa.n_nodes);
+
+    return true;
+#else
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    return false;
+#endif
+}
+
+void ggml_numa_replicate_free(const void * data) {
+#if defined(__gnu_linux__)
+    struct ggml_numa_replica * r = NULL;
+
+    ggml_critical_section_start();
+    for (struct ggml_numa_replica ** pr = &g_state.replicas.head; *pr; pr = &(*pr)->next) {
+        if ((*pr)->base == data) {
+            r   = *pr;
+            *pr = r->next;
+            atomic_fetch_add(&g_state.replicas.gen, 1);
+            break;
+        }
+    }
+    ggml_critical_section_end();
+
+    if (r) {
+        for (uint32_t node = 0; node < GGML_NUMA_MAX_NODES; ++node) {
+            if (r->copies[node]) {
+                munmap(r->copies[node], r->size);
+            }
+        }
+        free(r);
+    }
+#else
+    GGML_UNUSED(data);
+#endif
+}
+
+// replica containing data, the caller holds ggml_critical_section
+static const struct ggml_numa_replica * ggml_numa_replica_find(const void * data) {
+    for (const struct ggml_numa_replica * r = g_state.replicas.head; r; r = r->next) {
+        if ((const char *) data >= r->base && (const char *) data < r->base + r->size) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+const void * ggml_numa_tensor_data(const struct ggml_compute_params * params, const struct ggml_tensor * tensor) {
+    return params->src0_numa ? params->src0_numa : tensor->data;
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -1112,6 +1460,7 @@ void ggml_set_f32_nd(const struct ggml_tensor * tensor, int i0, int i1, int i2,
 static void ggml_compute_forward_mul_mat_one_chunk(
     const struct ggml_compute_params * params,
     struct ggml_tensor * dst,
+    const void * src1_wdata,
     const enum ggml_type type,
     const int64_t num_rows_per_vec_dot,
     const int64_t ir0_start,
@@ -1126,6 +1475,8 @@ static void ggml_compute_forward_mul_mat_one_chunk(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
+    const char * src0_data = (const char *) ggml_numa_tensor_data(params, src0);
+
     ggml_vec_dot_t const vec_dot      = type_traits_cpu[type].vec_dot;
     enum ggml_type const vec_dot_type = type_traits_cpu[type].vec_dot_type;
 
@@ -1140,7 +1491,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
         return;
     }
 
-    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : src1_wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
     assert(ne12 % ne02 == 0);
@@ -1171,7 +1522,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 const int64_t i2 = i12;
                 const int64_t i3 = i13;
 
-                const char * src0_row = (const char*)src0->data + (0 + i02 * nb02 + i03 * nb03);
+                const char * src0_row = src0_data + (0 + i02 * nb02 + i03 * nb03);
 
                 // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
                 //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
@@ -1241,12 +1592,17 @@ void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
+    // the r2 src1 matrices that share a src0 matrix (the query heads of a GQA group in attention) are adjacent in
+    // src1 and dst: multiply them in a single call, so that src0 is streamed once per group instead of once per head
+    const int64_t ng = nb2 == ne1*nb1 ? r2 : 1;
+
     if (src1_cont) {
+        const int64_t ng1 = nb12 == ne11*nb11 ? ng : 1;
         for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
+            for (int64_t i12 = 0; i12 < ne12; i12 += ng1)
                 if (!llamafile_sgemm(params,
-                                     ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     ne01, ne11*ng1, ne00/ggml_blck_size(src0->type),
+                                     (const char *)ggml_numa_tensor_data(params, src0) + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
@@ -1261,15 +1617,17 @@ void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    // src1 quantized to vec_dot_type, the layout is the vec_dot_type itself
+    char * wdata = NULL;
+    bool src1_cached = false;
 
+    if (src1->type != vec_dot_type) {
         const size_t nbw0 = ggml_type_size(vec_dot_type);
         const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
+        wdata = ggml_cpu_src1_wdata(params, src1, vec_dot_type, ne13*nbw3, &src1_cached);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
     #if 0
@@ -1283,7 +1641,7 @@ UseGgmlGemm1:;
             }
         }
     #else
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
+        for (int64_t i13 = 0; i13 < ne13 && !src1_cached; ++i13) {
             for (int64_t i12 = 0; i12 < ne12; ++i12) {
                 for (int64_t i11 = 0; i11 < ne11; ++i11) {
                     size_t bs = ggml_blck_size(vec_dot_type);
@@ -1298,37 +1656,6 @@ UseGgmlGemm1:;
     #endif
     }
 
-    if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
-    }
-
-    ggml_barrier(params->threadpool);
-
-#if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
-        const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-
-        for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(params,
-                                     ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
-                                     nb01/ggml_type_size(src0->type),
-                                     (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
-                                     row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
-                                     nb1/ggml_type_size(dst->type),
-                                     src0->type,
-                                     vec_dot_type,
-                                     dst->type))
-                    goto UseGgmlGemm2;
-        return;
-    }
-UseGgmlGemm2:;
-#endif
-
     // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
     const int64_t nr0 = ne0;
 
@@ -1362,10 +1689,44 @@ UseGgmlGemm2:;
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    // Each thread starts with a contiguous range of chunks, at batch size 1 it gets the same src0 rows for consecutive
+    // tokens. Threads that finish early steal chunks.
+    {
+        const int64_t nchunk = nchunk0 * nchunk1;
+        ggml_threadpool_chunks_assign(params->threadpool, ith, (ith * nchunk) / nth, ((ith + 1) * nchunk) / nth);
+    }
 
-    while (current_chunk < nchunk0 * nchunk1) {
+    ggml_barrier(params->threadpool);
+
+    if (src1->type != vec_dot_type && !src1_cached) {
+        ggml_cpu_src1_wdata_set(params, src1, vec_dot_type);
+    }
+
+#if GGML_USE_LLAMAFILE
+    if (src1->type != vec_dot_type) {
+        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+        for (int64_t i13 = 0; i13 < ne13; i13++)
+            for (int64_t i12 = 0; i12 < ne12; i12 += ng)
+                if (!llamafile_sgemm(params,
+                                     ne01, ne11*ng, ne00/ggml_blck_size(src0->type),
+                                     (const char *)ggml_numa_tensor_data(params, src0) + i12/r2*nb02 + i13/r3*nb03,
+                                     nb01/ggml_type_size(src0->type),
+                                     (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
+                                     row_size/ggml_type_size(vec_dot_type),
+                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     nb1/ggml_type_size(dst->type),
+                                     src0->type,
+                                     vec_dot_type,
+                                     dst->type))
+                    goto UseGgmlGemm2;
+        return;
+    }
+UseGgmlGemm2:;
+#endif
+
+    for (int current_chunk = ggml_threadpool_chunk_claim(params->threadpool, ith, nth); current_chunk >= 0;
+             current_chunk = ggml_threadpool_chunk_claim(params->threadpool, ith, nth)) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1383,13 +1744,7 @@ UseGgmlGemm2:;
         if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
             num_rows_per_vec_dot = 1;
         }
-        ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
-
-        if (nth >= nchunk0 * nchunk1) {
-            break;
-        }
-
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, wdata, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
     }
 }
 
@@ -1593,7 +1948,7 @@ static void ggml_compute_forward_mul_mat_id(
             continue;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
+        const char * src0_cur = (const char *) ggml_numa_tensor_data(params, src0) + cur_a * nb02;
         const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -2051,7 +2406,9 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_MIRROR:
             // run thread on node_num thread_n / (threads per node)
+            // with MIRROR the thread reads the weights from the replica on this node, see ggml_numa_tensor_data
             node_num = thread_n % g_state.numa.n_nodes;
             break;
         case GGML_NUMA_STRATEGY_ISOLATE:
@@ -2220,6 +2577,11 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
                 // decreases performance with GPU offloading
                 //n_tasks = n_threads;
                 n_tasks = 1;
+
+                // the raw rows of a KV cache gather (ggml_get_rows_raw) are large and only run on the CPU
+                if (node->op == GGML_OP_GET_ROWS && node->type == node->src[0]->type && node->type != GGML_TYPE_F32 && node->type != GGML_TYPE_I32) {
+                    n_tasks = n_threads;
+                }
             } break;
         case GGML_OP_SCALE:
         case GGML_OP_SET:
@@ -2593,6 +2955,10 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     threadpool->pause = false;
 
     ggml_cond_broadcast(&threadpool->cond);
+
+    atomic_fetch_add_explicit(&threadpool->n_work_wakeups, 1, memory_order_seq_cst);
+    ggml_thread_wake(&threadpool->n_work_wakeups, &threadpool->n_work_sleepers);
+
     ggml_mutex_unlock(&threadpool->mutex);
 
     for (int j = 1; j < n_threads; j++) {
@@ -2605,6 +2971,9 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    free(threadpool->graph_info.src0_replica);
+    free(threadpool->graph_info.fused);
+
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
@@ -2649,6 +3018,26 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+// size of the quantized src1 of the largest mul_mat, kept at the end of the work buffer
+static size_t ggml_graph_src1_work_size(const struct ggml_cgraph * cgraph) {
+    size_t size = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (node->op == GGML_OP_MUL_MAT) {
+            // src1 quantized to the vec_dot_type of src0, also by the repacked mul_mat
+            const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+            if (node->src[1]->type != vec_dot_type) {
+                size = MAX(size, ggml_row_size(vec_dot_type, ggml_nelements(node->src[1])));
+            }
+        }
+    }
+
+    return GGML_PAD(size, CACHE_LINE_SIZE);
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -2710,11 +3099,7 @@ struct ggml_cplan ggml_graph_plan(
                     } break;
                 case GGML_OP_MUL_MAT:
                     {
-                        const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
-
-                        if (node->src[1]->type != vec_dot_type) {
-                            cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                        }
+                        // the quantized src1 is counted in src1_work_size
                     } break;
                 case GGML_OP_MUL_MAT_ID:
                     {
@@ -2793,9 +3178,13 @@ struct ggml_cplan ggml_graph_plan(
                 case GGML_OP_FLASH_ATTN_EXT:
                     {
                         const int64_t ne10 = node->src[1]->ne[0]; // DK
+                        const int64_t ne12 = node->src[1]->ne[2]; // KV heads
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        // per thread and KV head walked together (up to GGML_FA_TILE_HEADS):
+                        // GGML_FA_TILE_Q x (head size K + head size V + GGML_FA_TILE_KV) + GGML_FA_TILE_KV x head size V
+                        // this also covers the untiled kernel (1x head size K + 2x head size V)
+                        cur = sizeof(float)*MIN(ne12, GGML_FA_TILE_HEADS)*(GGML_FA_TILE_Q*(ne10 + ne20 + GGML_FA_TILE_KV) + GGML_FA_TILE_KV*ne20)*n_tasks;
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2834,6 +3223,9 @@ struct ggml_cplan ggml_graph_plan(
         work_size += CACHE_LINE_SIZE*(n_threads);
     }
 
+    // the quantized src1 of mul_mat goes after the work data of the other ops, so that it survives them
+    work_size = GGML_PAD(work_size, CACHE_LINE_SIZE) + ggml_graph_src1_work_size(cgraph);
+
     cplan.threadpool = threadpool;
     cplan.n_threads  = MIN(max_tasks, n_threads);
     cplan.work_size  = work_size;
@@ -2842,6 +3234,156 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// graph fusion
+//
+// a few node sequences that the llama graphs produce for every layer are computed by a single
+// fused kernel, which saves the barriers between them and the round trip of the intermediate
+// tensor through memory. the decision only depends on the graph, it is made once per graph in
+// ggml_graph_info_update and all threads follow it.
+// set GGML_CPU_DISABLE_FUSION to compute every node separately
+
+static bool ggml_cpu_disable_fusion = false;
+
+// how far ahead of a rope node to look for the set_rows that stores its result
+#define GGML_CPU_FUSE_LOOKAHEAD 8
+
+// rms_norm followed by the multiplication with the norm weight
+static bool ggml_cpu_can_fuse_rms_norm_mul(const struct ggml_cgraph * cgraph, int node_n) {
+    static const enum ggml_op ops[] = { GGML_OP_RMS_NORM, GGML_OP_MUL };
+
+    if (cgraph->nodes[node_n]->op != GGML_OP_RMS_NORM || !ggml_can_fuse(cgraph, node_n, ops, 2)) {
+        return false;
+    }
+
+    const struct ggml_tensor * norm = cgraph->nodes[node_n];
+    const struct ggml_tensor * mul  = cgraph->nodes[node_n + 1];
+    const struct ggml_tensor * w    = mul->src[0] == norm ? mul->src[1] : mul->src[0];
+
+    return w != norm &&
+           norm->src[0]->type == GGML_TYPE_F32 && norm->src[0]->nb[0] == sizeof(float) &&
+           w->type            == GGML_TYPE_F32 && w->nb[0]            == sizeof(float) &&
+           mul->type          == GGML_TYPE_F32 && mul->nb[0]          == sizeof(float) &&
+           w->ne[0] == norm->ne[0] && ggml_can_repeat(w, mul);
+}
+
+static const struct ggml_tensor * ggml_cpu_view_base(const struct ggml_tensor * tensor) {
+    return tensor->view_src ? tensor->view_src : tensor;
+}
+
+// rope of the K projection followed, a few nodes later, by the reshape and set_rows that store it
+// into the KV cache. returns the index of the set_rows node, or -1
+static int ggml_cpu_can_fuse_rope_set_rows(const struct ggml_cgraph * cgraph, int node_n) {
+    const struct ggml_tensor * rope = cgraph->nodes[node_n];
+
+    if (rope->op != GGML_OP_ROPE || rope->type != GGML_TYPE_F32 || rope->ne[3] != 1 ||
+        !ggml_is_contiguous(rope) || !ggml_node_has_n_uses(cgraph, node_n, 1)) {
+        return -1;
+    }
+
+    int reshape_n = -1;
+    for (int i = node_n + 1; i + 1 < cgraph->n_nodes && i <= node_n + GGML_CPU_FUSE_LOOKAHEAD; i++) {
+        if (cgraph->nodes[i]->op == GGML_OP_RESHAPE && cgraph->nodes[i]->src[0] == rope) {
+            reshape_n = i;
+            break;
+        }
+    }
+
+    if (reshape_n < 0) {
+        return -1;
+    }
+
+    const struct ggml_tensor * reshape  = cgraph->nodes[reshape_n];
+    const struct ggml_tensor * set_rows = cgraph->nodes[reshape_n + 1];
+
+    const size_t reshape_hash_pos = ggml_hash_find(&cgraph->visited_hash_set, reshape);
+    if (cgraph->use_counts[reshape_hash_pos] != 1 || (reshape->flags & GGML_TENSOR_FLAG_OUTPUT)) {
+        return -1;
+    }
+
+    if (set_rows->op != GGML_OP_SET_ROWS || set_rows->src[0] != reshape ||
+        set_rows->src[1]->type != GGML_TYPE_I64 || set_rows->src[1]->op != GGML_OP_NONE ||
+        set_rows->ne[2] != 1 || set_rows->ne[3] != 1 || set_rows->nb[0] != ggml_type_size(set_rows->type) ||
+        reshape->ne[0] != rope->ne[0]*rope->ne[1] || reshape->ne[1] != rope->ne[2] || reshape->ne[2] != 1 ||
+        rope->ne[0] % ggml_blck_size(set_rows->type) != 0 ||
+        ggml_get_type_traits_cpu(set_rows->type)->from_float == NULL) {
+        return -1;
+    }
+
+    // the store is moved ahead of the nodes in between, none of them may touch the destination
+    const struct ggml_tensor * base = ggml_cpu_view_base(set_rows);
+    for (int i = node_n + 1; i < reshape_n; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_cpu_view_base(node) == base) {
+            return -1;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] && ggml_cpu_view_base(node->src[j]) == base) {
+                return -1;
+            }
+        }
+    }
+
+    return reshape_n + 1;
+}
+
+static void ggml_graph_info_update(struct ggml_graph_info * info, const struct ggml_cgraph * cgraph) {
+    const int numa_gen = atomic_load(&g_state.replicas.gen);
+
+    // graphs assembled by hand have no uid and are never cached
+    if (cgraph->uid != 0 && cgraph->uid == info->uid && cgraph->nodes == info->nodes &&
+        cgraph->n_nodes == info->n_nodes && numa_gen == info->numa_gen) {
+        return;
+    }
+
+    if (info->n_alloc < cgraph->n_nodes) {
+        free(info->src0_replica);
+        free(info->fused);
+        info->src0_replica = malloc(cgraph->n_nodes*sizeof(*info->src0_replica));
+        info->fused        = malloc(cgraph->n_nodes*sizeof(*info->fused));
+        GGML_ASSERT(info->src0_replica && info->fused);
+        info->n_alloc = cgraph->n_nodes;
+    }
+
+    // same order as the compute loop: the mul of a fused rms_norm does not start another fusion, and only one
+    // set_rows moved ahead of the nodes in between may be pending at a time
+    int set_rows_n = -1;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        info->fused[i] = -1;
+        if (ggml_cpu_disable_fusion || i == set_rows_n) {
+            continue;
+        }
+
+        int n;
+        if (ggml_cpu_can_fuse_rms_norm_mul(cgraph, i)) {
+            info->fused[i]   = i + 1;
+            info->fused[++i] = -1;
+        } else if (set_rows_n < i && (n = ggml_cpu_can_fuse_rope_set_rows(cgraph, i)) >= 0) {
+            info->fused[i] = n;
+            set_rows_n     = n;
+        }
+    }
+
+    ggml_critical_section_start();
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        info->src0_replica[i] = NULL;
+        if (g_state.replicas.head && (node->op == GGML_OP_MUL_MAT || node->op == GGML_OP_MUL_MAT_ID)) {
+            info->src0_replica[i] = ggml_numa_replica_find(node->src[0]->data);
+        }
+    }
+    ggml_critical_section_end();
+
+    info->src1_work_size = ggml_graph_src1_work_size(cgraph);
+
+    info->uid      = cgraph->uid;
+    info->nodes    = cgraph->nodes;
+    info->n_nodes  = cgraph->n_nodes;
+    info->numa_gen = numa_gen;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2851,19 +3393,58 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     set_numa_thread_affinity(state->ith);
 
+#ifndef GGML_USE_OPENMP
+    ggml_barrier_ith = state->ith;
+#endif
+
     struct ggml_compute_params params = {
         /*.ith       =*/ state->ith,
         /*.nth       =*/ atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed),
-        /*.wsize     =*/ cplan->work_size,
+        /*.wsize     =*/ cplan->work_size - tp->graph_info.src1_work_size,
         /*.wdata     =*/ cplan->work_data,
         /*.threadpool=*/ tp,
+        /*.src0_numa =*/ NULL,
     };
 
+    const struct ggml_graph_info * info = &tp->graph_info;
+
+    // threads are pinned to node ith % n_nodes, see set_numa_thread_affinity
+    const uint32_t numa_node = g_state.numa.n_nodes > 0 ? state->ith % g_state.numa.n_nodes : 0;
+
+    // set_rows node that was already computed by a fused rope
+    int node_fused = -1;
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        // nodes that do not touch any data need no barrier after them
+        if (node_n == node_fused || ggml_op_is_empty(node->op)) {
+            continue;
+        }
+
+        const int fused_n = info->fused[node_n];
+
+        if (fused_n >= 0 && node->op == GGML_OP_RMS_NORM) {
+            ggml_compute_forward_rms_norm_mul(&params, node, cgraph->nodes[fused_n]);
+            node_n = fused_n;
+        } else if (fused_n >= 0) {
+            ggml_compute_forward_rope_set_rows(&params, node, cgraph->nodes[fused_n]);
+            node_fused = fused_n;
+            if (state->ith == 0) {
+                ggml_cpu_src1_wdata_check(tp, cgraph->nodes[fused_n]);
+            }
+        } else {
+            const struct ggml_numa_replica * r = info->src0_replica[node_n];
+            params.src0_numa = r ? (const char *) r->copies[numa_node] + ((const char *) node->src[0]->data - r->base) : NULL;
+
+            ggml_compute_forward(&params, node);
+        }
+
+        if (state->ith == 0) {
+            ggml_cpu_src1_wdata_check(tp, cgraph->nodes[node_n]);
+        }
 
+        // the abort check must be followed by a barrier so that all threads stop at the same node
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
@@ -2924,9 +3505,7 @@ static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state *
         return state->pending;
     }
 
-    // This seems to make 0 ... 100 a decent range for polling level across modern processors.
-    // Perhaps, we can adjust it dynamically based on load and things.
-    const uint64_t n_rounds = 1024UL * 128 * threadpool->poll;
+    const uint64_t n_rounds = threadpool->work_spin;
 
     for (uint64_t i=0; !ggml_graph_compute_thread_ready(state) && i < n_rounds; i++) {
         // No new work. Keep polling.
@@ -2944,6 +3523,18 @@ static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state *
         return state->pending;
     }
 
+#ifdef GGML_USE_FUTEX
+    // No new work. Park until the graph kickoff or threadpool stop bumps n_work_wakeups.
+    while (true) {
+        const int n_wakeups = atomic_load_explicit(&threadpool->n_work_wakeups, memory_order_seq_cst);
+        if (ggml_graph_compute_thread_ready(state)) {
+            break;
+        }
+        GGML_PRINT_DEBUG("thread #%d waiting for work (sleeping)\n", state->ith);
+        ggml_thread_wait_while_eq(&threadpool->n_work_wakeups, n_wakeups, 0, &threadpool->n_work_sleepers);
+    }
+    ggml_graph_compute_thread_sync(state);
+#else
     ggml_mutex_lock_shared(&threadpool->mutex);
     while (!ggml_graph_compute_thread_ready(state)) {
         // No new work. Wait for the signal.
@@ -2951,6 +3542,7 @@ static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state *
         ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
     }
     ggml_mutex_unlock_shared(&threadpool->mutex);
+#endif
 
     return state->pending;
 }
@@ -3009,6 +3601,9 @@ static void ggml_graph_compute_kickoff(struct ggml_threadpool * threadpool, int
     // We need the full seq-cst fence here because of the polling threads (used in thread_sync)
     atomic_fetch_add_explicit(&threadpool->n_graph, 1, memory_order_seq_cst);
 
+    atomic_fetch_add_explicit(&threadpool->n_work_wakeups, 1, memory_order_seq_cst);
+    ggml_thread_wake(&threadpool->n_work_wakeups, &threadpool->n_work_sleepers);
+
     if (threadpool->pause) {
        // Update main thread prio and affinity to match the threadpool settings
        ggml_thread_apply_priority(threadpool->prio);
@@ -3041,15 +3636,37 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
         threadpool->current_chunk    = 0;
+        threadpool->n_barrier_sleepers = 0;
+        threadpool->n_work_sleepers    = 0;
+        threadpool->n_work_wakeups     = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
+        threadpool->src1_cached      = NULL;
         threadpool->workers          = NULL;
+
+        memset(&threadpool->graph_info, 0, sizeof(threadpool->graph_info));
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+
+        for (int i = 0; i < GGML_BARRIER_TREE_NODES; i++) {
+            threadpool->barrier_tree[i].n = 0;
+        }
+
+#ifndef GGML_USE_OPENMP
+        // poll 0 ... 100 maps to 1 ... 101 us of spinning in barriers and 0 ... 2 ms while waiting for the next graph
+        const uint64_t relax_per_us = ggml_thread_cpu_relax_per_us();
+        threadpool->barrier_spin     = relax_per_us * (1 + tpp->poll);
+        threadpool->barrier_spin_min = relax_per_us;
+        threadpool->work_spin        = relax_per_us * 20 * tpp->poll;
+#else
+        threadpool->barrier_spin     = 0;
+        threadpool->barrier_spin_min = 0;
+        threadpool->work_spin        = 0;
+#endif
     }
 
     // Allocate and init workers state
@@ -3060,6 +3677,9 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     for (int j = 0; j < tpp->n_threads; j++) {
         workers[j].threadpool = threadpool;
         workers[j].ith        = j;
+#ifndef GGML_USE_OPENMP
+        workers[j].barrier_spin = threadpool->barrier_spin;
+#endif
     }
 
     threadpool->workers = workers;
@@ -3123,9 +3743,15 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->cplan            = cplan;
         threadpool->current_chunk    = 0;
         threadpool->abort            = -1;
+        threadpool->src1_cached      = NULL;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_graph_info_update(&threadpool->graph_info, cgraph);
+
+    // the plan must come from ggml_graph_plan for this graph
+    GGML_ASSERT(cplan->work_size >= threadpool->graph_info.src1_work_size);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3561,6 +4187,8 @@ void ggml_cpu_init(void) {
 #endif
         }
 
+        ggml_cpu_disable_fusion = getenv("GGML_CPU_DISABLE_FUSION") != NULL;
+
 #if defined(__ARM_ARCH)
         ggml_init_arm_arch_features();
 #endif
@@ -95,6 +95,14 @@ struct ggml_backend_cpu_context {
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    // plan of the last computed graph, reused while the same graph is computed again
+    // (e.g. llama decode steps that reuse the previous graph)
+    struct ggml_cplan   cplan;
+    uint64_t            cplan_uid;
+    ggml_tensor **      cplan_nodes;
+    int                 cplan_n_nodes;
+    int                 cplan_n_threads;
 };
 
 static const char * ggml_backend_cpu_get_name(ggml_backend_t backend) {
@@ -157,7 +165,22 @@ static enum ggml_status ggml_backend_cpu_graph_plan_compute(ggml_backend_t backe
 static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
 
-    struct ggml_cplan cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+    const bool reuse_plan = cgraph->uid != 0 &&
+        cgraph->uid        == cpu_ctx->cplan_uid &&
+        cgraph->nodes      == cpu_ctx->cplan_nodes &&
+        cgraph->n_nodes    == cpu_ctx->cplan_n_nodes &&
+        cpu_ctx->n_threads == cpu_ctx->cplan_n_threads &&
+        cpu_ctx->threadpool == cpu_ctx->cplan.threadpool;
+
+    if (!reuse_plan) {
+        cpu_ctx->cplan           = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+        cpu_ctx->cplan_uid       = cgraph->uid;
+        cpu_ctx->cplan_nodes     = cgraph->nodes;
+        cpu_ctx->cplan_n_nodes   = cgraph->n_nodes;
+        cpu_ctx->cplan_n_threads = cpu_ctx->n_threads;
+    }
+
+    struct ggml_cplan cplan = cpu_ctx->cplan;
 
     if (cpu_ctx->work_size < cplan.work_size) {
         delete[] cpu_ctx->work_data;
@@ -212,6 +235,11 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->work_size           = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->cplan               = {};
+    ctx->cplan_uid           = 0;
+    ctx->cplan_nodes         = NULL;
+    ctx->cplan_n_nodes       = 0;
+    ctx->cplan_n_threads     = 0;
 
     ggml_backend_t cpu_backend = new ggml_backend {
         /* .guid    = */ ggml_backend_cpu_guid(),
@@ -632,6 +660,15 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_numa_replicate") == 0) {
+        return (void *)ggml_numa_replicate;
+    }
+    if (strcmp(name, "ggml_backend_cpu_numa_replicate_free") == 0) {
+        return (void *)ggml_numa_replicate_free;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repack_buffer_from_ptr") == 0) {
+        return (void *)ggml_backend_cpu_repack_buffer_from_ptr;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
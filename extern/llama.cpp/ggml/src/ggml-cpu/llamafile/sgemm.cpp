@@ -63,6 +63,14 @@
 #define NOINLINE __attribute__((__noinline__))
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(p) __builtin_prefetch((p), 0, 3)
+#elif defined(_M_X64) || defined(_M_IX86)
+#define PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define PREFETCH(p)
+#endif
+
 #if defined(__ARM_NEON) || defined(__AVX512F__) || defined(__VXE__) || defined(__VXE2__)
 #define VECTOR_REGISTERS 32
 #else
@@ -394,8 +402,15 @@ class tinyBLAS {
     }
 
     template <int RM, int RN>
-    inline void gemm_bloc(int64_t ii, int64_t jj) {
+    inline void gemm_bloc(int64_t m, int64_t ii, int64_t jj) {
         D Cv[RN][RM] = {};
+        if (k*sizeof(TA) <= 512) {
+            // short rows (scores against the KV cache) leave too little work per tile to overlap the memory latency
+            // of the next rows, fetch the A rows of the tile 4 tiles ahead (only the rows that exist)
+            for (int64_t i = ii + 4*RM; i < ii + 5*RM && i < m; ++i)
+                for (int64_t l = 0; l < k; l += 64/sizeof(TA))
+                    PREFETCH(A + lda * i + l);
+        }
         for (int64_t l = 0; l < k; l += KN) {
             // help compiler for op order.
             if constexpr (RM <= RN) {
@@ -462,11 +477,11 @@ class tinyBLAS {
             for (int64_t bi = 0; bi < BM * RM; bi += RM) {
                 int64_t jj = jj0;
                 for (; jj < jj1; jj += RN) {
-                    gemm_bloc<RM, RN>(ii + bi, jj);
+                    gemm_bloc<RM, RN>(m, ii + bi, jj);
                 }
                 if constexpr (RN > 1) {
                     for (; jj < jj2; jj += RN - 1) {
-                        gemm_bloc<RM, RN-1>(ii + bi, jj);
+                        gemm_bloc<RM, RN-1>(m, ii + bi, jj);
                     }
                 }
                 GGML_ASSERT(jj == jj2);
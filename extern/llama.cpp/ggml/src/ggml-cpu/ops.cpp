@@ -1,5 +1,8 @@
 #include "ops.h"
 
+#define GGML_COMMON_DECL_CPP
+#include "ggml-common.h"
+
 #include "ggml-cpu.h"
 #include "ggml-impl.h"
 #include "binary-ops.h"
@@ -4204,6 +4207,84 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// ggml_compute_forward_rms_norm_mul
+
+// fused rms_norm(x) * w: the normalized row is scaled by the weight while it is still in registers,
+// the intermediate rms_norm tensor is never written
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+    const ggml_tensor * src1 = dst->src[0] == norm ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src1->ne[0] == src0->ne[0]);
+    GGML_ASSERT(ggml_can_repeat(src1, dst));
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01%ne11)*nb11 + (i02%ne12)*nb12 + (i03%ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                // if you hit this, likely you got an inf somewhere earlier
+                assert(scale > 0.0f);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                // same rounding as rms_norm followed by mul
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    y[i00] = (x[i00]*scale)*w[i00];
+                }
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_rms_norm_mul(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, norm, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -5131,7 +5212,8 @@ static void ggml_compute_forward_get_rows_q(
     const int64_t nr = ggml_nelements(src1);
 
     const ggml_type type = src0->type;
-    ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(type)->to_float;
+    ggml_to_float_t const dequantize_row_q = ggml_get_type_traits_cpu(type)->to_float ?
+        ggml_get_type_traits_cpu(type)->to_float : ggml_get_type_traits(type)->to_float;
 
     assert(ne0  == nc);
     assert(ne02 == ne11);
@@ -5285,12 +5367,57 @@ static void ggml_compute_forward_get_rows_f32(
     }
 }
 
+// rows copied without a conversion, see ggml_get_rows_raw
+static void ggml_compute_forward_get_rows_raw(
+        const ggml_compute_params * params,
+              ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const size_t  row_size = ggml_row_size(src0->type, ne00);
+    const int64_t nr       = ggml_nelements(src1);
+
+    assert(dst->type == src0->type);
+    assert(ne0  == ne00);
+    assert(ne02 == ne11);
+    assert(ggml_nrows(dst) == nr);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t i = ir0; i < ir1; ++i) {
+        const int64_t i12 = i/(ne11*ne10);
+        const int64_t i11 = (i - i12*ne11*ne10)/ne10;
+        const int64_t i10 = (i - i12*ne11*ne10 - i11*ne10);
+        const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
+
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
+        memcpy((char *) dst->data + i10*nb1 + i11*nb2 + i12*nb3, (const char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03, row_size);
+    }
+}
+
 void ggml_compute_forward_get_rows(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
 
     const ggml_tensor * src0 = dst->src[0];
 
+    if (dst->type == src0->type && dst->type != GGML_TYPE_F32 && dst->type != GGML_TYPE_I32) {
+        ggml_compute_forward_get_rows_raw(params, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
@@ -6536,6 +6663,56 @@ void ggml_compute_forward_rope(
     }
 }
 
+// ggml_compute_forward_rope_set_rows
+
+// fused rope + set_rows (the K-cache store): each thread converts the rows it has just rotated
+// straight into the destination rows, while they are still in its cache, instead of waiting for
+// a barrier and re-reading rows produced by other threads
+void ggml_compute_forward_rope_set_rows(
+        const ggml_compute_params * params,
+        ggml_tensor * rope,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_ASSERT(rope->type == GGML_TYPE_F32);
+    GGML_ASSERT(rope->ne[3] == 1 && ggml_is_contiguous(rope));
+    GGML_ASSERT(src1->type == GGML_TYPE_I64);
+    GGML_ASSERT(dst->src[0]->ne[0] == rope->ne[0]*rope->ne[1]);
+    GGML_ASSERT(rope->ne[0] % ggml_blck_size(dst->type) == 0);
+
+    ggml_compute_forward_rope(params, rope);
+
+    const int64_t ne0 = rope->ne[0];
+    const int64_t ne1 = rope->ne[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr = ggml_nrows(rope);
+
+    // must match the row split of ggml_compute_forward_rope_f32
+    const int dr = (nr + nth - 1)/nth;
+
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    ggml_from_float_t const from_float = ggml_get_type_traits_cpu(dst->type)->from_float;
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int64_t i1 = ir%ne1; // head
+        const int64_t i2 = ir/ne1; // token
+
+        const int64_t i = *(int64_t *) ((char *) src1->data + i2*src1->nb[0]);
+
+        GGML_ASSERT(i >= 0 && i < dst->ne[1]);
+
+        from_float(
+                (const float *) ((char *) rope->data + i1*rope->nb[1] + i2*rope->nb[2]),
+                                ((char *)  dst->data + i*dst->nb[1] + ggml_row_size(dst->type, i1*ne0)), ne0);
+    }
+}
+
 // ggml_compute_forward_rope_back
 
 void ggml_compute_forward_rope_back(
@@ -8124,6 +8301,9 @@ static void ggml_compute_forward_argsort_f32(
 
     ggml_sort_order order = (ggml_sort_order) ggml_get_op_params_i32(dst, 0);
 
+    // set by ggml_top_k: only the first top_k indices are read
+    const int64_t top_k = ggml_get_op_params_i32(dst, 1);
+
     for (int64_t i = ith; i < nr; i += nth) {
         int32_t * dst_data = (int32_t *)((char *) dst->data + i*nb1);
         const float * src_data = (float *)((char *) src0->data + i*nb01);
@@ -8132,6 +8312,36 @@ static void ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
+        if (top_k > 0 && top_k < ne0) {
+            // cmp(a, b) is true when a comes first, ties are broken by index so that the result is deterministic
+            auto cmp = [src_data, order](int32_t a, int32_t b) {
+                const float fa = src_data[a];
+                const float fb = src_data[b];
+                if (fa != fb) {
+                    return order == GGML_SORT_ORDER_ASC ? fa < fb : fa > fb;
+                }
+                return a < b;
+            };
+
+            // keep the first k in a heap with the last of them on top, most entries are rejected with one comparison
+            // the evicted index is swapped into the tail so that dst stays a permutation
+            const float sign = order == GGML_SORT_ORDER_ASC ? -1.0f : 1.0f;
+
+            std::make_heap(dst_data, dst_data + top_k, cmp);
+            float last = sign*src_data[dst_data[0]];
+            for (int64_t j = top_k; j < ne0; j++) {
+                if (sign*src_data[j] < last || !cmp(j, dst_data[0])) {
+                    continue;
+                }
+                std::pop_heap(dst_data, dst_data + top_k, cmp);
+                std::swap(dst_data[top_k - 1], dst_data[j]);
+                std::push_heap(dst_data, dst_data + top_k, cmp);
+                last = sign*src_data[dst_data[0]];
+            }
+            std::sort_heap(dst_data, dst_data + top_k, cmp);
+            continue;
+        }
+
         // C doesn't have a functional sort, so we do a bubble sort instead
         for (int64_t j = 0; j < ne0; j++) {
             for (int64_t k = j + 1; k < ne0; k++) {
@@ -8252,7 +8462,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_type         const k_vec_dot_type = ggml_get_type_traits_cpu(k->type)->vec_dot_type;
     ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
     ggml_vec_dot_t    const kq_vec_dot     = ggml_get_type_traits_cpu(k->type)->vec_dot;
-    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+    ggml_to_float_t   const v_to_float     = ggml_get_type_traits_cpu(v->type)->to_float ?
+        ggml_get_type_traits_cpu(v->type)->to_float : ggml_get_type_traits(v->type)->to_float;
 
     GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
@@ -8404,15 +8615,553 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// element j of a V row of type VT, and on x86 the GGML_F32_EPR elements from j dequantized in registers
+// a vector never crosses a block of the quantized types, GGML_F32_EPR divides their block size
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__F16C__))
+#define GGML_FA_V_IN_REGISTERS
+#endif
+
+template <ggml_type VT>
+static inline float ggml_fa_v_get(const char * v, int64_t j) {
+    if constexpr (VT == GGML_TYPE_F32) {
+        return ((const float *) v)[j];
+    } else if constexpr (VT == GGML_TYPE_F16) {
+        return GGML_CPU_FP16_TO_FP32(((const ggml_fp16_t *) v)[j]);
+    } else if constexpr (VT == GGML_TYPE_Q8_0) {
+        const block_q8_0 * b = (const block_q8_0 *) v + j/QK8_0;
+        return GGML_CPU_FP16_TO_FP32(b->d)*b->qs[j%QK8_0];
+    } else {
+        static_assert(VT == GGML_TYPE_Q4_0, "unsupported V type");
+        const block_q4_0 * b = (const block_q4_0 *) v + j/QK4_0;
+        const int64_t      o = j%QK4_0;
+        return GGML_CPU_FP16_TO_FP32(b->d)*(((b->qs[o%(QK4_0/2)] >> (o < QK4_0/2 ? 0 : 4)) & 0x0F) - 8);
+    }
+}
+
+#if defined(GGML_FA_V_IN_REGISTERS)
+template <ggml_type VT>
+static inline GGML_F32_VEC ggml_fa_v_load(const char * v, int64_t j) {
+    if constexpr (VT == GGML_TYPE_F32) {
+        return GGML_F32_VEC_LOAD((const float *) v + j);
+    } else if constexpr (VT == GGML_TYPE_F16) {
+#if defined(__AVX512F__)
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) ((const ggml_fp16_t *) v + j)));
+#else
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) ((const ggml_fp16_t *) v + j)));
+#endif
+    } else {
+        __m128i q;
+        ggml_fp16_t d;
+        if constexpr (VT == GGML_TYPE_Q8_0) {
+            const block_q8_0 * b = (const block_q8_0 *) v + j/QK8_0;
+#if defined(__AVX512F__)
+            q = _mm_loadu_si128((const __m128i *) (b->qs + j%QK8_0));
+#else
+            q = _mm_loadl_epi64((const __m128i *) (b->qs + j%QK8_0));
+#endif
+            d = b->d;
+        } else {
+            static_assert(VT == GGML_TYPE_Q4_0, "unsupported V type");
+            const block_q4_0 * b = (const block_q4_0 *) v + j/QK4_0;
+            const int64_t      o = j%QK4_0;
+#if defined(__AVX512F__)
+            q = _mm_loadu_si128((const __m128i *) (b->qs + o%(QK4_0/2)));
+#else
+            q = _mm_loadl_epi64((const __m128i *) (b->qs + o%(QK4_0/2)));
+#endif
+            // low nibbles are the first half of the block, high nibbles the second
+            q = _mm_and_si128(o < QK4_0/2 ? q : _mm_srli_epi16(q, 4), _mm_set1_epi8(0x0F));
+            q = _mm_sub_epi8(q, _mm_set1_epi8(8));
+            d = b->d;
+        }
+#if defined(__AVX512F__)
+        return _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(q)), _mm512_set1_ps(GGML_CPU_FP16_TO_FP32(d)));
+#else
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q)), _mm256_set1_ps(GGML_CPU_FP16_TO_FP32(d)));
+#endif
+    }
+}
+#endif
+
+// VKQ[r] += sum_c KQ[r][c]*V[c] for NR rows of a flash attention tile, V[c] is a row of type VT
+// the accumulators of all rows stay in registers while the V rows of the block stream through
+template <int NR, ggml_type VT>
+static void ggml_fa_tile_accumulate_v(int64_t DV, int64_t nc, float * VKQ, const float * KQ, const char * const * V) {
+    int64_t j0 = 0;
+
+#if defined(GGML_FA_V_IN_REGISTERS)
+    for (; j0 + GGML_F32_EPR <= DV; j0 += GGML_F32_EPR) {
+        GGML_F32_VEC acc[NR];
+
+        for (int r = 0; r < NR; ++r) {
+            acc[r] = GGML_F32_VEC_LOAD(VKQ + r*DV + j0);
+        }
+
+        for (int64_t c = 0; c < nc; ++c) {
+            if (V[c] == NULL) {
+                continue;
+            }
+
+            const GGML_F32_VEC vv = ggml_fa_v_load<VT>(V[c], j0);
+
+            for (int r = 0; r < NR; ++r) {
+                acc[r] = GGML_F32_VEC_FMA(acc[r], vv, GGML_F32_VEC_SET1(KQ[r*GGML_FA_TILE_KV + c]));
+            }
+        }
+
+        for (int r = 0; r < NR; ++r) {
+            GGML_F32_VEC_STORE(VKQ + r*DV + j0, acc[r]);
+        }
+    }
+#elif defined(GGML_SIMD) && !defined(__ARM_FEATURE_SVE) && !defined(__riscv_v_intrinsic)
+    if constexpr (VT == GGML_TYPE_F32) {
+        for (; j0 + GGML_F32_EPR <= DV; j0 += GGML_F32_EPR) {
+            GGML_F32_VEC acc[NR];
+
+            for (int r = 0; r < NR; ++r) {
+                acc[r] = GGML_F32_VEC_LOAD(VKQ + r*DV + j0);
+            }
+
+            for (int64_t c = 0; c < nc; ++c) {
+                if (V[c] == NULL) {
+                    continue;
+                }
+
+                const GGML_F32_VEC vv = GGML_F32_VEC_LOAD((const float *) V[c] + j0);
+
+                for (int r = 0; r < NR; ++r) {
+                    acc[r] = GGML_F32_VEC_FMA(acc[r], vv, GGML_F32_VEC_SET1(KQ[r*GGML_FA_TILE_KV + c]));
+                }
+            }
+
+            for (int r = 0; r < NR; ++r) {
+                GGML_F32_VEC_STORE(VKQ + r*DV + j0, acc[r]);
+            }
+        }
+    }
+#endif
+
+    // leftovers
+    for (int64_t c = 0; c < nc; ++c) {
+        if (V[c] == NULL) {
+            continue;
+        }
+
+        for (int r = 0; r < NR; ++r) {
+            const float vs = KQ[r*GGML_FA_TILE_KV + c];
+
+            for (int64_t j = j0; j < DV; ++j) {
+                VKQ[r*DV + j] += vs*ggml_fa_v_get<VT>(V[c], j);
+            }
+        }
+    }
+}
+
+template <ggml_type VT>
+static void ggml_fa_tile_accumulate_v(int64_t nr, int64_t DV, int64_t nc, float * VKQ, const float * KQ, const char * const * V) {
+    static_assert(GGML_FA_TILE_Q == 8, "update the dispatch below");
+
+    switch (nr) {
+        case 1: ggml_fa_tile_accumulate_v<1, VT>(DV, nc, VKQ, KQ, V); break;
+        case 2: ggml_fa_tile_accumulate_v<2, VT>(DV, nc, VKQ, KQ, V); break;
+        case 3: ggml_fa_tile_accumulate_v<3, VT>(DV, nc, VKQ, KQ, V); break;
+        case 4: ggml_fa_tile_accumulate_v<4, VT>(DV, nc, VKQ, KQ, V); break;
+        case 5: ggml_fa_tile_accumulate_v<5, VT>(DV, nc, VKQ, KQ, V); break;
+        case 6: ggml_fa_tile_accumulate_v<6, VT>(DV, nc, VKQ, KQ, V); break;
+        case 7: ggml_fa_tile_accumulate_v<7, VT>(DV, nc, VKQ, KQ, V); break;
+        case 8: ggml_fa_tile_accumulate_v<8, VT>(DV, nc, VKQ, KQ, V); break;
+        default: GGML_ABORT("fatal error");
+    }
+}
+
+// tiled variant, used when K and V share the head broadcast
+// the query rows that use the same KV head (GQA group x tokens) are processed together against blocks of
+// GGML_FA_TILE_KV cells: each K row is dotted with all the rows of the tile while it is in L1, and each
+// V row is read once per tile instead of once per query row (dequantized in registers, see ggml_fa_v_load)
+// a work item also walks a range of KV heads block by block: the KV cache stores the heads of a cell next to
+// each other, so reading one head at a time over the whole context would only use a fraction of each row
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * q     = dst->src[0];
+    const ggml_tensor * k     = dst->src[1];
+    const ggml_tensor * v     = dst->src[2];
+    const ggml_tensor * mask  = dst->src[3];
+    const ggml_tensor * sinks = dst->src[4];
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nev1 == nek1);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors, the same for K and V
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    GGML_ASSERT(rk2 == neq2/nev2 && rk3 == neq3/nev3);
+
+    // query rows that share a KV head
+    const int64_t n_group = rk2*N;
+
+    // not enough work items to keep all threads busy (decode): split the KV heads first, then the tiles
+    int64_t tile_q = std::min<int64_t>(GGML_FA_TILE_Q, n_group);
+    int64_t n_hs   = (nek2 + GGML_FA_TILE_HEADS - 1)/GGML_FA_TILE_HEADS; // KV head ranges
+
+    while (n_hs < nek2 && neq3*((n_group + tile_q - 1)/tile_q)*n_hs < nth) {
+        n_hs++;
+    }
+
+    const int64_t n_heads = (nek2 + n_hs - 1)/n_hs; // KV heads per range
+    n_hs = (nek2 + n_heads - 1)/n_heads;
+
+    while (tile_q > 1 && neq3*((n_group + tile_q - 1)/tile_q)*n_hs < nth) {
+        tile_q /= 2;
+    }
+
+    const int64_t n_tiles = (n_group + tile_q - 1)/tile_q;
+    const int64_t n_items = neq3*n_hs*n_tiles;
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    ggml_type         const k_vec_dot_type = ggml_get_type_traits_cpu(k->type)->vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = ggml_get_type_traits_cpu(k->type)->vec_dot;
+    ggml_to_float_t         v_to_float     = ggml_get_type_traits(v->type)->to_float;
+
+    GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
+    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
+
+    // V types that are dequantized in registers by ggml_fa_tile_accumulate_v, the others are converted to an
+    // FP32 row of V32 once per block
+#if defined(GGML_FA_V_IN_REGISTERS)
+    const bool v_in_registers = v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16 ||
+                                v->type == GGML_TYPE_Q8_0 || v->type == GGML_TYPE_Q4_0;
+#else
+    const bool v_in_registers = v->type == GGML_TYPE_F32;
+#endif
+
+    // SIMD conversions
+    if (v_in_registers) {
+        v_to_float = NULL;
+    } else if (v->type == GGML_TYPE_F16) {
+        v_to_float = (ggml_to_float_t) ggml_cpu_fp16_to_fp32;
+    } else if (v->type == GGML_TYPE_BF16) {
+        v_to_float = (ggml_to_float_t) ggml_cpu_bf16_to_fp32;
+    } else if (ggml_get_type_traits_cpu(v->type)->to_float) {
+        v_to_float = ggml_get_type_traits_cpu(v->type)->to_float;
+    }
+
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, DK);
+
+    const ggml_fp16_t mask_neg_inf = GGML_CPU_FP32_TO_FP16(-INFINITY);
+
+    // the state of KV head h of a work item and tile row r is at index is = h*GGML_FA_TILE_Q + r
+    const int64_t n_ws = std::min<int64_t>(nek2, GGML_FA_TILE_HEADS);
+
+    float * VKQ = (float *) params->wdata + ith*(n_ws*(GGML_FA_TILE_Q*(DK + DV + GGML_FA_TILE_KV) + GGML_FA_TILE_KV*DV) + CACHE_LINE_SIZE_F32); // [is][DV] FP32 accumulators
+    float * KQ  = VKQ + n_ws*GGML_FA_TILE_Q*DV;              // [is][GGML_FA_TILE_KV] KQ values, then softmax numerators
+    float * V32 = KQ  + n_ws*GGML_FA_TILE_Q*GGML_FA_TILE_KV; // [h][GGML_FA_TILE_KV][DV] V rows of the block converted to FP32
+    char  * Q_q = (char *) (V32 + n_ws*GGML_FA_TILE_KV*DV);  // [is] Q rows converted to the K vec_dot type
+
+    float               M    [GGML_FA_TILE_HEADS*GGML_FA_TILE_Q]; // maximum KQ value
+    float               S    [GGML_FA_TILE_HEADS*GGML_FA_TILE_Q]; // sum
+    float               slope[GGML_FA_TILE_HEADS*GGML_FA_TILE_Q];
+    const ggml_fp16_t * mp   [GGML_FA_TILE_HEADS*GGML_FA_TILE_Q];
+
+    const char * v_rows[GGML_FA_TILE_HEADS*GGML_FA_TILE_KV]; // V rows of the block, NULL when no row of the tile uses the cell
+
+    // tiles of a causal prefill differ a lot in the number of unmasked cells, hand them out dynamically
+    if (ith == 0) {
+        ggml_threadpool_chunk_set(params->threadpool, nth);
+    }
+
+    ggml_barrier(params->threadpool);
+
+    for (int64_t item = ith; item < n_items; item = ggml_threadpool_chunk_add(params->threadpool, 1)) {
+        const int64_t iq3 = item/(n_hs*n_tiles);
+        const int64_t ihs = (item - iq3*n_hs*n_tiles)/n_tiles;
+        const int64_t ik3 = iq3/rk3;
+
+        const int64_t ik2_0 = ihs*n_heads;
+        const int64_t ik2_1 = std::min(nek2, ik2_0 + n_heads);
+
+        const int64_t j0 = (item % n_tiles)*tile_q;
+        const int64_t nr = std::min(tile_q, n_group - j0);
+
+        // heads of the group vary fastest, so the rows of a tile mostly share the same mask row
+        // tile row r of KV head ik2 is token (j0 + r)/rk2 of query head ik2*rk2 + (j0 + r)%rk2
+
+        for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+            for (int64_t r = 0; r < nr; ++r) {
+                const int64_t is  = (ik2 - ik2_0)*GGML_FA_TILE_Q + r;
+                const int64_t iq1 = (j0 + r)/rk2;
+                const int64_t iq2 = ik2*rk2 + (j0 + r)%rk2;
+
+                const uint32_t h = iq2; // head index
+
+                slope[is] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+                M[is]     = -INFINITY;
+                S[is]     = 0.0f;
+
+                memset(VKQ + is*DV, 0, DV*sizeof(float));
+
+                const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+                q_to_vec_dot(pq, Q_q + is*q_row_size, DK);
+            }
+        }
+
+        // online softmax / attention over blocks of KV cells
+        // ref: https://arxiv.org/pdf/2112.05682.pdf
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += GGML_FA_TILE_KV) {
+            const int64_t nc = std::min<int64_t>(GGML_FA_TILE_KV, nek1 - ic0);
+
+            for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+                for (int64_t r = 0; r < nr; ++r) {
+                    const int64_t iq1 = (j0 + r)/rk2;
+                    const int64_t iq2 = ik2*rk2 + (j0 + r)%rk2;
+
+                    mp[(ik2 - ik2_0)*GGML_FA_TILE_Q + r] = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) + ic0 : NULL;
+                }
+            }
+
+            // tiles hidden from every row (blocks of other sequences in a paged KV cache, the causal future) are skipped whole
+            if (mask) {
+                bool hidden = true;
+
+                const ggml_fp16_t * m_prev = NULL;
+
+                for (int64_t is = 0; hidden && is < (ik2_1 - ik2_0)*GGML_FA_TILE_Q; ++is) {
+                    const ggml_fp16_t * m = mp[is];
+
+                    if (is%GGML_FA_TILE_Q >= nr || m == m_prev) {
+                        continue;
+                    }
+
+                    for (int64_t c = 0; c < nc; ++c) {
+                        if (m[c] != mask_neg_inf) {
+                            hidden = false;
+                            break;
+                        }
+                    }
+
+                    m_prev = m;
+                }
+
+                if (hidden) {
+                    continue;
+                }
+            }
+
+            bool any = false;
+
+            // the KV heads of a cell are next to each other in the cache, walk them together
+            for (int64_t c = 0; c < nc; ++c) {
+                for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+                    const int64_t is0 = (ik2 - ik2_0)*GGML_FA_TILE_Q;
+
+                    const char * k_data = (const char *) k->data + ((ic0 + c)*nbk1 + ik2*nbk2 + ik3*nbk3);
+
+                    for (int64_t r = 0; r < nr; ++r) {
+                        const int64_t is = is0 + r;
+
+                        const float mv = mp[is] ? slope[is]*GGML_CPU_FP16_TO_FP32(mp[is][c]) : 0.0f;
+                        if (mv == -INFINITY) {
+                            KQ[is*GGML_FA_TILE_KV + c] = -INFINITY;
+                            continue;
+                        }
+
+                        float s; // KQ value
+
+                        kq_vec_dot(DK, &s, 0, k_data, 0, Q_q + is*q_row_size, 0, 1);
+
+                        s = s*scale; // scale KQ value
+
+                        if (logit_softcap != 0.0f) {
+                            s = logit_softcap*tanhf(s);
+                        }
+
+                        KQ[is*GGML_FA_TILE_KV + c] = s + mv; // apply mask
+
+                        any = true;
+                    }
+                }
+            }
+
+            if (!any) {
+                continue;
+            }
+
+            for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+                for (int64_t r = 0; r < nr; ++r) {
+                    const int64_t is = (ik2 - ik2_0)*GGML_FA_TILE_Q + r;
+
+                    float * kq = KQ + is*GGML_FA_TILE_KV;
+
+                    float Mb = -INFINITY;
+                    ggml_vec_max_f32(nc, &Mb, kq);
+
+                    if (Mb == -INFINITY) {
+                        // no unmasked cell for this row in the block
+                        memset(kq, 0, nc*sizeof(float));
+                        continue;
+                    }
+
+                    const float Mnew = MAX(M[is], Mb);
+                    const float ms   = expf(M[is] - Mnew); // upon new higher max val, scale VKQ and KQ sum with this value
+
+                    if (ms != 1.0f) {
+                        ggml_vec_scale_f32(DV, VKQ + is*DV, ms);
+                    }
+
+                    // kq = expf(kq - M)
+                    S[is] = S[is]*ms + (float) ggml_vec_soft_max_f32(nc, kq, kq, Mnew);
+                    M[is] = Mnew;
+                }
+            }
+
+            // VKQ += v*expf(kq - M), each V row is read once for all rows of the tile
+            for (int64_t c = 0; c < nc; ++c) {
+                for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+                    const int64_t is0 = (ik2 - ik2_0)*GGML_FA_TILE_Q;
+                    const int64_t iv  = (ik2 - ik2_0)*GGML_FA_TILE_KV + c;
+
+                    v_rows[iv] = NULL;
+
+                    for (int64_t r = 0; r < nr; ++r) {
+                        if (KQ[(is0 + r)*GGML_FA_TILE_KV + c] != 0.0f) {
+                            const char * v_data = (const char *) v->data + ((ic0 + c)*nbv1 + ik2*nbv2 + ik3*nbv3);
+
+                            if (v_to_float) {
+                                v_to_float(v_data, V32 + iv*DV, DV);
+                                v_rows[iv] = (const char *) (V32 + iv*DV);
+                            } else {
+                                v_rows[iv] = v_data;
+                            }
+                            break;
+                        }
+                    }
+                }
+            }
+
+            for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+                const int64_t is0 = (ik2 - ik2_0)*GGML_FA_TILE_Q;
+
+                float        * vkq  = VKQ + is0*DV;
+                const float  * kq   = KQ  + is0*GGML_FA_TILE_KV;
+                const char * const * rows = v_rows + (ik2 - ik2_0)*GGML_FA_TILE_KV;
+
+                switch (v_to_float ? GGML_TYPE_F32 : v->type) {
+                    case GGML_TYPE_F16:  ggml_fa_tile_accumulate_v<GGML_TYPE_F16> (nr, DV, nc, vkq, kq, rows); break;
+                    case GGML_TYPE_Q8_0: ggml_fa_tile_accumulate_v<GGML_TYPE_Q8_0>(nr, DV, nc, vkq, kq, rows); break;
+                    case GGML_TYPE_Q4_0: ggml_fa_tile_accumulate_v<GGML_TYPE_Q4_0>(nr, DV, nc, vkq, kq, rows); break;
+                    default:             ggml_fa_tile_accumulate_v<GGML_TYPE_F32> (nr, DV, nc, vkq, kq, rows); break;
+                }
+            }
+        }
+
+        for (int64_t ik2 = ik2_0; ik2 < ik2_1; ++ik2) {
+            for (int64_t r = 0; r < nr; ++r) {
+                const int64_t is  = (ik2 - ik2_0)*GGML_FA_TILE_Q + r;
+                const int64_t iq1 = (j0 + r)/rk2;
+                const int64_t iq2 = ik2*rk2 + (j0 + r)%rk2;
+
+                float * VKQ32 = VKQ + is*DV;
+
+                // sinks
+                if (sinks) {
+                    const float s = ((float *)((char *) sinks->data))[iq2];
+
+                    float ms = 1.0f;
+                    float vs = 1.0f;
+
+                    if (s > M[is]) {
+                        ms = expf(M[is] - s);
+                        ggml_vec_scale_f32(DV, VKQ32, ms);
+                    } else {
+                        vs = expf(s - M[is]);
+                    }
+
+                    S[is] = S[is]*ms + vs;
+                }
+
+                // V /= S, rows without any unmasked cell are zero
+                const float S_inv = S[is] == 0.0f ? 0.0f : 1.0f/S[is];
+                ggml_vec_scale_f32(DV, VKQ32, S_inv);
+
+                // dst indices
+                const int64_t i1 = iq1;
+                const int64_t i2 = iq2;
+                const int64_t i3 = iq3;
+
+                // permute(0, 2, 1, 3)
+                memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+            }
+        }
+    }
+}
+
 void ggml_compute_forward_flash_attn_ext(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+    const ggml_tensor * v = dst->src[2];
+
     switch (dst->op_params[3]) {
         case GGML_PREC_DEFAULT:
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, dst);
+                if (q->ne[2]/k->ne[2] == q->ne[2]/v->ne[2] && q->ne[3]/k->ne[3] == q->ne[3]/v->ne[3]) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, dst);
+                }
             } break;
         default:
             {
@@ -22,7 +22,7 @@
 
 #define UNUSED GGML_UNUSED
 
-void quantize_row_q4_0(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k) {
+void quantize_row_q4_0_generic(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k) {
     quantize_row_q4_0_ref(x, y, k);
 }
 
@@ -50,6 +50,16 @@ void quantize_row_mxfp4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, i
     quantize_row_mxfp4_ref(x, y, k);
 }
 
+// dequantization of the types used by the quantized KV cache
+
+void dequantize_row_q4_0_cpu_generic(const void * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k) {
+    dequantize_row_q4_0((const block_q4_0 *) x, y, k);
+}
+
+void dequantize_row_q8_0_cpu_generic(const void * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k) {
+    dequantize_row_q8_0((const block_q8_0 *) x, y, k);
+}
+
 //
 // 2-6 bit quantization in super-blocks
 //
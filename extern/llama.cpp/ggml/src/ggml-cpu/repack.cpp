@@ -487,6 +487,137 @@ void ggml_gemv_q2_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs,
     }
 }
 
+// offset of the 8 quants of row j within a chunk of the Q5_Kx8/Q6_Kx8 layouts
+// the first 32 positions are the low nibbles (rows 0, 1, 4, 5), the last 32 the high nibbles (rows 2, 3, 6, 7)
+static inline int q_Kx8_chunk_pos(int j) {
+    return ((j >> 1) & 1) * 32 + ((j >> 2) * 2 + (j & 1)) * 8;
+}
+
+// 5-bit quant i of row j in chunk c
+static inline int q5_Kx8_get_q(const block_q5_Kx8 * b, int c, int j, int i) {
+    const int p  = q_Kx8_chunk_pos(j) + i;
+    const int ql = (b->qs[c * 32 + (p & 31)] >> ((p >> 5) * 4)) & 0xF;
+    const int qh = (b->qh[c * 8 + (p & 7)] >> (p >> 3)) & 1;
+    return ql | (qh << 4);
+}
+
+// 6-bit quant i of row j in chunk c
+static inline int q6_Kx8_get_q(const block_q6_Kx8 * b, int c, int j, int i) {
+    const int p  = q_Kx8_chunk_pos(j) + i;
+    const int ql = (b->ql[c * 32 + (p & 31)] >> ((p >> 5) * 4)) & 0xF;
+    const int qh = (b->qh[c * 16 + (p & 15)] >> ((p >> 4) * 2)) & 3;
+    return ql | (qh << 4);
+}
+
+// Unpack the 8 scales and 8 mins of sub-block sb, one per row
+static inline void q5_Kx8_get_scales_mins(const block_q5_Kx8 * b, int sb, uint8_t * scales, uint8_t * mins) {
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+    memcpy(utmp, b->scales + sb * 12, 12);
+    utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+    const uint32_t uaux = utmp[1] & kmask1;
+    utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+    utmp[2] = uaux;
+    utmp[0] &= kmask1;
+
+    memcpy(scales, utmp + 0, 8);
+    memcpy(mins,   utmp + 2, 8);
+}
+
+void ggml_gemv_q5_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+
+    float sumf[8];
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+        for (int j = 0; j < ncols_interleaved; j++) {
+            sumf[j] = 0.0f;
+        }
+        for (int l = 0; l < nb; l++) {
+            uint8_t scales[8][8];
+            uint8_t mins[8][8];
+            for (int sb = 0; sb < 8; sb++) {
+                q5_Kx8_get_scales_mins(&b_ptr[l], sb, scales[sb], mins[sb]);
+            }
+            for (int j = 0; j < ncols_interleaved; j++) {
+                int sumi = 0;
+                int summ = 0;
+                for (int sb = 0; sb < 8; sb++) {
+                    int sumi_sb = 0;
+                    for (int c = sb * 4; c < sb * 4 + 4; c++) {
+                        for (int i = 0; i < blocklen; i++) {
+                            sumi_sb += q5_Kx8_get_q(&b_ptr[l], c, j, i) * a_ptr[l].qs[c * blocklen + i];
+                        }
+                    }
+                    sumi += sumi_sb * scales[sb][j];
+                    summ += mins[sb][j] * (a_ptr[l].bsums[sb * 2] + a_ptr[l].bsums[sb * 2 + 1]);
+                }
+                sumf[j] += (sumi * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) - summ * GGML_CPU_FP16_TO_FP32(b_ptr[l].dmin[j])) * a_ptr[l].d;
+            }
+        }
+        for (int j = 0; j < ncols_interleaved; j++) {
+            s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+void ggml_gemv_q6_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+
+    float sumf[8];
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+        for (int j = 0; j < ncols_interleaved; j++) {
+            sumf[j] = 0.0f;
+        }
+        for (int l = 0; l < nb; l++) {
+            for (int j = 0; j < ncols_interleaved; j++) {
+                int sumi = 0;
+                for (int g = 0; g < QK_K / 16; g++) {
+                    int sumi_g = 0;
+                    for (int c = g * 2; c < g * 2 + 2; c++) {
+                        for (int i = 0; i < blocklen; i++) {
+                            sumi_g += (q6_Kx8_get_q(&b_ptr[l], c, j, i) - 32) * a_ptr[l].qs[c * blocklen + i];
+                        }
+                    }
+                    sumi += sumi_g * b_ptr[l].scales[g * 8 + j];
+                }
+                sumf[j] += sumi * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d;
+            }
+        }
+        for (int j = 0; j < ncols_interleaved; j++) {
+            s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
 void ggml_gemv_iq4_nl_4x4_q8_0_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -907,6 +1038,109 @@ void ggml_gemm_q2_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs,
 }
 
 
+void ggml_gemm_q5_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    float sumf[4][8];
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumf[m][j] = 0.0f;
+                }
+            }
+            for (int l = 0; l < nb; l++) {
+                uint8_t scales[8][8];
+                uint8_t mins[8][8];
+                for (int sb = 0; sb < 8; sb++) {
+                    q5_Kx8_get_scales_mins(&b_ptr[l], sb, scales[sb], mins[sb]);
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        int sumi = 0;
+                        int summ = 0;
+                        for (int sb = 0; sb < 8; sb++) {
+                            int sumi_sb = 0;
+                            for (int c = sb * 4; c < sb * 4 + 4; c++) {
+                                for (int i = 0; i < blocklen; i++) {
+                                    sumi_sb += q5_Kx8_get_q(&b_ptr[l], c, j, i) * a_ptr[l].qs[c * 4 * blocklen + m * blocklen + i];
+                                }
+                            }
+                            // bsums of the 16-element groups 2*sb and 2*sb + 1 of row m
+                            const int16_t * bsums = a_ptr[l].bsums + (sb / 2) * 16 + m * 4 + (sb % 2) * 2;
+                            sumi += sumi_sb * scales[sb][j];
+                            summ += mins[sb][j] * (bsums[0] + bsums[1]);
+                        }
+                        sumf[m][j] += (sumi * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) - summ * GGML_CPU_FP16_TO_FP32(b_ptr[l].dmin[j])) * a_ptr[l].d[m];
+                    }
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+void ggml_gemm_q6_K_8x8_q8_K_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    float sumf[4][8];
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumf[m][j] = 0.0f;
+                }
+            }
+            for (int l = 0; l < nb; l++) {
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        int sumi = 0;
+                        for (int g = 0; g < QK_K / 16; g++) {
+                            int sumi_g = 0;
+                            for (int c = g * 2; c < g * 2 + 2; c++) {
+                                for (int i = 0; i < blocklen; i++) {
+                                    sumi_g += (q6_Kx8_get_q(&b_ptr[l], c, j, i) - 32) * a_ptr[l].qs[c * 4 * blocklen + m * blocklen + i];
+                                }
+                            }
+                            sumi += sumi_g * b_ptr[l].scales[g * 8 + j];
+                        }
+                        sumf[m][j] += sumi * GGML_CPU_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d[m];
+                    }
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
 void ggml_gemm_iq4_nl_4x4_q8_0_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -1290,6 +1524,127 @@ static int repack_q2_K_to_q2_K_8_bl(struct ggml_tensor * t, int interleave_block
     GGML_UNUSED(data_size);
 }
 
+// The Q5_K/Q6_K quants are unpacked to one value per byte and stored again in the chunked Kx8 layout, see repack.h
+static void pack_q_Kx8_chunks(const uint8_t (*q)[QK_K], int nbits_hi, uint8_t * ql, uint8_t * qh) {
+    const int qh_bytes = 8 * nbits_hi; // per chunk: 8 bytes for 1 high bit, 16 bytes for 2 high bits
+
+    memset(ql, 0, QK_K * 4);
+    memset(qh, 0, (QK_K / 8) * qh_bytes);
+
+    for (int c = 0; c < QK_K / 8; c++) {
+        for (int j = 0; j < 8; j++) {
+            const int pos = q_Kx8_chunk_pos(j);
+            for (int i = 0; i < 8; i++) {
+                const int p = pos + i;
+                const uint8_t v = q[j][c * 8 + i];
+                ql[c * 32 + (p & 31)] |= (v & 0xF) << ((p >> 5) * 4);
+                qh[c * qh_bytes + p % qh_bytes] |= (v >> 4) << ((p / qh_bytes) * nbits_hi);
+            }
+        }
+    }
+}
+
+static block_q5_Kx8 make_block_q5_Kx8(const block_q5_K * in) {
+    block_q5_Kx8 out;
+    uint8_t q[8][QK_K];
+
+    for (int j = 0; j < 8; j++) {
+        out.d[j]    = in[j].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d;
+        out.dmin[j] = in[j].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin;
+
+        for (int e = 0; e < QK_K; e++) {
+            const int c  = e / 64;
+            const int hi = (e % 64) / 32;
+            const int l  = e % 32;
+            const int ql = (in[j].qs[c * 32 + l] >> (hi * 4)) & 0xF;
+            const int qh = (in[j].qh[l] >> (c * 2 + hi)) & 1;
+            q[j][e] = ql | (qh << 4);
+        }
+    }
+
+    // The scales and mins of sub-block sb of the 8 rows are packed in 12 bytes, in the same way
+    // as the 8 sub-blocks of a single Q4_K/Q5_K block
+    for (int sb = 0; sb < 8; sb++) {
+        uint8_t s[8], m[8];
+        for (int j = 0; j < 8; j++) {
+            const uint8_t * sc = in[j].scales;
+            if (sb < 4) {
+                s[j] = sc[sb] & 63;
+                m[j] = sc[sb + 4] & 63;
+            } else {
+                s[j] = (sc[sb + 4] & 0xF) | ((sc[sb - 4] >> 6) << 4);
+                m[j] = (sc[sb + 4] >>  4) | ((sc[sb]     >> 6) << 4);
+            }
+        }
+        uint8_t * dst = out.scales + sb * 12;
+        for (int j = 0; j < 4; j++) {
+            dst[j]     = (s[j] & 63) | ((s[j + 4] & 48) << 2);
+            dst[j + 4] = (m[j] & 63) | ((m[j + 4] & 48) << 2);
+            dst[j + 8] = (s[j + 4] & 15) | ((m[j + 4] & 15) << 4);
+        }
+    }
+
+    pack_q_Kx8_chunks(q, 1, out.qs, out.qh);
+
+    return out;
+}
+
+static block_q6_Kx8 make_block_q6_Kx8(const block_q6_K * in) {
+    block_q6_Kx8 out;
+    uint8_t q[8][QK_K];
+
+    for (int j = 0; j < 8; j++) {
+        out.d[j] = in[j].d;
+
+        for (int g = 0; g < QK_K / 16; g++) {
+            out.scales[g * 8 + j] = in[j].scales[g];
+        }
+
+        for (int e = 0; e < QK_K; e++) {
+            const int half = e / 128;
+            const int k    = (e % 128) / 32;
+            const int l    = e % 32;
+            const int ql = (in[j].ql[half * 64 + (k & 1) * 32 + l] >> ((k >> 1) * 4)) & 0xF;
+            const int qh = (in[j].qh[half * 32 + l] >> (k * 2)) & 3;
+            q[j][e] = ql | (qh << 4);
+        }
+    }
+
+    pack_q_Kx8_chunks(q, 2, out.ql, out.qh);
+
+    return out;
+}
+
+template <typename BLOC_TYPE, typename BLOC_TYPE_X8, BLOC_TYPE_X8 (*make_block)(const BLOC_TYPE *)>
+static int repack_q_K_to_q_K_8_bl(struct ggml_tensor * t, const void * GGML_RESTRICT data, size_t data_size) {
+    constexpr int nrows_interleaved = 8;
+
+    BLOC_TYPE_X8 * dst = (BLOC_TYPE_X8 *) t->data;
+    const BLOC_TYPE * src = (const BLOC_TYPE *) data;
+    BLOC_TYPE dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(BLOC_TYPE));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % QK_K != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block(dst_tmp);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 static int repack_q4_0_to_q4_0_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
     GGML_ASSERT(t->type == GGML_TYPE_Q4_0);
     GGML_ASSERT(interleave_block == 8);
@@ -1472,6 +1827,16 @@ template <> int repack<block_q2_K, 8, 8>(struct ggml_tensor * t, const void * da
     return repack_q2_K_to_q2_K_8_bl(t, 8, data, data_size);
 }
 
+template <> int repack<block_q5_K, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q5_K);
+    return repack_q_K_to_q_K_8_bl<block_q5_K, block_q5_Kx8, make_block_q5_Kx8>(t, data, data_size);
+}
+
+template <> int repack<block_q6_K, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q6_K);
+    return repack_q_K_to_q_K_8_bl<block_q6_K, block_q6_Kx8, make_block_q6_Kx8>(t, data, data_size);
+}
+
 template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void * data, size_t data_size) {
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
@@ -1509,6 +1874,14 @@ template <> void gemv<block_q2_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemv_q2_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q5_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q5_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemv<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -1541,6 +1914,14 @@ template <> void gemm<block_q2_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemm_q2_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q5_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q5_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemm<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -1561,7 +1942,8 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
         switch (op->op) {
             case GGML_OP_MUL_MAT:
                 {
-                    size = ggml_row_size(PARAM_TYPE, ggml_nelements(op->src[1]));
+                    // src1 is quantized into the src1 part of the work buffer, see ggml_cpu_src1_wdata
+                    size = 0;
                     return true;
                 }
             case GGML_OP_MUL_MAT_ID:
@@ -1626,26 +2008,33 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
         GGML_ASSERT(ggml_n_dims(op->src[0]) == 2);
         // GGML_ASSERT(ggml_n_dims(op->src[1]) == 2);
 
-        char *       wdata = static_cast<char *>(params->wdata);
         const size_t nbw1  = ggml_row_size(PARAM_TYPE, ne10);
 
-        assert(params->wsize >= nbw1 * ne11);
+        // with less than 4 rows nothing is interleaved and the rows are the same as in the plain mul_mat, so they can
+        // be shared with it (a Q6_K projection next to repacked Q4_K ones)
+        const int layout = ne11 < 4 ? (int) PARAM_TYPE : GGML_TYPE_COUNT*INTER_SIZE + PARAM_TYPE;
+        bool      cached = false;
+        char *    wdata  = static_cast<char *>(ggml_cpu_src1_wdata(params, src1, layout, nbw1 * ne11, &cached));
 
-        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
+        if (!cached) {
+            const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
-        int64_t i11_processed = 0;
-        for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
-            ggml_quantize_mat_t<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10);
-        }
+            int64_t i11_processed = 0;
+            for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
+                ggml_quantize_mat_t<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10);
+            }
 
-        i11_processed = ne11 - ne11 % 4;
-        for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
-            from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
-        }
+            i11_processed = ne11 - ne11 % 4;
+            for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
+                from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
+            }
 
-        ggml_barrier(params->threadpool);
+            ggml_barrier(params->threadpool);
 
-        const void * src1_wdata      = params->wdata;
+            ggml_cpu_src1_wdata_set(params, src1, layout);
+        }
+
+        const void * src1_wdata      = wdata;
         const size_t src1_col_stride = ggml_row_size(PARAM_TYPE, ne10);
         int64_t      src0_start      = (ith * ne01) / nth;
         int64_t      src0_end        = ((ith + 1) * ne01) / nth;
@@ -1659,13 +2048,13 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
         if (ne11 > 3) {
             gemm<BLOC_TYPE, INTER_SIZE, NB_COLS, PARAM_TYPE>(ne00,
                     (float *) ((char *) dst->data) + src0_start, ne01,
-                    (const char *) src0->data + src0_start * nb01,
+                    (const char *) ggml_numa_tensor_data(params, src0) + src0_start * nb01,
                     (const char *) src1_wdata, ne11 - ne11 % 4, src0_end - src0_start);
         }
         for (int iter = ne11 - ne11 % 4; iter < ne11; iter++) {
             gemv<BLOC_TYPE, INTER_SIZE, NB_COLS, PARAM_TYPE>(ne00,
                     (float *) ((char *) dst->data + (iter * nb1)) + src0_start, ne01,
-                    (const char *) src0->data + src0_start * nb01,
+                    (const char *) ggml_numa_tensor_data(params, src0) + src0_start * nb01,
                     (const char *) src1_wdata + (src1_col_stride * iter), 1,
                     src0_end - src0_start);
         }
@@ -1764,7 +2153,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
                 continue;
             }
 
-            const auto * src0_cur = (const char *) src0->data + cur_a*nb02;
+            const auto * src0_cur = (const char *) ggml_numa_tensor_data(params, src0) + cur_a*nb02;
 
             //const int64_t nr0 = ne01; // src0 rows
             const int64_t nr1 = cne1; // src1 rows
@@ -1821,6 +2210,10 @@ static const ggml::cpu::tensor_traits * ggml_repack_get_optimal_repack_type(cons
     // instance for Q2
     static const ggml::cpu::repack::tensor_traits<block_q2_K, 8, 8, GGML_TYPE_Q8_K> q2_K_8x8_q8_K;
 
+    // instance for Q5/Q6
+    static const ggml::cpu::repack::tensor_traits<block_q5_K, 8, 8, GGML_TYPE_Q8_K> q5_K_8x8_q8_K;
+    static const ggml::cpu::repack::tensor_traits<block_q6_K, 8, 8, GGML_TYPE_Q8_K> q6_K_8x8_q8_K;
+
     // instance for IQ4
     static const ggml::cpu::repack::tensor_traits<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
     static const ggml::cpu::repack::tensor_traits<block_iq4_nl, 8, 8, GGML_TYPE_Q8_0> iq4_nl_8x8_q8_0;
@@ -1853,6 +2246,18 @@ static const ggml::cpu::tensor_traits * ggml_repack_get_optimal_repack_type(cons
                 return &q2_K_8x8_q8_K;
             }
         }
+    } else if (cur->type == GGML_TYPE_Q5_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &q5_K_8x8_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q6_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &q6_K_8x8_q8_K;
+            }
+        }
     } else if (cur->type == GGML_TYPE_IQ4_NL) {
         if (ggml_cpu_has_avx2()) {
             if (cur->ne[1] % 8 == 0) {
@@ -1909,6 +2314,22 @@ static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(gg
     return buffer;
 }
 
+ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_from_ptr(void * ptr, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    // the data is already repacked, so only the tensor traits have to be set up
+    buffer->buft              = ggml_backend_cpu_repack_buffer_type();
+    buffer->iface.init_tensor = ggml_backend_cpu_repack_buffer_init_tensor;
+    buffer->iface.set_tensor  = ggml_backend_cpu_repack_buffer_set_tensor;
+    buffer->iface.get_tensor  = nullptr;
+    buffer->iface.cpy_tensor  = nullptr;
+    return buffer;
+}
+
 static size_t ggml_backend_cpu_repack_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
     return TENSOR_ALIGNMENT;
 
@@ -1,8 +1,11 @@
 #include "ggml-threading.h"
+#include <atomic>
 #include <mutex>
 
 std::mutex ggml_critical_section_mutex;
 
+static std::atomic<uint64_t> ggml_uid_next { 1 };
+
 void ggml_critical_section_start() {
     ggml_critical_section_mutex.lock();
 }
@@ -10,3 +13,7 @@ void ggml_critical_section_start() {
 void ggml_critical_section_end(void) {
     ggml_critical_section_mutex.unlock();
 }
+
+uint64_t ggml_next_uid(void) {
+    return ggml_uid_next.fetch_add(1, std::memory_order_relaxed);
+}
@@ -9,6 +9,9 @@ extern "C" {
 GGML_API void ggml_critical_section_start(void);
 GGML_API void ggml_critical_section_end(void);
 
+// returns a new process-wide unique id, never 0
+GGML_API uint64_t ggml_next_uid(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -284,12 +284,23 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // path of a file used to cache the CPU repacked weights between loads (NULL = disabled)
+        // on the first load the repacked weights are written to it, later loads memory map it and skip repacking
+        // the cache is only used if a hash of the full data of the source weights matches, requires use_mmap
+        const char * repack_cache_path;
+
+        // type of a coarse copy of the output matrix used for approximate output logits (GGML_TYPE_COUNT = none)
+        // the copy is quantized from output.weight at load time, see llama_context_params.lm_head_top_m
+        enum ggml_type lm_head_proxy_type;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;      // only load the vocabulary, no weights
         bool use_mmap;        // use mmap if possible
         bool use_mlock;       // force system to keep model in RAM
         bool check_tensors;   // validate model tensor data
         bool use_extra_bufts; // use extra buffer types (used for weight repacking)
+        bool use_hugepages;   // copy the weights into 2 MiB pages instead of mapping the file (Linux, requires use_mmap)
+                              // interleaved across NUMA nodes when llama_numa_init detected more than one node
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -328,6 +339,22 @@ extern "C" {
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
 
+        // approximate output logits, requires a model loaded with lm_head_proxy_type [EXPERIMENTAL]
+        // the proxy matrix scores the whole vocabulary, then only the lm_head_top_m best rows and the
+        // tokens passed to llama_set_lm_head_candidates() get exact logits, 0 = always exact
+        int32_t lm_head_top_m;
+        int32_t lm_head_check_interval; // compare against the exact logits every n outputs, 0 = never
+
+        // paged KV cache: the cells are handed out to the sequences in blocks of kv_block_size cells (a power
+        // of 2 up to 256) and all sequences share one pool of n_ctx cells, implies kv_unified, 0 = disabled [EXPERIMENTAL]
+        uint32_t kv_block_size;
+
+        // KV spill tier: once more than kv_spill_tokens cells are used, the least recently decoded sequences that
+        // share no cells are serialized to host memory (or to the kv_spill_path file), their cells are freed and they
+        // are restored by the next llama_decode() that uses them, 0 = disabled [EXPERIMENTAL]
+        uint32_t     kv_spill_tokens;
+        const char * kv_spill_path;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // offload the KQV ops (including the KV cache) to GPU
@@ -458,6 +485,10 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // Bytes of the compute buffers reserved for the worst-case graph (n_ubatch tokens against the whole cache),
+    // summed over the backends
+    LLAMA_API size_t llama_get_compute_buffer_size(const struct llama_context * ctx);
+
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
     DEPRECATED(LLAMA_API int32_t llama_n_layer    (const struct llama_model * model), "use llama_model_n_layer instead");
@@ -971,6 +1002,10 @@ extern "C" {
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
 
+    // Tokens that always get exact logits when lm_head_top_m > 0 (e.g. the repetition penalty window)
+    // The list is copied and used by the following calls to llama_decode()
+    LLAMA_API void llama_set_lm_head_candidates(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -1433,6 +1468,74 @@ extern "C" {
         int32_t n_sample;
     };
 
+    // divergence of the approximate output logits, accumulated over the outputs compared with the exact logits
+    struct llama_lm_head_stats {
+        int32_t n_approx;  // outputs computed with the proxy matrix
+        int32_t n_checked; // outputs also computed exactly
+        int32_t n_top1;    // checked outputs with the same argmax
+
+        double recall;     // mean fraction of the exact top 64 tokens that got exact logits
+        double kl;         // mean KL(exact || approx) of the softmax
+        double max_err;    // max absolute logit error over the exact top 64 tokens
+    };
+
+    LLAMA_API struct llama_lm_head_stats llama_get_lm_head_stats  (const struct llama_context * ctx);
+    LLAMA_API void                       llama_reset_lm_head_stats(      struct llama_context * ctx);
+
+    // KV spill tier (kv_spill_tokens > 0), restores are compared with prefilling the same tokens at the measured
+    // prompt eval speed
+    struct llama_kv_spill_stats {
+        int32_t n_spill;           // sequences spilled
+        int32_t n_restore;         // sequences restored
+        int32_t n_tokens_restored; // tokens restored instead of prefilled
+
+        int32_t n_seq_spilled;     // sequences currently spilled
+        size_t  size_spilled;      // bytes currently held by the spill tier
+
+        double t_spill_ms;
+        double t_restore_ms;
+        double t_prefill_ms;       // estimated prefill time of the restored tokens
+    };
+
+    LLAMA_API struct llama_kv_spill_stats llama_get_kv_spill_stats  (const struct llama_context * ctx);
+    LLAMA_API void                        llama_reset_kv_spill_stats(      struct llama_context * ctx);
+
+    // spill an idle sequence now instead of waiting for the budget to run out, or restore it ahead of its next batch
+    // returns false if the sequence is not resident or shares cells with other sequences (spill), is not spilled
+    // (restore), or the spill tier is disabled
+    LLAMA_API bool llama_kv_spill_seq  (struct llama_context * ctx, llama_seq_id seq_id);
+    LLAMA_API bool llama_kv_restore_seq(struct llama_context * ctx, llama_seq_id seq_id);
+
+    // KV eviction policy of a sequence, for conversations longer than the context [EXPERIMENTAL]
+    enum llama_kv_evict_type {
+        LLAMA_KV_EVICT_NONE      = 0,
+        LLAMA_KV_EVICT_STREAMING = 1, // keep the first n_sink tokens (attention sinks) and the last n_window tokens
+        LLAMA_KV_EVICT_HEAVY     = 2, // also keep the n_heavy tokens that received the most attention, needs flash_attn off
+    };
+
+    struct llama_kv_evict_params {
+        enum llama_kv_evict_type type;
+
+        int32_t n_sink;
+        int32_t n_window;
+        int32_t n_heavy;
+    };
+
+    LLAMA_API struct llama_kv_evict_params llama_kv_evict_default_params(void);
+
+    // when a batch would take the sequence over n_sink + n_heavy + n_window tokens, llama_decode() first evicts the
+    // tokens outside the policy, a quarter of the window at a time, and moves the kept tokens down with
+    // llama_memory_seq_add() so that the positions stay contiguous
+    // the sequence then continues from llama_memory_seq_pos_max() + 1: explicit positions of the batch are moved down
+    // by the number of evicted tokens, batches without positions (llama_batch_get_one) need no care
+    // nothing is evicted while kept tokens that would move are shared with other sequences (llama_memory_seq_cp)
+    // requires an attention KV cache that can shift (not a recurrent or hybrid memory), heavy hitters also need a model
+    // without SWA, returns false if the policy is not supported
+    LLAMA_API bool llama_set_kv_evict(struct llama_context * ctx, llama_seq_id seq_id, struct llama_kv_evict_params params);
+
+    // number of tokens evicted from the sequence so far
+    LLAMA_API int32_t llama_get_kv_evict_n_evicted(const struct llama_context * ctx, llama_seq_id seq_id);
+
     LLAMA_API struct llama_perf_context_data llama_perf_context      (const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_print(const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_reset(      struct llama_context * ctx);
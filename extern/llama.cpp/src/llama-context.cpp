@@ -3,13 +3,18 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-io.h"
+#include "llama-kv-spill.h"
+#include "llama-kv-evict.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cmath>
 #include <cstring>
 #include <limits>
+#include <numeric>
 #include <stdexcept>
 
 //
@@ -103,6 +108,14 @@ llama_context::llama_context(
     cparams.op_offload = params.op_offload;
     cparams.kv_unified = params.kv_unified;
 
+    cparams.lm_head_top_m          = std::max(0, params.lm_head_top_m);
+    cparams.lm_head_check_interval = std::max(0, params.lm_head_check_interval);
+
+    if (cparams.lm_head_top_m > 0 && !model.output_proxy) {
+        LLAMA_LOG_WARN("%s: lm_head_top_m requires a model loaded with lm_head_proxy_type - using the exact output\n", __func__);
+        cparams.lm_head_top_m = 0;
+    }
+
     {
         const char * LLAMA_SET_ROWS = getenv("LLAMA_SET_ROWS");
         supports_set_rows = LLAMA_SET_ROWS ? (atoi(LLAMA_SET_ROWS) != 0) : supports_set_rows;
@@ -113,6 +126,23 @@ llama_context::llama_context(
         }
     }
 
+    cparams.kv_block_size = params.kv_block_size;
+
+    if (cparams.kv_block_size > 0) {
+        if (cparams.kv_block_size > 256 || (cparams.kv_block_size & (cparams.kv_block_size - 1)) != 0) {
+            LLAMA_LOG_WARN("%s: kv_block_size = %u is not a power of 2 up to 256 - disabling the paged KV cache\n", __func__, cparams.kv_block_size);
+            cparams.kv_block_size = 0;
+        } else if (!supports_set_rows) {
+            LLAMA_LOG_WARN("%s: paged KV cache requires ggml_set_rows() - disabling it\n", __func__);
+            cparams.kv_block_size = 0;
+        } else if (!cparams.kv_unified) {
+            // one pool of cells for all sequences, sized by the tokens in flight instead of n_seq_max*n_ctx
+            cparams.kv_unified = true;
+        }
+    }
+
+    cparams.kv_spill_tokens = params.kv_spill_tokens;
+
     {
         const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
         graph_reuse_disable = LLAMA_GRAPH_REUSE_DISABLE ? (atoi(LLAMA_GRAPH_REUSE_DISABLE) != 0) : graph_reuse_disable;
@@ -132,6 +162,12 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: causal_attn   = %d\n",   __func__, cparams.causal_attn);
     LLAMA_LOG_INFO("%s: flash_attn    = %d\n",   __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: kv_unified    = %s\n",   __func__, cparams.kv_unified ? "true" : "false");
+    if (cparams.kv_block_size > 0) {
+        LLAMA_LOG_INFO("%s: kv_block_size = %u\n",   __func__, cparams.kv_block_size);
+    }
+    if (cparams.lm_head_top_m > 0) {
+        LLAMA_LOG_INFO("%s: lm_head_top_m = %d (check every %d outputs)\n", __func__, cparams.lm_head_top_m, cparams.lm_head_check_interval);
+    }
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
 
@@ -215,6 +251,10 @@ llama_context::llama_context(
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
+
+        if (memory && cparams.kv_spill_tokens > 0) {
+            kv_spill = std::make_unique<llama_kv_spill>(*this, cparams.kv_unified ? LLAMA_MAX_SEQ : cparams.n_seq_max, cparams.kv_spill_tokens, params.kv_spill_path);
+        }
     }
 
     // init backends
@@ -440,6 +480,14 @@ uint32_t llama_context::n_threads_batch() const {
     return cparams.n_threads_batch;
 }
 
+size_t llama_context::compute_buffer_size() const {
+    size_t size = 0;
+    for (auto * backend : backend_ptrs) {
+        size += ggml_backend_sched_get_buffer_size(sched.get(), backend);
+    }
+    return size;
+}
+
 llama_memory_t llama_context::get_memory() const {
     return memory.get();
 }
@@ -673,6 +721,17 @@ void llama_context::set_warmup(bool value) {
     cparams.warmup = value;
 }
 
+void llama_context::set_lm_head_candidates(const llama_token * tokens, int32_t n_tokens) {
+    const int32_t n_vocab = model.vocab.n_tokens();
+
+    lm_head_cand.clear();
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] >= 0 && tokens[i] < n_vocab) {
+            lm_head_cand.push_back(tokens[i]);
+        }
+    }
+}
+
 void llama_context::set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale) {
@@ -855,6 +914,10 @@ int llama_context::encode(const llama_batch & batch_inp) {
         GGML_ASSERT(logits != nullptr);
 
         ggml_backend_tensor_get_async(backend_res, t_logits, logits, 0, n_tokens*n_vocab*sizeof(float));
+
+        if (res->t_lm_head_ids) {
+            lm_head_apply(res, logits);
+        }
     }
 
     // extract embeddings
@@ -943,15 +1006,15 @@ int llama_context::encode(const llama_batch & batch_inp) {
     return 0;
 }
 
-int llama_context::decode(const llama_batch & batch_inp) {
-    GGML_ASSERT((!batch_inp.token && batch_inp.embd) || (batch_inp.token && !batch_inp.embd)); // NOLINT
+int llama_context::decode(const llama_batch & batch_arg) {
+    GGML_ASSERT((!batch_arg.token && batch_arg.embd) || (batch_arg.token && !batch_arg.embd)); // NOLINT
 
     if (!memory) {
         LLAMA_LOG_DEBUG("%s: cannot decode batches with this context (calling encode() instead)\n", __func__);
-        return encode(batch_inp);
+        return encode(batch_arg);
     }
 
-    if (batch_inp.n_tokens == 0) {
+    if (batch_arg.n_tokens == 0) {
         LLAMA_LOG_ERROR("%s: n_tokens == 0\n", __func__);
         return -1;
     }
@@ -965,6 +1028,16 @@ int llama_context::decode(const llama_batch & batch_inp) {
     // when computing embeddings, all tokens are output
     const bool output_all = cparams.embeddings;
 
+    // bring back the spilled sequences of the batch before the batch allocator checks their positions
+    if (kv_spill && !kv_spill->prepare(batch_arg)) {
+        return -1;
+    }
+
+    // make room in the sequences that run past their eviction budget, the explicit positions of the batch move down with them
+    const llama_batch & batch_inp = kv_evict ? kv_evict->prepare(batch_arg) : batch_arg;
+
+    const int64_t t_decode_start_us = ggml_time_us();
+
     if (!balloc->init(batch_inp, vocab, memory.get(), n_embd, cparams.kv_unified ? LLAMA_MAX_SEQ : cparams.n_seq_max, output_all)) {
         LLAMA_LOG_ERROR("%s: failed to initialize batch\n", __func__);
         return -1;
@@ -1072,9 +1145,18 @@ int llama_context::decode(const llama_batch & batch_inp) {
             n_outputs = n_outputs_new;
         }
 
+        lm_head_check = cparams.lm_head_top_m > 0 && cparams.lm_head_check_interval > 0 && n_outputs > 0 &&
+            lm_head_stats.n_approx >= lm_head_n_next_check;
+
         ggml_status status;
         const auto * res = process_ubatch(ubatch, LLM_GRAPH_TYPE_DECODER, mctx.get(), status);
 
+        if (res && res->t_kv_score) {
+            // the graph may still be running on an async backend
+            ggml_backend_sched_synchronize(sched.get());
+            kv_evict->scores_add(mctx.get(), res->t_kv_score);
+        }
+
         if (!res) {
             // the last ubatch failed or was aborted -> remove all positions of that ubatch from the KV cache
             llama_pos pos_min[LLAMA_MAX_SEQ];
@@ -1130,6 +1212,10 @@ int llama_context::decode(const llama_batch & batch_inp) {
                 GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
                 GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
                 ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+
+                if (res->t_lm_head_ids) {
+                    lm_head_apply(res, logits_out);
+                }
             }
         }
 
@@ -1250,6 +1336,11 @@ int llama_context::decode(const llama_batch & batch_inp) {
         ggml_backend_sched_reset(sched.get());
     }
 
+    // prompt processing speed, the restores of the spill tier are compared with it
+    if (kv_spill && n_tokens_all > 1) {
+        kv_spill->record_prefill(n_tokens_all, ggml_time_us() - t_decode_start_us);
+    }
+
     return 0;
 }
 
@@ -1426,6 +1517,9 @@ llm_graph_params llama_context::graph_params(
         /*.n_outputs   =*/ n_outputs,
         /*.cb          =*/ graph_get_cb(),
         /*.res         =*/ res,
+        /*.lm_head_cand  =*/ &lm_head_cand,
+        /*.lm_head_check =*/ lm_head_check,
+        /*.kv_score      =*/ kv_evict && kv_evict->need_scores() && !cparams.flash_attn,
     };
 }
 
@@ -2016,6 +2110,158 @@ void llama_context::perf_reset() {
     n_reused    = 0;
 }
 
+//
+// approximate lm_head
+//
+
+void llama_context::lm_head_apply(const llm_graph_result * res, float * logits_out) {
+    const int64_t n_vocab = model.vocab.n_tokens();
+
+    // the exact logits of the candidates are written over the proxy logits copied to logits_out
+    ggml_backend_sched_synchronize(sched.get());
+
+    const int64_t n_top  = res->t_lm_head_ids->ne[0];
+    const int64_t n_cand = res->t_lm_head_cand->ne[0];
+
+    std::vector<int32_t> ids(n_top*n_outputs);
+    std::vector<float>   top(n_top*n_outputs);
+    std::vector<float>   cand_logits(n_cand*n_outputs);
+
+    ggml_backend_tensor_get(res->t_lm_head_ids,    ids.data(),         0, ids.size()*sizeof(int32_t));
+    ggml_backend_tensor_get(res->t_lm_head_top,    top.data(),         0, top.size()*sizeof(float));
+    ggml_backend_tensor_get(res->t_lm_head_logits, cand_logits.data(), 0, cand_logits.size()*sizeof(float));
+
+    // input tensor, always in a host buffer
+    const int32_t * cand = (const int32_t *) res->t_lm_head_cand->data;
+
+    for (uint32_t i = 0; i < n_outputs; ++i) {
+        float * row = logits_out + i*n_vocab;
+        for (int64_t j = 0; j < n_top; ++j) {
+            row[ids[i*n_top + j]] = top[i*n_top + j];
+        }
+        for (int64_t j = 0; j < n_cand; ++j) {
+            row[cand[j]] = cand_logits[i*n_cand + j];
+        }
+    }
+
+    lm_head_stats.n_approx += n_outputs;
+
+    if (!res->t_logits_exact) {
+        return;
+    }
+
+    // divergence from the exact logits
+    const int64_t n_best = std::min<int64_t>(64, n_vocab);
+
+    std::vector<float>   exact(n_vocab*n_outputs);
+    std::vector<int32_t> order(n_vocab);
+    std::vector<uint8_t> is_exact(n_vocab);
+
+    ggml_backend_tensor_get(res->t_logits_exact, exact.data(), 0, exact.size()*sizeof(float));
+
+    for (uint32_t i = 0; i < n_outputs; ++i) {
+        const float * le = exact.data() + i*n_vocab;
+        const float * la = logits_out   + i*n_vocab;
+
+        std::fill(is_exact.begin(), is_exact.end(), 0);
+        for (int64_t j = 0; j < n_top; ++j) {
+            is_exact[ids[i*n_top + j]] = 1;
+        }
+        for (int64_t j = 0; j < n_cand; ++j) {
+            is_exact[cand[j]] = 1;
+        }
+
+        std::iota(order.begin(), order.end(), 0);
+        std::partial_sort(order.begin(), order.begin() + n_best, order.end(), [le](int32_t a, int32_t b) { return le[a] > le[b]; });
+
+        const int32_t argmax_a = std::max_element(la, la + n_vocab) - la;
+
+        int64_t n_hit = 0;
+        for (int64_t j = 0; j < n_best; ++j) {
+            const int32_t t = order[j];
+            n_hit += is_exact[t];
+            lm_head_stats.max_err = std::max(lm_head_stats.max_err, (double) std::fabs(la[t] - le[t]));
+        }
+
+        // KL(exact || approx) of the softmax, computed from the log-sum-exp of both rows
+        const double max_e = le[order[0]];
+        const double max_a = la[argmax_a];
+
+        double sum_e = 0.0;
+        double sum_a = 0.0;
+        for (int64_t t = 0; t < n_vocab; ++t) {
+            sum_e += std::exp(le[t] - max_e);
+            sum_a += std::exp(la[t] - max_a);
+        }
+        const double lse_e = max_e + std::log(sum_e);
+        const double lse_a = max_a + std::log(sum_a);
+
+        double kl = 0.0;
+        for (int64_t t = 0; t < n_vocab; ++t) {
+            const double lp_e = le[t] - lse_e;
+            kl += std::exp(lp_e) * (lp_e - (la[t] - lse_a));
+        }
+
+        lm_head_stats.n_checked += 1;
+        lm_head_stats.n_top1    += argmax_a == order[0];
+        lm_head_stats.recall    += (double) n_hit / n_best;
+        lm_head_stats.kl        += std::max(0.0, kl);
+    }
+
+    lm_head_n_next_check = lm_head_stats.n_approx + cparams.lm_head_check_interval;
+}
+
+llama_lm_head_stats llama_context::lm_head_get_stats() const {
+    llama_lm_head_stats stats = lm_head_stats;
+
+    if (stats.n_checked > 0) {
+        stats.recall /= stats.n_checked;
+        stats.kl     /= stats.n_checked;
+    }
+
+    return stats;
+}
+
+void llama_context::lm_head_reset_stats() {
+    lm_head_stats        = {};
+    lm_head_n_next_check = 0;
+}
+
+llama_kv_spill_stats llama_context::kv_spill_get_stats() const {
+    return kv_spill ? kv_spill->get_stats() : llama_kv_spill_stats {};
+}
+
+void llama_context::kv_spill_reset_stats() {
+    if (kv_spill) {
+        kv_spill->reset_stats();
+    }
+}
+
+bool llama_context::kv_spill_seq(llama_seq_id seq_id) {
+    return kv_spill && kv_spill->spill(seq_id);
+}
+
+bool llama_context::kv_restore_seq(llama_seq_id seq_id) {
+    return kv_spill && kv_spill->restore(seq_id);
+}
+
+bool llama_context::kv_evict_set(llama_seq_id seq_id, const llama_kv_evict_params & params) {
+    if (!memory) {
+        LLAMA_LOG_WARN("%s: the context has no memory\n", __func__);
+        return false;
+    }
+
+    if (!kv_evict) {
+        kv_evict = std::make_unique<llama_kv_evict>(*this, cparams.kv_unified ? LLAMA_MAX_SEQ : cparams.n_seq_max);
+    }
+
+    return kv_evict->set(seq_id, params);
+}
+
+int32_t llama_context::kv_evict_get_n_evicted(llama_seq_id seq_id) const {
+    return kv_evict ? kv_evict->get_n_evicted(seq_id) : 0;
+}
+
 //
 // training
 //
@@ -2262,6 +2508,11 @@ llama_context_params llama_context_default_params() {
         /*.type_v                      =*/ GGML_TYPE_F16,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
+        /*.lm_head_top_m               =*/ 0,
+        /*.lm_head_check_interval      =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_spill_tokens             =*/ 0,
+        /*.kv_spill_path               =*/ nullptr,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
@@ -2339,6 +2590,10 @@ uint32_t llama_n_seq_max(const llama_context * ctx) {
     return ctx->n_seq_max();
 }
 
+size_t llama_get_compute_buffer_size(const llama_context * ctx) {
+    return ctx->compute_buffer_size();
+}
+
 const llama_model * llama_get_model(const llama_context * ctx) {
     return &ctx->get_model();
 }
@@ -2396,6 +2651,10 @@ void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
 
+void llama_set_lm_head_candidates(llama_context * ctx, const llama_token * tokens, int32_t n_tokens) {
+    ctx->set_lm_head_candidates(tokens, n_tokens);
+}
+
 void llama_synchronize(llama_context * ctx) {
     ctx->synchronize();
 }
@@ -2902,12 +3161,62 @@ void llama_perf_context_print(const llama_context * ctx) {
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
     LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
+
+    const auto spill = ctx->kv_spill_get_stats();
+    if (spill.n_spill > 0) {
+        LLAMA_LOG_INFO("%s:    kv spill time = %10.2f ms / %5d seqs\n", __func__, spill.t_spill_ms, spill.n_spill);
+        LLAMA_LOG_INFO("%s:  kv restore time = %10.2f ms / %5d seqs   (%5d tokens, prefill ~ %.2f ms)\n",
+                __func__, spill.t_restore_ms, spill.n_restore, spill.n_tokens_restored, spill.t_prefill_ms);
+    }
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
     ctx->perf_reset();
 }
 
+llama_lm_head_stats llama_get_lm_head_stats(const llama_context * ctx) {
+    return ctx->lm_head_get_stats();
+}
+
+void llama_reset_lm_head_stats(llama_context * ctx) {
+    ctx->lm_head_reset_stats();
+}
+
+llama_kv_spill_stats llama_get_kv_spill_stats(const llama_context * ctx) {
+    return ctx->kv_spill_get_stats();
+}
+
+void llama_reset_kv_spill_stats(llama_context * ctx) {
+    ctx->kv_spill_reset_stats();
+}
+
+bool llama_kv_spill_seq(llama_context * ctx, llama_seq_id seq_id) {
+    return ctx->kv_spill_seq(seq_id);
+}
+
+bool llama_kv_restore_seq(llama_context * ctx, llama_seq_id seq_id) {
+    return ctx->kv_restore_seq(seq_id);
+}
+
+llama_kv_evict_params llama_kv_evict_default_params(void) {
+    llama_kv_evict_params result = {
+        /*.type     =*/ LLAMA_KV_EVICT_NONE,
+        /*.n_sink   =*/ 4,
+        /*.n_window =*/ 1024,
+        /*.n_heavy  =*/ 0,
+    };
+
+    return result;
+}
+
+bool llama_set_kv_evict(llama_context * ctx, llama_seq_id seq_id, llama_kv_evict_params params) {
+    return ctx->kv_evict_set(seq_id, params);
+}
+
+int32_t llama_get_kv_evict_n_evicted(const llama_context * ctx, llama_seq_id seq_id) {
+    return ctx->kv_evict_get_n_evicted(seq_id);
+}
+
 //
 // training
 //
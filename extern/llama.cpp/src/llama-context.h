@@ -20,6 +20,9 @@ class llama_io_write_i;
 struct llama_memory_i;
 struct llama_memory_context_i;
 
+class llama_kv_spill;
+class llama_kv_evict;
+
 struct llama_context {
     // init scheduler and compute buffers, reserve worst-case graphs
     llama_context(
@@ -44,6 +47,8 @@ struct llama_context {
     uint32_t n_threads()       const;
     uint32_t n_threads_batch() const;
 
+    size_t compute_buffer_size() const;
+
     llama_memory_t get_memory() const;
 
     // return true of the KV cache was updated
@@ -74,6 +79,8 @@ struct llama_context {
     void set_causal_attn(bool value);
     void set_warmup(bool value);
 
+    void set_lm_head_candidates(const llama_token * tokens, int32_t n_tokens);
+
     void set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale);
@@ -146,6 +153,18 @@ struct llama_context {
     llama_perf_context_data perf_get_data() const;
     void perf_reset();
 
+    llama_lm_head_stats lm_head_get_stats() const;
+    void lm_head_reset_stats();
+
+    llama_kv_spill_stats kv_spill_get_stats() const;
+    void kv_spill_reset_stats();
+
+    bool kv_spill_seq  (llama_seq_id seq_id);
+    bool kv_restore_seq(llama_seq_id seq_id);
+
+    bool    kv_evict_set(llama_seq_id seq_id, const llama_kv_evict_params & params);
+    int32_t kv_evict_get_n_evicted(llama_seq_id seq_id) const;
+
     //
     // training
     //
@@ -184,6 +203,9 @@ private:
 
     void output_reorder();
 
+    // scatter the exact logits of the approximate lm_head into logits_out and compare with the exact logits if computed
+    void lm_head_apply(const llm_graph_result * res, float * logits_out);
+
     //
     // graph
     //
@@ -230,6 +252,12 @@ private:
 
     std::unique_ptr<llama_memory_i> memory;
 
+    // idle sequences spilled out of the memory, null if kv_spill_tokens == 0
+    std::unique_ptr<llama_kv_spill> kv_spill;
+
+    // per-sequence eviction policies, created by the first llama_set_kv_evict()
+    std::unique_ptr<llama_kv_evict> kv_evict;
+
     // TODO: temporary, until the llama_kv_self_defrag() API is removed
     bool memory_force_optimize = false;
 
@@ -260,6 +288,15 @@ private:
 
     std::vector<swap_info> output_swaps;
 
+    // approximate lm_head
+    std::vector<llama_token> lm_head_cand;
+
+    bool lm_head_check = false; // compute the exact logits of the next ubatch as well
+
+    int32_t lm_head_n_next_check = 0; // value of n_approx at which the next check is due
+
+    llama_lm_head_stats lm_head_stats = {}; // recall and kl are sums over the checked outputs
+
     ggml_backend_sched_ptr sched;
 
     ggml_backend_t backend_cpu = nullptr;
@@ -26,6 +26,12 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    int32_t lm_head_top_m;
+    int32_t lm_head_check_interval;
+
+    uint32_t kv_block_size;
+    uint32_t kv_spill_tokens;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -29,10 +29,11 @@ static std::pair<uint32_t, const char *> decode_utf8(const char * src) {
 }
 
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        std::string_view src,
         llama_partial_utf8 partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src.data();
+    const char          * end      = src.data() + src.size();
     std::vector<uint32_t> code_points;
 
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
@@ -41,7 +42,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     int      n_remain = partial_start.n_remain;
 
     // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
+    while (pos < end && *pos != 0 && n_remain > 0) {
         uint8_t next_byte = static_cast<uint8_t>(*pos);
         if ((next_byte >> 6) != 2) {
             // invalid sequence, abort
@@ -58,7 +59,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     }
 
     // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
+    while (pos < end && *pos != 0) {
         uint8_t first_byte = static_cast<uint8_t>(*pos);
         uint8_t highbits   = first_byte >> 4;
         n_remain   = lookup[highbits] - 1;
@@ -74,7 +75,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         value = first_byte & mask;
 
         ++pos;
-        while (*pos != 0 && n_remain > 0) {
+        while (pos < end && *pos != 0 && n_remain > 0) {
             value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
             ++pos;
             --n_remain;
@@ -1137,8 +1138,8 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
     candidates_grammar.reserve(cur_p->size);
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->token_to_piece(id);
+        const llama_token      id    = cur_p->data[i].id;
+        const std::string_view piece = grammar.vocab->token_to_piece(id);
 
         if (grammar.vocab->is_eog(id)) {
             if (!allow_eog) {
@@ -1161,7 +1162,7 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
-    const auto & piece = grammar.vocab->token_to_piece(token);
+    const std::string piece(grammar.vocab->token_to_piece(token));
 
     if (grammar.awaiting_trigger) {
         if (std::find(grammar.trigger_tokens.begin(), grammar.trigger_tokens.end(), token) != grammar.trigger_tokens.end()) {
@@ -143,6 +143,30 @@ bool llm_graph_input_out_ids::can_reuse(const llm_graph_params & params) {
     return res;
 }
 
+void llm_graph_input_lm_head::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(cand_ids);
+    GGML_ASSERT(ggml_backend_buffer_is_host(cand_ids->buffer));
+
+    int32_t * data = (int32_t *) cand_ids->data;
+
+    // the padding repeats a candidate, scattering its exact logit twice is harmless
+    const int64_t n_cand = cand ? cand->size() : 0;
+    for (int64_t i = 0; i < cand_ids->ne[0]; ++i) {
+        data[i] = n_cand > 0 ? (*cand)[i < n_cand ? i : 0] : 0;
+    }
+}
+
+bool llm_graph_input_lm_head::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= cand == params.lm_head_cand;
+    res &= cand_ids->ne[0] == n_pad(cand ? cand->size() : 0);
+
+    return res;
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -298,6 +322,10 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
+    if (self_kv_idxs) {
+        mctx->set_input_kv_idxs(self_kv_idxs);
+    }
+
     mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
 }
 
@@ -417,6 +445,14 @@ void llm_graph_result::reset() {
     t_embd        = nullptr;
     t_embd_pooled = nullptr;
 
+    t_lm_head_ids    = nullptr;
+    t_lm_head_top    = nullptr;
+    t_lm_head_cand   = nullptr;
+    t_lm_head_logits = nullptr;
+    t_logits_exact   = nullptr;
+
+    t_kv_score = nullptr;
+
     params = {};
 
     inputs.clear();
@@ -521,6 +557,9 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     mctx             (params.mctx),
     cross            (params.cross),
+    lm_head_cand     (params.lm_head_cand),
+    lm_head_check    (params.lm_head_check),
+    kv_score         (params.kv_score),
     cb_func          (params.cb),
     res              (params.res),
     ctx0             (res->get_ctx()),
@@ -1225,7 +1264,8 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * kq_mask,
          ggml_tensor * v_mla,
          ggml_tensor * sinks,
-             float     kq_scale) const {
+             float     kq_scale,
+              bool     kv_score) const {
     const bool v_trans = v->nb[1] > v->nb[2];
 
     // split the batch into streams if needed
@@ -1312,6 +1352,28 @@ ggml_tensor * llm_graph_context::build_attn_mha(
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         ggml_soft_max_add_sinks(kq, sinks);
 
+        if (kv_score) {
+            // [n_kv, n_tokens, n_head, n_stream] -> [n_kv, n_stream], summed over the layers
+            // the column sums are outer products with a vector of ones, they read kq row by row without transposing it,
+            // first per head (one row of the result per head and stream, split across the threads) then over the heads
+            const int64_t n_head_kq = kq->ne[2];
+            const int64_t n_stream  = kq->ne[3];
+
+            ggml_tensor * ones = ggml_arange(ctx0, 0.0f, (float) (kq->ne[1]*n_head_kq*n_stream), 1.0f);
+            ones = ggml_scale_bias(ctx0, ones, 0.0f, 1.0f);
+
+            ggml_tensor * score = ggml_out_prod(ctx0, kq, ggml_reshape_4d(ctx0, ones, 1, kq->ne[1], n_head_kq, n_stream));
+            score = ggml_reshape_4d(ctx0, score, kq->ne[0], n_head_kq, 1, n_stream);
+            score = ggml_out_prod(ctx0, score,
+                    ggml_view_4d(ctx0, ones, 1, n_head_kq, 1, n_stream, sizeof(float), n_head_kq*sizeof(float), n_head_kq*sizeof(float), 0));
+            score = ggml_reshape_2d(ctx0, score, kq->ne[0], n_stream);
+
+            res->t_kv_score = res->t_kv_score ? ggml_add(ctx0, res->t_kv_score, score) : score;
+
+            ggml_set_output(res->t_kv_score);
+            ggml_build_forward_expand(gf, res->t_kv_score);
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1415,8 +1477,9 @@ static std::unique_ptr<llm_graph_input_attn_kv_unified> build_attn_inp_kv_unifie
         const auto n_tokens = ubatch.n_tokens;
         const auto n_stream = cparams.kv_unified ? 1 : ubatch.n_seqs_unq;
 
-        inp->self_k_idxs = mctx_cur->build_input_k_idxs(ctx0, ubatch);
-        inp->self_v_idxs = mctx_cur->build_input_v_idxs(ctx0, ubatch);
+        inp->self_k_idxs  = mctx_cur->build_input_k_idxs(ctx0, ubatch);
+        inp->self_v_idxs  = mctx_cur->build_input_v_idxs(ctx0, ubatch);
+        inp->self_kv_idxs = mctx_cur->build_input_kv_idxs(ctx0);
 
         inp->self_kq_mask = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens/n_stream, GGML_KQ_MASK_PAD), 1, n_stream);
         ggml_set_input(inp->self_kq_mask);
@@ -1466,10 +1529,10 @@ ggml_tensor * llm_graph_context::build_attn(
     const auto & kq_mask = inp->get_kq_mask();
 
     ggml_tensor * q = q_cur;
-    ggml_tensor * k = mctx_cur->get_k(ctx0, il);
-    ggml_tensor * v = mctx_cur->get_v(ctx0, il);
+    ggml_tensor * k = mctx_cur->get_k(ctx0, il, inp->get_kv_idxs());
+    ggml_tensor * v = mctx_cur->get_v(ctx0, il, inp->get_kv_idxs());
 
-    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale);
+    ggml_tensor * cur = build_attn_mha(q, k, v, kq_b, kq_mask, v_mla, nullptr, kq_scale, kv_score);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1885,6 +1948,96 @@ void llm_graph_context::build_pooling(
     ggml_build_forward_expand(gf, cur);
 }
 
+void llm_graph_context::build_lm_head_approx(
+        ggml_tensor * output,
+        ggml_tensor * output_rows,
+        ggml_tensor * output_proxy) const {
+    // batches with many outputs are cheaper to compute exactly, the gathered rows grow with n_outputs*n_top
+    const int64_t n_outputs_max = 8;
+
+    ggml_tensor * cur = res->t_logits;
+
+    // only a plain matrix multiplication with the output can be approximated (no bias, lora, scale or softcap)
+    if (cparams.lm_head_top_m <= 0 || !output_proxy || !cur || cur->op != GGML_OP_MUL_MAT || cur->src[0] != output) {
+        return;
+    }
+
+    ggml_tensor * inp = cur->src[1];
+
+    const int64_t n_vocab = cur->ne[0];
+    const int64_t n_out   = cur->ne[1];
+    const int64_t n_top   = std::min<int64_t>(cparams.lm_head_top_m, n_vocab);
+
+    if (n_out > n_outputs_max || !ggml_is_contiguous(inp) || ggml_nrows(inp) != n_out) {
+        return;
+    }
+
+    if (lm_head_check) {
+        ggml_set_output(cur);
+        res->t_logits_exact = cur;
+    } else {
+        // the exact logits are not needed, rebuild the graph without them
+        const int n_nodes = ggml_graph_n_nodes(gf);
+
+        std::vector<ggml_tensor *> nodes;
+        nodes.reserve(n_nodes);
+        for (int i = 0; i < n_nodes; ++i) {
+            ggml_tensor * node = ggml_graph_node(gf, i);
+            for (int j = 0; j < GGML_MAX_SRC; ++j) {
+                if (node->src[j] == cur) {
+                    return;
+                }
+            }
+            if (node != cur) {
+                nodes.push_back(node);
+            }
+        }
+
+        ggml_graph_clear(gf);
+        for (ggml_tensor * node : nodes) {
+            ggml_build_forward_expand(gf, node);
+        }
+    }
+
+    // dense logits from the proxy
+    ggml_tensor * logits = ggml_mul_mat(ctx0, output_proxy, inp);
+    cb(logits, "result_output_proxy", -1);
+    ggml_set_output(logits);
+    res->t_logits = logits;
+
+    // exact logits of the best n_top rows
+    ggml_tensor * ids = ggml_cont(ctx0, ggml_top_k(ctx0, logits, n_top)); // [n_top, n_out]
+    ggml_set_output(ids);
+
+    ggml_tensor * rows = ggml_get_rows(ctx0, output_rows, ggml_reshape_1d(ctx0, ids, n_top*n_out));
+    rows = ggml_reshape_3d(ctx0, rows, n_embd, n_top, n_out);
+
+    ggml_tensor * top = ggml_mul_mat(ctx0, rows, ggml_reshape_3d(ctx0, inp, n_embd, 1, n_out)); // [n_top, 1, n_out]
+    cb(top, "result_output_top", -1);
+    ggml_set_output(top);
+
+    // exact logits of the requested candidates
+    auto inp_cand = std::make_unique<llm_graph_input_lm_head>(lm_head_cand);
+
+    inp_cand->cand_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, llm_graph_input_lm_head::n_pad(lm_head_cand ? lm_head_cand->size() : 0));
+    ggml_set_input(inp_cand->cand_ids);
+
+    ggml_tensor * cand = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, output_rows, inp_cand->cand_ids), inp); // [n_cand, n_out]
+    cb(cand, "result_output_cand", -1);
+    ggml_set_output(cand);
+
+    res->t_lm_head_ids    = ids;
+    res->t_lm_head_top    = top;
+    res->t_lm_head_cand   = inp_cand->cand_ids;
+    res->t_lm_head_logits = cand;
+
+    res->add_input(std::move(inp_cand));
+
+    ggml_build_forward_expand(gf, logits);
+    ggml_build_forward_expand(gf, top);
+    ggml_build_forward_expand(gf, cand);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
@@ -184,6 +184,24 @@ public:
     const uint32_t n_outputs;
 };
 
+// tokens that always get exact logits with the approximate lm_head
+class llm_graph_input_lm_head : public llm_graph_input_i {
+public:
+    llm_graph_input_lm_head(const std::vector<llama_token> * cand) : cand(cand) {}
+    virtual ~llm_graph_input_lm_head() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    bool can_reuse(const llm_graph_params & params) override;
+
+    // the size is padded so that the graph can be reused while the list changes
+    static int64_t n_pad(size_t n_cand) { return GGML_PAD(n_cand > 0 ? (int64_t) n_cand : 1, 32); }
+
+    ggml_tensor * cand_ids = nullptr; // I32 [n_pad(n_cand)]
+
+    const std::vector<llama_token> * cand;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -273,13 +291,15 @@ public:
 
     bool can_reuse(const llm_graph_params & params) override;
 
-    ggml_tensor * get_k_idxs() const { return self_k_idxs; }
-    ggml_tensor * get_v_idxs() const { return self_v_idxs; }
+    ggml_tensor * get_k_idxs()  const { return self_k_idxs; }
+    ggml_tensor * get_v_idxs()  const { return self_v_idxs; }
+    ggml_tensor * get_kv_idxs() const { return self_kv_idxs; }
 
     ggml_tensor * get_kq_mask() const { return self_kq_mask_cnv; }
 
-    ggml_tensor * self_k_idxs = nullptr; // I64 [n_batch]
-    ggml_tensor * self_v_idxs = nullptr; // I64 [n_batch] or [n_batch*n_embd_v_gqa]
+    ggml_tensor * self_k_idxs  = nullptr; // I64 [n_batch]
+    ggml_tensor * self_v_idxs  = nullptr; // I64 [n_batch] or [n_batch*n_embd_v_gqa]
+    ggml_tensor * self_kv_idxs = nullptr; // I32 [n_kv], paged cache: the cells the K and V rows are gathered from
 
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch/n_stream, 1, n_stream]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch/n_stream, 1, n_stream]
@@ -409,6 +429,13 @@ struct llm_graph_params {
 
     llm_graph_result * res;
 
+    // approximate lm_head, see llm_graph_context::build_lm_head_approx
+    const std::vector<llama_token> * lm_head_cand = nullptr;
+
+    bool lm_head_check = false; // also compute the exact logits
+
+    bool kv_score = false; // sum the attention received by each KV cell into t_kv_score (heavy-hitter eviction)
+
     // return true if the "other" params would result in a graph with the same topology as with the current params
     //   having the same topology allows us to reuse the graph in some cases
     bool allow_reuse(const llm_graph_params & other) const {
@@ -450,7 +477,9 @@ struct llm_graph_params {
             cvec      == other.cvec  &&
             loras     == other.loras &&
             cross     == other.cross &&
-            n_outputs == other.n_outputs;
+            n_outputs == other.n_outputs &&
+            lm_head_check == other.lm_head_check &&
+            kv_score      == other.kv_score;
     }
 };
 
@@ -491,6 +520,15 @@ public:
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
 
+    // approximate lm_head: t_logits holds the proxy logits, the exact logits of the candidates are scattered into them
+    ggml_tensor * t_lm_head_ids    = nullptr; // I32 [n_top, n_outputs]
+    ggml_tensor * t_lm_head_top    = nullptr; // F32 [n_top, 1, n_outputs]
+    ggml_tensor * t_lm_head_cand   = nullptr; // I32 [n_cand]
+    ggml_tensor * t_lm_head_logits = nullptr; // F32 [n_cand, n_outputs]
+    ggml_tensor * t_logits_exact   = nullptr; // F32 [n_vocab, n_outputs], only when checking the divergence
+
+    ggml_tensor * t_kv_score = nullptr; // F32 [n_kv, n_stream], attention received by each cell of the unified KV cache
+
     std::vector<llm_graph_input_ptr> inputs;
 
     ggml_context_ptr ctx_compute;
@@ -566,6 +604,12 @@ struct llm_graph_context {
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
+    const std::vector<llama_token> * lm_head_cand;
+
+    const bool lm_head_check;
+
+    const bool kv_score;
+
     const llm_graph_cb & cb_func;
 
     llm_graph_result * res;
@@ -687,7 +731,8 @@ struct llm_graph_context {
              ggml_tensor * kq_mask,
              ggml_tensor * sinks,
              ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
-                   float   kq_scale) const;
+                   float   kq_scale,
+                    bool   kv_score = false) const; // accumulate the softmaxed KQ per KV cell into res->t_kv_score
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
@@ -814,6 +859,15 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // approximate lm_head
+    //
+
+    void build_lm_head_approx(
+            ggml_tensor * output,
+            ggml_tensor * output_rows,
+            ggml_tensor * output_proxy) const;
 };
 
 // TODO: better name
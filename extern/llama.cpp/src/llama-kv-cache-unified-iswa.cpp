@@ -43,14 +43,14 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
     kv_base = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_base), type_k, type_v,
             v_trans, offload, unified, size_base, n_seq_max, n_pad,
-            0, LLAMA_SWA_TYPE_NONE);
+            0, LLAMA_SWA_TYPE_NONE, 0);
 
     LLAMA_LOG_INFO("%s: creating     SWA KV cache, size = %u cells\n", __func__, size_swa);
 
     kv_swa = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_swa), type_k, type_v,
             v_trans, offload, unified, size_swa, n_seq_max, n_pad,
-            hparams.n_swa, hparams.swa_type);
+            hparams.n_swa, hparams.swa_type, 0);
 }
 
 void llama_kv_cache_unified_iswa::clear(bool data) {
@@ -96,6 +96,15 @@ llama_pos llama_kv_cache_unified_iswa::seq_pos_max(llama_seq_id seq_id) const {
     return kv_swa->seq_pos_max(seq_id);
 }
 
+uint32_t llama_kv_cache_unified_iswa::seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const {
+    // the SWA cache holds at most a window of each sequence, count the cells of the base cache
+    return kv_base->seq_n_cells(seq_id, p0, p1, exclusive);
+}
+
+uint32_t llama_kv_cache_unified_iswa::get_n_used() const {
+    return kv_base->get_n_used();
+}
+
 llama_memory_context_ptr llama_kv_cache_unified_iswa::init_batch(llama_batch_allocr & balloc, uint32_t n_ubatch, bool embd_all) {
     GGML_UNUSED(embd_all);
 
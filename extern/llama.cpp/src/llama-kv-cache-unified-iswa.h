@@ -54,6 +54,9 @@ public:
     llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
+    uint32_t seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const override;
+    uint32_t get_n_used() const override;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_state_seq_flags flags = 0) const override;
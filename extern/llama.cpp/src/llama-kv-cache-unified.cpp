@@ -8,10 +8,27 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
+#include <numeric>
 #include <map>
 #include <stdexcept>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// index of the lowest set bit, bits != 0
+static int lowest_bit(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, bits);
+    return idx;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
 //
 // llama_kv_cache_unified
 //
@@ -28,9 +45,10 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    n_block) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad), n_swa(n_swa), n_block(n_block), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
@@ -81,6 +99,31 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         v_cells[s].resize(kv_size);
     }
 
+    if (n_block > 0) {
+        GGML_ASSERT(n_stream == 1 && "paged KV cache requires a unified KV cache");
+        GGML_ASSERT(kv_size % n_block == 0);
+
+        blocks.seq_blocks.resize(LLAMA_MAX_SEQ);
+        blocks.seq_tail.resize(LLAMA_MAX_SEQ, -1);
+        blocks.owners.resize(kv_size/n_block, 0);
+        blocks.n_used.resize(kv_size/n_block, 0);
+        blocks.is_dirty.resize(kv_size/n_block, 0);
+
+        // the CPU gathers the rows of the blocks of a ubatch in any cache type, this needs V stored by row
+        kv_gather = true;
+        for (uint32_t il = 0; il < n_layer_cache; il++) {
+            if (filter && !filter(il)) {
+                continue;
+            }
+
+            kv_gather &= !offload || ggml_backend_buft_is_host(ggml_backend_dev_buffer_type(model.dev_layer(il)));
+        }
+
+        if (kv_gather) {
+            this->v_trans = false;
+        }
+    }
+
     // by default, all sequence ids are mapped to the 0th stream
     seq_to_stream.resize(LLAMA_MAX_SEQ, 0);
 
@@ -92,7 +135,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     }
 
     // [TAG_V_CACHE_VARIABLE]
-    if (v_trans && hparams.is_n_embd_v_gqa_variable()) {
+    if (this->v_trans && hparams.is_n_embd_v_gqa_variable()) {
         LLAMA_LOG_WARN("%s: the V embeddings have different sizes across layers and FA is not enabled - padding V cache to %d\n",
                 __func__, hparams.n_embd_v_gqa_max());
     }
@@ -105,7 +148,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 
         // [TAG_V_CACHE_VARIABLE]
         const uint32_t n_embd_k_gqa =            hparams.n_embd_k_gqa(il);
-        const uint32_t n_embd_v_gqa = !v_trans ? hparams.n_embd_v_gqa(il) : hparams.n_embd_v_gqa_max();
+        const uint32_t n_embd_v_gqa = !this->v_trans ? hparams.n_embd_v_gqa(il) : hparams.n_embd_v_gqa_max();
 
         const char * dev_name = "CPU";
 
@@ -191,6 +234,11 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max, n_stream,
                 ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
                 ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+
+        if (n_block > 0) {
+            LLAMA_LOG_INFO("%s: paged, %u blocks of %u cells shared by all sequences%s\n", __func__, kv_size/n_block, n_block,
+                    kv_gather ? ", the attention gathers the blocks of its sequences" : "");
+        }
     }
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
@@ -215,6 +263,8 @@ void llama_kv_cache_unified::clear(bool data) {
         v_heads[s] = 0;
     }
 
+    blocks_clear();
+
     if (data) {
         for (auto & buf : bufs) {
             ggml_backend_buffer_clear(buf.get(), 0);
@@ -244,7 +294,13 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
                 continue;
             }
 
-            if (cells.seq_has(i, seq_id) && cells.seq_rm(i, seq_id)) {
+            if (!cells.seq_has(i, seq_id)) {
+                continue;
+            }
+
+            blocks_touch(i);
+
+            if (cells.seq_rm(i, seq_id)) {
                 if (new_head == cells.size()) {
                     new_head = i;
                 }
@@ -268,6 +324,8 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
                     continue;
                 }
 
+                blocks_touch(i);
+
                 cells.rm(i);
 
                 if (new_head == cells.size()) {
@@ -282,6 +340,8 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         }
     }
 
+    blocks_sync();
+
     return true;
 }
 
@@ -316,10 +376,15 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             }
 
             if (cells.seq_has(i, seq_id_src)) {
+                blocks_touch(i);
+
                 cells.seq_add(i, seq_id_dst);
             }
         }
 
+        // the destination now shares the blocks of the source
+        blocks_sync();
+
         return;
     }
 
@@ -377,6 +442,10 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = cells.size();
 
     for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.is_empty(i) && cells.seq_bits(i) != uint64_t(1) << seq_id) {
+            blocks_touch(i);
+        }
+
         if (cells.seq_keep(i, seq_id)) {
             if (new_head == cells.size()) {
                 new_head = i;
@@ -388,6 +457,8 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != cells.size() && new_head < head) {
         head = new_head;
     }
+
+    blocks_sync();
 }
 
 void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
@@ -421,6 +492,8 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         }
 
         if (cells.seq_has(i, seq_id)) {
+            blocks_touch(i);
+
             if (cells.pos_add(i, shift)) {
                 if (new_head == cells.size()) {
                     new_head = i;
@@ -432,6 +505,8 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != cells.size() ? new_head : 0;
+
+    blocks_sync();
 }
 
 void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -462,9 +537,13 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         }
 
         if (cells.seq_has(i, seq_id)) {
+            blocks_touch(i);
+
             cells.pos_div(i, d);
         }
     }
+
+    blocks_sync();
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
@@ -483,6 +562,44 @@ llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     return cells.seq_pos_max(seq_id);
 }
 
+uint32_t llama_kv_cache_unified::seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    const auto & cells = v_cells[seq_to_stream[seq_id]];
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (cells.seq_pos_min(seq_id) < 0 || p0 >= p1) {
+        return 0;
+    }
+
+    uint32_t res = 0;
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.pos_in(i, p0, p1) && cells.seq_has(i, seq_id) && (!exclusive || cells.seq_count(i) == 1)) {
+            res++;
+        }
+    }
+
+    return res;
+}
+
+uint32_t llama_kv_cache_unified::get_n_used() const {
+    uint32_t res = 0;
+
+    for (const auto & cells : v_cells) {
+        res += cells.get_used();
+    }
+
+    return res;
+}
+
 llama_memory_context_ptr llama_kv_cache_unified::init_batch(
             llama_batch_allocr & balloc,
             uint32_t n_ubatch,
@@ -530,7 +647,8 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
     defrag_info dinfo;
 
     // see if we need to defrag
-    if (n_stream == 1) {
+    // a paged cache frees whole blocks and is not defragmented, moving cells would break the block tables
+    if (n_stream == 1 && n_block == 0) {
         // note : for now do not consider defrag for n_stream > 1
         const auto & cells = v_cells[seq_to_stream[0]];
 
@@ -574,6 +692,8 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
     // remember the old state of the cells so we can restore it in the end
     std::vector<state_t> states;
 
+    const block_tables_t blocks_old = blocks;
+
     bool success = true;
 
     for (const auto & ubatch : ubatches) {
@@ -622,6 +742,8 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
         }
     }
 
+    blocks = blocks_old;
+
     if (!success) {
         return {};
     }
@@ -817,6 +939,12 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
         }
     }
 
+    if (n_block > 0) {
+        GGML_ASSERT(!cont);
+
+        return find_slot_paged(ubatch);
+    }
+
     uint32_t n_tokens = ubatch.n_tokens;
     uint32_t n_seqs   = 1;
 
@@ -948,6 +1076,219 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
     return res;
 }
 
+llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) const {
+    const auto & cells = v_cells[0];
+
+    const uint32_t n_tokens = ubatch.n_tokens;
+    const uint32_t n_blocks = cells.size()/n_block;
+
+    slot_info res = {
+        /*.s0   =*/ 0,
+        /*.s1   =*/ 0,
+        /*.strm =*/ { 0 },
+        /*.idxs =*/ { { } },
+    };
+
+    res.idxs[0].reserve(n_tokens);
+
+    // the block each sequence of the ubatch writes to and the next cell to try in it (-2 = not started)
+    std::vector<int32_t>  seq_cur (LLAMA_MAX_SEQ, -2);
+    std::vector<uint32_t> seq_next(LLAMA_MAX_SEQ,  0);
+
+    // blocks below b_free are either in use or opened by this ubatch
+    uint32_t b_free = 0;
+
+    // cells taken out of other blocks once no block is free, sorted
+    std::vector<uint32_t> stray;
+    uint32_t i_stray = 0;
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch.seq_id[i][0];
+
+        int32_t & cur = seq_cur[seq_id];
+
+        if (cur == -2) {
+            // append to the tail block while the sequence is its only owner
+            const int32_t tail = blocks.seq_tail[seq_id];
+
+            cur = tail >= 0 && blocks.owners[tail] == uint64_t(1) << seq_id && blocks.n_used[tail] < n_block ? tail : -1;
+            seq_next[seq_id] = cur >= 0 ? cur*n_block : 0;
+        }
+
+        int64_t idx = -1;
+
+        if (cur >= 0) {
+            for (uint32_t j = seq_next[seq_id]; j < (uint32_t) (cur + 1)*n_block; ++j) {
+                if (cells.is_empty(j) && !std::binary_search(stray.begin(), stray.end(), j)) {
+                    idx = j;
+                    break;
+                }
+            }
+        }
+
+        if (idx < 0) {
+            while (b_free < n_blocks && (blocks.owners[b_free] != 0 || blocks.n_used[b_free] > 0)) {
+                b_free++;
+            }
+
+            if (b_free < n_blocks) {
+                cur = b_free++;
+                idx = cur*n_block;
+            } else {
+                // out of blocks: use the free cells left in partially filled blocks, the capacity is the same as
+                // for a contiguous cache, the sequence just stops owning a block of its own
+                cur = -1;
+
+                for (; i_stray < cells.size(); ++i_stray) {
+                    bool busy = !cells.is_empty(i_stray);
+
+                    for (uint32_t k = 0; !busy && k < res.idxs[0].size(); ++k) {
+                        busy = res.idxs[0][k] == i_stray;
+                    }
+
+                    if (!busy) {
+                        break;
+                    }
+                }
+
+                if (i_stray == cells.size()) {
+                    LLAMA_LOG_DEBUG("%s: no free cell for %d tokens (%u blocks of %u cells)\n", __func__, n_tokens, n_blocks, n_block);
+                    return { };
+                }
+
+                idx = i_stray++;
+                stray.push_back(idx);
+            }
+        }
+
+        if (cur >= 0) {
+            seq_next[seq_id] = idx + 1;
+        }
+
+        res.idxs[0].push_back(idx);
+    }
+
+    if (debug > 0) {
+        uint32_t n_blocks_used = 0;
+        for (uint32_t b = 0; b < n_blocks; ++b) {
+            n_blocks_used += blocks.owners[b] != 0;
+        }
+
+        LLAMA_LOG_DEBUG("%s: %u/%u blocks in use, %u stray cells\n", __func__, n_blocks_used, n_blocks, (uint32_t) stray.size());
+    }
+
+    return res;
+}
+
+void llama_kv_cache_unified::blocks_touch(uint32_t i) {
+    if (n_block == 0) {
+        return;
+    }
+
+    const uint32_t b = i/n_block;
+
+    if (!blocks.is_dirty[b]) {
+        blocks.is_dirty[b] = 1;
+        blocks.dirty.push_back(b);
+    }
+}
+
+void llama_kv_cache_unified::blocks_sync() {
+    if (n_block == 0) {
+        return;
+    }
+
+    const auto & cells = v_cells[0];
+
+    // sequences that joined or left a block, or whose positions in it changed
+    uint64_t seqs_dirty = 0;
+
+    for (const uint32_t b : blocks.dirty) {
+        blocks.is_dirty[b] = 0;
+
+        uint32_t n_used = 0;
+        uint64_t owners = 0;
+
+        for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+            if (!cells.is_empty(i)) {
+                n_used++;
+                owners |= cells.seq_bits(i);
+            }
+        }
+
+        for (uint64_t bits = blocks.owners[b] & ~owners; bits; bits &= bits - 1) {
+            auto & seq_blocks = blocks.seq_blocks[lowest_bit(bits)];
+
+            seq_blocks.erase(std::find(seq_blocks.begin(), seq_blocks.end(), b));
+        }
+
+        for (uint64_t bits = owners & ~blocks.owners[b]; bits; bits &= bits - 1) {
+            blocks.seq_blocks[lowest_bit(bits)].push_back(b);
+        }
+
+        seqs_dirty |= owners | blocks.owners[b];
+
+        blocks.owners[b] = owners;
+        blocks.n_used[b] = n_used;
+    }
+
+    blocks.dirty.clear();
+
+    // restore the position order and the tail of the sequences, this reads only the cells of their own blocks
+    std::vector<std::pair<llama_pos, uint32_t>> order; // (first position, block)
+
+    for (; seqs_dirty; seqs_dirty &= seqs_dirty - 1) {
+        const llama_seq_id s = lowest_bit(seqs_dirty);
+
+        auto & seq_blocks = blocks.seq_blocks[s];
+
+        const llama_pos pos_max = cells.seq_pos_max(s);
+
+        blocks.seq_tail[s] = -1;
+
+        order.clear();
+
+        for (const uint32_t b : seq_blocks) {
+            llama_pos pos_min = std::numeric_limits<llama_pos>::max();
+
+            for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+                if (!cells.is_empty(i) && cells.seq_has(i, s)) {
+                    pos_min = std::min(pos_min, cells.pos_get(i));
+
+                    if (cells.pos_get(i) == pos_max) {
+                        blocks.seq_tail[s] = b;
+                    }
+                }
+            }
+
+            order.emplace_back(pos_min, b);
+        }
+
+        std::sort(order.begin(), order.end());
+
+        for (size_t k = 0; k < order.size(); ++k) {
+            seq_blocks[k] = order[k].second;
+        }
+    }
+}
+
+void llama_kv_cache_unified::blocks_clear() {
+    if (n_block == 0) {
+        return;
+    }
+
+    for (auto & seq_blocks : blocks.seq_blocks) {
+        seq_blocks.clear();
+    }
+
+    std::fill(blocks.seq_tail.begin(), blocks.seq_tail.end(), -1);
+    std::fill(blocks.owners.begin(),   blocks.owners.end(),   0);
+    std::fill(blocks.n_used.begin(),   blocks.n_used.end(),   0);
+    std::fill(blocks.is_dirty.begin(), blocks.is_dirty.end(), 0);
+
+    blocks.dirty.clear();
+}
+
 void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
@@ -966,6 +1307,10 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
 
             const auto idx = sinfo.idxs[s][ii];
 
+            if (n_block > 0 && cells.is_empty(idx)) {
+                blocks.n_used[idx/n_block]++;
+            }
+
             if (!cells.is_empty(idx)) {
                 assert(cells.seq_count(idx) == 1);
 
@@ -982,6 +1327,23 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
             for (int32_t s = 0; s < ubatch.n_seq_id[i]; s++) {
                 cells.seq_add(idx, ubatch.seq_id[i][s]);
             }
+
+            if (n_block > 0) {
+                const uint32_t b = idx/n_block;
+
+                for (int32_t s = 0; s < ubatch.n_seq_id[i]; s++) {
+                    const llama_seq_id seq_id = ubatch.seq_id[i][s];
+
+                    if (!(blocks.owners[b] >> seq_id & 1)) {
+                        blocks.seq_blocks[seq_id].push_back(b);
+                        blocks.owners[b] |= uint64_t(1) << seq_id;
+                    }
+
+                    if (cells.seq_pos_max(seq_id) == ubatch.pos[i]) {
+                        blocks.seq_tail[seq_id] = b;
+                    }
+                }
+            }
         }
     }
 
@@ -1037,6 +1399,44 @@ bool llama_kv_cache_unified::get_has_shift() const {
     return result;
 }
 
+void llama_kv_cache_unified::scores_add(const ggml_tensor * scores, uint32_t n_kv, const slot_info & sinfo, const std::vector<int32_t> * kv_idxs) {
+    const uint32_t ns = sinfo.s1 - sinfo.s0 + 1;
+
+    GGML_ASSERT(scores->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(scores) == (int64_t) n_kv*ns);
+
+    std::vector<float> data(n_kv*ns);
+    ggml_backend_tensor_get(scores, data.data(), 0, data.size()*sizeof(float));
+
+    for (uint32_t s = 0; s < ns; ++s) {
+        auto & cells = v_cells[sinfo.s0 + s];
+
+        for (uint32_t j = 0; j < n_kv; ++j) {
+            const int32_t i = kv_idxs ? (*kv_idxs)[j] : (int32_t) j;
+
+            if (i >= 0 && !cells.is_empty(i)) {
+                cells.score_add(i, data[s*n_kv + j]);
+            }
+        }
+    }
+}
+
+std::vector<std::pair<llama_pos, float>> llama_kv_cache_unified::seq_scores(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    const auto & cells = v_cells[seq_to_stream[seq_id]];
+
+    std::vector<std::pair<llama_pos, float>> res;
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.is_empty(i) && cells.seq_has(i, seq_id)) {
+            res.emplace_back(cells.pos_get(i), cells.score_get(i));
+        }
+    }
+
+    return res;
+}
+
 uint32_t llama_kv_cache_unified::get_n_kv() const {
     uint32_t result = 0;
 
@@ -1049,11 +1449,58 @@ uint32_t llama_kv_cache_unified::get_n_kv() const {
     return result;
 }
 
+bool llama_kv_cache_unified::get_kv_gather() const {
+    return kv_gather;
+}
+
+std::vector<int32_t> llama_kv_cache_unified::get_kv_idxs(const llama_ubatch & ubatch) const {
+    std::vector<int32_t> res;
+
+    if (!kv_gather) {
+        return res;
+    }
+
+    uint64_t seqs = 0;
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+            seqs |= uint64_t(1) << ubatch.seq_id[i][s];
+        }
+    }
+
+    // a block shared by several sequences of the ubatch (a forked prefix) is gathered once
+    std::vector<uint8_t> block_taken;
+    if (seqs & (seqs - 1)) {
+        block_taken.resize(blocks.owners.size(), 0);
+    }
+
+    for (; seqs; seqs &= seqs - 1) {
+        for (const uint32_t b : blocks.seq_blocks[lowest_bit(seqs)]) {
+            if (!block_taken.empty()) {
+                if (block_taken[b]) {
+                    continue;
+                }
+                block_taken[b] = 1;
+            }
+
+            for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+                res.push_back(i);
+            }
+        }
+    }
+
+    // the ubatch was applied, all its sequences have cells
+    GGML_ASSERT(!res.empty());
+
+    res.resize(GGML_PAD(res.size(), n_pad), -1);
+
+    return res;
+}
+
 bool llama_kv_cache_unified::get_supports_set_rows() const {
     return supports_set_rows;
 }
 
-ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo) const {
+ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo, ggml_tensor * kv_idxs) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto * k = layers[ikv].k;
@@ -1063,6 +1510,14 @@ ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, int32_t il, uint
 
     assert(n_embd_k_gqa == hparams.n_embd_k_gqa(il));
 
+    if (kv_idxs) {
+        GGML_ASSERT(kv_idxs->ne[0] == n_kv);
+
+        ggml_tensor * rows = ggml_get_rows_raw(ctx, k, kv_idxs);
+
+        return ggml_reshape_4d(ctx, rows, hparams.n_embd_head_k, hparams.n_head_kv(il), n_kv, 1);
+    }
+
     const uint32_t ns = sinfo.s1 - sinfo.s0 + 1;
 
     return ggml_view_4d(ctx, k,
@@ -1073,7 +1528,7 @@ ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, int32_t il, uint
             ggml_row_size(k->type, n_embd_k_gqa*kv_size)*sinfo.s0);
 }
 
-ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo) const {
+ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo, ggml_tensor * kv_idxs) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto * v = layers[ikv].v;
@@ -1084,6 +1539,14 @@ ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, int32_t il, uint
     // [TAG_V_CACHE_VARIABLE]
     assert(n_embd_v_gqa >= hparams.n_embd_v_gqa(il));
 
+    if (kv_idxs) {
+        GGML_ASSERT(kv_idxs->ne[0] == n_kv && !v_trans);
+
+        ggml_tensor * rows = ggml_get_rows_raw(ctx, v, kv_idxs);
+
+        return ggml_reshape_4d(ctx, rows, hparams.n_embd_head_v, hparams.n_head_kv(il), n_kv, 1);
+    }
+
     const uint32_t ns = sinfo.s1 - sinfo.s0 + 1;
 
     if (!v_trans) {
@@ -1286,7 +1749,7 @@ void llama_kv_cache_unified::set_input_k_shift(ggml_tensor * dst) const {
     }
 }
 
-void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
+void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<int32_t> * kv_idxs) const {
     const uint32_t n_tokens = ubatch->n_tokens;
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
@@ -1315,8 +1778,9 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
-    // TODO: optimize this section
-    for (uint32_t h = 0; h < 1; ++h) {
+
+    // ALiBi biases every cell by its distance to the token, each row is different
+    if (hparams.use_alibi) {
         for (uint32_t s = 0; s < n_stream; ++s) {
             for (uint32_t ii = 0; ii < n_tps; ++ii) {
                 const uint32_t i = s*n_tps + ii;
@@ -1327,38 +1791,159 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
 
                 const llama_pos p1 = ubatch->pos[i];
 
-                const uint64_t idst = n_kv*(h*n_stream*n_tps_pad + s*n_tps_pad + ii);
+                const uint64_t idst = n_kv*(s*n_tps_pad + ii);
 
                 for (uint32_t j = 0; j < n_kv; ++j) {
-                    if (cells.is_empty(j)) {
+                    const int32_t c = kv_idxs ? (*kv_idxs)[j] : (int32_t) j;
+
+                    if (c < 0 || cells.is_empty(c) || !cells.seq_has(c, seq_id)) {
                         continue;
                     }
 
-                    // mask the token if not the same sequence
-                    if (!cells.seq_has(j, seq_id)) {
+                    const llama_pos p0 = cells.pos_get(c);
+
+                    if ((causal_attn && p0 > p1) || is_masked_swa(p0, p1)) {
                         continue;
                     }
 
-                    const llama_pos p0 = cells.pos_get(j);
+                    data[idst + j] = -std::abs(p0 - p1);
+                }
+            }
+        }
+
+        return;
+    }
 
-                    // mask future tokens
-                    if (causal_attn && p0 > p1) {
+    // The rows of the tokens of a sequence differ only in the cells masked for some of its tokens and not others:
+    //   - one pass over the cells fills the row of the first token of each sequence with spans of visible cells
+    //   - a cell visible to the lowest and to the highest position of the sequence in the ubatch is visible to all its
+    //     tokens (causal and SWA masking are monotonic), the other cells (the ubatch itself, the SWA boundary) are
+    //     listed and set for each row on top of a copy of the first row
+    struct seq_rows {
+        int32_t   row = -1; // first token of the sequence in the stream
+        llama_pos p1_min;
+        llama_pos p1_max;
+        int64_t   j0;       // start of the current span of visible cells
+
+        std::vector<std::pair<uint32_t, llama_pos>> cells_row; // cells set per row
+    };
+
+    std::vector<seq_rows> seqs(LLAMA_MAX_SEQ);
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[seq_to_stream[ubatch->seq_id[s*n_tps][0]]];
+
+        float * data_s = data + n_kv*s*n_tps_pad;
+
+        uint64_t bits_ubatch = 0;
+
+        for (uint32_t ii = 0; ii < n_tps; ++ii) {
+            const uint32_t i = s*n_tps + ii;
+
+            const llama_seq_id seq_id = ubatch->seq_id[i][0];
+            const llama_pos    p1     = ubatch->pos[i];
+
+            auto & sr = seqs[seq_id];
+
+            if (!(bits_ubatch >> seq_id & 1)) {
+                sr.row    = ii;
+                sr.p1_min = p1;
+                sr.p1_max = p1;
+                sr.cells_row.clear();
+
+                bits_ubatch |= uint64_t(1) << seq_id;
+            } else {
+                sr.p1_min = std::min(sr.p1_min, p1);
+                sr.p1_max = std::max(sr.p1_max, p1);
+            }
+        }
+
+        uint64_t bits_prev = 0;
+
+        for (uint32_t j = 0; j < n_kv; ++j) {
+            uint64_t bits_vis = 0;
+
+            const int32_t c = kv_idxs ? (*kv_idxs)[j] : (int32_t) j;
+
+            uint64_t bits = c < 0 || cells.is_empty(c) ? 0 : cells.seq_bits(c) & bits_ubatch;
+
+            if (bits) {
+                const llama_pos p0 = cells.pos_get(c);
+
+                for (; bits; bits &= bits - 1) {
+                    const int seq_id = lowest_bit(bits);
+
+                    auto & sr = seqs[seq_id];
+
+                    // visible to all the tokens of the sequence
+                    if (!(causal_attn && p0 > sr.p1_min) && !is_masked_swa(p0, sr.p1_max)) {
+                        bits_vis |= uint64_t(1) << seq_id;
                         continue;
                     }
 
-                    // apply SWA if any
-                    if (is_masked_swa(p0, p1)) {
+                    // masked for all the tokens of the sequence
+                    if ((causal_attn && p0 > sr.p1_max) || is_masked_swa(p0, sr.p1_min)) {
                         continue;
                     }
 
-                    data[idst + j] = hparams.use_alibi ? -std::abs(p0 - p1) : 0.0f;
+                    sr.cells_row.emplace_back(j, p0);
+                }
+            }
+
+            // open and close the spans of visible cells
+            for (uint64_t bits_diff = bits_vis ^ bits_prev; bits_diff; bits_diff &= bits_diff - 1) {
+                const int seq_id = lowest_bit(bits_diff);
+
+                auto & sr = seqs[seq_id];
+
+                if (bits_vis >> seq_id & 1) {
+                    sr.j0 = j;
+                } else {
+                    std::fill(data_s + n_kv*sr.row + sr.j0, data_s + n_kv*sr.row + j, 0.0f);
                 }
             }
+
+            bits_prev = bits_vis;
+        }
+
+        for (; bits_prev; bits_prev &= bits_prev - 1) {
+            auto & sr = seqs[lowest_bit(bits_prev)];
+
+            std::fill(data_s + n_kv*sr.row + sr.j0, data_s + n_kv*(sr.row + 1), 0.0f);
+        }
+
+        auto set_row = [&](float * row, const seq_rows & sr, llama_pos p1) {
+            for (const auto & [j, p0] : sr.cells_row) {
+                row[j] = (causal_attn && p0 > p1) || is_masked_swa(p0, p1) ? -INFINITY : 0.0f;
+            }
+        };
+
+        for (uint32_t ii = 0; ii < n_tps; ++ii) {
+            const uint32_t i = s*n_tps + ii;
+
+            const auto & sr = seqs[ubatch->seq_id[i][0]];
+
+            if ((int32_t) ii == sr.row) {
+                continue;
+            }
+
+            float * row = data_s + n_kv*ii;
+
+            std::memcpy(row, data_s + n_kv*sr.row, n_kv*sizeof(float));
+
+            set_row(row, sr, ubatch->pos[i]);
+        }
+
+        // the first rows last, they are the templates of the others
+        for (uint64_t bits = bits_ubatch; bits; bits &= bits - 1) {
+            const auto & sr = seqs[lowest_bit(bits)];
+
+            set_row(data_s + n_kv*sr.row, sr, ubatch->pos[s*n_tps + sr.row]);
         }
     }
 }
 
-void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
+void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch, const std::vector<int32_t> * kv_idxs) const {
     const int64_t n_tokens = ubatch->n_tokens;
 
     GGML_ASSERT(n_stream == 1 && "TODO: support multiple streams");
@@ -1375,7 +1960,8 @@ void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor * dst, const llama
         for (int i = 0; i < n_tokens; ++i) {
             for (int j = 0; j < n_kv; ++j) {
                 // the position when the cells is empty is irrelevant - it will be masked out later in the attention
-                const llama_pos p0 = cells.is_empty(j) ? -1 : cells.pos_get(j);
+                const int32_t   c  = kv_idxs ? (*kv_idxs)[j] : (int32_t) j;
+                const llama_pos p0 = c < 0 || cells.is_empty(c) ? -1 : cells.pos_get(c);
 
                 data[h*(n_kv*n_tokens) + i*n_kv + j] = llama_relative_position_bucket(p0, ubatch->pos[i], hparams.n_rel_attn_bkts, false);
             }
@@ -1902,9 +2488,11 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
 
         const uint32_t strm = seq_id == -1 ? s : seq_to_stream[seq_id];
 
+        slot_info::idx_vec_t idxs;
+
         bool res = true;
-        res = res && state_read_meta(io, strm, cell_count, seq_id);
-        res = res && state_read_data(io, strm, cell_count);
+        res = res && state_read_meta(io, strm, cell_count, idxs, seq_id);
+        res = res && state_read_data(io, strm, idxs);
 
         if (!res) {
             if (seq_id == -1) {
@@ -1915,6 +2503,8 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
             throw std::runtime_error("failed to restore kv cache");
         }
     }
+
+    blocks_sync();
 }
 
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const cell_ranges_t & cr, llama_seq_id seq_id) const {
@@ -2040,7 +2630,7 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const cell_
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, slot_info::idx_vec_t & idxs, llama_seq_id dest_seq_id) {
     auto & cells = v_cells[strm];
     auto & head  = v_heads[strm];
 
@@ -2077,7 +2667,8 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
             ubatch.seq_id[i]   = &dest_seq_id;
         }
 
-        const auto sinfo = find_slot(ubatch, true);
+        // paged: the cells go wherever the block tables put them, the data is scattered in state_read_data()
+        const auto sinfo = find_slot(ubatch, n_block == 0);
         if (sinfo.empty()) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
@@ -2085,6 +2676,12 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
 
         apply_ubatch(sinfo, ubatch);
 
+        idxs = sinfo.idxs[0];
+
+        if (n_block > 0) {
+            return true;
+        }
+
         const auto head_cur = sinfo.head();
 
         // keep the head at the old position because we will read the KV data into it in state_read_data()
@@ -2118,6 +2715,8 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
 
             cells.pos_set(i, pos);
 
+            blocks_touch(i);
+
             for (uint32_t j = 0; j < n_seq_id; ++j) {
                 llama_seq_id seq_id;
                 io.read_to(&seq_id, sizeof(seq_id));
@@ -2132,14 +2731,30 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t strm
         }
 
         head = 0;
+
+        idxs.resize(cell_count);
+        for (uint32_t i = 0; i < cell_count; ++i) {
+            idxs[i] = i;
+        }
     }
 
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm, uint32_t cell_count) {
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm, const slot_info::idx_vec_t & idxs) {
     auto & cells = v_cells[strm];
-    auto & head  = v_heads[strm];
+
+    const uint32_t cell_count = idxs.size();
+
+    // runs of consecutive destination cells, [first, first + n)
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    for (uint32_t i = 0; i < cell_count; ++i) {
+        if (!runs.empty() && runs.back().first + runs.back().second == idxs[i]) {
+            runs.back().second++;
+        } else {
+            runs.emplace_back(idxs[i], 1);
+        }
+    }
 
     uint32_t v_trans;
     uint32_t n_layer;
@@ -2188,9 +2803,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(k, io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys, one contiguous block per run of cells
+        for (const auto & [first, n] : runs) {
+            ggml_backend_tensor_set(k, io.read(n * k_size_row), first * k_size_row, n * k_size_row);
         }
     }
 
@@ -2220,9 +2835,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(v, io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values, one contiguous block per run of cells
+            for (const auto & [first, n] : runs) {
+                ggml_backend_tensor_set(v, io.read(n * v_size_row), first * v_size_row, n * v_size_row);
             }
         }
     } else {
@@ -2260,11 +2875,11 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t strm
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * cells.size()) * v_size_el;
-                    ggml_backend_tensor_set(v, io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values for each run of cells
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & [first, n] : runs) {
+                    const size_t dst_offset = (first + j * cells.size()) * v_size_el;
+                    ggml_backend_tensor_set(v, io.read(n * v_size_el), dst_offset, n * v_size_el);
                 }
             }
         }
@@ -2283,6 +2898,12 @@ llama_kv_cache_unified_context::llama_kv_cache_unified_context(
         llama_kv_cache_unified * kv) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv) {
     n_kv = kv->get_size();
 
+    // the largest gather is every cell
+    if (kv->get_kv_gather()) {
+        kv_idxs.resize(n_kv);
+        std::iota(kv_idxs.begin(), kv_idxs.end(), 0);
+    }
+
     const uint32_t n_stream = kv->get_n_stream();
 
     // create a dummy slot info - the actual data is irrelevant. we just need to build the graph
@@ -2337,7 +2958,9 @@ bool llama_kv_cache_unified_context::apply() {
 
     kv->apply_ubatch(sinfos[i_cur], ubatches[i_cur]);
 
-    n_kv = kv->get_n_kv();
+    kv_idxs = kv->get_kv_idxs(ubatches[i_cur]);
+
+    n_kv = kv_idxs.empty() ? kv->get_n_kv() : kv_idxs.size();
 
     return true;
 }
@@ -2360,12 +2983,12 @@ bool llama_kv_cache_unified_context::get_supports_set_rows() const {
     return kv->get_supports_set_rows();
 }
 
-ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il) const {
-    return kv->get_k(ctx, il, n_kv, sinfos[i_cur]);
+ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il, ggml_tensor * kv_idxs) const {
+    return kv->get_k(ctx, il, n_kv, sinfos[i_cur], kv_idxs);
 }
 
-ggml_tensor * llama_kv_cache_unified_context::get_v(ggml_context * ctx, int32_t il) const {
-    return kv->get_v(ctx, il, n_kv, sinfos[i_cur]);
+ggml_tensor * llama_kv_cache_unified_context::get_v(ggml_context * ctx, int32_t il, ggml_tensor * kv_idxs) const {
+    return kv->get_v(ctx, il, n_kv, sinfos[i_cur], kv_idxs);
 }
 
 ggml_tensor * llama_kv_cache_unified_context::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il) const {
@@ -2384,6 +3007,17 @@ ggml_tensor * llama_kv_cache_unified_context::build_input_v_idxs(ggml_context *
     return kv->build_input_v_idxs(ctx, ubatch);
 }
 
+ggml_tensor * llama_kv_cache_unified_context::build_input_kv_idxs(ggml_context * ctx) const {
+    if (kv_idxs.empty()) {
+        return nullptr;
+    }
+
+    ggml_tensor * res = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_kv);
+    ggml_set_input(res);
+
+    return res;
+}
+
 void llama_kv_cache_unified_context::set_input_k_shift(ggml_tensor * dst) const {
     kv->set_input_k_shift(dst);
 }
@@ -2396,12 +3030,28 @@ void llama_kv_cache_unified_context::set_input_v_idxs(ggml_tensor * dst, const l
     kv->set_input_v_idxs(dst, ubatch, sinfos[i_cur]);
 }
 
+void llama_kv_cache_unified_context::set_input_kv_idxs(ggml_tensor * dst) const {
+    GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
+    GGML_ASSERT(dst->ne[0] == (int64_t) kv_idxs.size());
+
+    int32_t * data = (int32_t *) dst->data;
+
+    // the padding gathers cell 0, the mask hides it
+    for (size_t j = 0; j < kv_idxs.size(); ++j) {
+        data[j] = std::max(kv_idxs[j], 0);
+    }
+}
+
 void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
-    kv->set_input_kq_mask(dst, ubatch, causal_attn);
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, kv_idxs.empty() ? nullptr : &kv_idxs);
 }
 
 void llama_kv_cache_unified_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
-    kv->set_input_pos_bucket(dst, ubatch);
+    kv->set_input_pos_bucket(dst, ubatch, kv_idxs.empty() ? nullptr : &kv_idxs);
+}
+
+void llama_kv_cache_unified_context::scores_add(const ggml_tensor * scores) {
+    kv->scores_add(scores, n_kv, sinfos[i_cur], kv_idxs.empty() ? nullptr : &kv_idxs);
 }
 
 uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) {
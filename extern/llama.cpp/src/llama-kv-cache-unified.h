@@ -104,7 +104,8 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    n_block);
 
     ~llama_kv_cache_unified() = default;
 
@@ -134,6 +135,9 @@ public:
     llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
+    uint32_t seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const override;
+    uint32_t get_n_used() const override;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1, llama_state_seq_flags flags = 0) const override;
@@ -148,18 +152,33 @@ public:
 
     bool get_has_shift() const;
 
+    // heavy-hitter eviction: add the attention received by the cells [0, n_kv) of the streams of sinfo
+    // (the cells kv_idxs[0, n_kv) when the K and V rows were gathered, see get_kv_idxs)
+    // scores is F32 [n_kv, n_stream], as computed by llm_graph_context::build_attn_mha
+    void scores_add(const ggml_tensor * scores, uint32_t n_kv, const slot_info & sinfo, const std::vector<int32_t> * kv_idxs);
+
+    // (pos, accumulated attention) of the cells of the sequence
+    std::vector<std::pair<llama_pos, float>> seq_scores(llama_seq_id seq_id) const;
+
     //
     // graph_build API
     //
 
     uint32_t get_n_kv() const;
 
+    bool get_kv_gather() const;
+
+    // paged mode: the cells of the blocks of the sequences of the ubatch, in the order of their block tables and
+    // padded to n_pad with -1, the attention gathers its K and V rows from them instead of viewing [0, n_kv)
+    // empty when the rows are not gathered (contiguous cells, or a cache outside of host memory)
+    std::vector<int32_t> get_kv_idxs(const llama_ubatch & ubatch) const;
+
     // TODO: temporary
     bool get_supports_set_rows() const;
 
-    // get views of the current state of the cache
-    ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo) const;
-    ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo) const;
+    // get views of the current state of the cache, or with kv_idxs the rows of these cells
+    ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo, ggml_tensor * kv_idxs) const;
+    ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv, const slot_info & sinfo, ggml_tensor * kv_idxs) const;
 
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il, const slot_info & sinfo) const;
@@ -180,6 +199,9 @@ public:
     // return empty slot_info on failure
     slot_info find_slot(const llama_ubatch & ubatch, bool cont) const;
 
+    // paged mode: each sequence fills its own blocks, see block_tables_t
+    slot_info find_slot_paged(const llama_ubatch & ubatch) const;
+
     // emplace the ubatch context into slot: [sinfo.idxs[0...ubatch.n_tokens - 1]]
     void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
 
@@ -195,8 +217,9 @@ public:
 
     void set_input_k_shift(ggml_tensor * dst) const;
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
-    void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    // column j of the mask is the cell kv_idxs[j] if given, the cell j otherwise
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<int32_t> * kv_idxs) const;
+    void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch, const std::vector<int32_t> * kv_idxs) const;
 
 private:
     const llama_model & model;
@@ -225,6 +248,12 @@ private:
     // SWA
     const uint32_t n_swa = 0;
 
+    // paged mode: cells are handed out in blocks of n_block cells, 0 = disabled
+    const uint32_t n_block = 0;
+
+    // paged mode with the cache in host memory: the attention gathers the rows of its blocks, V is not transposed
+    bool kv_gather = false;
+
     // env: LLAMA_KV_CACHE_DEBUG
     int debug = 0;
 
@@ -249,6 +278,29 @@ private:
     // pending stream copies that will be applied during the next update
     stream_copy_info sc_info;
 
+    // paged mode (single stream): a block belongs to every sequence that has cells in it
+    // a sequence appends to its tail block only while it is the sole owner, so the blocks of a prefix
+    // shared with seq_cp() stay shared and each fork continues in a block of its own (copy-on-write
+    // without a copy, the cells of a block are never rewritten while they are in use)
+    struct block_tables_t {
+        std::vector<std::vector<uint32_t>> seq_blocks; // [LLAMA_MAX_SEQ] blocks of the sequence, in position order
+        std::vector<int32_t>               seq_tail;   // [LLAMA_MAX_SEQ] block holding the last position, -1 = none
+
+        std::vector<uint64_t> owners; // [n_blocks] sequences with cells in the block, bit s for seq_id s
+        std::vector<uint32_t> n_used; // [n_blocks] number of non-empty cells in the block
+
+        std::vector<uint32_t> dirty;    // blocks changed since the last blocks_sync()
+        std::vector<uint8_t>  is_dirty; // [n_blocks]
+    };
+
+    block_tables_t blocks;
+
+    // appends update the block tables in apply_ubatch(), any other change of a cell marks its block with
+    // blocks_touch() and blocks_sync() then updates the tables of the marked blocks and of their sequences
+    void blocks_touch(uint32_t i);
+    void blocks_sync();
+    void blocks_clear();
+
     std::vector<kv_layer> layers;
 
     // model layer id -> KV cache layer id
@@ -291,8 +343,9 @@ private:
     void state_write_meta(llama_io_write_i & io, const cell_ranges_t & cr, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const cell_ranges_t & cr) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t strm, uint32_t cell_count);
+    // idxs receives the cells the data is read into, one per restored cell (contiguous unless paged)
+    bool state_read_meta(llama_io_read_i & io, uint32_t strm, uint32_t cell_count, slot_info::idx_vec_t & idxs, llama_seq_id dest_seq_id = -1);
+    bool state_read_data(llama_io_read_i & io, uint32_t strm, const slot_info::idx_vec_t & idxs);
 };
 
 class llama_kv_cache_unified_context : public llama_memory_context_i {
@@ -344,9 +397,9 @@ public:
     // TODO: temporary
     bool get_supports_set_rows() const;
 
-    // get views of the current state of the cache
-    ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
-    ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
+    // get views of the current state of the cache, kv_idxs is the input from build_input_kv_idxs()
+    ggml_tensor * get_k(ggml_context * ctx, int32_t il, ggml_tensor * kv_idxs = nullptr) const;
+    ggml_tensor * get_v(ggml_context * ctx, int32_t il, ggml_tensor * kv_idxs = nullptr) const;
 
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il) const;
@@ -355,13 +408,20 @@ public:
     ggml_tensor * build_input_k_idxs(ggml_context * ctx, const llama_ubatch & ubatch) const;
     ggml_tensor * build_input_v_idxs(ggml_context * ctx, const llama_ubatch & ubatch) const;
 
-    void set_input_k_idxs(ggml_tensor * dst, const llama_ubatch * ubatch) const;
-    void set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    // the cells to gather the K and V rows from, nullptr if the cache is viewed directly
+    ggml_tensor * build_input_kv_idxs(ggml_context * ctx) const;
+
+    void set_input_k_idxs (ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    void set_input_v_idxs (ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    void set_input_kv_idxs(ggml_tensor * dst) const;
 
     void set_input_k_shift   (ggml_tensor * dst) const;
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    // attention scores of the current ubatch, see llama_kv_cache_unified::scores_add
+    void scores_add(const ggml_tensor * scores);
+
 private:
     llama_memory_status status;
 
@@ -396,4 +456,7 @@ private:
     // a heuristic, to avoid attending the full cache if it is not yet utilized
     // as the cache gets filled, the benefit from this heuristic disappears
     int32_t n_kv;
+
+    // paged mode: the n_kv cells the K and V rows are gathered from, see llama_kv_cache_unified::get_kv_idxs
+    std::vector<int32_t> kv_idxs;
 };
@@ -17,6 +17,7 @@ public:
         for (uint32_t i = 0; i < pos.size(); ++i) {
             pos[i]   = -1;
             shift[i] =  0;
+            score[i] =  0.0f;
             seq[i].reset();
         }
 
@@ -44,6 +45,7 @@ public:
     void resize(uint32_t n) {
         pos.resize(n);
         shift.resize(n);
+        score.resize(n);
         seq.resize(n);
 
         reset();
@@ -86,10 +88,12 @@ public:
 
         pos  [idst] = pos  [isrc];
         shift[idst] = shift[isrc];
+        score[idst] = score[isrc];
         seq  [idst] = seq  [isrc];
 
         pos  [isrc] = -1;
         shift[isrc] =  0;
+        score[isrc] =  0.0f;
         seq  [isrc].reset();
 
         used.erase (isrc);
@@ -204,6 +208,7 @@ public:
 
         pos[i] = -1;
         shift[i] = 0;
+        score[i] = 0.0f;
 
         used.erase(i);
     }
@@ -278,6 +283,15 @@ public:
         return seq[i].test(seq_id);
     }
 
+    // the sequences in the cell, bit s is set for seq_id s
+    uint64_t seq_bits(uint32_t i) const {
+        static_assert(LLAMA_MAX_SEQ <= 64, "the sequence set does not fit in 64 bits");
+
+        assert(i < pos.size());
+
+        return seq[i].to_ullong();
+    }
+
     // note: call only if the cell is not empty and the seq_id is not in the cell
     void seq_add(uint32_t i, llama_seq_id seq_id) {
         assert(i < pos.size());
@@ -364,10 +378,24 @@ public:
         assert(seq[i].none());
 
         pos[i] = p;
+        score[i] = 0.0f;
 
         used.insert(i);
     }
 
+    // attention received by the cell since it was written, summed over the layers, heads and queries
+    float score_get(uint32_t i) const {
+        assert(i < pos.size());
+
+        return score[i];
+    }
+
+    void score_add(uint32_t i, float s) {
+        assert(i < pos.size());
+
+        score[i] += s;
+    }
+
     // pos[i] = pos[i] + d
     // sets "has_shift" to true
     // note: call only if the cell is not empty
@@ -441,6 +469,9 @@ private:
     //
     std::vector<llama_pos> shift;
 
+    // accumulated attention scores, only collected for the heavy-hitter eviction policy
+    std::vector<float> score;
+
     using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
 
     // the bitset seq[i] tells us which sequences are currently occupying the i-th cell
@@ -0,0 +1,259 @@
+#include "llama-kv-evict.h"
+
+#include "llama-impl.h"
+#include "llama-context.h"
+#include "llama-kv-cache-unified.h"
+#include "llama-kv-cache-unified-iswa.h"
+
+#include <algorithm>
+
+//
+// llama_kv_evict
+//
+
+llama_kv_evict::llama_kv_evict(llama_context & lctx, uint32_t n_seq_max) :
+    lctx(lctx), n_seq_max(n_seq_max), params(n_seq_max, llama_kv_evict_default_params()), n_evicted(n_seq_max, 0) {
+}
+
+bool llama_kv_evict::set(llama_seq_id seq_id, const llama_kv_evict_params & p) {
+    if (seq_id < 0 || (uint32_t) seq_id >= n_seq_max) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id %d\n", __func__, seq_id);
+        return false;
+    }
+
+    if (p.type == LLAMA_KV_EVICT_NONE) {
+        params[seq_id] = p;
+        return true;
+    }
+
+    auto * mem = lctx.get_memory();
+
+    const bool is_unified = dynamic_cast<llama_kv_cache_unified *>(mem) != nullptr;
+    const bool is_iswa    = dynamic_cast<llama_kv_cache_unified_iswa *>(mem) != nullptr;
+
+    if ((!is_unified && !is_iswa) || !mem->get_can_shift()) {
+        LLAMA_LOG_WARN("%s: KV eviction needs an attention KV cache that can shift\n", __func__);
+        return false;
+    }
+
+    if (p.n_sink < 0 || p.n_window <= 0 || p.n_heavy < 0) {
+        LLAMA_LOG_ERROR("%s: invalid policy: n_sink = %d, n_window = %d, n_heavy = %d\n", __func__, p.n_sink, p.n_window, p.n_heavy);
+        return false;
+    }
+
+    if (p.type == LLAMA_KV_EVICT_HEAVY) {
+        // flash attention never materializes the softmax, the attention received by the cells is unknown
+        if (!is_unified || lctx.get_cparams().flash_attn) {
+            LLAMA_LOG_WARN("%s: heavy hitters need flash_attn off and a model without SWA\n", __func__);
+            return false;
+        }
+    }
+
+    params[seq_id] = p;
+
+    LLAMA_LOG_INFO("%s: seq %d: keep %d sink + %d heavy + %d recent tokens\n", __func__, seq_id,
+            p.n_sink, p.type == LLAMA_KV_EVICT_HEAVY ? p.n_heavy : 0, p.n_window);
+
+    return true;
+}
+
+int32_t llama_kv_evict::get_n_evicted(llama_seq_id seq_id) const {
+    if (seq_id < 0 || (uint32_t) seq_id >= n_seq_max) {
+        return 0;
+    }
+
+    return n_evicted[seq_id];
+}
+
+bool llama_kv_evict::need_scores() const {
+    for (const auto & p : params) {
+        if (p.type == LLAMA_KV_EVICT_HEAVY) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void llama_kv_evict::scores_add(llama_memory_context_i * mctx, const ggml_tensor * scores) {
+    // need_scores() implies a llama_kv_cache_unified memory
+    static_cast<llama_kv_cache_unified_context *>(mctx)->scores_add(scores);
+}
+
+bool llama_kv_evict::select(llama_seq_id seq_id, uint32_t n_new, std::vector<std::pair<llama_pos, llama_pos>> & res) const {
+    const auto * mem = lctx.get_memory();
+    const auto & p   = params[seq_id];
+
+    const llama_pos p0 = mem->seq_pos_min(seq_id);
+    const llama_pos p1 = mem->seq_pos_max(seq_id);
+
+    if (p0 < 0) {
+        return false;
+    }
+
+    const int32_t n_heavy = p.type == LLAMA_KV_EVICT_HEAVY ? p.n_heavy : 0;
+
+    if ((int64_t) (p1 - p0 + 1) + n_new <= (int64_t) p.n_sink + n_heavy + p.n_window) {
+        return false;
+    }
+
+    // free a quarter of the window on top of the new tokens, so that the K-shift does not run on every token
+    const int32_t n_slack = std::max(1, p.n_window/4);
+    const int32_t n_keep  = std::max(0, p.n_window - (int32_t) n_new - n_slack);
+
+    const llama_pos ps = std::min(p0 + p.n_sink, p1 + 1);
+    const llama_pos pw = std::max(ps, p1 + 1 - n_keep);
+
+    res.clear();
+
+    if (ps > p0) {
+        res.emplace_back(p0, ps);
+    }
+
+    if (n_heavy > 0 && pw > ps) {
+        std::vector<std::pair<llama_pos, float>> cand;
+
+        for (const auto & [pos, score] : static_cast<const llama_kv_cache_unified *>(mem)->seq_scores(seq_id)) {
+            if (pos >= ps && pos < pw) {
+                cand.emplace_back(pos, score);
+            }
+        }
+
+        const size_t n_top = std::min<size_t>(cand.size(), n_heavy);
+
+        std::partial_sort(cand.begin(), cand.begin() + n_top, cand.end(),
+                [](const auto & a, const auto & b) { return a.second > b.second; });
+        std::sort(cand.begin(), cand.begin() + n_top);
+
+        for (size_t i = 0; i < n_top; ++i) {
+            if (!res.empty() && res.back().second == cand[i].first) {
+                res.back().second++;
+            } else {
+                res.emplace_back(cand[i].first, cand[i].first + 1);
+            }
+        }
+    }
+
+    if (pw <= p1) {
+        if (!res.empty() && res.back().second == pw) {
+            res.back().second = p1 + 1;
+        } else {
+            res.emplace_back(pw, p1 + 1);
+        }
+    }
+
+    return true;
+}
+
+const llama_batch & llama_kv_evict::prepare(const llama_batch & batch) {
+    auto * mem = lctx.get_memory();
+
+    // tokens of each sequence in the batch
+    std::vector<uint32_t> n_new(n_seq_max, 0);
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const int32_t n_seq = batch.seq_id ? batch.n_seq_id[i] : 1;
+
+        for (int32_t s = 0; s < n_seq; ++s) {
+            const llama_seq_id seq_id = batch.seq_id ? batch.seq_id[i][s] : 0;
+            if (seq_id < 0 || (uint32_t) seq_id >= n_seq_max) {
+                continue; // rejected by the batch allocator
+            }
+
+            n_new[seq_id]++;
+        }
+    }
+
+    // how far the positions of each sequence moved down
+    std::vector<llama_pos> moved(n_seq_max, 0);
+
+    bool any_moved = false;
+
+    std::vector<std::pair<llama_pos, llama_pos>> keep;
+
+    for (llama_seq_id s = 0; s < (llama_seq_id) n_seq_max; ++s) {
+        if (params[s].type == LLAMA_KV_EVICT_NONE || n_new[s] == 0) {
+            continue;
+        }
+
+        if (!select(s, n_new[s], keep)) {
+            continue;
+        }
+
+        const llama_pos p0 = mem->seq_pos_min(s);
+        const llama_pos p1 = mem->seq_pos_max(s);
+
+        // a shift moves a cell for all of its sequences: refuse to move kept cells that other sequences hold as well,
+        // removing such cells from this sequence is fine
+        bool moves_shared = false;
+        {
+            llama_pos p_next = p0;
+            llama_pos d      = 0;
+
+            for (const auto & [k0, k1] : keep) {
+                d += std::max(0, k0 - p_next);
+
+                if (d > 0 && mem->seq_n_cells(s, k0, k1, true) < mem->seq_n_cells(s, k0, k1, false)) {
+                    moves_shared = true;
+                    break;
+                }
+
+                p_next = k1;
+            }
+        }
+
+        if (moves_shared) {
+            LLAMA_LOG_DEBUG("%s: seq %d: kept tokens share cells with other sequences and cannot be moved - not evicting\n", __func__, s);
+            continue;
+        }
+
+        // remove what is not kept and close the gaps from the front, the moved ranges only go down
+        llama_pos p_next = p0;
+        llama_pos d      = 0;
+        int32_t   n_keep = 0;
+
+        for (const auto & [k0, k1] : keep) {
+            if (k0 > p_next) {
+                mem->seq_rm(s, p_next, k0);
+                d += k0 - p_next;
+            }
+
+            if (d > 0) {
+                mem->seq_add(s, k0, k1, -d);
+            }
+
+            n_keep += k1 - k0;
+            p_next  = k1;
+        }
+
+        if (p_next <= p1) {
+            mem->seq_rm(s, p_next, -1);
+        }
+
+        moved[s] = p1 - mem->seq_pos_max(s);
+
+        LLAMA_LOG_DEBUG("%s: seq %d: evicted %d tokens, kept %d in %zu ranges, positions moved down by %d\n",
+                __func__, s, p1 - p0 + 1 - n_keep, n_keep, keep.size(), moved[s]);
+
+        n_evicted[s] += p1 - p0 + 1 - n_keep;
+        any_moved = true;
+    }
+
+    if (!any_moved || !batch.pos) {
+        return batch;
+    }
+
+    pos_moved.assign(batch.pos, batch.pos + batch.n_tokens);
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const llama_seq_id seq_id = batch.seq_id ? batch.seq_id[i][0] : 0;
+        if (seq_id >= 0 && (uint32_t) seq_id < n_seq_max) {
+            pos_moved[i] -= moved[seq_id];
+        }
+    }
+
+    batch_moved     = batch;
+    batch_moved.pos = pos_moved.data();
+
+    return batch_moved;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct llama_context;
+struct llama_memory_context_i;
+struct ggml_tensor;
+
+//
+// llama_kv_evict
+//
+
+// per-sequence KV eviction for conversations longer than the context (StreamingLLM, H2O):
+//   - the first n_sink tokens absorb the attention mass of the softmax and are never evicted
+//   - the last n_window tokens are kept for the local context
+//   - heavy hitters: the n_heavy tokens between them with the largest accumulated attention are kept as well
+// evicted tokens are removed with seq_rm and the kept ones are moved down with seq_add, the K-shift applies the new
+// positions to the cached keys before the next ubatch
+// kept cells that other sequences hold as well (llama_memory_seq_cp) are never moved, the sequence is not evicted while
+// they would have to be
+class llama_kv_evict {
+public:
+    llama_kv_evict(llama_context & lctx, uint32_t n_seq_max);
+
+    bool set(llama_seq_id seq_id, const llama_kv_evict_params & params);
+
+    int32_t get_n_evicted(llama_seq_id seq_id) const;
+
+    // the graph has to sum the attention each cell receives (see llm_graph_params::kv_score)
+    bool need_scores() const;
+
+    void scores_add(llama_memory_context_i * mctx, const ggml_tensor * scores);
+
+    // evict from the sequences that the batch would take over their budget
+    // returns the batch to decode: batch itself, or a copy with the explicit positions moved down
+    const llama_batch & prepare(const llama_batch & batch);
+
+private:
+    // ranges [p0, p1) of positions of the sequence to keep, returns false if nothing has to be evicted
+    bool select(llama_seq_id seq_id, uint32_t n_new, std::vector<std::pair<llama_pos, llama_pos>> & res) const;
+
+    llama_context & lctx;
+
+    const uint32_t n_seq_max;
+
+    std::vector<llama_kv_evict_params> params;    // [n_seq_max]
+    std::vector<int32_t>               n_evicted; // [n_seq_max]
+
+    // batch with the moved positions
+    llama_batch            batch_moved;
+    std::vector<llama_pos> pos_moved;
+};
@@ -0,0 +1,318 @@
+#include "llama-kv-spill.h"
+
+#include "llama-impl.h"
+#include "llama-context.h"
+#include "llama-memory.h"
+#include "llama-mmap.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+//
+// llama_kv_spill
+//
+
+llama_kv_spill::llama_kv_spill(llama_context & lctx, uint32_t n_seq_max, uint32_t n_resident_max, const char * path) :
+    lctx(lctx), n_seq_max(n_seq_max), n_resident_max(n_resident_max), last_use(n_seq_max, 0) {
+    if (path && path[0] != '\0') {
+        try {
+            file = std::make_unique<llama_file>(path, "w+b");
+            fname = path;
+        } catch (const std::exception & err) {
+            LLAMA_LOG_WARN("%s: failed to create the spill file '%s': %s - spilling to host memory\n", __func__, path, err.what());
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: resident token budget = %u, spilling to %s\n", __func__, n_resident_max, file ? fname.c_str() : "host memory");
+}
+
+llama_kv_spill::~llama_kv_spill() {
+    if (file) {
+        // the spill file only holds scratch data of this context
+        file.reset();
+        std::remove(fname.c_str());
+    }
+}
+
+bool llama_kv_spill::prepare(const llama_batch & batch) {
+    auto * mem = lctx.get_memory();
+
+    // first position of each sequence of the batch
+    std::map<llama_seq_id, llama_pos> p_first;
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const int32_t n_seq = batch.seq_id ? batch.n_seq_id[i] : 1;
+
+        for (int32_t s = 0; s < n_seq; ++s) {
+            const llama_seq_id seq_id = batch.seq_id ? batch.seq_id[i][s] : 0;
+            if (seq_id < 0 || seq_id >= (llama_seq_id) n_seq_max) {
+                continue; // rejected by the batch allocator
+            }
+
+            const llama_pos pos = batch.pos ? batch.pos[i] : -1;
+
+            auto it = p_first.emplace(seq_id, pos).first;
+            it->second = std::min(it->second, pos);
+        }
+    }
+
+    // a spilled sequence that the batch does not continue has been reset by the caller, drop the spilled copy
+    for (auto it = spilled.begin(); it != spilled.end();) {
+        const llama_seq_id seq_id = it->first;
+
+        const auto p = p_first.find(seq_id);
+
+        if (p != p_first.end() && (mem->seq_pos_max(seq_id) >= 0 || (batch.pos && p->second != it->second.p1 + 1))) {
+            LLAMA_LOG_DEBUG("%s: seq %d does not continue from its spilled cells - dropping them\n", __func__, seq_id);
+
+            if (file) {
+                file_free(it->second.offs, it->second.size);
+            }
+            it = spilled.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // cells used once the batch is decoded
+    uint64_t n_need = mem->get_n_used() + batch.n_tokens;
+
+    for (const auto & [seq_id, e] : spilled) {
+        if (p_first.count(seq_id)) {
+            n_need += e.n_cells;
+        }
+    }
+
+    // LRU: spill the idle sequences that were decoded the longest time ago, the budget is exceeded only by the batch
+    // itself and by the sequences that cannot be spilled
+    if (n_need > n_resident_max) {
+        std::vector<llama_seq_id> idle;
+
+        for (auto it = resident.begin(); it != resident.end();) {
+            if (mem->seq_pos_max(*it) < 0) {
+                it = resident.erase(it); // removed by the caller
+            } else {
+                if (!p_first.count(*it)) {
+                    idle.push_back(*it);
+                }
+                ++it;
+            }
+        }
+
+        std::sort(idle.begin(), idle.end(), [this](llama_seq_id a, llama_seq_id b) {
+            return last_use[a] < last_use[b];
+        });
+
+        for (const llama_seq_id seq_id : idle) {
+            if (n_need <= n_resident_max) {
+                break;
+            }
+
+            if (spill(seq_id)) {
+                n_need -= spilled.at(seq_id).n_cells;
+            }
+        }
+    }
+
+    for (const auto & [seq_id, p] : p_first) {
+        if (spilled.count(seq_id) && !restore(seq_id)) {
+            LLAMA_LOG_ERROR("%s: failed to restore the spilled cells of seq %d\n", __func__, seq_id);
+            return false;
+        }
+
+        last_use[seq_id] = ++n_use;
+
+        resident.insert(seq_id);
+    }
+
+    return true;
+}
+
+bool llama_kv_spill::spill(llama_seq_id seq_id) {
+    if (seq_id < 0 || seq_id >= (llama_seq_id) n_seq_max || spilled.count(seq_id)) {
+        return false;
+    }
+
+    auto * mem = lctx.get_memory();
+
+    const uint32_t n_cells = mem->seq_n_cells(seq_id, -1, -1, false);
+    if (n_cells == 0) {
+        return false;
+    }
+
+    if (mem->seq_n_cells(seq_id, -1, -1, true) < n_cells) {
+        LLAMA_LOG_DEBUG("%s: seq %d shares cells with other sequences - not spilling it\n", __func__, seq_id);
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    entry e = {
+        /*.p1      =*/ mem->seq_pos_max(seq_id),
+        /*.n_cells =*/ n_cells,
+        /*.offs    =*/ 0,
+        /*.size    =*/ lctx.state_seq_get_size(seq_id, 0),
+        /*.data    =*/ {},
+    };
+
+    if (e.size == 0) {
+        return false;
+    }
+
+    auto & dst = file ? buf : e.data;
+
+    dst.resize(e.size);
+
+    if (lctx.state_seq_get_data(seq_id, dst.data(), e.size, 0) != e.size) {
+        LLAMA_LOG_ERROR("%s: failed to serialize seq %d\n", __func__, seq_id);
+        return false;
+    }
+
+    if (file) {
+        e.offs = file_alloc(e.size);
+
+        try {
+            file->seek(e.offs, SEEK_SET);
+            file->write_raw(buf.data(), e.size);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: failed to write seq %d to the spill file: %s\n", __func__, seq_id, err.what());
+            file_free(e.offs, e.size);
+            return false;
+        }
+    }
+
+    mem->seq_rm(seq_id, -1, -1);
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    LLAMA_LOG_DEBUG("%s: spilled seq %d (%u cells, %.2f MiB) in %.2f ms\n", __func__, seq_id, e.n_cells, e.size/1024.0/1024.0, 1e-3*t_us);
+
+    stats.n_spill    += 1;
+    stats.t_spill_ms += 1e-3*t_us;
+
+    spilled.emplace(seq_id, std::move(e));
+    resident.erase(seq_id);
+
+    return true;
+}
+
+bool llama_kv_spill::restore(llama_seq_id seq_id) {
+    auto it = spilled.find(seq_id);
+    if (it == spilled.end() || lctx.get_memory()->seq_pos_max(seq_id) >= 0) {
+        return false;
+    }
+
+    auto & e = it->second;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (file) {
+        buf.resize(e.size);
+
+        try {
+            file->seek(e.offs, SEEK_SET);
+            file->read_raw(buf.data(), e.size);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: failed to read seq %d from the spill file: %s\n", __func__, seq_id, err.what());
+            return false;
+        }
+    }
+
+    // on failure the spilled copy is kept, the restore can be retried once there are enough free cells
+    if (lctx.state_seq_set_data(seq_id, file ? buf.data() : e.data.data(), e.size, 0) != e.size) {
+        lctx.get_memory()->seq_rm(seq_id, -1, -1);
+        return false;
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    const int32_t n_tokens = e.n_cells;
+
+    // what prefilling the same tokens would have cost at the prompt processing speed measured so far
+    const double t_prefill_ms = n_prefill > 0 ? 1e-3*t_prefill_us/n_prefill*n_tokens : 0.0;
+
+    LLAMA_LOG_DEBUG("%s: restored seq %d (%d tokens, %.2f MiB) in %.2f ms, prefill ~ %.2f ms\n",
+            __func__, seq_id, n_tokens, e.size/1024.0/1024.0, 1e-3*t_us, t_prefill_ms);
+
+    stats.n_restore         += 1;
+    stats.n_tokens_restored += n_tokens;
+    stats.t_restore_ms      += 1e-3*t_us;
+    stats.t_prefill_ms      += t_prefill_ms;
+
+    if (file) {
+        file_free(e.offs, e.size);
+    }
+    spilled.erase(it);
+    resident.insert(seq_id);
+
+    return true;
+}
+
+void llama_kv_spill::record_prefill(uint32_t n_tokens, int64_t t_us) {
+    n_prefill    += n_tokens;
+    t_prefill_us += t_us;
+}
+
+size_t llama_kv_spill::file_alloc(size_t size) {
+    for (auto it = file_holes.begin(); it != file_holes.end(); ++it) {
+        if (it->second >= size) {
+            const size_t offs = it->first;
+
+            it->first  += size;
+            it->second -= size;
+
+            if (it->second == 0) {
+                file_holes.erase(it);
+            }
+
+            return offs;
+        }
+    }
+
+    const size_t offs = file_size;
+
+    file_size += size;
+
+    return offs;
+}
+
+void llama_kv_spill::file_free(size_t offs, size_t size) {
+    auto it = std::lower_bound(file_holes.begin(), file_holes.end(), std::make_pair(offs, size));
+
+    it = file_holes.insert(it, { offs, size });
+
+    // merge with the next hole, then with the previous one
+    if (it + 1 != file_holes.end() && it->first + it->second == (it + 1)->first) {
+        it->second += (it + 1)->second;
+        file_holes.erase(it + 1);
+    }
+
+    if (it != file_holes.begin() && (it - 1)->first + (it - 1)->second == it->first) {
+        (it - 1)->second += it->second;
+        it = file_holes.erase(it) - 1;
+    }
+
+    // a hole at the end of the file is given back to the appends
+    if (it->first + it->second == file_size) {
+        file_size = it->first;
+        file_holes.erase(it);
+    }
+}
+
+llama_kv_spill_stats llama_kv_spill::get_stats() const {
+    llama_kv_spill_stats res = stats;
+
+    res.n_seq_spilled = spilled.size();
+    res.size_spilled  = 0;
+
+    for (const auto & [seq_id, e] : spilled) {
+        res.size_spilled += e.size;
+    }
+
+    return res;
+}
+
+void llama_kv_spill::reset_stats() {
+    stats = {};
+}
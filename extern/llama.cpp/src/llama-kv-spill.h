@@ -0,0 +1,85 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct llama_context;
+struct llama_file;
+
+//
+// llama_kv_spill
+//
+
+// second tier for the KV cache of idle sequences:
+//   - the cells of a sequence are serialized with the per-sequence state (state_write_data) into a host memory pool,
+//     or into a spill file when a path is given, and then removed from the cache
+//   - the sequence is restored (state_read_data) before the next batch that uses it is decoded
+//   - the least recently decoded sequences are spilled first, until the used cells fit in the budget
+// a sequence that shares cells with other sequences (llama_memory_seq_cp) is not spilled: removing it would free only
+// the cells that no other sequence holds, and the restore would bring the shared cells back as private copies
+class llama_kv_spill {
+public:
+    llama_kv_spill(llama_context & lctx, uint32_t n_seq_max, uint32_t n_resident_max, const char * path);
+    ~llama_kv_spill();
+
+    // restore the spilled sequences of the batch and make room for it by spilling the least recently used ones
+    bool prepare(const llama_batch & batch);
+
+    bool spill  (llama_seq_id seq_id);
+    bool restore(llama_seq_id seq_id);
+
+    // decode time of a batch of prompt tokens, the restores are compared with prefilling at this speed
+    void record_prefill(uint32_t n_tokens, int64_t t_us);
+
+    llama_kv_spill_stats get_stats() const;
+    void reset_stats();
+
+private:
+    struct entry {
+        llama_pos p1;      // last position of the spilled cells
+        uint32_t  n_cells; // number of spilled cells
+
+        size_t offs; // spill file: byte range of the serialized state
+        size_t size;
+
+        std::vector<uint8_t> data; // host pool: the serialized state
+    };
+
+    // first-fit allocation in the spill file, freed ranges are merged with their neighbours
+    size_t file_alloc(size_t size);
+    void   file_free (size_t offs, size_t size);
+
+    llama_context & lctx;
+
+    const uint32_t n_seq_max; // sequence ids accepted by the memory
+    const uint32_t n_resident_max;
+
+    std::unique_ptr<llama_file> file;
+    std::string                 fname;
+
+    size_t file_size = 0;
+
+    std::vector<std::pair<size_t, size_t>> file_holes; // sorted by offset
+
+    std::vector<uint8_t> buf; // staging buffer for the spill file
+
+    std::map<llama_seq_id, entry> spilled;
+
+    // sequences decoded or restored by this context and not spilled since, the candidates for spilling
+    std::set<llama_seq_id> resident;
+
+    std::vector<uint64_t> last_use; // [n_seq_max]
+    uint64_t n_use = 0;
+
+    int64_t n_prefill    = 0;
+    int64_t t_prefill_us = 0;
+
+    llama_kv_spill_stats stats = {};
+};
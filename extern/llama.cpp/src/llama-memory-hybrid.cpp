@@ -44,7 +44,8 @@ llama_memory_hybrid::llama_memory_hybrid(
         n_seq_max,
         n_pad,
         n_swa,
-        swa_type
+        swa_type,
+        0
     )),
     mem_recr(new llama_memory_recurrent(
         model,
@@ -165,6 +166,15 @@ llama_pos llama_memory_hybrid::seq_pos_max(llama_seq_id seq_id) const {
     return std::min(mem_attn->seq_pos_max(seq_id), mem_recr->seq_pos_max(seq_id));
 }
 
+uint32_t llama_memory_hybrid::seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const {
+    // the recurrent states have a fixed size per sequence, only the attention cache grows with the tokens
+    return mem_attn->seq_n_cells(seq_id, p0, p1, exclusive);
+}
+
+uint32_t llama_memory_hybrid::get_n_used() const {
+    return mem_attn->get_n_used();
+}
+
 void llama_memory_hybrid::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_state_seq_flags flags) const {
     GGML_UNUSED(flags);
 
@@ -359,6 +359,30 @@ llama_pos llama_memory_recurrent::seq_pos_max(llama_seq_id seq_id) const {
     return result;
 }
 
+uint32_t llama_memory_recurrent::seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    uint32_t result = 0;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1 && (!exclusive || cells[i].seq_id.size() == 1)) {
+            result++;
+        }
+    }
+
+    return result;
+}
+
+uint32_t llama_memory_recurrent::get_n_used() const {
+    return used;
+}
+
 llama_memory_context_ptr llama_memory_recurrent::init_batch(llama_batch_allocr & balloc, uint32_t n_ubatch, bool embd_all) {
     do {
         balloc.split_reset();
@@ -54,6 +54,9 @@ public:
     llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
+    uint32_t seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const override;
+    uint32_t get_n_used() const override;
+
     bool prepare(const std::vector<llama_ubatch> & ubatches);
 
     // find a contiguous slot of memory cells and emplace the ubatch there
@@ -100,6 +100,12 @@ struct llama_memory_i {
     virtual llama_pos seq_pos_min(llama_seq_id seq_id) const = 0;
     virtual llama_pos seq_pos_max(llama_seq_id seq_id) const = 0;
 
+    // number of cells of the sequence with positions in [p0, p1), if exclusive only the cells that hold no other sequence
+    virtual uint32_t seq_n_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1, bool exclusive) const = 0;
+
+    // number of cells that hold at least one sequence
+    virtual uint32_t get_n_used() const = 0;
+
     //
     // state write/read
     //
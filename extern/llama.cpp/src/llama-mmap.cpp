@@ -4,11 +4,13 @@
 
 #include "ggml.h"
 
+#include <cstdio>
 #include <cstring>
 #include <climits>
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <mutex>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -17,6 +19,9 @@
             #include <sys/mman.h>
             #include <fcntl.h>
         #endif
+        #if defined(__linux__)
+            #include <sys/syscall.h>
+        #endif
         #if defined(_POSIX_MEMLOCK_RANGE)
             #include <sys/resource.h>
         #endif
@@ -126,6 +131,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +234,30 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+#if defined(_POSIX_VERSION)
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            const ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+#else
+        std::lock_guard<std::mutex> lock(mutex);
+        seek(offset, SEEK_SET);
+        read_raw(ptr, len);
+#endif
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -239,6 +288,10 @@ struct llama_file::impl {
 
     FILE * fp;
     size_t size;
+
+#if !defined(_WIN32) && !defined(_POSIX_VERSION)
+    mutable std::mutex mutex;
+#endif
 };
 
 llama_file::llama_file(const char * fname, const char * mode) : pimpl(std::make_unique<impl>(fname, mode)) {}
@@ -261,6 +314,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -273,8 +327,18 @@ struct llama_mmap::impl {
 #ifdef _POSIX_MAPPED_FILES
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    // granularity of the mapping, 2 MiB when the weights were copied into hugepages
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         size = file->size();
+#ifdef __linux__
+        if (hugepages && map_hugepages(file, numa)) {
+            return;
+        }
+#else
+        GGML_UNUSED(hugepages);
+#endif
         int fd = file->file_id();
         int flags = MAP_SHARED;
         if (numa) { prefetch = 0; }
@@ -306,6 +370,124 @@ struct llama_mmap::impl {
         mapped_fragments.emplace_back(0, file->size());
     }
 
+#ifdef __linux__
+    static constexpr size_t HUGEPAGE_SIZE = 2u*1024*1024;
+
+    // mask of the online memory nodes from a list like "0-3,6", empty if it cannot be read
+    static std::vector<unsigned long> online_numa_nodes() {
+        std::vector<unsigned long> nodemask;
+
+        FILE * fp = fopen("/sys/devices/system/node/online", "r");
+        if (!fp) {
+            return nodemask;
+        }
+
+        const size_t bits = sizeof(unsigned long)*CHAR_BIT;
+        unsigned first, last;
+        int n;
+        while ((n = fscanf(fp, "%u-%u", &first, &last)) >= 1) {
+            if (n == 1) {
+                last = first;
+            }
+            for (unsigned node = first; node <= last; ++node) {
+                if (node/bits >= nodemask.size()) {
+                    nodemask.resize(node/bits + 1, 0);
+                }
+                nodemask[node/bits] |= 1ul << (node%bits);
+            }
+            if (fgetc(fp) != ',') {
+                break;
+            }
+        }
+        fclose(fp);
+
+        return nodemask;
+    }
+
+    // interleave the pages of [ptr, ptr + len) across the online memory nodes
+    // must be called before the pages are touched, the policy only applies to new allocations
+    static void interleave_numa(void * ptr, size_t len) {
+#if defined(SYS_mbind)
+        const int MPOL_INTERLEAVE_ = 3;
+        const std::vector<unsigned long> nodemask = online_numa_nodes();
+        if (nodemask.empty()) {
+            LLAMA_LOG_WARN("warning: no online memory nodes in /sys/devices/system/node/online, not interleaving\n");
+            return;
+        }
+
+        // the mask must not reach beyond the kernel's MAX_NUMNODES, so it ends at the highest online node
+        // the kernel reads maxnode - 1 bits, hence the highest node + 2
+        const size_t bits = sizeof(unsigned long)*CHAR_BIT;
+        const unsigned long maxnode = (nodemask.size() - 1)*bits + (bits - __builtin_clzl(nodemask.back())) + 1;
+        if (syscall(SYS_mbind, ptr, len, MPOL_INTERLEAVE_, nodemask.data(), maxnode, 0) != 0) {
+            LLAMA_LOG_WARN("warning: mbind(.., MPOL_INTERLEAVE) failed: %s\n", strerror(errno));
+        }
+#else
+        GGML_UNUSED(ptr);
+        GGML_UNUSED(len);
+#endif
+    }
+
+    // copy the file into anonymous memory backed by 2 MiB pages to reduce TLB misses on the weight scans
+    // explicit hugepages (MAP_HUGETLB) are used when the pool has enough free pages, transparent hugepages otherwise
+    // returns false if no memory could be allocated, the caller falls back to a regular file mapping
+    bool map_hugepages(struct llama_file * file, bool numa) {
+        const size_t len = GGML_PAD(size, HUGEPAGE_SIZE);
+        const char * kind = "explicit";
+
+        void * ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (ptr == MAP_FAILED) {
+            kind = "transparent";
+
+            // over-allocate so that the region can be trimmed to a 2 MiB aligned start
+            uint8_t * raw = (uint8_t *) mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) {
+                LLAMA_LOG_WARN("warning: failed to allocate %zu MiB for hugepage backed weights: %s\n", len/1024/1024, strerror(errno));
+                return false;
+            }
+            uint8_t * aligned = (uint8_t *) GGML_PAD((uintptr_t) raw, HUGEPAGE_SIZE);
+            if (aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            if (aligned + len < raw + len + HUGEPAGE_SIZE) {
+                munmap(aligned + len, raw + len + HUGEPAGE_SIZE - (aligned + len));
+            }
+            ptr = aligned;
+#ifdef MADV_HUGEPAGE
+            if (madvise(ptr, len, MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+            }
+#endif
+        }
+
+        if (numa) {
+            interleave_numa(ptr, len);
+        }
+
+        try {
+            file->read_raw_at(ptr, size, 0);
+        } catch (...) {
+            munmap(ptr, len);
+            throw;
+        }
+
+        if (mprotect(ptr, len, PROT_READ)) {
+            LLAMA_LOG_WARN("warning: mprotect(.., PROT_READ) failed: %s\n", strerror(errno));
+        }
+
+        LLAMA_LOG_INFO("%s: copied %zu MiB of weights into %s hugepages%s\n", __func__,
+                size/1024/1024, kind, numa ? ", interleaved across NUMA nodes" : "");
+
+        addr      = ptr;
+        page_size = HUGEPAGE_SIZE;
+        mapped_fragments.emplace_back(0, len);
+        return true;
+    }
+#endif
+
     static void align_range(size_t * first, size_t * last, size_t page_size) {
         size_t offset_in_page = *first & (page_size - 1);
         size_t offset_to_page = offset_in_page == 0 ? 0 : page_size - offset_in_page;
@@ -319,7 +501,6 @@ struct llama_mmap::impl {
     }
 
     void unmap_fragment(size_t first, size_t last) {
-        int page_size = sysconf(_SC_PAGESIZE);
         align_range(&first, &last, page_size);
         size_t len = last - first;
 
@@ -362,8 +543,9 @@ struct llama_mmap::impl {
         }
     }
 #elif defined(_WIN32)
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         size = file->size();
 
@@ -418,10 +600,11 @@ struct llama_mmap::impl {
         }
     }
 #else
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(file);
         GGML_UNUSED(prefetch);
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         throw std::runtime_error("mmap not supported");
     }
@@ -438,7 +621,7 @@ struct llama_mmap::impl {
     size_t size;
 };
 
-llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) : pimpl(std::make_unique<impl>(file, prefetch, numa)) {}
+llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) : pimpl(std::make_unique<impl>(file, prefetch, numa, hugepages)) {}
 llama_mmap::~llama_mmap() = default;
 
 size_t llama_mmap::size() const { return pimpl->size; }
@@ -598,3 +781,12 @@ const bool llama_mlock::SUPPORTED = false;
 size_t llama_path_max() {
     return PATH_MAX;
 }
+
+bool llama_file_replace(const char * src, const char * dst) {
+#if defined(_WIN32)
+    // rename() fails on Windows if dst exists
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(src, dst) == 0;
+#endif
+}
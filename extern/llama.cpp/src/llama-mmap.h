@@ -26,6 +26,9 @@ struct llama_file {
     void read_raw(void * ptr, size_t len) const;
     uint32_t read_u32() const;
 
+    // read at an absolute offset without moving the file position, safe to call from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
@@ -36,7 +39,9 @@ private:
 
 struct llama_mmap {
     llama_mmap(const llama_mmap &) = delete;
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false);
+    // hugepages: copy the file into anonymous memory backed by 2 MiB pages instead of mapping it (Linux only)
+    //            with numa the copy is interleaved across the memory nodes
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false, bool hugepages = false);
     ~llama_mmap();
 
     size_t size() const;
@@ -66,3 +71,6 @@ private:
 };
 
 size_t llama_path_max();
+
+// rename src to dst, atomically replacing dst if it exists
+bool llama_file_replace(const char * src, const char * dst);
@@ -2,10 +2,16 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
+#include <exception>
 #include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -843,7 +849,7 @@ void llama_model_loader::done_getting_tensors() const {
     }
 }
 
-void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps) {
+void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps, bool hugepages) {
     if (use_mmap) {
         mappings.reserve(files.size());
         mmaps_used.reserve(files.size());
@@ -859,7 +865,7 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
                 }
             }
 
-            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa);
+            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa, hugepages);
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -916,6 +922,152 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+bool llama_model_loader::load_data_parallel(
+        struct ggml_context * ctx,
+        std::unordered_set<const ggml_tensor *> & loaded,
+        llama_progress_callback progress_callback,
+        void * progress_callback_user_data) {
+    struct load_job {
+        ggml_tensor * tensor;
+        const llama_tensor_weight * weight;
+    };
+
+    std::vector<load_job> jobs;
+
+    for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+        const auto * weight = get_weight(ggml_get_name(cur));
+        if (weight == nullptr || cur->buffer == nullptr) {
+            continue;
+        }
+
+        // uploads to device memory stay on the main thread
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+        if (!ggml_backend_buffer_is_host(cur->buffer) && (!dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU)) {
+            continue;
+        }
+
+        jobs.push_back({ cur, weight });
+    }
+
+    const size_t n_threads = std::min<size_t>(jobs.size(), std::clamp(std::thread::hardware_concurrency(), 1u, 8u));
+    if (n_threads < 2) {
+        return true;
+    }
+
+    // read in file order, so that the threads work on neighbouring regions of the file
+    std::sort(jobs.begin(), jobs.end(), [](const load_job & a, const load_job & b) {
+        return a.weight->idx != b.weight->idx ? a.weight->idx < b.weight->idx : a.weight->offs < b.weight->offs;
+    });
+
+    std::atomic<size_t> next_job   {0};
+    std::atomic<size_t> bytes_done {0};
+    std::atomic<bool>   stop       {false};
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    size_t                  n_finished = 0;
+    std::exception_ptr      error;
+    std::vector<std::string> invalid;
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads);
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers.emplace_back([&]() {
+            // staging buffer for tensors that are converted on upload (e.g. repacked)
+            std::vector<no_init<uint8_t>> read_buf;
+
+            while (!stop) {
+                const size_t i_job = next_job++;
+                if (i_job >= jobs.size()) {
+                    break;
+                }
+
+                ggml_tensor * cur    = jobs[i_job].tensor;
+                const auto  * weight = jobs[i_job].weight;
+                const size_t  n_size = ggml_nbytes(cur);
+
+                try {
+                    const auto & file = files.at(weight->idx);
+
+                    const void * data = nullptr;
+                    if (ggml_backend_buffer_is_host(cur->buffer)) {
+                        file->read_raw_at(cur->data, n_size, weight->offs);
+                        data = cur->data;
+                    } else {
+                        read_buf.resize(n_size);
+                        file->read_raw_at(read_buf.data(), n_size, weight->offs);
+                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                        data = read_buf.data();
+                    }
+
+                    if (check_tensors && !ggml_validate_row_data(cur->type, data, n_size)) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        invalid.push_back(ggml_get_name(cur));
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    stop = true;
+                }
+
+                bytes_done += n_size;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            n_finished++;
+            cv.notify_one();
+        });
+    }
+
+    // report the progress from this thread while the workers are reading
+    bool cancelled = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (n_finished < n_threads) {
+            cv.wait_for(lock, std::chrono::milliseconds(10));
+
+            if (progress_callback && !cancelled) {
+                lock.unlock();
+                if (!progress_callback((float) (size_done + bytes_done) / size_data, progress_callback_user_data)) {
+                    cancelled = true;
+                    stop = true;
+                }
+                lock.lock();
+            }
+        }
+    }
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    size_done += bytes_done;
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    if (!invalid.empty()) {
+        for (const auto & name : invalid) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, name.c_str());
+        }
+        throw std::runtime_error("found tensors with invalid data");
+    }
+
+    if (cancelled) {
+        return false;
+    }
+
+    for (const auto & job : jobs) {
+        loaded.insert(job.tensor);
+    }
+
+    return true;
+}
+
 bool llama_model_loader::load_all_data(
         struct ggml_context * ctx,
         llama_buf_map & bufs,
@@ -1016,6 +1168,14 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // without mmap, read the tensors stored in CPU memory in parallel, the rest is loaded below
+    std::unordered_set<const ggml_tensor *> loaded;
+    if (!use_mmap && !upload_backend) {
+        if (!load_data_parallel(ctx, loaded, progress_callback, progress_callback_user_data)) {
+            return false;
+        }
+    }
+
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
@@ -1023,6 +1183,10 @@ bool llama_model_loader::load_all_data(
             continue;
         }
 
+        if (loaded.count(cur)) {
+            continue;
+        }
+
         if (progress_callback) {
             if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
                 return false;
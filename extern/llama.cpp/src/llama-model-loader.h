@@ -12,6 +12,7 @@
 #include <map>
 #include <stdexcept>
 #include <unordered_map>
+#include <unordered_set>
 
 using llama_buf_map = std::unordered_map<uint32_t, ggml_backend_buffer_t>;
 
@@ -149,7 +150,7 @@ struct llama_model_loader {
 
     void done_getting_tensors() const;
 
-    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr);
+    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr, bool hugepages = false);
 
     void get_mapping_range(size_t * first, size_t * last, void ** addr, int idx, ggml_context * ctx) const;
 
@@ -164,6 +165,15 @@ struct llama_model_loader {
             llama_progress_callback progress_callback,
             void * progress_callback_user_data);
 
+    // read the tensors of ctx that are stored in CPU memory using multiple threads, used when mmap is disabled
+    // the loaded tensors are added to `loaded`
+    // Returns false if cancelled by progress_callback
+    bool load_data_parallel(
+            struct ggml_context * ctx,
+            std::unordered_set<const ggml_tensor *> & loaded,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data);
+
     std::string ftype_name() const;
 
     void print_info() const;
@@ -12,8 +12,10 @@
 #include "llama-memory-recurrent.h"
 
 #include "ggml-cpp.h"
+#include "ggml-cpu.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cfloat>
@@ -24,6 +26,7 @@
 #include <regex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 const char * llm_type_name(llm_type type) {
     switch (type) {
@@ -394,9 +397,276 @@ static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, llama_split_mode s
     return buft_list;
 }
 
+// cache of the CPU repacked weights
+// the repacked tensors are stored in a GGUF file, later loads memory map it as a CPU_REPACK buffer instead of repacking again
+
+static const char *   LLAMA_REPACK_CACHE_KEY_VERSION     = "repack_cache.version";
+static const char *   LLAMA_REPACK_CACHE_KEY_FINGERPRINT = "repack_cache.fingerprint";
+static const uint32_t LLAMA_REPACK_CACHE_VERSION         = 2;
+
+static bool buft_is_cpu_repack(ggml_backend_buffer_type_t buft) {
+    return strcmp(ggml_backend_buft_name(buft), "CPU_REPACK") == 0;
+}
+
+// extra buffer types of the CPU (CPU_REPACK, AMX) hold the weights in a layout that only their mul_mat can read
+static bool buft_is_cpu_extra(ggml_backend_buffer_type_t buft) {
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+    return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU && !ggml_backend_buft_is_host(buft);
+}
+
+// the rows of a weight can be read from the memory mapped model file by a CPU buffer
+static bool llama_weight_is_mappable(const llama_model_loader & ml, const char * name) {
+    return ml.use_mmap && ml.require_weight(name).offs % 32 == 0;
+}
+
+// identifies the source weights and the repacked layout, which depends on the CPU features
+// the whole data of every repacked source tensor is hashed, so a model re-quantized with the same shapes does not match
+static uint64_t llama_repack_cache_fingerprint(const llama_model_loader & ml, ggml_context * ctx) {
+    // 4 independent lanes of 64-bit multiply-rotate rounds (the xxHash64 round), so the hash runs at memory speed
+    static const uint64_t P1 = 0x9e3779b185ebca87ULL;
+    static const uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+
+    uint64_t acc[4] = { P1 + P2, P2, 0, 0 - P1 };
+
+    auto hround = [](uint64_t h, uint64_t v) {
+        h += v * P2;
+        h  = (h << 31) | (h >> 33);
+        return h * P1;
+    };
+
+    auto mix = [&](const void * data, size_t size) {
+        const uint8_t * bytes = (const uint8_t *) data;
+
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            uint64_t v[4];
+            memcpy(v, bytes + i, sizeof(v));
+            for (int j = 0; j < 4; ++j) {
+                acc[j] = hround(acc[j], v[j]);
+            }
+        }
+        for (; i < size; ++i) {
+            acc[i % 4] = hround(acc[i % 4], bytes[i]);
+        }
+        acc[0] = hround(acc[0], size);
+    };
+
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+    auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_get_features");
+    if (get_features_fn) {
+        for (auto * feature = get_features_fn(cpu_reg); feature->name; ++feature) {
+            mix(feature->name,  strlen(feature->name));
+            mix(feature->value, strlen(feature->value));
+        }
+    }
+
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        const auto & w = ml.require_weight(ggml_get_name(cur));
+
+        const uint8_t * data = (const uint8_t *) ml.mappings.at(w.idx)->addr() + w.offs;
+
+        mix(cur->name, strlen(cur->name));
+        mix(&cur->type, sizeof(cur->type));
+        mix(cur->ne, sizeof(cur->ne));
+        mix(data, ggml_nbytes(cur));
+    }
+
+    uint64_t hash = 0;
+    for (int j = 0; j < 4; ++j) {
+        hash = hround(hash ^ hround(0, acc[j]), P1);
+    }
+
+    return hash;
+}
+
+// map the tensors of ctx from the cache file, returns false if the file is missing or does not match
+static bool llama_repack_cache_load(
+        const char * path,
+        uint64_t fingerprint,
+        ggml_context * ctx,
+        std::unique_ptr<llama_mmap> & mapping,
+        ggml_backend_buffer_ptr & buf) {
+    std::unique_ptr<llama_file> file;
+    try {
+        file = std::make_unique<llama_file>(path, "rb");
+    } catch (const std::exception &) {
+        return false;
+    }
+
+    gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ nullptr,
+    };
+
+    gguf_context_ptr meta(gguf_init_from_file(path, params));
+    if (!meta) {
+        return false;
+    }
+
+    const int64_t kid_version     = gguf_find_key(meta.get(), LLAMA_REPACK_CACHE_KEY_VERSION);
+    const int64_t kid_fingerprint = gguf_find_key(meta.get(), LLAMA_REPACK_CACHE_KEY_FINGERPRINT);
+    if (kid_version < 0 || gguf_get_kv_type(meta.get(), kid_version) != GGUF_TYPE_UINT32 ||
+        kid_fingerprint < 0 || gguf_get_kv_type(meta.get(), kid_fingerprint) != GGUF_TYPE_UINT64 ||
+        gguf_get_val_u32(meta.get(), kid_version) != LLAMA_REPACK_CACHE_VERSION ||
+        gguf_get_val_u64(meta.get(), kid_fingerprint) != fingerprint) {
+        LLAMA_LOG_INFO("%s: repack cache '%s' does not match the model, it will be rebuilt\n", __func__, path);
+        return false;
+    }
+
+    const size_t offs_data = gguf_get_data_offset(meta.get());
+
+    int64_t n_tensors = 0;
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        const int64_t tid = gguf_find_tensor(meta.get(), ggml_get_name(cur));
+        if (tid < 0 || gguf_get_tensor_type(meta.get(), tid) != cur->type ||
+            gguf_get_tensor_size(meta.get(), tid) != ggml_nbytes(cur) ||
+            offs_data + gguf_get_tensor_offset(meta.get(), tid) + ggml_nbytes(cur) > file->size()) {
+            LLAMA_LOG_INFO("%s: repack cache '%s' does not match the model, it will be rebuilt\n", __func__, path);
+            return false;
+        }
+        n_tensors++;
+    }
+    if (n_tensors != gguf_get_n_tensors(meta.get())) {
+        LLAMA_LOG_INFO("%s: repack cache '%s' does not match the model, it will be rebuilt\n", __func__, path);
+        return false;
+    }
+
+    auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+    auto * buffer_from_ptr_fn = (decltype(ggml_backend_cpu_repack_buffer_from_ptr) *)
+        ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_repack_buffer_from_ptr");
+    if (!buffer_from_ptr_fn) {
+        return false;
+    }
+
+    mapping = std::make_unique<llama_mmap>(file.get());
+
+    uint8_t * data = (uint8_t *) mapping->addr() + offs_data;
+
+    buf.reset(buffer_from_ptr_fn(data, mapping->size() - offs_data));
+    if (!buf) {
+        return false;
+    }
+
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        const int64_t tid = gguf_find_tensor(meta.get(), ggml_get_name(cur));
+        ggml_backend_tensor_alloc(buf.get(), cur, data + gguf_get_tensor_offset(meta.get(), tid));
+    }
+
+    return true;
+}
+
+// write the repacked tensors of ctx to the cache file
+static void llama_repack_cache_save(const char * path, uint64_t fingerprint, ggml_context * ctx) {
+    gguf_context_ptr meta(gguf_init_empty());
+
+    gguf_set_val_u32(meta.get(), LLAMA_REPACK_CACHE_KEY_VERSION,     LLAMA_REPACK_CACHE_VERSION);
+    gguf_set_val_u64(meta.get(), LLAMA_REPACK_CACHE_KEY_FINGERPRINT, fingerprint);
+
+    size_t n_size = 0;
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        // the repack buffer cannot read tensors back, the data is written directly from cur->data below
+        ggml_tensor info = *cur;
+        info.buffer = nullptr;
+        gguf_add_tensor(meta.get(), &info);
+        n_size += ggml_nbytes(cur);
+    }
+
+    const std::string path_tmp = std::string(path) + ".tmp";
+
+    try {
+        llama_file file(path_tmp.c_str(), "wb");
+
+        std::vector<uint8_t> data(gguf_get_meta_size(meta.get()));
+        gguf_get_meta_data(meta.get(), data.data());
+        file.write_raw(data.data(), data.size());
+
+        const size_t alignment = gguf_get_alignment(meta.get());
+        const std::vector<uint8_t> zeros(alignment, 0);
+
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+            const size_t n_bytes = ggml_nbytes(cur);
+            file.write_raw(cur->data, n_bytes);
+            file.write_raw(zeros.data(), GGML_PAD(n_bytes, alignment) - n_bytes);
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write repack cache '%s': %s\n", __func__, path, err.what());
+        std::remove(path_tmp.c_str());
+        return;
+    }
+
+    if (!llama_file_replace(path_tmp.c_str(), path)) {
+        LLAMA_LOG_WARN("%s: failed to write repack cache '%s'\n", __func__, path);
+        std::remove(path_tmp.c_str());
+        return;
+    }
+
+    LLAMA_LOG_INFO("%s: wrote repack cache '%s' (%.2f MiB)\n", __func__, path, n_size / 1024.0 / 1024.0);
+}
+
+// quantize output to the type of the proxy used by the approximate lm_head
+// the rows are converted in chunks so that the whole matrix is never held in F32
+static void llama_lm_head_proxy_quantize(ggml_tensor * output, ggml_tensor * proxy, std::vector<uint8_t> & dst) {
+    const int64_t n_embd  = output->ne[0];
+    const int64_t n_vocab = output->ne[1];
+
+    // the output is either in a host buffer or gets copied to one
+    std::vector<uint8_t> src_buf;
+    const uint8_t * src = (const uint8_t *) output->data;
+    if (!ggml_backend_buffer_is_host(output->buffer)) {
+        src_buf.resize(ggml_nbytes(output));
+        ggml_backend_tensor_get(output, src_buf.data(), 0, src_buf.size());
+        src = src_buf.data();
+    }
+
+    const auto * traits = ggml_get_type_traits(output->type);
+    if (output->type != GGML_TYPE_F32 && !traits->to_float) {
+        throw std::runtime_error(format("cannot convert %s to float", ggml_type_name(output->type)));
+    }
+
+    dst.resize(ggml_nbytes(proxy));
+    ggml_quantize_init(proxy->type);
+
+    const int64_t chunk_rows = 64;
+    const int64_t n_chunks   = (n_vocab + chunk_rows - 1) / chunk_rows;
+    const int     n_threads  = std::clamp<int>(std::thread::hardware_concurrency(), 1, 8);
+
+    std::atomic<int64_t> next_chunk(0);
+    auto worker = [&]() {
+        std::vector<float> rows(chunk_rows*n_embd);
+        for (int64_t chunk = next_chunk++; chunk < n_chunks; chunk = next_chunk++) {
+            const int64_t r0 = chunk*chunk_rows;
+            const int64_t nr = std::min(chunk_rows, n_vocab - r0);
+            for (int64_t r = 0; r < nr; ++r) {
+                const void * row = src + (r0 + r)*output->nb[1];
+                if (output->type == GGML_TYPE_F32) {
+                    memcpy(rows.data() + r*n_embd, row, n_embd*sizeof(float));
+                } else {
+                    traits->to_float(row, rows.data() + r*n_embd, n_embd);
+                }
+            }
+            ggml_quantize_chunk(proxy->type, rows.data(), dst.data() + r0*proxy->nb[1], 0, nr, n_embd, nullptr);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
 struct llama_model::impl {
     impl() {}
-    ~impl() {}
+    ~impl() {
+        for (const void * base : numa_replicas) {
+            numa_replicate_free_fn(base);
+        }
+    }
 
     uint64_t n_elements = 0;
 
@@ -417,6 +687,10 @@ struct llama_model::impl {
     // the model memory buffers for the tensor data
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // base addresses of the CPU buffers replicated on each NUMA node (GGML_NUMA_STRATEGY_MIRROR)
+    std::vector<const void *> numa_replicas;
+    decltype(ggml_numa_replicate_free) * numa_replicate_free_fn = nullptr;
+
     buft_list_t cpu_buft_list;
     std::map<ggml_backend_dev_t, buft_list_t> gpu_buft_list;
 
@@ -2139,6 +2413,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 }
             }
 
+            // the approximate lm_head gathers rows of the output, which a repacked layout cannot do
+            // they are read from the model file instead (see output_rows), without mmap the output is not repacked
+            if (tn_tensor == LLM_TENSOR_OUTPUT && params.lm_head_proxy_type != GGML_TYPE_COUNT && buft_is_cpu_extra(buft) &&
+                !llama_weight_is_mappable(ml, tn.str().c_str())) {
+                buft = select_weight_buft(hparams, t_meta, GGML_OP_GET_ROWS, *buft_list);
+                if (!buft) {
+                    throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", tn.str().c_str()));
+                }
+            }
+
             // avoid using a host buffer when using mmap
             auto * buft_dev = ggml_backend_buft_get_device(buft);
             if (ml.use_mmap && buft_dev && buft == ggml_backend_dev_host_buffer_type(buft_dev)) {
@@ -5549,7 +5833,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr, params.use_hugepages);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -5560,6 +5844,15 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     const size_t n_max_backend_buffer = ctx_map.size() * ml.files.size();
     pimpl->bufs.reserve(n_max_backend_buffer);
 
+    // the fingerprint of the repack cache is computed from the memory mapped model
+    const char * repack_cache_path = ml.use_mmap ? params.repack_cache_path : nullptr;
+    if (params.repack_cache_path && !ml.use_mmap) {
+        LLAMA_LOG_WARN("%s: repack cache requires mmap, ignoring '%s'\n", __func__, params.repack_cache_path);
+    }
+
+    ggml_context * repack_cache_ctx = nullptr;
+    uint64_t repack_cache_fingerprint = 0;
+
     for (auto & it : ctx_map) {
         ggml_backend_buffer_type_t buft = it.first;
         ggml_context * ctx              = it.second;
@@ -5569,6 +5862,36 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
             continue;
         }
 
+        if (repack_cache_path && buft_is_cpu_repack(buft)) {
+            repack_cache_fingerprint = llama_repack_cache_fingerprint(ml, ctx);
+
+            std::unique_ptr<llama_mmap> mapping;
+            ggml_backend_buffer_ptr buf;
+            if (llama_repack_cache_load(repack_cache_path, repack_cache_fingerprint, ctx, mapping, buf)) {
+                LLAMA_LOG_INFO("%s: using repack cache '%s'\n", __func__, repack_cache_path);
+
+                if (use_mlock) {
+                    pimpl->mlock_bufs.emplace_back(new llama_mlock);
+                    auto & mlock_buf = pimpl->mlock_bufs.back();
+                    mlock_buf->init   (ggml_backend_buffer_get_base(buf.get()));
+                    mlock_buf->grow_to(ggml_backend_buffer_get_size(buf.get()));
+                }
+
+                ggml_backend_buffer_set_usage(buf.get(), GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+                pimpl->bufs.emplace_back(std::move(buf));
+                pimpl->mappings.emplace_back(std::move(mapping));
+
+                // the tensors are already loaded and are skipped by load_all_data, count them for the progress
+                for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+                    ml.size_done += ggml_nbytes(cur);
+                }
+                continue;
+            }
+
+            // write the cache once the tensors have been repacked
+            repack_cache_ctx = ctx;
+        }
+
         llama_buf_map buf_map;
         buf_map.reserve(n_max_backend_buffer);
 
@@ -5671,12 +5994,146 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (repack_cache_ctx) {
+        llama_repack_cache_save(repack_cache_path, repack_cache_fingerprint, repack_cache_ctx);
+    }
+
+    // coarse copy of the output matrix for the approximate lm_head, see llm_graph_context::build_lm_head_approx
+    if (params.lm_head_proxy_type != GGML_TYPE_COUNT && output) {
+        const ggml_type type = params.lm_head_proxy_type;
+        if (type < 0 || type >= GGML_TYPE_COUNT || !ggml_is_quantized(type) || ggml_quantize_requires_imatrix(type) ||
+            output->ne[0] % ggml_blck_size(type) != 0) {
+            throw std::runtime_error(format("invalid lm_head proxy type %d for output.weight", (int) type));
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        ggml_init_params ctx_params = {
+            /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context_ptr ctx { ggml_init(ctx_params) };
+        if (!ctx) {
+            throw std::runtime_error(format("failed to create ggml context"));
+        }
+
+        ggml_tensor * proxy = ggml_new_tensor_2d(ctx.get(), type, output->ne[0], output->ne[1]);
+        ggml_set_name(proxy, "output_proxy.weight");
+
+        // scored with a mul_mat, so unlike output the proxy can be repacked
+        ggml_backend_buffer_type_t buft = select_weight_buft(hparams, proxy, GGML_OP_MUL_MAT, *pimpl->dev_output.buft_list);
+        if (!buft) {
+            throw std::runtime_error("failed to find a compatible buffer type for the lm_head proxy");
+        }
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), buft);
+        if (buf == nullptr) {
+            throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
+        }
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        pimpl->bufs.emplace_back(buf);
+
+        // a repacked output cannot be read by row, the proxy is quantized from the model file and the rows are gathered
+        // from there, the mapping is file backed so the pages of the rows that are not gathered can be reclaimed
+        output_rows = output;
+        if (buft_is_cpu_extra(ggml_backend_buffer_get_type(output->buffer))) {
+            const auto & w = ml.require_weight(ggml_get_name(output));
+            GGML_ASSERT(llama_weight_is_mappable(ml, ggml_get_name(output)));
+
+            auto mapping = std::make_unique<llama_mmap>(ml.files.at(w.idx).get(), 0);
+
+            auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+            ggml_backend_buffer_t rows_buf = ggml_backend_dev_buffer_from_host_ptr(cpu_dev,
+                    (char *) mapping->addr() + w.offs, ggml_nbytes(output), ggml_nbytes(output));
+            if (rows_buf == nullptr) {
+                throw std::runtime_error("unable to map the rows of output.weight");
+            }
+            ggml_backend_buffer_set_usage(rows_buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            pimpl->bufs.emplace_back(rows_buf);
+            pimpl->mappings.emplace_back(std::move(mapping));
+
+            ggml_tensor * rows = ggml_new_tensor_2d(ctx.get(), output->type, output->ne[0], output->ne[1]);
+            ggml_set_name(rows, "output_rows.weight");
+            if (ggml_backend_tensor_alloc(rows_buf, rows, ggml_backend_buffer_get_base(rows_buf)) != GGML_STATUS_SUCCESS) {
+                throw std::runtime_error("unable to map the rows of output.weight");
+            }
+            output_rows = rows;
+        }
+
+        std::vector<uint8_t> data;
+        llama_lm_head_proxy_quantize(output_rows, proxy, data);
+        ggml_backend_tensor_set(proxy, data.data(), 0, data.size());
+
+        output_proxy = proxy;
+
+        pimpl->ctxs.emplace_back(std::move(ctx));
+
+        LLAMA_LOG_INFO("%s: lm_head proxy %s %s, %.2f MiB (output %s %s, %.2f MiB%s), built in %.2f ms\n", __func__,
+                ggml_type_name(type), ggml_backend_buft_name(buft), ggml_nbytes(proxy) / 1024.0 / 1024.0,
+                ggml_type_name(output->type), ggml_backend_buffer_name(output->buffer), ggml_nbytes(output) / 1024.0 / 1024.0,
+                output_rows != output ? ", rows from the model file" : "", (ggml_time_us() - t_start_us) / 1000.0);
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
         }
     }
 
+    // with GGML_NUMA_STRATEGY_MIRROR, give every node its own copy of the matrices that the CPU multiplies
+    // only the ranges of these tensors are copied, a mapped buffer may also span tensors of other devices
+    if (auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+        auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto * replicate_fn = (decltype(ggml_numa_replicate) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_numa_replicate");
+        auto * replicate_free_fn = (decltype(ggml_numa_replicate_free) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_numa_replicate_free");
+        if (replicate_fn && replicate_free_fn) {
+            pimpl->numa_replicate_free_fn = replicate_free_fn;
+
+            std::vector<std::pair<const char *, const char *>> ranges;
+            for (const auto & it : tensors_by_name) {
+                const ggml_tensor * t = it.second;
+
+                // the token embeddings are only read by get_rows, unless they are tied to the output
+                if (!t->buffer || ggml_n_dims(t) < 2 || (t == tok_embd && t != output)) {
+                    continue;
+                }
+
+                // host buffers are read by the CPU backend, extra buffer types such as CPU_REPACK are not host buffers
+                ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(t->buffer);
+                if (!ggml_backend_buffer_is_host(t->buffer) && ggml_backend_buft_get_device(buft) != cpu_dev) {
+                    continue;
+                }
+
+                // the layout of an extra buffer type such as AMX can be larger than ggml_nbytes
+                ranges.emplace_back((const char *) t->data, (const char *) t->data + ggml_backend_buft_get_alloc_size(buft, t));
+            }
+
+            // tensors that are adjacent up to their alignment padding share one replica
+            std::sort(ranges.begin(), ranges.end());
+            std::vector<std::pair<const char *, const char *>> merged;
+            for (const auto & range : ranges) {
+                if (!merged.empty() && range.first <= merged.back().second + 4096) {
+                    merged.back().second = std::max(merged.back().second, range.second);
+                } else {
+                    merged.push_back(range);
+                }
+            }
+
+            size_t n_replicated = 0;
+            for (const auto & range : merged) {
+                if (replicate_fn(range.first, range.second - range.first)) {
+                    pimpl->numa_replicas.push_back(range.first);
+                    n_replicated += range.second - range.first;
+                }
+            }
+            if (n_replicated > 0) {
+                LLAMA_LOG_INFO("%s: replicated %.2f MiB of weights in %zu ranges on every NUMA node\n", __func__,
+                        n_replicated/1024.0/1024.0, pimpl->numa_replicas.size());
+            }
+        }
+    }
+
     return true;
 }
 
@@ -18066,6 +18523,11 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                             std::max((uint32_t) 1, cparams.n_seq_max),
                             cparams.n_seq_max);
                 } else if (llm_arch_is_hybrid(arch)) {
+                    if (cparams.kv_block_size > 0) {
+                        LLAMA_LOG_WARN("%s: paged KV cache is not supported by hybrid models - using contiguous cells\n", __func__);
+                        cparams.kv_block_size = 0;
+                    }
+
                     const auto padding = llama_kv_cache_unified::get_padding(cparams);
 
                     cparams.n_ctx = GGML_PAD(cparams.n_ctx, padding);
@@ -18098,7 +18560,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
 
                         cparams.n_ctx = n_ctx_per_stream*cparams.n_seq_max;
                     } else {
-                        n_ctx_per_stream = GGML_PAD(n_ctx_per_stream, padding);
+                        // a paged cache is a whole number of blocks (both are powers of 2)
+                        n_ctx_per_stream = GGML_PAD(n_ctx_per_stream, std::max(padding, cparams.kv_block_size));
 
                         cparams.n_ctx = n_ctx_per_stream;
                     }
@@ -18108,6 +18571,11 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                     if (hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
                         GGML_ASSERT(hparams.is_swa_any());
 
+                        if (cparams.kv_block_size > 0) {
+                            LLAMA_LOG_WARN("%s: paged KV cache is not supported with SWA - using contiguous cells\n", __func__);
+                            cparams.kv_block_size = 0;
+                        }
+
                         res = new llama_kv_cache_unified_iswa(
                                 *this,
                                 params.type_k,
@@ -18135,7 +18603,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 cparams.n_seq_max,
                                 padding,
                                 hparams.n_swa,
-                                hparams.swa_type);
+                                hparams.swa_type,
+                                cparams.kv_block_size);
                     }
                 }
             }
@@ -18507,6 +18976,9 @@ ggml_cgraph * llama_model::build_graph(const llm_graph_params & params) const {
     // add on pooling layer
     llm->build_pooling(cls, cls_b, cls_out, cls_out_b);
 
+    // score the vocabulary with the proxy and compute only the best rows exactly
+    llm->build_lm_head_approx(output, output_rows, output_proxy);
+
     return llm->res->get_gf();
 }
 
@@ -18525,11 +18997,14 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache_path           =*/ nullptr,
+        /*.lm_head_proxy_type          =*/ GGML_TYPE_COUNT,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
         /*.use_extra_bufts             =*/ true,
+        /*.use_hugepages               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
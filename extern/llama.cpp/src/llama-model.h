@@ -400,6 +400,8 @@ struct llama_model {
     struct ggml_tensor * output          = nullptr;
     struct ggml_tensor * output_b        = nullptr;
     struct ggml_tensor * output_norm_enc = nullptr;
+    struct ggml_tensor * output_proxy    = nullptr; // coarse copy of output, see llama_model_params.lm_head_proxy_type
+    struct ggml_tensor * output_rows     = nullptr; // output in the layout of the model file, the approximate lm_head gathers its rows
 
     // classifier
     struct ggml_tensor * cls       = nullptr;
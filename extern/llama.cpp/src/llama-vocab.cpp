@@ -1161,7 +1161,7 @@ struct llm_tokenizer_rwkv : llm_tokenizer {
         // build trie
         for (uint32_t id = 0; id < vocab.n_tokens(); ++id) {
             const auto & data = vocab.get_token_data(id);
-            const auto text = llama_unescape_rwkv_token(data.text);
+            const auto text = llama_unescape_rwkv_token(std::string(data.text));
             token_matcher.insert((const char *) text.data(), text.size(), id);
         }
     }
@@ -1223,13 +1223,14 @@ struct llm_tokenizer_plamo2 : llm_tokenizer {
 
         for (size_t token_id = 0; token_id < vocab.n_tokens(); ++token_id) {
             const auto & entry = vocab.get_token_data(token_id);
-            tokens_.push_back(entry.text);
-            token_to_id[entry.text] = static_cast<llama_token>(token_id);
+            const std::string text(entry.text);
+            tokens_.push_back(text);
+            token_to_id[text] = static_cast<llama_token>(token_id);
 
             // Handle byte tokens
             if (vocab.is_byte(token_id)) {
                 if (entry.text.length() == 6 && entry.text.substr(0, 3) == "<0x" && entry.text.back() == '>') {
-                    std::string hex_str = entry.text.substr(3, 2);
+                    std::string hex_str(entry.text.substr(3, 2));
                     int byte_val = std::stoi(hex_str, nullptr, 16);
                     bytes_[byte_val] = static_cast<llama_token>(token_id);
                 }
@@ -1237,10 +1238,10 @@ struct llm_tokenizer_plamo2 : llm_tokenizer {
             }
 
             // Add token and all its suffixes to suffix_to_score
-            suffix_to_score[entry.text] = entry.score;
+            suffix_to_score[text] = entry.score;
 
             // Extract suffixes character by character (UTF-8 aware)
-            std::vector<uint32_t> cpts = unicode_cpts_from_utf8(entry.text);
+            std::vector<uint32_t> cpts = unicode_cpts_from_utf8(text);
             for (size_t i = 1; i < cpts.size(); ++i) {
                 std::string suffix;
                 for (size_t j = i; j < cpts.size(); ++j) {
@@ -1564,11 +1565,19 @@ struct llama_vocab::impl {
     bool escape_whitespaces         = true;
     bool treat_whitespace_as_suffix = false;
 
-    std::unordered_map<std::string, llama_token> token_to_id;
-    std::vector<token_data>                      id_to_token;
+    // the token texts of id_to_token and the keys of token_to_id are views into token_text_data,
+    // which holds all of them 0-terminated in one buffer instead of one heap string per token
+    std::vector<char> token_text_data;
+
+    std::unordered_map<std::string_view, llama_token> token_to_id;
+    std::vector<token_data>                           id_to_token;
 
     std::vector<llama_token> cache_special_tokens;
-    std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // llama_token_to_piece(special = true) for all tokens, packed into a single buffer
+    // piece i is stored at [offs[i], offs[i + 1] - 1) followed by a 0 terminator
+    std::vector<uint32_t> cache_token_to_piece_offs;
+    std::vector<char>     cache_token_to_piece_data;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1611,9 +1620,10 @@ struct llama_vocab::impl {
 
     void tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const;
 
-    std::string token_to_piece_for_cache(
+    void token_to_piece_for_cache(
                   llama_token   token,
-                         bool   special) const;
+                         bool   special,
+            std::vector<char> & piece) const;
 
 
     std::vector<llama_token> tokenize(
@@ -1638,7 +1648,7 @@ struct llama_vocab::impl {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    std::string_view token_to_piece(llama_token token) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -2027,19 +2037,42 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
     uint32_t n_tokens = gguf_get_arr_n(ctx, token_idx);
     id_to_token.resize(n_tokens);
+    token_to_id.reserve(n_tokens);
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        std::string word = gguf_get_arr_str(ctx, token_idx, i);
-        if (word.empty()) {
-            LLAMA_LOG_WARN("%s: empty token at index %u\n", __func__, i);
-            word = "[EMPTY_" + std::to_string(i) + "]";
+    // copy all token texts into one buffer first, the views are taken once it no longer grows
+    std::vector<uint32_t> token_text_offs(n_tokens + 1);
+    {
+        size_t size_text = 0;
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            size_text += strlen(gguf_get_arr_str(ctx, token_idx, i)) + 1;
+        }
+        token_text_data.reserve(size_text);
+
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            const char * word = gguf_get_arr_str(ctx, token_idx, i);
+            token_text_offs[i] = (uint32_t) token_text_data.size();
+            if (*word == 0) {
+                LLAMA_LOG_WARN("%s: empty token at index %u\n", __func__, i);
+                const std::string empty = "[EMPTY_" + std::to_string(i) + "]";
+                token_text_data.insert(token_text_data.end(), empty.begin(), empty.end());
+            } else {
+                token_text_data.insert(token_text_data.end(), word, word + strlen(word));
+            }
+            token_text_data.push_back(0);
         }
+        token_text_offs[n_tokens] = (uint32_t) token_text_data.size();
+
+        GGML_ASSERT(token_text_data.size() < std::numeric_limits<uint32_t>::max());
+    }
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        const std::string_view word(token_text_data.data() + token_text_offs[i], token_text_offs[i + 1] - token_text_offs[i] - 1);
 
         token_to_id[word] = i;
         max_token_len = std::max(max_token_len, (int) word.size());
 
         auto & token_data = id_to_token[i];
-        token_data.text  = std::move(word);
+        token_data.text  = word;
         token_data.score = scores ? scores[i] : 0.0f;
         token_data.attr  = LLAMA_TOKEN_ATTR_NORMAL;
 
@@ -2162,7 +2195,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_eot_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2176,7 +2209,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_eom_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2196,7 +2229,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_pre_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2216,7 +2249,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_suf_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2236,7 +2269,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_mid_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2253,7 +2286,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_pad_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2271,7 +2304,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_rep_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2285,7 +2318,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                     special_fim_sep_id = t.second;
                     if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                         LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                                __func__, t.second, t.first.c_str());
+                                __func__, t.second, t.first.data());
                         id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                     }
                 }
@@ -2327,14 +2360,14 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
                 special_eog_ids.insert(t.second);
                 if ((id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL) == 0) {
                     LLAMA_LOG_WARN("%s: control-looking token: %6d '%s' was not control-type; this is probably a bug in the model. its type will be overridden\n",
-                            __func__, t.second, t.first.c_str());
+                            __func__, t.second, t.first.data());
                     id_to_token[t.second].attr = LLAMA_TOKEN_ATTR_CONTROL;
                 }
             } else {
                 // token is control, but not marked as EOG -> print a debug log
                 if (id_to_token[t.second].attr & LLAMA_TOKEN_ATTR_CONTROL && special_eog_ids.count(t.second) == 0) {
                     LLAMA_LOG_DEBUG("%s: control token: %6d '%s' is not marked as EOG\n",
-                            __func__, t.second, t.first.c_str());
+                            __func__, t.second, t.first.data());
                 }
             }
         }
@@ -2374,7 +2407,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
             LLAMA_LOG_INFO("%s: printing all EOG tokens:\n", __func__);
             for (auto tid : special_eog_ids) {
-                LLAMA_LOG_INFO("%s:   - %d ('%s')\n", __func__, tid, id_to_token[tid].text.c_str());
+                LLAMA_LOG_INFO("%s:   - %d ('%s')\n", __func__, tid, id_to_token[tid].text.data());
 
                 if (id_to_token[tid].text == "<|return|>") {
                     has_return = true;
@@ -2412,20 +2445,32 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     }
 
     // build token to piece cache
+    // all pieces go into one contiguous buffer to avoid a heap allocation per token
     {
-        size_t size_cache = 0;
+        size_t size_text = 0;
+        for (const auto & token_data : id_to_token) {
+            size_text += token_data.text.size() + 1;
+        }
 
-        std::vector<std::string> cache(n_tokens);
+        std::vector<uint32_t> offs;
+        std::vector<char>     data;
 
-        for (uint32_t id = 0; id < n_tokens; ++id) {
-            cache[id] = token_to_piece_for_cache(id, true);
+        offs.reserve(n_tokens + 1);
+        data.reserve(size_text);
 
-            size_cache += cache[id].size();
+        for (uint32_t id = 0; id < n_tokens; ++id) {
+            offs.push_back((uint32_t) data.size());
+            token_to_piece_for_cache(id, true, data);
+            data.push_back(0);
         }
+        offs.push_back((uint32_t) data.size());
 
-        std::swap(cache_token_to_piece, cache);
+        GGML_ASSERT(data.size() < std::numeric_limits<uint32_t>::max());
 
-        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+        std::swap(cache_token_to_piece_offs, offs);
+        std::swap(cache_token_to_piece_data, data);
+
+        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, cache_token_to_piece_data.size() / 1024.0 / 1024.0);
     }
 
     // Handle per token attributes
@@ -2549,7 +2594,7 @@ uint8_t llama_vocab::impl::token_to_byte(llama_token id) const {
     switch (get_type()) {
         case LLAMA_VOCAB_TYPE_SPM:
         case LLAMA_VOCAB_TYPE_UGM: {
-            auto buf = token_data.text.substr(3, 2);
+            const std::string buf(token_data.text.substr(3, 2));
             return strtol(buf.c_str(), NULL, 16);
         }
         case LLAMA_VOCAB_TYPE_BPE: {
@@ -2720,20 +2765,20 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 }
 
 // NOTE: avoid ever using this except for building the token_to_piece caches
-std::string llama_vocab::impl::token_to_piece_for_cache(llama_token token, bool special) const {
-    std::string piece;
-    piece.resize(piece.capacity());  // using string internal cache
-    const int n_chars = vocab.token_to_piece(token, &piece[0], piece.size(), 0, special);
+// appends the piece to the end of the buffer
+void llama_vocab::impl::token_to_piece_for_cache(llama_token token, bool special, std::vector<char> & piece) const {
+    const size_t n_prev = piece.size();
+
+    piece.resize(n_prev + 32);
+    const int n_chars = vocab.token_to_piece(token, piece.data() + n_prev, piece.size() - n_prev, 0, special);
     if (n_chars < 0) {
-        piece.resize(-n_chars);
-        int check = vocab.token_to_piece(token, &piece[0], piece.size(), 0, special);
+        piece.resize(n_prev - n_chars);
+        int check = vocab.token_to_piece(token, piece.data() + n_prev, -n_chars, 0, special);
         GGML_ASSERT(check == -n_chars);
     }
     else {
-        piece.resize(n_chars);
+        piece.resize(n_prev + n_chars);
     }
-
-    return piece;
 }
 
 static void llama_escape_whitespace(std::string & text) {
@@ -2983,17 +3028,13 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     };
 
     // if we have a cache - use it
-    {
-        const auto & cache = cache_token_to_piece;
-
-        if (!cache.empty()) {
-            const auto & result = cache.at(token);
-            return _try_copy(result.data(), result.size());
-        }
+    if (!cache_token_to_piece_offs.empty()) {
+        const auto result = token_to_piece(token);
+        return _try_copy(result.data(), result.size());
     }
 
     if (0 <= token && token < (int32_t) id_to_token.size()) {
-        const std::string & token_text = id_to_token[token].text;
+        const std::string_view token_text = id_to_token[token].text;
         switch (get_type()) {
             case LLAMA_VOCAB_TYPE_WPM:
             case LLAMA_VOCAB_TYPE_SPM:
@@ -3004,7 +3045,7 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
                     return _try_copy(token_text.data(), token_text.size());
                 }
                 if (attr & LLAMA_TOKEN_ATTR_NORMAL) {
-                    std::string result = token_text;
+                    std::string result(token_text);
                     llama_unescape_whitespace(result);
                     return _try_copy(result.data(), result.size());
                 }
@@ -3021,13 +3062,13 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
                     return _try_copy(token_text.data(), token_text.size());
                 }
                 if (attr & LLAMA_TOKEN_ATTR_NORMAL) {
-                    std::string result = llama_decode_text(token_text);
+                    std::string result = llama_decode_text(std::string(token_text));
                     return _try_copy(result.data(), result.size());
                 }
                 break;
             }
             case LLAMA_VOCAB_TYPE_RWKV: {
-                std::vector<uint8_t> result = llama_unescape_rwkv_token(token_text);
+                std::vector<uint8_t> result = llama_unescape_rwkv_token(std::string(token_text));
 
                 // If we don't have enough space, return an error
                 if (result.size() > (size_t)length) {
@@ -3042,7 +3083,7 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
                 if (vocab.is_byte(token)) {
                     // Handle byte tokens like <0xXX>
                     if (token_text.length() == 6 && token_text.substr(0, 3) == "<0x" && token_text.back() == '>') {
-                        int hex_val = std::stoi(token_text.substr(3, 2), nullptr, 16);
+                        int hex_val = std::stoi(std::string(token_text.substr(3, 2)), nullptr, 16);
                         if (length < 1) {
                             return -1;
                         }
@@ -3052,8 +3093,7 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
                 }
 
                 // Normal token - just copy the text
-                std::string result = token_text;
-                return _try_copy(result.data(), result.size());
+                return _try_copy(token_text.data(), token_text.size());
             }
             default:
                 GGML_ABORT("fatal error");
@@ -3063,8 +3103,11 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     return 0;
 }
 
-const std::string & llama_vocab::impl::token_to_piece(llama_token token) const {
-    return cache_token_to_piece.at(token);
+std::string_view llama_vocab::impl::token_to_piece(llama_token token) const {
+    const uint32_t beg = cache_token_to_piece_offs.at(token);
+    const uint32_t end = cache_token_to_piece_offs.at(token + 1);
+
+    return std::string_view(cache_token_to_piece_data.data() + beg, end - beg - 1);
 }
 
 int32_t llama_vocab::impl::detokenize(
@@ -3185,26 +3228,26 @@ void llama_vocab::impl::print_info() const {
     LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (uint32_t) bpe_ranks.size());
 
     // special tokens
-    if (special_bos_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: BOS token        = %d '%s'\n", __func__, special_bos_id,     id_to_token.at(special_bos_id).text.c_str() );  }
-    if (special_eos_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOS token        = %d '%s'\n", __func__, special_eos_id,     id_to_token.at(special_eos_id).text.c_str() );  }
-    if (special_eot_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOT token        = %d '%s'\n", __func__, special_eot_id,     id_to_token.at(special_eot_id).text.c_str() );  }
-    if (special_eom_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOM token        = %d '%s'\n", __func__, special_eom_id,     id_to_token.at(special_eom_id).text.c_str() );  }
-    if (special_unk_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: UNK token        = %d '%s'\n", __func__, special_unk_id,     id_to_token.at(special_unk_id).text.c_str() );  }
-    if (special_sep_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: SEP token        = %d '%s'\n", __func__, special_sep_id,     id_to_token.at(special_sep_id).text.c_str() );  }
-    if (special_pad_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: PAD token        = %d '%s'\n", __func__, special_pad_id,     id_to_token.at(special_pad_id).text.c_str() );  }
-    if (special_mask_id != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: MASK token       = %d '%s'\n", __func__, special_mask_id,    id_to_token.at(special_mask_id).text.c_str() ); }
-
-    if (linefeed_id != LLAMA_TOKEN_NULL)        { LLAMA_LOG_INFO( "%s: LF token         = %d '%s'\n", __func__, linefeed_id,        id_to_token.at(linefeed_id).text.c_str() ); }
-
-    if (special_fim_pre_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM PRE token    = %d '%s'\n", __func__, special_fim_pre_id, id_to_token.at(special_fim_pre_id).text.c_str() ); }
-    if (special_fim_suf_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM SUF token    = %d '%s'\n", __func__, special_fim_suf_id, id_to_token.at(special_fim_suf_id).text.c_str() ); }
-    if (special_fim_mid_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM MID token    = %d '%s'\n", __func__, special_fim_mid_id, id_to_token.at(special_fim_mid_id).text.c_str() ); }
-    if (special_fim_pad_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM PAD token    = %d '%s'\n", __func__, special_fim_pad_id, id_to_token.at(special_fim_pad_id).text.c_str() ); }
-    if (special_fim_rep_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM REP token    = %d '%s'\n", __func__, special_fim_rep_id, id_to_token.at(special_fim_rep_id).text.c_str() ); }
-    if (special_fim_sep_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM SEP token    = %d '%s'\n", __func__, special_fim_sep_id, id_to_token.at(special_fim_sep_id).text.c_str() ); }
+    if (special_bos_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: BOS token        = %d '%s'\n", __func__, special_bos_id,     id_to_token.at(special_bos_id).text.data() );  }
+    if (special_eos_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOS token        = %d '%s'\n", __func__, special_eos_id,     id_to_token.at(special_eos_id).text.data() );  }
+    if (special_eot_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOT token        = %d '%s'\n", __func__, special_eot_id,     id_to_token.at(special_eot_id).text.data() );  }
+    if (special_eom_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: EOM token        = %d '%s'\n", __func__, special_eom_id,     id_to_token.at(special_eom_id).text.data() );  }
+    if (special_unk_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: UNK token        = %d '%s'\n", __func__, special_unk_id,     id_to_token.at(special_unk_id).text.data() );  }
+    if (special_sep_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: SEP token        = %d '%s'\n", __func__, special_sep_id,     id_to_token.at(special_sep_id).text.data() );  }
+    if (special_pad_id  != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: PAD token        = %d '%s'\n", __func__, special_pad_id,     id_to_token.at(special_pad_id).text.data() );  }
+    if (special_mask_id != LLAMA_TOKEN_NULL)    { LLAMA_LOG_INFO( "%s: MASK token       = %d '%s'\n", __func__, special_mask_id,    id_to_token.at(special_mask_id).text.data() ); }
+
+    if (linefeed_id != LLAMA_TOKEN_NULL)        { LLAMA_LOG_INFO( "%s: LF token         = %d '%s'\n", __func__, linefeed_id,        id_to_token.at(linefeed_id).text.data() ); }
+
+    if (special_fim_pre_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM PRE token    = %d '%s'\n", __func__, special_fim_pre_id, id_to_token.at(special_fim_pre_id).text.data() ); }
+    if (special_fim_suf_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM SUF token    = %d '%s'\n", __func__, special_fim_suf_id, id_to_token.at(special_fim_suf_id).text.data() ); }
+    if (special_fim_mid_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM MID token    = %d '%s'\n", __func__, special_fim_mid_id, id_to_token.at(special_fim_mid_id).text.data() ); }
+    if (special_fim_pad_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM PAD token    = %d '%s'\n", __func__, special_fim_pad_id, id_to_token.at(special_fim_pad_id).text.data() ); }
+    if (special_fim_rep_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM REP token    = %d '%s'\n", __func__, special_fim_rep_id, id_to_token.at(special_fim_rep_id).text.data() ); }
+    if (special_fim_sep_id != LLAMA_TOKEN_NULL) { LLAMA_LOG_INFO( "%s: FIM SEP token    = %d '%s'\n", __func__, special_fim_sep_id, id_to_token.at(special_fim_sep_id).text.data() ); }
 
     for (const auto & id : special_eog_ids) {
-        LLAMA_LOG_INFO( "%s: EOG token        = %d '%s'\n", __func__, id, id_to_token.at(id).text.c_str() );
+        LLAMA_LOG_INFO( "%s: EOG token        = %d '%s'\n", __func__, id, id_to_token.at(id).text.data() );
     }
 
     LLAMA_LOG_INFO("%s: max token length = %d\n", __func__, max_token_len);
@@ -3326,7 +3369,7 @@ const llama_vocab::token_data & llama_vocab::get_token_data(llama_token id) cons
 
 const char * llama_vocab::token_get_text(llama_token id) const {
     GGML_ASSERT(pimpl->type != LLAMA_VOCAB_TYPE_NONE);
-    return pimpl->id_to_token.at(id).text.c_str();
+    return pimpl->id_to_token.at(id).text.data();
 }
 
 float llama_vocab::token_get_score(llama_token id) const {
@@ -3510,7 +3553,7 @@ std::vector<llama_token> llama_vocab::tokenize(
     return pimpl->tokenize(raw_text, add_special, parse_special);
 }
 
-const std::string & llama_vocab::token_to_piece(llama_token token) const {
+std::string_view llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
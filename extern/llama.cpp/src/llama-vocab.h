@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
@@ -54,7 +55,7 @@ struct llama_model_loader;
 
 struct llama_vocab {
     struct token_data {
-        std::string      text;
+        std::string_view text = ""; // 0-terminated, points into the vocab's packed token text buffer
         float            score;
         llama_token_attr attr;
     };
@@ -154,7 +155,8 @@ struct llama_vocab {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    // the returned view is 0-terminated and valid for the lifetime of the vocab
+    std::string_view token_to_piece(llama_token token) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -0,0 +1,325 @@
+// Tests the paged KV cache (llama_context_params::kv_block_size) against a contiguous cache with one sequence:
+// a forked prefix, copy-on-write of the shared blocks and the state save/restore of a sequence and of the whole cache
+
+#include "llama.h"
+#include "ggml.h"
+#include "gguf.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const char * MODEL_PATH = "test-kv-paged-model.gguf";
+
+static std::string g_log;
+
+// small llama model with F16 weights, two layers
+static void write_model() {
+    const int n_embd = 128, n_ff = 256, n_head = 4, n_head_kv = 2, n_vocab = 272;
+    const int n_embd_gqa = n_embd / n_head * n_head_kv;
+
+    gguf_context * g = gguf_init_empty();
+    gguf_set_val_str(g, "general.architecture", "llama");
+    gguf_set_val_u32(g, "llama.context_length", 256);
+    gguf_set_val_u32(g, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(g, "llama.block_count", 2);
+    gguf_set_val_u32(g, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(g, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(g, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_u32(g, "llama.rope.dimension_count", n_embd / n_head);
+    gguf_set_val_f32(g, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    std::vector<std::string> tokens = { "<unk>", "<s>", "</s>" };
+    std::vector<int32_t>     types  = { 2, 3, 3 };
+    for (int b = 0; b < 256; ++b) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "<0x%02X>", b);
+        tokens.push_back(buf);
+        types.push_back(6);
+    }
+    while ((int) tokens.size() < n_vocab) {
+        tokens.push_back("\xe2\x96\x81t" + std::to_string(tokens.size()));
+        types.push_back(1);
+    }
+    std::vector<float> scores(n_vocab);
+    std::vector<const char *> ptrs;
+    for (int i = 0; i < n_vocab; ++i) {
+        scores[i] = -(float) i;
+        ptrs.push_back(tokens[i].c_str());
+    }
+    gguf_set_val_str(g, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(g, "tokenizer.ggml.tokens", ptrs.data(), ptrs.size());
+    gguf_set_arr_data(g, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(g, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_val_u32(g, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(g, "tokenizer.ggml.eos_token_id", 2);
+
+    ggml_init_params params = { (size_t) 16 << 20, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    uint32_t state = 1;
+    auto next = [&state]() {
+        state = state*1664525u + 1013904223u;
+        return (int32_t) (state >> 8) / (float) (1 << 23) - 0.5f;
+    };
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F16, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        if (t->type == GGML_TYPE_F32) {
+            for (int64_t i = 0; i < ne0; ++i) {
+                ((float *) t->data)[i] = 1.0f;
+            }
+        } else {
+            std::vector<float> data(ne0*ne1);
+            for (auto & v : data) {
+                v = 0.2f*next();
+            }
+            ggml_quantize_chunk(t->type, data.data(), t->data, 0, ne1, ne0, nullptr);
+        }
+        gguf_add_tensor(g, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+    for (int il = 0; il < 2; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        add(blk + "attn_norm.weight",   n_embd, 0);
+        add(blk + "attn_q.weight",      n_embd, n_embd);
+        add(blk + "attn_k.weight",      n_embd, n_embd_gqa);
+        add(blk + "attn_v.weight",      n_embd, n_embd_gqa);
+        add(blk + "attn_output.weight", n_embd, n_embd);
+        add(blk + "ffn_norm.weight",    n_embd, 0);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd);
+        add(blk + "ffn_up.weight",      n_embd, n_ff);
+    }
+
+    GGML_ASSERT(gguf_write_to_file(g, MODEL_PATH, false));
+    gguf_free(g);
+    ggml_free(ctx);
+}
+
+static llama_context * new_context(llama_model * model, uint32_t kv_block_size, uint32_t n_seq_max, bool flash_attn) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 64;
+    cparams.n_ubatch        = 64;
+    cparams.n_seq_max       = n_seq_max;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.flash_attn      = flash_attn;
+    cparams.kv_block_size   = kv_block_size;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx);
+
+    return ctx;
+}
+
+// logits of the last token of a sequence decoded alone in a contiguous cache
+static std::vector<float> reference(llama_model * model, const std::vector<llama_token> & tokens, bool flash_attn) {
+    llama_context * ctx = new_context(model, 0, 1, flash_attn);
+
+    std::vector<llama_token> tmp = tokens;
+    GGML_ASSERT(llama_decode(ctx, llama_batch_get_one(tmp.data(), tmp.size())) == 0);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + n_vocab);
+
+    llama_free(ctx);
+
+    return res;
+}
+
+// paged context with the next position of each of its 4 sequences
+struct paged_run {
+    llama_model   * model;
+    llama_context * ctx;
+
+    std::vector<llama_pos> n_past = std::vector<llama_pos>(4, 0);
+
+    // decodes (seq_id, tokens) pairs as one batch, returns the logits of the last token of each pair
+    std::vector<std::vector<float>> step(const std::vector<std::pair<llama_seq_id, std::vector<llama_token>>> & parts) {
+        int n_tokens = 0;
+        for (const auto & part : parts) {
+            n_tokens += part.second.size();
+        }
+
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        std::vector<int> last;
+        for (const auto & [seq_id, tokens] : parts) {
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                const int k = batch.n_tokens++;
+                batch.token[k]     = tokens[i];
+                batch.pos[k]       = n_past[seq_id]++;
+                batch.n_seq_id[k]  = 1;
+                batch.seq_id[k][0] = seq_id;
+                batch.logits[k]    = i + 1 == tokens.size();
+            }
+            last.push_back(batch.n_tokens - 1);
+        }
+
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+        const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+        std::vector<std::vector<float>> res;
+        for (const int k : last) {
+            const float * logits = llama_get_logits_ith(ctx, k);
+            res.emplace_back(logits, logits + n_vocab);
+        }
+
+        llama_batch_free(batch);
+
+        return res;
+    }
+};
+
+static bool same(const std::vector<float> & a, const std::vector<float> & b) {
+    float max_err = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max_err = std::max(max_err, std::fabs(a[i] - b[i]));
+    }
+    return a.size() == b.size() && max_err < 1e-3f;
+}
+
+static int check(const char * name, bool ok) {
+    printf("%-56s %s\n", name, ok ? "ok" : "FAILED");
+    return !ok;
+}
+
+static int test_paged(llama_model * model, bool flash_attn) {
+    printf("flash_attn = %d\n", flash_attn);
+
+    int n_failed = 0;
+
+    g_log.clear();
+    paged_run run = { model, new_context(model, 16, 4, flash_attn) };
+    n_failed += check("the attention gathers the blocks", g_log.find("gathers the blocks") != std::string::npos);
+
+    // the prompt ends inside its second block, which the fork then shares
+    std::vector<llama_token> a;
+    for (int i = 0; i < 20; ++i) {
+        a.push_back(3 + (i*37) % 250);
+    }
+    std::vector<llama_token> b = a;
+
+    auto out = run.step({ { 0, a } });
+    n_failed += check("prompt", same(out[0], reference(model, a, flash_attn)));
+
+    llama_memory_t mem = llama_get_memory(run.ctx);
+
+    // fork: both sequences continue from the shared prefix in blocks of their own
+    llama_memory_seq_cp(mem, 0, 1, -1, -1);
+    run.n_past[1] = run.n_past[0];
+
+    bool ok_fork = true;
+    for (int k = 0; k < 24; ++k) {
+        a.push_back(100 + k);
+        b.push_back(200 + k);
+
+        out = run.step({ { 0, { a.back() } }, { 1, { b.back() } } });
+
+        ok_fork &= same(out[0], reference(model, a, flash_attn));
+        ok_fork &= same(out[1], reference(model, b, flash_attn));
+    }
+    n_failed += check("fork, both sequences append", ok_fork);
+
+    // copy-on-write: truncating the fork inside the shared prefix leaves the other sequence intact
+    llama_memory_seq_cp(mem, 1, 2, -1, -1);
+    run.n_past[2] = run.n_past[1];
+    llama_memory_seq_rm(mem, 2, 10, -1);
+    run.n_past[2] = 10;
+
+    std::vector<llama_token> c(b.begin(), b.begin() + 10);
+    c.push_back(250);
+    b.push_back(201);
+
+    out = run.step({ { 2, { c.back() } }, { 1, { b.back() } } });
+    n_failed += check("truncated fork appends after the shared prefix", same(out[0], reference(model, c, flash_attn)));
+    n_failed += check("the forked sequence is not affected",            same(out[1], reference(model, b, flash_attn)));
+
+    // removing the first owner of the prefix keeps the blocks that the fork still uses
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    llama_memory_seq_rm(mem, 2, -1, -1);
+
+    b.push_back(202);
+    out = run.step({ { 1, { b.back() } } });
+    n_failed += check("shared blocks outlive their first owner", same(out[0], reference(model, b, flash_attn)));
+
+    // state of one sequence, restored into another sequence id of the same cache
+    {
+        std::vector<uint8_t> state(llama_state_seq_get_size(run.ctx, 1));
+        n_failed += check("save sequence", llama_state_seq_get_data(run.ctx, state.data(), state.size(), 1) == state.size());
+
+        llama_memory_seq_rm(mem, 1, -1, -1);
+        n_failed += check("restore sequence", llama_state_seq_set_data(run.ctx, state.data(), state.size(), 3) == state.size());
+        run.n_past[3] = run.n_past[1];
+
+        b.push_back(203);
+        out = run.step({ { 3, { b.back() } } });
+        n_failed += check("restored sequence continues", same(out[0], reference(model, b, flash_attn)));
+    }
+
+    // the whole cache, restored into a new context, with a second sequence forked from the restored one
+    {
+        llama_memory_seq_cp(mem, 3, 0, -1, -1);
+        run.n_past[0] = run.n_past[3];
+
+        std::vector<uint8_t> state(llama_state_get_size(run.ctx));
+        n_failed += check("save cache", llama_state_get_data(run.ctx, state.data(), state.size()) == state.size());
+
+        llama_free(run.ctx);
+        run.ctx = new_context(model, 16, 4, flash_attn);
+        n_failed += check("restore cache", llama_state_set_data(run.ctx, state.data(), state.size()) == state.size());
+
+        std::vector<llama_token> d = b;
+        b.push_back(204);
+        d.push_back(205);
+
+        out = run.step({ { 3, { b.back() } }, { 0, { d.back() } } });
+        n_failed += check("restored cache continues", same(out[0], reference(model, b, flash_attn)));
+        n_failed += check("restored fork continues",  same(out[1], reference(model, d, flash_attn)));
+    }
+
+    llama_free(run.ctx);
+
+    return n_failed;
+}
+
+int main(void) {
+    llama_log_set([](ggml_log_level level, const char * text, void *) {
+        if (level != GGML_LOG_LEVEL_DEBUG) {
+            g_log += text;
+        }
+    }, nullptr);
+
+    llama_backend_init();
+
+    write_model();
+
+    llama_model * model = llama_model_load_from_file(MODEL_PATH, llama_model_default_params());
+    GGML_ASSERT(model);
+
+    int n_failed = 0;
+
+    n_failed += test_paged(model, false);
+    n_failed += test_paged(model, true);
+
+    llama_model_free(model);
+    std::remove(MODEL_PATH);
+    llama_backend_free();
+
+    printf("%d tests failed\n", n_failed);
+
+    return n_failed > 0;
+}
@@ -0,0 +1,206 @@
+// Tests the cache of the CPU repacked weights (llama_model_params::repack_cache_path):
+// a miss writes the cache, a hit maps it and a model re-quantized with the same shapes rebuilds it
+
+#include "llama.h"
+#include "ggml.h"
+#include "gguf.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char * MODEL_PATH = "test-repack-cache-model.gguf";
+static const char * CACHE_PATH = "test-repack-cache-model.repack";
+
+static std::string g_log;
+
+// small llama model with Q4_K weights, all matrices have a row count that is a multiple of 8 so they are repacked
+// requant changes only the middle quarter of the rows of each matrix, away from the start and the end of its data
+static void write_model(bool requant) {
+    const int n_embd = 256, n_ff = 512, n_head = 4, n_head_kv = 2, n_vocab = 272;
+    const int n_embd_gqa = n_embd / n_head * n_head_kv;
+
+    gguf_context * g = gguf_init_empty();
+    gguf_set_val_str(g, "general.architecture", "llama");
+    gguf_set_val_u32(g, "llama.context_length", 64);
+    gguf_set_val_u32(g, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(g, "llama.block_count", 1);
+    gguf_set_val_u32(g, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(g, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(g, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_u32(g, "llama.rope.dimension_count", n_embd / n_head);
+    gguf_set_val_f32(g, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    std::vector<std::string> tokens = { "<unk>", "<s>", "</s>" };
+    std::vector<int32_t>     types  = { 2, 3, 3 };
+    for (int b = 0; b < 256; ++b) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "<0x%02X>", b);
+        tokens.push_back(buf);
+        types.push_back(6);
+    }
+    while ((int) tokens.size() < n_vocab) {
+        tokens.push_back("\xe2\x96\x81t" + std::to_string(tokens.size()));
+        types.push_back(1);
+    }
+    std::vector<float> scores(n_vocab);
+    std::vector<const char *> ptrs;
+    for (int i = 0; i < n_vocab; ++i) {
+        scores[i] = -(float) i;
+        ptrs.push_back(tokens[i].c_str());
+    }
+    gguf_set_val_str(g, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(g, "tokenizer.ggml.tokens", ptrs.data(), ptrs.size());
+    gguf_set_arr_data(g, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(g, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_val_u32(g, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(g, "tokenizer.ggml.eos_token_id", 2);
+
+    ggml_init_params params = { (size_t) 16 << 20, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    uint32_t state = 1;
+    auto next = [&state]() {
+        state = state*1664525u + 1013904223u;
+        return (int32_t) (state >> 8) / (float) (1 << 23) - 0.5f;
+    };
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_K, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        if (t->type == GGML_TYPE_F32) {
+            for (int64_t i = 0; i < ne0; ++i) {
+                ((float *) t->data)[i] = 1.0f;
+            }
+        } else {
+            std::vector<float> data(ne0*ne1);
+            for (auto & v : data) {
+                v = 0.1f*next();
+            }
+            if (requant) {
+                for (int64_t i = (ne1/2 - ne1/8)*ne0; i < (ne1/2 + ne1/8)*ne0; ++i) {
+                    data[i] = -data[i];
+                }
+            }
+            ggml_quantize_chunk(t->type, data.data(), t->data, 0, ne1, ne0, nullptr);
+        }
+        gguf_add_tensor(g, t);
+    };
+
+    add("token_embd.weight",       n_embd, n_vocab);
+    add("output_norm.weight",      n_embd, 0);
+    add("output.weight",           n_embd, n_vocab);
+    add("blk.0.attn_norm.weight",  n_embd, 0);
+    add("blk.0.attn_q.weight",     n_embd, n_embd);
+    add("blk.0.attn_k.weight",     n_embd, n_embd_gqa);
+    add("blk.0.attn_v.weight",     n_embd, n_embd_gqa);
+    add("blk.0.attn_output.weight", n_embd, n_embd);
+    add("blk.0.ffn_norm.weight",   n_embd, 0);
+    add("blk.0.ffn_gate.weight",   n_embd, n_ff);
+    add("blk.0.ffn_down.weight",   n_ff,   n_embd);
+    add("blk.0.ffn_up.weight",     n_embd, n_ff);
+
+    GGML_ASSERT(gguf_write_to_file(g, MODEL_PATH, false));
+    gguf_free(g);
+    ggml_free(ctx);
+}
+
+// logits of the last token of a short prompt, g_log holds the load log
+static std::vector<float> run(bool use_cache, bool use_mlock) {
+    g_log.clear();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.repack_cache_path = use_cache ? CACHE_PATH : nullptr;
+    mparams.use_mlock         = use_mlock;
+
+    llama_model * model = llama_model_load_from_file(MODEL_PATH, mparams);
+    GGML_ASSERT(model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 64;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx);
+
+    std::vector<llama_token> prompt = { 1, 40, 28, 7, 100 };
+    GGML_ASSERT(llama_decode(ctx, llama_batch_get_one(prompt.data(), prompt.size())) == 0);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> result(logits, logits + n_vocab);
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    return result;
+}
+
+static bool logged(const char * text) {
+    return g_log.find(text) != std::string::npos;
+}
+
+static int check(const char * name, bool ok) {
+    printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+    return !ok;
+}
+
+int main(void) {
+    llama_log_set([](ggml_log_level level, const char * text, void *) {
+        if (level != GGML_LOG_LEVEL_DEBUG) {
+            g_log += text;
+        }
+    }, nullptr);
+
+    llama_backend_init();
+
+    std::remove(CACHE_PATH);
+    write_model(false);
+
+    const std::vector<float> ref_a = run(false, false);
+    if (!logged("CPU_REPACK model buffer size")) {
+        printf("no weights in a CPU_REPACK buffer on this CPU, skipping\n");
+        std::remove(MODEL_PATH);
+        llama_backend_free();
+        return 0;
+    }
+
+    int n_failed = 0;
+
+    const std::vector<float> miss_a = run(true, false);
+    n_failed += check("miss writes the cache",        logged("wrote repack cache") && !logged("using repack cache"));
+    n_failed += check("miss logits match",            miss_a == ref_a);
+
+    const std::vector<float> hit_a = run(true, true);
+    n_failed += check("hit maps the cache",           logged("using repack cache") && !logged("wrote repack cache"));
+    n_failed += check("hit logits match",             hit_a == ref_a);
+
+    // same shapes and types, different weights
+    write_model(true);
+
+    const std::vector<float> ref_b = run(false, false);
+    n_failed += check("re-quantized model changes the logits", ref_b != ref_a);
+
+    const std::vector<float> stale_b = run(true, false);
+    n_failed += check("stale fingerprint rebuilds the cache",
+                      logged("does not match the model") && logged("wrote repack cache") && !logged("using repack cache"));
+    n_failed += check("stale logits match the new model", stale_b == ref_b);
+
+    const std::vector<float> hit_b = run(true, false);
+    n_failed += check("rebuilt cache is hit",         logged("using repack cache"));
+    n_failed += check("rebuilt cache logits match",   hit_b == ref_b);
+
+    std::remove(CACHE_PATH);
+    std::remove(MODEL_PATH);
+    llama_backend_free();
+
+    printf("%d tests failed\n", n_failed);
+
+    return n_failed > 0;
+}
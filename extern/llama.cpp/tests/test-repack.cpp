@@ -0,0 +1,224 @@
+// Tests the interleaved (CPU_REPACK) mul_mat of the K-quants against the vec_dot of the plain layout
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// the repacked kernels quantize src1 the same way as quantize_row_q8_K and sum in a different order
+constexpr double MAX_NMSE = 1e-7;
+
+static const char * RESULT_STR[] = {"ok", "FAILED"};
+
+// Generate synthetic data
+static void generate_data(float offset, size_t n, float * dst) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = 0.1 + 2*cosf(i*0.37f + offset) * sinf(i*0.011f + 2*offset);
+    }
+}
+
+static double nmse(const float * a, const float * ref, size_t n) {
+    double err = 0;
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        err += (a[i] - ref[i]) * (double) (a[i] - ref[i]);
+        sum += ref[i] * (double) ref[i];
+    }
+    return err / sum;
+}
+
+static ggml_backend_buffer_type_t repack_buffer_type(ggml_backend_dev_t dev) {
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+    auto get_extra_bufts = (ggml_backend_dev_get_extra_bufts_t)
+        ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts");
+    if (!get_extra_bufts) {
+        return nullptr;
+    }
+    for (ggml_backend_buffer_type_t * buft = get_extra_bufts(dev); buft && *buft; ++buft) {
+        if (strcmp(ggml_backend_buft_name(*buft), "CPU_REPACK") == 0) {
+            return *buft;
+        }
+    }
+    return nullptr;
+}
+
+// dst[i1][i0] = vec_dot(row i0 of the quantized weights, row i1 of src1 quantized to the vec_dot type)
+static void mul_mat_ref(ggml_type type, const std::vector<uint8_t> & w, const std::vector<float> & x,
+                        int64_t k, int64_t n, int64_t m, std::vector<float> & dst) {
+    const auto * qfns_cpu = ggml_get_type_traits_cpu(type);
+    const auto * vdot     = ggml_get_type_traits_cpu(qfns_cpu->vec_dot_type);
+
+    const size_t w_row = ggml_row_size(type, k);
+    const size_t x_row = ggml_row_size(qfns_cpu->vec_dot_type, k);
+
+    std::vector<uint8_t> xq(x_row*m);
+    for (int64_t i1 = 0; i1 < m; i1++) {
+        vdot->from_float(x.data() + i1*k, xq.data() + i1*x_row, k);
+    }
+
+    dst.resize(n*m);
+    for (int64_t i1 = 0; i1 < m; i1++) {
+        for (int64_t i0 = 0; i0 < n; i0++) {
+            qfns_cpu->vec_dot(k, &dst[i1*n + i0], 0, w.data() + i0*w_row, 0, xq.data() + i1*x_row, 0, 1);
+        }
+    }
+}
+
+// Returns 1 on a mismatch, -1 if the weights are not repacked on this CPU
+static int test_mul_mat(ggml_backend_t backend, ggml_backend_buffer_type_t buft, ggml_type type,
+                        int64_t k, int64_t n, int64_t m, bool verbose) {
+    std::vector<float> w_f32(k*n);
+    std::vector<float> x(k*m);
+    generate_data(0.0f, w_f32.size(), w_f32.data());
+    generate_data(1.0f, x.size(), x.data());
+
+    std::vector<uint8_t> w(ggml_row_size(type, k)*n);
+    ggml_quantize_chunk(type, w_f32.data(), w.data(), 0, n, k, nullptr);
+
+    std::vector<float> ref;
+    mul_mat_ref(type, w, x, k, n, m, ref);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    // the weights in the repack buffer, src1 and dst in a regular one
+    ggml_context * ctx_w = ggml_init(params);
+    ggml_context * ctx   = ggml_init(params);
+
+    ggml_tensor * tw  = ggml_new_tensor_2d(ctx_w, type, k, n);
+    ggml_tensor * tx  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, m);
+    ggml_tensor * out = ggml_mul_mat(ctx, tw, tx);
+
+    ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft);
+    ggml_backend_buffer_t buf   = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+    int result = -1;
+    if (ggml_backend_supports_op(backend, out)) {
+        ggml_backend_tensor_set(tw, w.data(), 0, w.size());
+        ggml_backend_tensor_set(tx, x.data(), 0, x.size()*sizeof(float));
+
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, out);
+        GGML_ASSERT(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+        std::vector<float> dst(n*m);
+        ggml_backend_tensor_get(out, dst.data(), 0, dst.size()*sizeof(float));
+
+        const double err = nmse(dst.data(), ref.data(), dst.size());
+        result = !(err < MAX_NMSE);
+        if (result || verbose) {
+            printf("%5s k = %5lld, n = %4lld, m = %3lld: %s (nmse %.3e)\n", ggml_type_name(type),
+                   (long long) k, (long long) n, (long long) m, RESULT_STR[result], err);
+        }
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx);
+    ggml_free(ctx_w);
+
+    return result;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    // the repack buffer logs every tensor it repacks
+    ggml_log_set([](ggml_log_level level, const char * text, void *) {
+        if (level != GGML_LOG_LEVEL_DEBUG) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, 4);
+
+    ggml_backend_buffer_type_t buft = repack_buffer_type(ggml_backend_get_device(backend));
+    if (!buft) {
+        printf("no CPU_REPACK buffer type, skipping\n");
+        ggml_backend_free(backend);
+        return 0;
+    }
+
+    int num_failed = 0;
+    int num_tested = 0;
+
+    for (ggml_type type : { GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K }) {
+        printf("Testing %s\n", ggml_type_name(type));
+        ggml_quantize_init(type);
+
+        // m covers the gemv (1 row), the gemm in blocks of 4 rows and the rows left over after them
+        for (int64_t k : { 256, 1280 }) {
+            for (int64_t n : { 8, 24, 264 }) {
+                for (int64_t m : { 1, 2, 3, 4, 5, 7, 8, 13, 33 }) {
+                    const int result = test_mul_mat(backend, buft, type, k, n, m, verbose);
+                    if (result < 0) {
+                        continue;
+                    }
+                    num_failed += result;
+                    num_tested++;
+                }
+            }
+        }
+
+        // weights with a row count that is not a multiple of 8 are not repacked, the loader keeps them in a plain buffer
+        for (int64_t n : { 1, 12, 100 }) {
+            ggml_init_params params = { 3*ggml_tensor_overhead(), nullptr, true };
+            ggml_context * ctx = ggml_init(params);
+
+            ggml_tensor * tw  = ggml_new_tensor_2d(ctx, type, 256, n);
+            ggml_tensor * tx  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 256, 1);
+            ggml_tensor * out = ggml_mul_mat(ctx, tw, tx);
+
+            ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+
+            const bool failed = ggml_backend_supports_op(backend, out);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s n = %4lld not repacked: %s\n", ggml_type_name(type), (long long) n, RESULT_STR[failed]);
+            }
+
+            ggml_backend_buffer_free(buf_w);
+            ggml_free(ctx);
+        }
+    }
+
+    ggml_backend_free(backend);
+
+    if (num_tested == 0) {
+        printf("the K-quants are not repacked on this CPU, only the fallback was tested\n");
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
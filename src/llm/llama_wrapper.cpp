@@ -7,13 +7,136 @@
 #include <ctime>
 #include <iomanip>
 #include <filesystem>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <thread>
 
-// ModelConfig implementation
-ModelConfig::ModelConfig(const std::string &path) : modelPath(path)
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// K and V cache types of a preset
+static void kvCachePresetTypes(KvCachePreset preset, ggml_type &typeK, ggml_type &typeV)
+{
+  switch (preset)
+  {
+  case KvCachePreset::Q8_0:
+    typeK = GGML_TYPE_Q8_0;
+    typeV = GGML_TYPE_Q8_0;
+    break;
+  case KvCachePreset::Q4_0:
+    typeK = GGML_TYPE_Q4_0;
+    typeV = GGML_TYPE_Q4_0;
+    break;
+  case KvCachePreset::K8V4:
+    typeK = GGML_TYPE_Q8_0;
+    typeV = GGML_TYPE_Q4_0;
+    break;
+  default:
+    typeK = GGML_TYPE_F16;
+    typeV = GGML_TYPE_F16;
+    break;
+  }
+}
+
+static std::string hostName()
 {
-  nBatch = nCtx;
+#ifdef _WIN32
+  const char *name = std::getenv("COMPUTERNAME");
+  return name ? name : "";
+#else
+  char name[256] = {};
+  gethostname(name, sizeof(name) - 1);
+  return name;
+#endif
 }
 
+// File in the nimblama directory of the user cache directory, empty when there is none
+static std::string userCachePath(const char *fileName)
+{
+#ifdef _WIN32
+  const char *base = std::getenv("LOCALAPPDATA");
+  if (!base || !*base)
+    return "";
+  std::filesystem::path dir(base);
+#else
+  std::filesystem::path dir;
+  const char *xdg = std::getenv("XDG_CACHE_HOME");
+  const char *home = std::getenv("HOME");
+  if (xdg && *xdg)
+    dir = xdg;
+  else if (home && *home)
+    dir = std::filesystem::path(home) / ".cache";
+  else
+    return "";
+#endif
+  return (dir / "nimblama" / fileName).string();
+}
+
+// Resident memory of the process: anonymous (buffers, repacked weights) and file-backed (mmap'ed weights, which the
+// kernel can drop again), false where it is not available
+static bool readRss(size_t &anonBytes, size_t &fileBytes)
+{
+  anonBytes = fileBytes = 0;
+#ifdef __linux__
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  bool found = false;
+  while (std::getline(status, line))
+  {
+    if (line.compare(0, 8, "RssAnon:") == 0)
+    {
+      anonBytes = std::stoull(line.substr(8)) * 1024;
+      found = true;
+    }
+    else if (line.compare(0, 8, "RssFile:") == 0)
+    {
+      fileBytes = std::stoull(line.substr(8)) * 1024;
+    }
+  }
+  return found;
+#else
+  return false;
+#endif
+}
+
+static const char *kvCachePresetName(KvCachePreset preset)
+{
+  switch (preset)
+  {
+  case KvCachePreset::Q8_0:
+    return "q8_0";
+  case KvCachePreset::Q4_0:
+    return "q4_0";
+  case KvCachePreset::K8V4:
+    return "k8v4";
+  default:
+    return "f16";
+  }
+}
+
+// Head sizes of the KV cache: <arch>.attention.key_length and value_length where the model sets them (Gemma, the
+// compressed cache of MLA models), n_embd / n_head otherwise, 0 for models without attention heads (Mamba, RWKV)
+static void modelHeadDims(const llama_model *model, int &nEmbdHeadK, int &nEmbdHeadV)
+{
+  const int nHead = llama_model_n_head(model);
+  nEmbdHeadK = nEmbdHeadV = nHead > 0 ? llama_model_n_embd(model) / nHead : 0;
+
+  char arch[64];
+  if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) < 0)
+    return;
+
+  char value[32];
+  if (llama_model_meta_val_str(model, (std::string(arch) + ".attention.key_length").c_str(), value, sizeof(value)) >= 0)
+    nEmbdHeadK = atoi(value);
+  if (llama_model_meta_val_str(model, (std::string(arch) + ".attention.value_length").c_str(), value, sizeof(value)) >= 0)
+    nEmbdHeadV = atoi(value);
+}
+
+// ModelConfig implementation
+ModelConfig::ModelConfig(const std::string &path) : modelPath(path), ubatchTuneCachePath(userCachePath("ubatch_tune.cache")) {}
+
 // Constructor
 LlamaWrapper::LlamaWrapper(const std::string &modelPath)
     : model(nullptr), ctx(nullptr), vocab(nullptr), sampler(nullptr),
@@ -46,12 +169,18 @@ bool LlamaWrapper::initialize()
 
   printCudaStatus();
 
+  readRss(rssAnonBeforeInit, rssFileBeforeInit);
+
   if (!initializeLogging())
     return false;
   if (!loadBackends())
     return false;
   if (!loadModel())
     return false;
+  if (modelConfig.memoryBudgetMiB > 0 && !planMemory())
+    return false;
+  if (modelConfig.tuneUbatch && !tuneUbatchSize())
+    return false;
   if (!createContext())
     return false;
   if (!setupSampler())
@@ -61,6 +190,11 @@ bool LlamaWrapper::initialize()
 
   isInitialized = true;
 
+  if (modelConfig.memoryBudgetMiB > 0)
+  {
+    printMemoryReport();
+  }
+
   if (loggingEnabled) {
         createLogFile();
     }
@@ -88,7 +222,55 @@ void LlamaWrapper::runChatLoop()
       break;
     }
 
-    std::string response = processUserMessage(userInput);
+    // /regen, /edit <index> <text>, /branch <index>, /drop <index>, /branches
+    if (userInput[0] == '/')
+    {
+      std::istringstream command(userInput);
+      std::string name;
+      command >> name;
+
+      if (name == "/regen")
+      {
+        regenerateLast();
+        continue;
+      }
+      if (name == "/edit")
+      {
+        size_t index = 0;
+        std::string text;
+        command >> index;
+        std::getline(command >> std::ws, text);
+        editMessage(index, text);
+        continue;
+      }
+      if (name == "/branch")
+      {
+        size_t branch = 0;
+        command >> branch;
+        if (!switchBranch(branch))
+          fprintf(stderr, "Error: no branch %zu\n", branch);
+        continue;
+      }
+      if (name == "/drop")
+      {
+        size_t branch = 0;
+        command >> branch;
+        if (!dropBranch(branch))
+          fprintf(stderr, "Error: no inactive branch %zu\n", branch);
+        continue;
+      }
+      if (name == "/branches")
+      {
+        for (size_t i = 0; i < branches.size(); ++i)
+        {
+          const size_t nMessages = i == activeBranch ? messageHistory.size() : branches[i].messages.size();
+          printf("%c %zu: %zu messages\n", i == activeBranch ? '*' : ' ', i, nMessages);
+        }
+        continue;
+      }
+    }
+
+    std::string response = processUserMessage(std::move(userInput));
     if (response.empty())
     {
       std::cerr << "Error generating response\n";
@@ -98,118 +280,888 @@ void LlamaWrapper::runChatLoop()
 }
 
 // Process a single user message and return response
-std::string LlamaWrapper::processUserMessage(const std::string &userMessage)
+std::string LlamaWrapper::processUserMessage(std::string userMessage)
 {
   if (!isInitialized)
   {
     return "";
   }
 
-  messageHistory.push_back({"user", strdup(userMessage.c_str())});
-
   writeToLog("user", userMessage);
 
+  messageHistory.push("user", std::move(userMessage));
+
+  return respondToHistory();
+}
+
+// Decode the part of the formatted history that is not in the KV cache yet and respond to it
+std::string LlamaWrapper::respondToHistory()
+{
   std::string prompt = buildPromptFromHistory();
-  if (prompt.empty())
-  {
-    return "";
-  }
+  std::string response;
 
   printf("\033[33m");
-  std::string response = generateResponse(prompt);
+  const bool complete = !prompt.empty() &&
+                        generateResponse(prompt.substr(std::min<size_t>(formattedLength, prompt.size())), response);
   printf("\n\033[0m");
 
-  messageHistory.push_back({"assistant", strdup(response.c_str())});
+  // the KV cache holds part of the turn at most, go back to before the user message so that cache and history agree
+  if (!complete)
+  {
+    rollbackTo(ChatCheckpoint(checkpoints.back()));
+    return "";
+  }
 
   writeToLog("assistant", response);
 
-  return response;
-}
+  messageHistory.push("assistant", response);
+
+  // the next prompt starts after the response in the formatted history
+  formattedLength = buildPromptFromHistory(false).size();
+  pushCheckpoint();
+
+  return response;
+}
+
+// New response to the last user message in a new branch
+std::string LlamaWrapper::regenerateLast()
+{
+  if (!isInitialized)
+  {
+    return "";
+  }
+
+  // a user message and its response after the system message, if there is one
+  const size_t nMessages = messageHistory.size();
+  if (nMessages < nSystemMessages() + 2 || strcmp(messageHistory[nMessages - 1].role, "assistant") != 0)
+  {
+    fprintf(stderr, "Error: there is no response to regenerate\n");
+    return "";
+  }
+
+  const ChatCheckpoint *checkpoint = findCheckpoint(nMessages - 2);
+  if (!checkpoint)
+  {
+    fprintf(stderr, "Error: no checkpoint before the last user message\n");
+    return "";
+  }
+
+  std::string userMessage = messageHistory.content(nMessages - 2);
+
+  branchFrom(*checkpoint);
+
+  messageHistory.push("user", std::move(userMessage));
+
+  return respondToHistory();
+}
+
+// Replace a user message and respond to it in a new branch
+std::string LlamaWrapper::editMessage(size_t index, const std::string &newContent)
+{
+  if (!isInitialized)
+  {
+    return "";
+  }
+
+  if (index >= messageHistory.size() || strcmp(messageHistory[index].role, "user") != 0)
+  {
+    fprintf(stderr, "Error: message %zu is not a user message\n", index);
+    return "";
+  }
+
+  const ChatCheckpoint *checkpoint = findCheckpoint(index);
+  if (!checkpoint)
+  {
+    fprintf(stderr, "Error: no checkpoint before message %zu\n", index);
+    return "";
+  }
+
+  branchFrom(*checkpoint);
+
+  writeToLog("user", newContent);
+
+  messageHistory.push("user", newContent);
+
+  return respondToHistory();
+}
+
+bool LlamaWrapper::switchBranch(size_t branch)
+{
+  if (branch >= branches.size())
+  {
+    return false;
+  }
+
+  if (branch != activeBranch)
+  {
+    saveActiveBranch();
+    loadBranch(branch);
+  }
+
+  return true;
+}
+
+// Free the KV cache sequence of an inactive branch
+bool LlamaWrapper::dropBranch(size_t branch)
+{
+  if (branch >= branches.size() || branch == activeBranch)
+  {
+    return false;
+  }
+
+  llama_memory_seq_rm(llama_get_memory(ctx), branches[branch].seqId, -1, -1);
+
+  branches.erase(branches.begin() + branch);
+  if (activeBranch > branch)
+  {
+    activeBranch--;
+  }
+
+  return true;
+}
+
+void LlamaWrapper::pushCheckpoint()
+{
+  const llama_seq_id seqId = branches[activeBranch].seqId;
+
+  ChatCheckpoint checkpoint;
+  checkpoint.nMessages = messageHistory.size();
+  checkpoint.nPast = llama_memory_seq_pos_max(llama_get_memory(ctx), seqId) + 1;
+  checkpoint.formattedLength = formattedLength;
+  checkpoint.nEvicted = llama_get_kv_evict_n_evicted(ctx, seqId);
+  checkpoint.recentTokens = recentTokens;
+
+  checkpoints.push_back(std::move(checkpoint));
+}
+
+const ChatCheckpoint *LlamaWrapper::findCheckpoint(size_t nMessages) const
+{
+  for (const auto &checkpoint : checkpoints)
+  {
+    if (checkpoint.nMessages == nMessages)
+    {
+      return &checkpoint;
+    }
+  }
+
+  return nullptr;
+}
+
+// Return the active branch to a checkpoint, its later tokens, messages and checkpoints are dropped
+void LlamaWrapper::rollbackTo(const ChatCheckpoint &checkpoint)
+{
+  const llama_seq_id seqId = branches[activeBranch].seqId;
+  llama_memory_t mem = llama_get_memory(ctx);
+
+  // evicting tokens moves the positions of the checkpoint, the history is then decoded again from the start
+  if (llama_get_kv_evict_n_evicted(ctx, seqId) != checkpoint.nEvicted)
+  {
+    llama_memory_seq_rm(mem, seqId, -1, -1);
+    formattedLength = 0;
+  }
+  else
+  {
+    llama_memory_seq_rm(mem, seqId, checkpoint.nPast, -1);
+    formattedLength = checkpoint.formattedLength;
+  }
+
+  messageHistory.truncate(checkpoint.nMessages);
+
+  recentTokens = checkpoint.recentTokens;
+  restoreSamplerWindow();
+
+  // after the copies above, checkpoint may refer to an element of checkpoints
+  const size_t nMessages = checkpoint.nMessages;
+  checkpoints.erase(std::remove_if(checkpoints.begin(), checkpoints.end(),
+                                   [nMessages](const ChatCheckpoint &cp)
+                                   { return cp.nMessages > nMessages; }),
+                    checkpoints.end());
+}
+
+// Make a new active branch that shares the KV cells of the active one up to the checkpoint
+bool LlamaWrapper::forkAt(const ChatCheckpoint &checkpoint)
+{
+  llama_seq_id seqId = -1;
+  for (llama_seq_id s = 0; s < modelConfig.maxBranches && seqId < 0; ++s)
+  {
+    if (std::none_of(branches.begin(), branches.end(), [s](const ChatBranch &b)
+                     { return b.seqId == s; }))
+    {
+      seqId = s;
+    }
+  }
+
+  if (seqId < 0)
+  {
+    return false;
+  }
+
+  llama_memory_t mem = llama_get_memory(ctx);
+  const llama_seq_id srcSeqId = branches[activeBranch].seqId;
+  const int nEvictedSrc = llama_get_kv_evict_n_evicted(ctx, srcSeqId);
+  const int nEvictedDst = llama_get_kv_evict_n_evicted(ctx, seqId);
+
+  // the checkpoint positions are only valid if nothing was evicted since. With KV eviction the prefix is not
+  // shared at all: a K-shift moves the position of a cell for every sequence that holds it, so evicting from one
+  // branch would move the tokens of the others. The new branch then decodes its history again from the start.
+  const bool shared = modelConfig.kvEvictWindow <= 0 && nEvictedSrc == checkpoint.nEvicted;
+
+  llama_memory_seq_rm(mem, seqId, -1, -1);
+  if (shared)
+  {
+    llama_memory_seq_cp(mem, srcSeqId, seqId, -1, checkpoint.nPast);
+  }
+
+  // the message text is shared with the active branch
+  ChatBranch branch;
+  branch.seqId = seqId;
+  branch.messages = messageHistory;
+  branch.messages.truncate(checkpoint.nMessages);
+  for (const auto &cp : checkpoints)
+  {
+    if (cp.nMessages <= checkpoint.nMessages)
+    {
+      branch.checkpoints.push_back(cp);
+      branch.checkpoints.back().nEvicted = shared && cp.nEvicted == nEvictedSrc ? nEvictedDst : -1;
+    }
+  }
+  branch.recentTokens = checkpoint.recentTokens;
+  branch.formattedLength = shared ? checkpoint.formattedLength : 0;
+
+  saveActiveBranch();
+  branches.push_back(std::move(branch));
+  loadBranch(branches.size() - 1);
+
+  return true;
+}
+
+// Continue from a checkpoint of the active branch in a new branch, or in place when every sequence is in use
+void LlamaWrapper::branchFrom(const ChatCheckpoint &checkpoint)
+{
+  const ChatCheckpoint target = checkpoint;
+
+  if (modelConfig.maxBranches > 1 && forkAt(target))
+  {
+    rollbackTo(ChatCheckpoint(checkpoints.back()));
+    return;
+  }
+
+  if (modelConfig.maxBranches > 1)
+  {
+    fprintf(stderr, "Warning: all %d branches are in use, replacing the current one\n", modelConfig.maxBranches);
+  }
+
+  rollbackTo(target);
+}
+
+void LlamaWrapper::saveActiveBranch()
+{
+  ChatBranch &branch = branches[activeBranch];
+  branch.messages = std::move(messageHistory);
+  branch.checkpoints = std::move(checkpoints);
+  branch.recentTokens = std::move(recentTokens);
+  branch.formattedLength = formattedLength;
+
+  messageHistory.clear();
+  checkpoints.clear();
+  recentTokens.clear();
+}
+
+void LlamaWrapper::loadBranch(size_t branch)
+{
+  activeBranch = branch;
+
+  ChatBranch &active = branches[activeBranch];
+  messageHistory = std::move(active.messages);
+  checkpoints = std::move(active.checkpoints);
+  recentTokens = std::move(active.recentTokens);
+  formattedLength = active.formattedLength;
+
+  active.messages.clear();
+  active.checkpoints.clear();
+  active.recentTokens.clear();
+
+  restoreSamplerWindow();
+}
+
+void ChatHistory::push(const char *role, std::string content)
+{
+  contents.push_back(std::make_shared<const std::string>(std::move(content)));
+  messages.push_back({role, contents.back()->c_str()});
+}
+
+// The text is freed with the last history that holds it
+void ChatHistory::truncate(size_t nMessages)
+{
+  if (nMessages < messages.size())
+  {
+    messages.resize(nMessages);
+    contents.resize(nMessages);
+  }
+}
+
+// Get current message history
+const std::vector<llama_chat_message> &LlamaWrapper::getMessageHistory() const
+{
+  return messageHistory.views();
+}
+
+// Clear message history (keeps system message), the other branches are versions of it and are dropped with their
+// KV cache sequences
+void LlamaWrapper::clearHistory()
+{
+  for (size_t i = branches.size(); i-- > 0;)
+  {
+    if (i != activeBranch)
+    {
+      dropBranch(i);
+    }
+  }
+
+  const size_t nKeep = nSystemMessages();
+
+  if (const ChatCheckpoint *first = findCheckpoint(nKeep))
+  {
+    rollbackTo(ChatCheckpoint(*first));
+    return;
+  }
+
+  // without a checkpoint there, decode the kept messages again from the start
+  llama_memory_seq_rm(llama_get_memory(ctx), branches[activeBranch].seqId, -1, -1);
+  messageHistory.truncate(nKeep);
+  formattedLength = 0;
+  recentTokens.clear();
+  restoreSamplerWindow();
+  checkpoints.clear();
+  pushCheckpoint();
+}
+
+// 1 if the history starts with a system message, which clearHistory() keeps
+size_t LlamaWrapper::nSystemMessages() const
+{
+  return !messageHistory.empty() && strcmp(messageHistory[0].role, "system") == 0 ? 1 : 0;
+}
+
+// Print CUDA availability status
+void LlamaWrapper::printCudaStatus()
+{
+#ifdef GGML_USE_CUBLAS
+  std::cout << "CUDA is ENABLED (GGML_USE_CUBLAS)." << std::endl;
+#elif defined(LLAMA_USE_CUDA)
+  std::cout << "CUDA is ENABLED (LLAMA_USE_CUDA)." << std::endl;
+#else
+  std::cout << "CUDA is DISABLED." << std::endl;
+#endif
+}
+
+// Initialize logging to only show errors
+bool LlamaWrapper::initializeLogging()
+{
+  llama_log_set([](enum ggml_log_level level, const char *text, void * /* user_data */)
+                {
+        if (level >= GGML_LOG_LEVEL_ERROR) {
+            fprintf(stderr, "%s", text);
+        } }, nullptr);
+  return true;
+}
+
+// Load all available backends
+bool LlamaWrapper::loadBackends()
+{
+  ggml_backend_load_all();
+  if (modelConfig.numaStrategy != GGML_NUMA_STRATEGY_DISABLED)
+  {
+    llama_numa_init(modelConfig.numaStrategy);
+  }
+  return true;
+}
+
+// Load the model from file
+bool LlamaWrapper::loadModel()
+{
+  llama_model_params modelParams = llama_model_default_params();
+  modelParams.n_gpu_layers = modelConfig.nGpuLayers;
+  if (!modelConfig.repackCachePath.empty())
+  {
+    modelParams.repack_cache_path = modelConfig.repackCachePath.c_str();
+  }
+  modelParams.use_hugepages = modelConfig.useHugepages;
+  if (samplingConfig.lmHeadTopM > 0)
+  {
+    modelParams.lm_head_proxy_type = samplingConfig.lmHeadProxyType;
+  }
+
+  model = llama_model_load_from_file(modelConfig.modelPath.c_str(), modelParams);
+  if (!model)
+  {
+    fprintf(stderr, "Error: unable to load model from %s\n", modelConfig.modelPath.c_str());
+    return false;
+  }
+
+  vocab = llama_model_get_vocab(model);
+  return true;
+}
+
+// Create inference context
+bool LlamaWrapper::createContext()
+{
+  if (!validateKvCachePreset(modelConfig.kvCachePreset))
+    return false;
+
+  ctx = llama_init_from_model(model, makeContextParams(modelConfig.kvCachePreset));
+  if (!ctx)
+  {
+    fprintf(stderr, "Error: failed to create llama_context\n");
+    return false;
+  }
+
+  // the compute estimate of the plan against the buffers the context reserved
+  if (modelConfig.memoryBudgetMiB > 0)
+  {
+    const size_t reserved = llama_get_compute_buffer_size(ctx);
+    const size_t planned = estimateMemory(modelConfig.nCtx, llama_n_ubatch(ctx), modelConfig.kvCachePreset).computeBytes;
+    if (reserved > planned)
+    {
+      fprintf(stderr, "Warning: the compute buffers take %.0f MiB, %.0f MiB more than planned\n",
+              reserved / 1048576.0, (reserved - planned) / 1048576.0);
+    }
+  }
+
+  if (!setupKvEvict())
+    return false;
+
+  tokenBatch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+
+  branches.assign(1, ChatBranch());
+  activeBranch = 0;
+
+  // Initialize formatted buffer
+  formattedBuffer.resize(llama_n_ctx(ctx));
+  return true;
+}
+
+// Eviction policy of the chat sequence, the evicted budget has to leave room for a prompt batch
+bool LlamaWrapper::setupKvEvict()
+{
+  if (modelConfig.kvEvictWindow <= 0)
+    return true;
+
+  if (modelConfig.kvEvictSink + modelConfig.kvEvictHeavy + modelConfig.kvEvictWindow >= modelConfig.nCtx)
+  {
+    fprintf(stderr, "Error: kvEvictSink + kvEvictHeavy + kvEvictWindow must be smaller than nCtx (%d)\n", modelConfig.nCtx);
+    return false;
+  }
+
+  llama_kv_evict_params params = llama_kv_evict_default_params();
+  params.type = modelConfig.kvEvictHeavy > 0 ? LLAMA_KV_EVICT_HEAVY : LLAMA_KV_EVICT_STREAMING;
+  params.n_sink = modelConfig.kvEvictSink;
+  params.n_window = modelConfig.kvEvictWindow;
+  params.n_heavy = modelConfig.kvEvictHeavy;
+
+  for (llama_seq_id seqId = 0; seqId < std::max(1, modelConfig.maxBranches); ++seqId)
+  {
+    if (!llama_set_kv_evict(ctx, seqId, params))
+    {
+      fprintf(stderr, "Error: the model or the context does not support KV eviction%s\n",
+              params.type == LLAMA_KV_EVICT_HEAVY ? " with heavy hitters (set flashAttn = false)" : "");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Check that the model and the attention path support the cache types before allocating anything
+bool LlamaWrapper::validateKvCachePreset(KvCachePreset preset, bool verbose) const
+{
+  ggml_type typeK, typeV;
+  kvCachePresetTypes(preset, typeK, typeV);
+
+  if (ggml_is_quantized(typeV) && !modelConfig.flashAttn)
+  {
+    if (verbose)
+      fprintf(stderr, "Error: KV cache preset %s quantizes V, which requires flashAttn\n", kvCachePresetName(preset));
+    return false;
+  }
+
+  int nEmbdHeadK, nEmbdHeadV;
+  modelHeadDims(model, nEmbdHeadK, nEmbdHeadV);
+  if (nEmbdHeadK % ggml_blck_size(typeK) != 0 || nEmbdHeadV % ggml_blck_size(typeV) != 0)
+  {
+    if (verbose)
+      fprintf(stderr, "Error: KV cache preset %s needs K and V head sizes divisible by %d and %d, the model has %d and %d\n",
+              kvCachePresetName(preset), (int)ggml_blck_size(typeK), (int)ggml_blck_size(typeV), nEmbdHeadK, nEmbdHeadV);
+    return false;
+  }
+
+  return true;
+}
+
+// Memory of a context from the model hparams, nCtx tokens per sequence in a pool of nCtx * targetConcurrency cells:
+//   - KV cache: a K and a V row per layer and cell (SWA layers are counted at full size)
+//   - compute buffer: the graph allocator reuses the tensors of a layer for the next one, so the buffer is the larger
+//     of two phases, per ubatch token:
+//       output: the f32 logits and the normed hidden state, 4 * (n_vocab + 2 n_embd)
+//       layers: ~8 n_embd of f32 activations (residual, FFN gate and up at n_ff <= 3.5 n_embd), plus the KQ mask per
+//       cell (f16 with flash attention, f32 without) and, without flash attention, the f32 KQ matrix of a layer
+//       (soft_max runs in place, 4 n_head bytes per cell)
+//     Checked against the reserved buffers (llama_get_compute_buffer_size(), printMemoryReport()): the per-cell
+//     slope is exact, the rest is within +15% (8 layer llama, n_embd 2048, nUbatch 128 - 2048, nCtx 2k - 8k)
+//   - logits: the output buffer is reserved for one token per sequence
+//   - weights: the file size, plus the copy of the output layer for the approximate LM head
+MemoryPlan LlamaWrapper::estimateMemory(int nCtx, int nUbatch, KvCachePreset preset) const
+{
+  ggml_type typeK, typeV;
+  kvCachePresetTypes(preset, typeK, typeV);
+
+  int nEmbdHeadK, nEmbdHeadV;
+  modelHeadDims(model, nEmbdHeadK, nEmbdHeadV);
+
+  const size_t nLayer = llama_model_n_layer(model);
+  const size_t nEmbd = llama_model_n_embd(model);
+  const size_t nHead = llama_model_n_head(model);
+  const size_t nEmbdKGqa = (size_t)nEmbdHeadK * llama_model_n_head_kv(model);
+  const size_t nEmbdVGqa = (size_t)nEmbdHeadV * llama_model_n_head_kv(model);
+  const size_t nVocab = llama_vocab_n_tokens(vocab);
+
+  MemoryPlan plan;
+  plan.nCtx = nCtx;
+  plan.nCells = nCtx * std::max(1, modelConfig.targetConcurrency);
+  plan.nBatch = std::min(modelConfig.nBatch, nCtx);
+  plan.nUbatch = nUbatch;
+  plan.nSeqMax = nSeqMax();
+  plan.kvCachePreset = preset;
+
+  plan.weightsBytes = llama_model_size(model);
+  if (samplingConfig.lmHeadTopM > 0)
+  {
+    plan.weightsBytes += nVocab * ggml_row_size(samplingConfig.lmHeadProxyType, nEmbd);
+  }
+
+  const size_t nCells = plan.nCells;
+  plan.kvBytes = nLayer * nCells * (ggml_row_size(typeK, nEmbdKGqa) + ggml_row_size(typeV, nEmbdVGqa));
+
+  const size_t nTokens = plan.nUbatch;
+  const size_t bytesPerCell = modelConfig.flashAttn ? 2 : 4 * (nHead + 1);
+  const size_t outputBytes = nTokens * 4 * (nVocab + 2 * nEmbd);
+  const size_t layerBytes = nTokens * (4 * 8 * nEmbd + nCells * bytesPerCell);
+  plan.computeBytes = std::max(outputBytes, layerBytes) + plan.nSeqMax * nVocab * 4;
+
+  return plan;
+}
+
+// Pick the configuration that fits memoryBudgetMiB: the KV cache precision is kept as high as possible, starting from
+// the configured preset, then the largest nUbatch (prefill speed), and nCtx is the largest multiple of 256 up to the
+// configured one. nBatch is capped at nCtx, it only sizes the token batch and the output ids (a few bytes per token)
+// and is not part of the estimate, the compute buffers grow with nUbatch
+bool LlamaWrapper::planMemory()
+{
+  const size_t budget = static_cast<size_t>(modelConfig.memoryBudgetMiB) << 20;
+  const int nCtxMax = modelConfig.nCtx;
+  const int nUbatchMax = std::min(modelConfig.nUbatch > 0 ? modelConfig.nUbatch : 512, modelConfig.nBatch);
+
+  // from the most to the least precise
+  const KvCachePreset presets[] = {KvCachePreset::F16, KvCachePreset::Q8_0, KvCachePreset::K8V4, KvCachePreset::Q4_0};
+  const KvCachePreset *first = std::find(std::begin(presets), std::end(presets), modelConfig.kvCachePreset);
+
+  MemoryPlan best;
+  for (const KvCachePreset *it = first; it != std::end(presets); ++it)
+  {
+    const KvCachePreset preset = *it;
+    if (!validateKvCachePreset(preset, false))
+      continue;
+
+    // nUbatchMax, nUbatchMax / 2, ... down to 128
+    for (int nUbatch = nUbatchMax; nUbatch > 0; nUbatch = nUbatch / 2 >= 128 ? nUbatch / 2 : 0)
+    {
+      // the KV cache and the KQ part of the compute buffer grow linearly with nCtx, the output phase of the compute
+      // buffer can be larger up to some nCtx: the first fit is a lower bound, lowered until the estimate fits
+      const size_t fixed = estimateMemory(0, nUbatch, preset).totalBytes();
+      const size_t perCell = estimateMemory(1, nUbatch, preset).totalBytes() - fixed;
+
+      if (fixed >= budget)
+        continue;
+
+      int nCtx = static_cast<int>(std::min<size_t>(nCtxMax, (budget - fixed) / perCell)) / 256 * 256;
+      while (nCtx > 0 && estimateMemory(nCtx, std::min(nUbatch, nCtx), preset).totalBytes() > budget)
+        nCtx -= 256;
+      if (nCtx > best.nCtx)
+        best = estimateMemory(nCtx, std::min(nUbatch, nCtx), preset);
+
+      if (nCtx >= nCtxMax / 256 * 256)
+        break;
+    }
+
+    if (best.nCtx >= nCtxMax / 256 * 256)
+      break;
+  }
+
+  if (best.nCtx < 256)
+  {
+    fprintf(stderr, "Error: a memory budget of %d MiB does not hold the model (%.0f MiB) and a context\n",
+            modelConfig.memoryBudgetMiB, estimateMemory(0, 0, KvCachePreset::F16).weightsBytes / 1048576.0);
+    return false;
+  }
+
+  if (best.nCtx < nCtxMax / 256 * 256)
+  {
+    fprintf(stderr, "Warning: the memory budget of %d MiB holds %d of the %d context tokens\n",
+            modelConfig.memoryBudgetMiB, best.nCtx, nCtxMax);
+  }
+
+  if (best.kvCachePreset != modelConfig.kvCachePreset)
+  {
+    fprintf(stderr, "Warning: the memory budget replaces the KV cache preset %s with %s\n",
+            kvCachePresetName(modelConfig.kvCachePreset), kvCachePresetName(best.kvCachePreset));
+  }
+
+  modelConfig.nCtx = best.nCtx;
+  modelConfig.nBatch = best.nBatch;
+  modelConfig.nUbatch = best.nUbatch;
+  modelConfig.kvCachePreset = best.kvCachePreset;
+  memoryPlan = best;
+
+  fprintf(stderr, "Memory plan: nCtx %d (%d cells), nBatch %d, nUbatch %d, %d sequences, KV cache %s, estimated %.0f of %d MiB\n",
+          best.nCtx, best.nCells, best.nBatch, best.nUbatch, best.nSeqMax, kvCachePresetName(best.kvCachePreset),
+          best.totalBytes() / 1048576.0, modelConfig.memoryBudgetMiB);
+
+  return true;
+}
+
+void LlamaWrapper::printMemoryReport() const
+{
+  if (!ctx)
+    return;
+
+  // the configuration in use, as planned or as configured
+  const MemoryPlan plan = estimateMemory(modelConfig.nCtx, llama_n_ubatch(ctx), modelConfig.kvCachePreset);
+
+  fprintf(stderr, "Memory (MiB):  weights %.0f + KV cache %.0f + compute %.0f = %.0f estimated\n",
+          plan.weightsBytes / 1048576.0, plan.kvBytes / 1048576.0, plan.computeBytes / 1048576.0,
+          plan.totalBytes() / 1048576.0);
+  fprintf(stderr, "               compute buffers reserved %.0f (without the logits)\n",
+          llama_get_compute_buffer_size(ctx) / 1048576.0);
+
+  size_t anon, file;
+  if (!readRss(anon, file))
+  {
+    fprintf(stderr, "               RSS not available\n");
+    return;
+  }
+
+  // repacked weights are a copy of the mapped ones, the pages read from the file stay resident until reclaimed
+  fprintf(stderr, "               RSS since initialize: anonymous +%.0f, file-backed +%.0f\n",
+          (anon - std::min(anon, rssAnonBeforeInit)) / 1048576.0, (file - std::min(file, rssFileBeforeInit)) / 1048576.0);
+}
+
+// What the prefill speed depends on: the machine, the model and the attention configuration
+std::string LlamaWrapper::ubatchTuneKey() const
+{
+  char desc[128];
+  llama_model_desc(model, desc, sizeof(desc));
+
+  std::ostringstream key;
+  key << hostName() << '|' << std::thread::hardware_concurrency() << '|' << modelConfig.modelPath << '|' << desc << '|'
+      << llama_model_size(model) << '|' << (modelConfig.flashAttn ? "fa" : "nofa") << '|'
+      << kvCachePresetName(modelConfig.kvCachePreset);
+  return key.str();
+}
+
+// Set nUbatch to the fastest candidate for prompt processing, or keep the default when the difference is within the
+// noise of the measurement. The cache file has a "<nUbatch>\t<key>" line per setup
+bool LlamaWrapper::tuneUbatchSize()
+{
+  const std::string key = ubatchTuneKey();
+  const std::string &cachePath = modelConfig.ubatchTuneCachePath;
+  const size_t budget = static_cast<size_t>(modelConfig.memoryBudgetMiB) << 20;
+
+  std::vector<std::string> cacheLines;
+  if (!cachePath.empty())
+  {
+    std::ifstream cache(cachePath);
+    std::string line;
+    while (std::getline(cache, line))
+    {
+      const size_t tab = line.find('\t');
+      if (tab == std::string::npos)
+        continue;
+
+      const int nUbatch = atoi(line.c_str());
+      if (line.compare(tab + 1, std::string::npos, key) == 0 && nUbatch > 0 &&
+          (budget == 0 || estimateMemory(modelConfig.nCtx, nUbatch, modelConfig.kvCachePreset).totalBytes() <= budget))
+      {
+        modelConfig.nUbatch = std::min({nUbatch, modelConfig.nBatch, modelConfig.nCtx});
+        fprintf(stderr, "nUbatch %d (tuned, from %s)\n", modelConfig.nUbatch, cachePath.c_str());
+        return true;
+      }
+
+      if (line.compare(tab + 1, std::string::npos, key) != 0)
+        cacheLines.push_back(line);
+    }
+  }
+
+  // the size llama.cpp would use without tuning, it is only replaced by a clearly faster one
+  const int nUbatchDefault = std::min({modelConfig.nUbatch > 0 ? modelConfig.nUbatch : 512, modelConfig.nBatch, modelConfig.nCtx});
+
+  std::vector<int> candidates;
+  for (int nUbatch = 128; nUbatch <= 2048; nUbatch *= 2)
+  {
+    if (nUbatch > modelConfig.nBatch || nUbatch > modelConfig.nCtx)
+      break;
+    if (budget > 0 && estimateMemory(modelConfig.nCtx, nUbatch, modelConfig.kvCachePreset).totalBytes() > budget)
+      break;
+    candidates.push_back(nUbatch);
+  }
+  if (std::find(candidates.begin(), candidates.end(), nUbatchDefault) == candidates.end())
+  {
+    candidates.insert(std::upper_bound(candidates.begin(), candidates.end(), nUbatchDefault), nUbatchDefault);
+  }
+
+  if (candidates.size() < 2)
+    return true;
+
+  // the same prompt for every candidate, at least one ubatch of the largest
+  const int nPrefill = std::min(modelConfig.nCtx, std::max(512, candidates.back()));
+  const int nVocab = llama_vocab_n_tokens(vocab);
+  const int nRuns = 3;
+
+  llama_batch batch = llama_batch_init(nPrefill, 0, 1);
+  for (int i = 0; i < nPrefill; ++i)
+  {
+    batch.token[i] = (llama_token)((i * 7919 + 13) % nVocab);
+    batch.pos[i] = i;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = 0;
+    batch.logits[i] = i == nPrefill - 1;
+  }
+
+  fprintf(stderr, "\nTuning nUbatch, prefill of %d tokens, median of %d runs:\n", nPrefill, nRuns);
+
+  // median and spread (fastest - slowest run) of every candidate that could be measured
+  struct Result
+  {
+    int nUbatch;
+    double median;
+    double spread;
+  };
+  std::vector<Result> results;
+
+  bool warm = false;
+  for (int nUbatch : candidates)
+  {
+    llama_context_params params = makeContextParams(modelConfig.kvCachePreset);
+    params.n_ctx = nPrefill;
+    params.n_batch = nPrefill;
+    params.n_ubatch = nUbatch;
+
+    llama_context *evalCtx = llama_init_from_model(model, params);
+    if (!evalCtx)
+    {
+      fprintf(stderr, "  nUbatch %4d  failed to create a context\n", nUbatch);
+      continue;
+    }
+
+    // the first decode pages in the weights
+    if (!warm)
+    {
+      batch.n_tokens = std::min(nUbatch, nPrefill);
+      llama_decode(evalCtx, batch);
+      warm = true;
+    }
+
+    std::vector<double> speeds;
+    batch.n_tokens = nPrefill;
+    for (int run = 0; run < nRuns; ++run)
+    {
+      llama_memory_clear(llama_get_memory(evalCtx), true);
+
+      const auto start = std::chrono::steady_clock::now();
+      const int ret = llama_decode(evalCtx, batch);
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (ret != 0)
+        break;
+
+      speeds.push_back(nPrefill / seconds);
+    }
+    llama_free(evalCtx);
 
-// Get current message history
-const std::vector<llama_chat_message> &LlamaWrapper::getMessageHistory() const
-{
-  return messageHistory;
-}
+    if ((int)speeds.size() < nRuns)
+    {
+      fprintf(stderr, "  nUbatch %4d  failed to decode\n", nUbatch);
+      continue;
+    }
 
-// Clear message history (keeps system message)
-void LlamaWrapper::clearHistory()
-{
-  for (size_t i = 1; i < messageHistory.size(); ++i)
-  {
-    free(const_cast<char *>(messageHistory[i].content));
+    std::sort(speeds.begin(), speeds.end());
+    results.push_back({nUbatch, speeds[nRuns / 2], speeds.back() - speeds.front()});
+    fprintf(stderr, "  nUbatch %4d  %8.1f tok/s  (%.1f - %.1f)\n", nUbatch, speeds[nRuns / 2], speeds.front(), speeds.back());
   }
 
-  if (!messageHistory.empty())
+  llama_batch_free(batch);
+
+  if (results.empty())
   {
-    messageHistory.resize(1);
+    fprintf(stderr, "Error: no nUbatch candidate could be benchmarked\n");
+    return false;
   }
-}
-
-// Print CUDA availability status
-void LlamaWrapper::printCudaStatus()
-{
-#ifdef GGML_USE_CUBLAS
-  std::cout << "CUDA is ENABLED (GGML_USE_CUBLAS)." << std::endl;
-#elif defined(LLAMA_USE_CUDA)
-  std::cout << "CUDA is ENABLED (LLAMA_USE_CUDA)." << std::endl;
-#else
-  std::cout << "CUDA is DISABLED." << std::endl;
-#endif
-}
 
-// Initialize logging to only show errors
-bool LlamaWrapper::initializeLogging()
-{
-  llama_log_set([](enum ggml_log_level level, const char *text, void * /* user_data */)
-                {
-        if (level >= GGML_LOG_LEVEL_ERROR) {
-            fprintf(stderr, "%s", text);
-        } }, nullptr);
-  return true;
-}
+  const Result &fastest = *std::max_element(results.begin(), results.end(), [](const Result &a, const Result &b)
+                                            { return a.median < b.median; });
+  const auto standard = std::find_if(results.begin(), results.end(), [nUbatchDefault](const Result &r)
+                                     { return r.nUbatch == nUbatchDefault; });
 
-// Load all available backends
-bool LlamaWrapper::loadBackends()
-{
-  ggml_backend_load_all();
-  return true;
-}
+  // a gain within the run-to-run spread of either size is noise, the default is kept then
+  int best = fastest.nUbatch;
+  if (standard != results.end() && fastest.nUbatch != nUbatchDefault &&
+      fastest.median - standard->median <= std::max(fastest.spread, standard->spread))
+  {
+    best = nUbatchDefault;
+  }
 
-// Load the model from file
-bool LlamaWrapper::loadModel()
-{
-  llama_model_params modelParams = llama_model_default_params();
-  modelParams.n_gpu_layers = modelConfig.nGpuLayers;
+  modelConfig.nUbatch = best;
+  fprintf(stderr, "nUbatch %d%s\n", best, best == nUbatchDefault ? " (default, no candidate is faster beyond the spread)" : "");
 
-  model = llama_model_load_from_file(modelConfig.modelPath.c_str(), modelParams);
-  if (!model)
+  if (!cachePath.empty())
   {
-    fprintf(stderr, "Error: unable to load model from %s\n", modelConfig.modelPath.c_str());
-    return false;
+    // a directory that cannot be created shows up as the write failing
+    std::error_code ec;
+    const std::filesystem::path cacheDir = std::filesystem::path(cachePath).parent_path();
+    if (!cacheDir.empty())
+      std::filesystem::create_directories(cacheDir, ec);
+
+    std::ofstream cache(cachePath, std::ios::trunc);
+    for (const auto &line : cacheLines)
+      cache << line << '\n';
+    cache << best << '\t' << key << '\n';
+    if (!cache)
+      fprintf(stderr, "Warning: could not write %s\n", cachePath.c_str());
   }
 
-  vocab = llama_model_get_vocab(model);
   return true;
 }
 
-// Create inference context
-bool LlamaWrapper::createContext()
+llama_context_params LlamaWrapper::makeContextParams(KvCachePreset preset) const
 {
   llama_context_params ctxParams = llama_context_default_params();
-  ctxParams.n_ctx = modelConfig.nCtx;
+  ctxParams.n_ctx = modelConfig.nCtx * std::max(1, modelConfig.targetConcurrency);
   ctxParams.n_batch = modelConfig.nBatch;
-
-  ctx = llama_init_from_model(model, ctxParams);
-  if (!ctx)
+  if (modelConfig.nUbatch > 0)
   {
-    fprintf(stderr, "Error: failed to create llama_context\n");
-    return false;
+    ctxParams.n_ubatch = modelConfig.nUbatch;
   }
+  ctxParams.flash_attn = modelConfig.flashAttn;
+  kvCachePresetTypes(preset, ctxParams.type_k, ctxParams.type_v);
+  ctxParams.lm_head_top_m = samplingConfig.lmHeadTopM;
+  ctxParams.lm_head_check_interval = samplingConfig.lmHeadCheckInterval;
+  // the sequences share one pool of cells
+  ctxParams.n_seq_max = nSeqMax();
+  ctxParams.kv_unified = true;
+  return ctxParams;
+}
 
-  // Initialize formatted buffer
-  formattedBuffer.resize(llama_n_ctx(ctx));
-  return true;
+// A sequence per branch, and at least one per conversation of targetConcurrency
+int LlamaWrapper::nSeqMax() const
+{
+  return std::max({1, modelConfig.maxBranches, modelConfig.targetConcurrency});
 }
 
 // Setup the sampling chain
@@ -217,13 +1169,8 @@ bool LlamaWrapper::setupSampler()
 {
   sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
 
-  // Add samplers in order (order matters!)
-  llama_sampler_chain_add(sampler, llama_sampler_init_penalties(
-                                       samplingConfig.repetitionPenaltyLastN,
-                                       samplingConfig.repetitionPenalty,
-                                       0.0f, // frequency penalty disabled
-                                       0.0f  // presence penalty disabled
-                                       ));
+  // Add samplers in order (order matters!), the penalties first (see restoreSamplerWindow())
+  llama_sampler_chain_add(sampler, makePenaltySampler());
 
   llama_sampler_chain_add(sampler, llama_sampler_init_top_k(samplingConfig.topK));
   llama_sampler_chain_add(sampler, llama_sampler_init_top_p(samplingConfig.topP, 1));
@@ -234,6 +1181,36 @@ bool LlamaWrapper::setupSampler()
   return true;
 }
 
+llama_sampler *LlamaWrapper::makePenaltySampler() const
+{
+  return llama_sampler_init_penalties(samplingConfig.repetitionPenaltyLastN,
+                                      samplingConfig.repetitionPenalty,
+                                      0.0f, // frequency penalty disabled
+                                      0.0f  // presence penalty disabled
+  );
+}
+
+// Rebuild the repetition penalty window of the sampler from recentTokens, after a rollback or a branch switch
+// the other samplers keep their state, so the RNG moves on and a regenerated response differs from the last one
+void LlamaWrapper::restoreSamplerWindow()
+{
+  llama_sampler *penalties = makePenaltySampler();
+  for (llama_token token : recentTokens)
+  {
+    llama_sampler_accept(penalties, token);
+  }
+
+  llama_sampler *restored = llama_sampler_chain_init(llama_sampler_chain_default_params());
+  llama_sampler_chain_add(restored, penalties);
+  for (int i = 1; i < llama_sampler_chain_n(sampler); ++i)
+  {
+    llama_sampler_chain_add(restored, llama_sampler_clone(llama_sampler_chain_get(sampler, i)));
+  }
+
+  llama_sampler_free(sampler);
+  sampler = restored;
+}
+
 // Setup initial system message
 bool LlamaWrapper::setupSystemMessage(const std::string &systemMessagePath)
 {
@@ -260,27 +1237,31 @@ bool LlamaWrapper::setupSystemMessage(const std::string &systemMessagePath)
                                    "5. Maintain a professional, intelligent, analytical tone.\n";
     }
 
-  messageHistory.push_back({"system", strdup(systemMessage.c_str())});
-
   writeToLog("system", systemMessage);
 
+  messageHistory.push("system", std::move(systemMessage));
+
+  // nothing is decoded before the first user message
+  formattedLength = 0;
+  pushCheckpoint();
+
   return true;
 }
 
 // Build prompt from current message history
-std::string LlamaWrapper::buildPromptFromHistory()
+std::string LlamaWrapper::buildPromptFromHistory(bool addAssistant)
 {
   const char *tmpl = llama_model_chat_template(model, nullptr);
 
-  int newLen = llama_chat_apply_template(tmpl, messageHistory.data(),
-                                         messageHistory.size(), true,
+  int newLen = llama_chat_apply_template(tmpl, messageHistory.views().data(),
+                                         messageHistory.size(), addAssistant,
                                          formattedBuffer.data(), formattedBuffer.size());
 
   if (newLen > static_cast<int>(formattedBuffer.size()))
   {
     formattedBuffer.resize(newLen);
-    newLen = llama_chat_apply_template(tmpl, messageHistory.data(),
-                                       messageHistory.size(), true,
+    newLen = llama_chat_apply_template(tmpl, messageHistory.views().data(),
+                                       messageHistory.size(), addAssistant,
                                        formattedBuffer.data(), formattedBuffer.size());
   }
 
@@ -293,51 +1274,69 @@ std::string LlamaWrapper::buildPromptFromHistory()
   return std::string(formattedBuffer.begin(), formattedBuffer.begin() + newLen);
 }
 
-// Core generation function
-std::string LlamaWrapper::generateResponse(const std::string &prompt)
+// Core generation function, false if it stopped before the end of generation token
+bool LlamaWrapper::generateResponse(const std::string &prompt, std::string &response)
 {
-  std::string response;
+  const llama_seq_id seqId = branches[activeBranch].seqId;
 
   // Determine if this is the first input
-  const bool isFirst = llama_memory_seq_pos_max(llama_get_memory(ctx), 0) == -1;
+  const bool isFirst = llama_memory_seq_pos_max(llama_get_memory(ctx), seqId) == -1;
 
   // Tokenize prompt
   const int nPromptTokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(),
                                             nullptr, 0, isFirst, true);
+  if (nPromptTokens <= 0)
+  {
+    fprintf(stderr, "Error: failed to tokenize the prompt\n");
+    return false;
+  }
+
   std::vector<llama_token> promptTokens(nPromptTokens);
 
   if (llama_tokenize(vocab, prompt.c_str(), prompt.size(),
                      promptTokens.data(), promptTokens.size(), isFirst, true) < 0)
   {
-    GGML_ABORT("Failed to tokenize prompt\n");
+    fprintf(stderr, "Error: failed to tokenize the prompt\n");
+    return false;
   }
 
-  // Create batch and generate tokens
-  llama_batch batch = llama_batch_get_one(promptTokens.data(), promptTokens.size());
+  // Decode the prompt, then one token at a time
+  const llama_token *batchTokens = promptTokens.data();
+  int nBatchTokens = promptTokens.size();
   llama_token newTokenId;
+  bool complete = true;
 
   while (true)
   {
-    // Check context space
-    int nCtx = llama_n_ctx(ctx);
-    int nCtxUsed = llama_memory_seq_pos_max(llama_get_memory(ctx), 0) + 1;
+    // Tokens that must keep exact logits with the approximate output layer
+    if (samplingConfig.lmHeadTopM > 0)
+    {
+      llama_set_lm_head_candidates(ctx, recentTokens.data(), recentTokens.size());
+    }
+
+    // Check context space, with KV eviction the decode makes room for the batch next to the sinks and heavy hitters
+    int nCtx = modelConfig.nCtx;
+    int nCtxUsed = modelConfig.kvEvictWindow > 0 ? modelConfig.kvEvictSink + modelConfig.kvEvictHeavy
+                                                 : llama_memory_seq_pos_max(llama_get_memory(ctx), seqId) + 1;
 
-    if (nCtxUsed + batch.n_tokens > nCtx)
+    if (nCtxUsed + nBatchTokens > nCtx)
     {
       printf("\033[0m\n");
       fprintf(stderr, "Context size exceeded\n");
+      complete = false;
       break;
     }
 
     // Run forward pass
-    int ret = llama_decode(ctx, batch);
-    if (ret != 0)
+    if (!decodeTokens(batchTokens, nBatchTokens))
     {
-      GGML_ABORT("Failed to decode, ret = %d\n", ret);
+      complete = false;
+      break;
     }
 
     // Sample next token
     newTokenId = llama_sampler_sample(sampler, ctx, -1);
+    trackSampledToken(newTokenId);
 
     // Check for end of generation
     if (llama_vocab_is_eog(vocab, newTokenId))
@@ -345,35 +1344,408 @@ std::string LlamaWrapper::generateResponse(const std::string &prompt)
       break;
     }
 
-    // Convert token to text
-    char buf[256];
-    int n = llama_token_to_piece(vocab, newTokenId, buf, sizeof(buf), 0, true);
+    // Convert token to text, a negative result is the size the piece needs
+    std::string piece(256, '\0');
+    int n = llama_token_to_piece(vocab, newTokenId, piece.data(), piece.size(), 0, true);
     if (n < 0)
     {
-      GGML_ABORT("Failed to convert token to piece\n");
+      piece.resize(-n);
+      n = llama_token_to_piece(vocab, newTokenId, piece.data(), piece.size(), 0, true);
+    }
+    if (n < 0)
+    {
+      printf("\033[0m\n");
+      fprintf(stderr, "Error: failed to convert token %d to text\n", newTokenId);
+      complete = false;
+      break;
     }
 
-    std::string piece(buf, n);
+    piece.resize(n);
     printf("%s", piece.c_str());
     fflush(stdout);
     response += piece;
 
     // Prepare next iteration
-    batch = llama_batch_get_one(&newTokenId, 1);
+    batchTokens = &newTokenId;
+    nBatchTokens = 1;
   }
 
-  return response;
+  return complete;
+}
+
+// Decode tokens at the end of the active branch in chunks of nBatch, only the last one gets logits
+bool LlamaWrapper::decodeTokens(const llama_token *tokens, int nTokens)
+{
+  const llama_seq_id seqId = branches[activeBranch].seqId;
+  const int nBatchMax = llama_n_batch(ctx);
+
+  for (int i0 = 0; i0 < nTokens; i0 += nBatchMax)
+  {
+    const llama_pos pos0 = llama_memory_seq_pos_max(llama_get_memory(ctx), seqId) + 1;
+
+    tokenBatch.n_tokens = std::min(nBatchMax, nTokens - i0);
+    for (int i = 0; i < tokenBatch.n_tokens; ++i)
+    {
+      tokenBatch.token[i] = tokens[i0 + i];
+      tokenBatch.pos[i] = pos0 + i;
+      tokenBatch.n_seq_id[i] = 1;
+      tokenBatch.seq_id[i][0] = seqId;
+      tokenBatch.logits[i] = i0 + i == nTokens - 1;
+    }
+
+    int ret = llama_decode(ctx, tokenBatch);
+    if (ret == 1)
+    {
+      printf("\033[0m\n");
+      fprintf(stderr, "KV cache is full, free the cells of a branch with /drop <index> (see /branches)\n");
+      return false;
+    }
+    if (ret != 0)
+    {
+      printf("\033[0m\n");
+      fprintf(stderr, "Error: failed to decode, ret = %d\n", ret);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Keep the window of the repetition penalty, the penalty sampler sees every sampled token
+void LlamaWrapper::trackSampledToken(llama_token token)
+{
+  // a negative window is empty, as in llama_sampler_init_penalties
+  const int lastN = std::max(0, samplingConfig.repetitionPenaltyLastN);
+
+  recentTokens.push_back(token);
+  if ((int)recentTokens.size() > lastN)
+  {
+    recentTokens.erase(recentTokens.begin(), recentTokens.end() - lastN);
+  }
+}
+
+// Divergence of the approximate output layer from the exact logits
+void LlamaWrapper::printLmHeadReport() const
+{
+  if (!isInitialized || samplingConfig.lmHeadTopM <= 0 || samplingConfig.lmHeadCheckInterval <= 0)
+  {
+    std::cerr << "Error: the lm_head report needs lmHeadTopM and lmHeadCheckInterval set before initialize()\n";
+    return;
+  }
+
+  const llama_lm_head_stats stats = llama_get_lm_head_stats(ctx);
+  if (stats.n_checked == 0)
+  {
+    std::cerr << "lm_head: no token checked against the exact logits yet\n";
+    return;
+  }
+
+  fprintf(stderr, "lm_head top-%d: %d tokens, %d checked, top-1 match %.1f%%, top-64 recall %.3f, KL %.5f, max logit error %.3f\n",
+          samplingConfig.lmHeadTopM, stats.n_approx, stats.n_checked, 100.0 * stats.n_top1 / stats.n_checked,
+          stats.recall, stats.kl, stats.max_err);
+}
+
+// The first nTokens tokens of a text file, for the perplexity reports
+bool LlamaWrapper::tokenizeTextFile(const std::string &textPath, int nTokens, std::vector<llama_token> &tokens)
+{
+  std::string text = readFileContents(textPath);
+  if (text.empty())
+  {
+    return false;
+  }
+
+  const int nText = -llama_tokenize(vocab, text.c_str(), text.size(), nullptr, 0, true, false);
+  tokens.resize(nText);
+  if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false) < 0)
+  {
+    fprintf(stderr, "Failed to tokenize %s\n", textPath.c_str());
+    return false;
+  }
+  tokens.resize(std::min<size_t>(tokens.size(), nTokens));
+  return true;
+}
+
+// Negative log-likelihood of the next token under the softmax of the logits
+static double tokenNll(const float *logits, int nVocab, llama_token next)
+{
+  const float maxLogit = *std::max_element(logits, logits + nVocab);
+  double sum = 0.0;
+  for (int i = 0; i < nVocab; ++i)
+  {
+    sum += std::exp(logits[i] - maxLogit);
+  }
+  return std::log(sum) + maxLogit - logits[next];
+}
+
+// Perplexity and generation speed of every KV cache preset on the same text, relative to f16
+void LlamaWrapper::printKvCacheReport(const std::string &textPath, int nTokens)
+{
+  if (!isInitialized)
+  {
+    std::cerr << "Error: Must call initialize() first\n";
+    return;
+  }
+
+  std::vector<llama_token> tokens;
+  if (!tokenizeTextFile(textPath, nTokens, tokens))
+  {
+    return;
+  }
+  if (tokens.size() < 2)
+  {
+    fprintf(stderr, "Error: %s is too short for a perplexity measurement\n", textPath.c_str());
+    return;
+  }
+
+  const int nGen = 64;
+  const int nVocab = llama_vocab_n_tokens(vocab);
+  const int nLayer = llama_model_n_layer(model);
+  int nEmbdHeadK, nEmbdHeadV;
+  modelHeadDims(model, nEmbdHeadK, nEmbdHeadV);
+  const int nHeadKv = llama_model_n_head_kv(model);
+
+  auto argmax = [nVocab](const float *logits)
+  {
+    return (llama_token)(std::max_element(logits, logits + nVocab) - logits);
+  };
+
+  fprintf(stderr, "\nKV cache presets, %zu tokens of %s, tg after the text:\n", tokens.size(), textPath.c_str());
+  fprintf(stderr, "  preset  KV MiB @ nCtx  perplexity     delta  tg tok/s\n");
+
+  double basePpl = 0.0;
+  for (KvCachePreset preset : {KvCachePreset::F16, KvCachePreset::Q8_0, KvCachePreset::Q4_0, KvCachePreset::K8V4})
+  {
+    if (!validateKvCachePreset(preset))
+      continue;
+
+    // exact logits for every position, the text is decoded as one batch
+    llama_context_params params = makeContextParams(preset);
+    params.n_ctx = tokens.size() + nGen;
+    params.n_batch = tokens.size();
+    params.lm_head_top_m = 0;
+
+    llama_context *evalCtx = llama_init_from_model(model, params);
+    if (!evalCtx)
+    {
+      fprintf(stderr, "  %-6s  failed to create a context\n", kvCachePresetName(preset));
+      continue;
+    }
+
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+      batch.token[i] = tokens[i];
+      batch.pos[i] = i;
+      batch.n_seq_id[i] = 1;
+      batch.seq_id[i][0] = 0;
+      batch.logits[i] = true;
+    }
+    batch.n_tokens = tokens.size();
+
+    if (llama_decode(evalCtx, batch) != 0)
+    {
+      fprintf(stderr, "  %-6s  failed to decode\n", kvCachePresetName(preset));
+      llama_batch_free(batch);
+      llama_free(evalCtx);
+      continue;
+    }
+
+    double nll = 0.0;
+    for (size_t i = 0; i + 1 < tokens.size(); ++i)
+    {
+      nll += tokenNll(llama_get_logits_ith(evalCtx, i), nVocab, tokens[i + 1]);
+    }
+    const double ppl = std::exp(nll / (tokens.size() - 1));
+    if (preset == KvCachePreset::F16)
+    {
+      basePpl = ppl;
+    }
+
+    // greedy continuation, one token per decode as in chat
+    llama_token token = argmax(llama_get_logits_ith(evalCtx, -1));
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nGen; ++i)
+    {
+      if (llama_decode(evalCtx, llama_batch_get_one(&token, 1)) != 0)
+        break;
+      token = argmax(llama_get_logits_ith(evalCtx, -1));
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ggml_type typeK, typeV;
+    kvCachePresetTypes(preset, typeK, typeV);
+    const double kvMiB = (double)nLayer * modelConfig.nCtx * (ggml_row_size(typeK, nEmbdHeadK * nHeadKv) + ggml_row_size(typeV, nEmbdHeadV * nHeadKv)) / (1024.0 * 1024.0);
+
+    if (basePpl > 0.0)
+    {
+      fprintf(stderr, "  %-6s  %13.1f  %10.4f  %+7.3f%%  %8.2f\n", kvCachePresetName(preset), kvMiB, ppl,
+              100.0 * (ppl - basePpl) / basePpl, nGen / seconds);
+    }
+    else
+    {
+      fprintf(stderr, "  %-6s  %13.1f  %10.4f  %8s  %8.2f\n", kvCachePresetName(preset), kvMiB, ppl, "-", nGen / seconds);
+    }
+
+    llama_batch_free(batch);
+    llama_free(evalCtx);
+  }
+}
+
+// Perplexity of the KV eviction policies on a text longer than their budget, relative to the full context
+void LlamaWrapper::printKvEvictReport(const std::string &textPath, int nTokens, int nWindow, int nSink, int nHeavy)
+{
+  if (!isInitialized)
+  {
+    std::cerr << "Error: Must call initialize() first\n";
+    return;
+  }
+
+  std::vector<llama_token> tokens;
+  if (!tokenizeTextFile(textPath, nTokens, tokens))
+  {
+    return;
+  }
+  if ((int)tokens.size() <= nSink + nHeavy + nWindow)
+  {
+    fprintf(stderr, "Error: %s is too short to evict anything from a budget of %d tokens\n", textPath.c_str(), nSink + nHeavy + nWindow);
+    return;
+  }
+
+  const int nChunk = 32;
+  const int nVocab = llama_vocab_n_tokens(vocab);
+
+  struct Policy
+  {
+    const char *name;
+    llama_kv_evict_type type;
+    int nSink;
+    int nWindow;
+    int nHeavy;
+  };
+
+  // the heavy hitters are compared with a sink + window policy of the same number of cells
+  const Policy policies[] = {
+      {"full context", LLAMA_KV_EVICT_NONE, 0, 0, 0},
+      {"window", LLAMA_KV_EVICT_STREAMING, 0, nWindow, 0},
+      {"sink + window", LLAMA_KV_EVICT_STREAMING, nSink, nWindow, 0},
+      {"sink + wider window", LLAMA_KV_EVICT_STREAMING, nSink, nWindow + nHeavy, 0},
+      {"sink + heavy + window", LLAMA_KV_EVICT_HEAVY, nSink, nWindow, nHeavy},
+  };
+
+  fprintf(stderr, "\nKV eviction, %zu tokens of %s in chunks of %d:\n", tokens.size(), textPath.c_str(), nChunk);
+  fprintf(stderr, "  policy                  KV cells  evicted  perplexity     delta\n");
+
+  double basePpl = 0.0;
+  for (const Policy &policy : policies)
+  {
+    const bool evict = policy.type != LLAMA_KV_EVICT_NONE;
+    const int nCells = evict ? policy.nSink + policy.nHeavy + policy.nWindow : (int)tokens.size();
+
+    // the attention scores of the heavy hitters need the non flash attention path and an f16 cache
+    llama_context_params params = makeContextParams(KvCachePreset::F16);
+    params.n_ctx = nCells + nChunk;
+    params.n_batch = nChunk;
+    params.flash_attn = false;
+    params.lm_head_top_m = 0;
+
+    llama_context *evalCtx = llama_init_from_model(model, params);
+    if (!evalCtx)
+    {
+      fprintf(stderr, "  %-22s  failed to create a context\n", policy.name);
+      continue;
+    }
+
+    if (evict)
+    {
+      llama_kv_evict_params evictParams = llama_kv_evict_default_params();
+      evictParams.type = policy.type;
+      evictParams.n_sink = policy.nSink;
+      evictParams.n_window = policy.nWindow;
+      evictParams.n_heavy = policy.nHeavy;
+
+      if (!llama_set_kv_evict(evalCtx, 0, evictParams))
+      {
+        fprintf(stderr, "  %-22s  not supported by this model\n", policy.name);
+        llama_free(evalCtx);
+        continue;
+      }
+    }
+
+    // every position is scored by the logits of the chunk that decodes it, after the evictions so far
+    llama_batch batch = llama_batch_init(nChunk, 0, 1);
+    double nll = 0.0;
+    size_t nScored = 0;
+    bool failed = false;
+
+    for (size_t i0 = 0; i0 < tokens.size() && !failed; i0 += nChunk)
+    {
+      const llama_pos pos0 = llama_memory_seq_pos_max(llama_get_memory(evalCtx), 0) + 1;
+
+      batch.n_tokens = std::min<size_t>(nChunk, tokens.size() - i0);
+      for (int j = 0; j < batch.n_tokens; ++j)
+      {
+        batch.token[j] = tokens[i0 + j];
+        batch.pos[j] = pos0 + j;
+        batch.n_seq_id[j] = 1;
+        batch.seq_id[j][0] = 0;
+        batch.logits[j] = true;
+      }
+
+      if (llama_decode(evalCtx, batch) != 0)
+      {
+        failed = true;
+        break;
+      }
+
+      for (int j = 0; j < batch.n_tokens && i0 + j + 1 < tokens.size(); ++j)
+      {
+        nll += tokenNll(llama_get_logits_ith(evalCtx, j), nVocab, tokens[i0 + j + 1]);
+        nScored++;
+      }
+    }
+
+    if (failed)
+    {
+      fprintf(stderr, "  %-22s  failed to decode\n", policy.name);
+    }
+    else
+    {
+      const double ppl = std::exp(nll / nScored);
+      const int nEvicted = llama_get_kv_evict_n_evicted(evalCtx, 0);
+
+      if (!evict)
+      {
+        basePpl = ppl;
+        fprintf(stderr, "  %-22s  %8d  %7d  %10.4f  %8s\n", policy.name, nCells, nEvicted, ppl, "-");
+      }
+      else if (basePpl > 0.0)
+      {
+        fprintf(stderr, "  %-22s  %8d  %7d  %10.4f  %+7.3f%%\n", policy.name, nCells, nEvicted, ppl, 100.0 * (ppl - basePpl) / basePpl);
+      }
+      else
+      {
+        fprintf(stderr, "  %-22s  %8d  %7d  %10.4f  %8s\n", policy.name, nCells, nEvicted, ppl, "-");
+      }
+    }
+
+    llama_batch_free(batch);
+    llama_free(evalCtx);
+  }
 }
 
 // Cleanup all allocated resources
 void LlamaWrapper::cleanup()
 {
   // Free message history
-  for (auto &msg : messageHistory)
+  messageHistory.clear();
+  branches.clear();
+  checkpoints.clear();
+
+  if (tokenBatch.token)
   {
-    free(const_cast<char *>(msg.content));
+    llama_batch_free(tokenBatch);
+    tokenBatch = {};
   }
-  messageHistory.clear();
 
   // Free llama.cpp resources in reverse order
   if (sampler)
@@ -412,9 +1784,27 @@ std::string LlamaWrapper::readFileContents(const std::string &filePath)
     return "";
   }
 
-  std::stringstream buffer;
-  buffer << file.rdbuf();
-  return buffer.str();
+  // read straight into the string that becomes the message
+  file.seekg(0, std::ios::end);
+  const std::streamoff size = file.tellg();
+  if (size <= 0)
+  {
+    // no size to read up front (pipes, /dev/stdin, /proc files), stream it
+    file.clear();
+    file.seekg(0, std::ios::beg);
+    file.clear();
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+  }
+
+  std::string content;
+  content.resize(static_cast<size_t>(size));
+  file.seekg(0, std::ios::beg);
+  file.read(&content[0], content.size());
+  content.resize(static_cast<size_t>(file.gcount()));
+  return content;
 }
 
 // Load file as first user message without generating response
@@ -432,10 +1822,10 @@ bool LlamaWrapper::loadFileAsFirstMessage(const std::string &filePath)
     return false;
   }
 
-  messageHistory.push_back({"user", strdup(fileContent.c_str())});
-
   writeToLog("user", fileContent);
 
+  messageHistory.push("user", std::move(fileContent));
+
   return true;
 }
 
@@ -455,27 +1845,11 @@ std::string LlamaWrapper::loadFileAsFirstMessageWithResponse(const std::string &
   }
 
   // Add the file content as first user message
-  messageHistory.push_back({"user", strdup(fileContent.c_str())});
-
   writeToLog("user", fileContent);
 
-  // Build prompt and generate response
-  std::string prompt = buildPromptFromHistory();
-  if (prompt.empty())
-  {
-    return "";
-  }
-
-  printf("\033[33m");
-  std::string response = generateResponse(prompt);
-  printf("\n\033[0m");
-
-  // Add response to history
-  messageHistory.push_back({"assistant", strdup(response.c_str())});
-
-  writeToLog("assistant", response);
+  messageHistory.push("user", std::move(fileContent));
 
-  return response;
+  return respondToHistory();
 }
 
 std::string LlamaWrapper::readSystemMessage(const std::string &filePath)
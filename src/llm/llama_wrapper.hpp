@@ -4,6 +4,7 @@
 #include "llama.h"
 #include <string>
 #include <vector>
+#include <memory>
 #include <fstream>
 
 // Configuration structure for sampling parameters
@@ -16,6 +17,23 @@ struct SamplingConfig
   float repetitionPenalty = 1.05f;
   int repetitionPenaltyLastN = 128;
   uint32_t seed = LLAMA_DEFAULT_SEED;
+
+  // Approximate output layer: a coarse copy of output.weight scores the vocabulary, then only the
+  // best lmHeadTopM tokens and the repetition penalty window get exact logits (0 = exact, set before initialize())
+  int lmHeadTopM = 0;
+  ggml_type lmHeadProxyType = GGML_TYPE_Q4_0;
+
+  // Compare with the exact logits every n tokens, for printLmHeadReport() (0 = never)
+  int lmHeadCheckInterval = 0;
+};
+
+// KV cache precision, K8V4 keeps K at q8_0 (attention scores) and V at q4_0
+enum class KvCachePreset
+{
+  F16,
+  Q8_0,
+  Q4_0,
+  K8V4
 };
 
 // Configuration structure for model and context parameters
@@ -25,11 +43,122 @@ struct ModelConfig
   std::string systemMessagePath = "";
   int nGpuLayers = 100;
   int nCtx = 8192;
-  int nBatch = 8192;
+
+  // Most prompt tokens per llama_decode call, independent of nCtx (longer prompts are decoded in chunks)
+  int nBatch = 2048;
+
+  // Physical batch size, the compute buffer grows with nUbatch (and nUbatch * nCtx without flashAttn), 0 = 512
+  int nUbatch = 0;
+
+  // Pick nUbatch at startup: a synthetic prefill with every candidate from 128 to 2048 (up to nBatch and within
+  // memoryBudgetMiB), the fastest median of 3 runs replaces the default nUbatch if it is faster by more than the
+  // run-to-run spread. The choice is cached per host and model in ubatchTuneCachePath (empty = tune every start),
+  // by default nimblama/ubatch_tune.cache in the user cache directory (XDG_CACHE_HOME, ~/.cache or LOCALAPPDATA)
+  bool tuneUbatch = false;
+  std::string ubatchTuneCachePath;
+
+  // RAM budget for the weights, the KV cache and the compute buffers (0 = disabled). initialize() then picks nCtx
+  // (at most the value above), nBatch, nUbatch and kvCachePreset (at most as precise as configured) that fit it,
+  // for targetConcurrency sequences of nCtx tokens (see below)
+  int memoryBudgetMiB = 0;
+
+  // Flash attention, never materializes the KQ matrix and allows a quantized V cache. Off by default: on the CPU the
+  // non-FA path measured faster (tg32 at 4k context 155 vs 135 t/s, and its prefill uses tinyBLAS)
+  bool flashAttn = false;
+
+  // KV cache types, the quantized presets need flashAttn (checked in initialize())
+  KvCachePreset kvCachePreset = KvCachePreset::F16;
+
+  // KV eviction for chats longer than nCtx: keep the first kvEvictSink tokens (attention sinks), the kvEvictHeavy
+  // most attended ones (needs flashAttn off) and the last kvEvictWindow tokens (0 = disabled, generation stops at nCtx)
+  int kvEvictWindow = 0;
+  int kvEvictSink = 4;
+  int kvEvictHeavy = 0;
+
+  // KV cache sequences for the versions of the conversation made by regenerateLast() and editMessage(),
+  // they share the cells of their common prefix unless kvEvictWindow is set (1 = roll back in place, no branches)
+  int maxBranches = 4;
+
+  // Sequences that hold a full nCtx context at the same time: the KV cache is one pool of nCtx * targetConcurrency
+  // cells shared by all sequences, and the context has max(maxBranches, targetConcurrency) of them. The memory plan
+  // sizes nCtx for the whole pool
+  int targetConcurrency = 1;
+
+  // File caching the CPU repacked weights between runs (empty = disabled)
+  std::string repackCachePath = "";
+
+  // Copy the weights into 2 MiB pages to reduce TLB misses (Linux only)
+  bool useHugepages = false;
+
+  // NUMA mode, GGML_NUMA_STRATEGY_MIRROR copies the weights to every node and pins threads per node
+  ggml_numa_strategy numaStrategy = GGML_NUMA_STRATEGY_DISABLED;
 
   explicit ModelConfig(const std::string &path);
 };
 
+// Memory estimate of a context configuration, see LlamaWrapper::planMemory()
+struct MemoryPlan
+{
+  int nCtx = 0;
+  int nCells = 0;
+  int nBatch = 0;
+  int nUbatch = 0;
+  int nSeqMax = 1;
+  KvCachePreset kvCachePreset = KvCachePreset::F16;
+
+  size_t weightsBytes = 0;
+  size_t kvBytes = 0;
+  size_t computeBytes = 0;
+
+  size_t totalBytes() const { return weightsBytes + kvBytes + computeBytes; }
+};
+
+// Messages of a conversation, the history owns their text and keeps the llama_chat_message views valid
+// while the message is in it. Each text is moved into a shared string of its own: the characters are not copied, but
+// every message costs one allocation for the shared holder, freed with the last history that holds it. Copies of the
+// history (branches) share the strings.
+class ChatHistory
+{
+public:
+  void push(const char *role, std::string content);
+  void truncate(size_t nMessages);
+  void clear() { truncate(0); }
+
+  size_t size() const { return messages.size(); }
+  bool empty() const { return messages.empty(); }
+  const llama_chat_message &operator[](size_t i) const { return messages[i]; }
+  const llama_chat_message &back() const { return messages.back(); }
+
+  // Text with its length, no strlen
+  const std::string &content(size_t i) const { return *contents[i]; }
+
+  const std::vector<llama_chat_message> &views() const { return messages; }
+
+private:
+  std::vector<llama_chat_message> messages;
+  std::vector<std::shared_ptr<const std::string>> contents;
+};
+
+// Conversation state after a message, regenerateLast() and editMessage() roll back to it
+struct ChatCheckpoint
+{
+  size_t nMessages = 0;                  // messages in the history
+  llama_pos nPast = 0;                   // tokens of the branch in the KV cache
+  int formattedLength = 0;               // characters of the formatted history that are decoded
+  int nEvicted = 0;                      // the positions are only valid while no more tokens are evicted
+  std::vector<llama_token> recentTokens; // repetition penalty window
+};
+
+// A version of the conversation, decoded into its own KV cache sequence
+struct ChatBranch
+{
+  llama_seq_id seqId = 0;
+  ChatHistory messages;
+  std::vector<ChatCheckpoint> checkpoints;
+  std::vector<llama_token> recentTokens;
+  int formattedLength = 0;
+};
+
 // Main chat application class
 class LlamaWrapper
 {
@@ -39,9 +168,28 @@ private:
   const llama_vocab *vocab;
   llama_sampler *sampler;
 
-  std::vector<llama_chat_message> messageHistory;
+  ChatHistory messageHistory;
   std::vector<char> formattedBuffer;
 
+  // Last sampled tokens, the window seen by the repetition penalty
+  std::vector<llama_token> recentTokens;
+
+  // Active branch: checkpoints after the system message and after every response, and the length of the
+  // formatted history that is in the KV cache (only the rest is decoded for the next message)
+  std::vector<ChatCheckpoint> checkpoints;
+  int formattedLength = 0;
+
+  // All branches, the entry of the active one only holds its sequence while the state above is in use
+  std::vector<ChatBranch> branches;
+  size_t activeBranch = 0;
+
+  llama_batch tokenBatch = {};
+
+  // Estimate of the configuration initialize() planned, and the RSS before it
+  MemoryPlan memoryPlan;
+  size_t rssAnonBeforeInit = 0;
+  size_t rssFileBeforeInit = 0;
+
   ModelConfig modelConfig;
   SamplingConfig samplingConfig;
 
@@ -66,7 +214,7 @@ public:
   // Core functionality
   bool initialize();
   void runChatLoop();
-  std::string processUserMessage(const std::string &userMessage);
+  std::string processUserMessage(std::string userMessage);
 
   // NEW: File loading functionality
   bool loadFileAsFirstMessage(const std::string &filePath);
@@ -76,6 +224,31 @@ public:
   const std::vector<llama_chat_message> &getMessageHistory() const;
   void clearHistory();
 
+  // New response to the last user message, the previous one stays available as a branch
+  std::string regenerateLast();
+
+  // Replace the user message at index and respond to it, the conversation from there on stays available as a branch
+  std::string editMessage(size_t index, const std::string &newContent);
+
+  // Switching branches decodes nothing, each branch keeps its KV cache sequence
+  size_t getBranchCount() const { return branches.size(); }
+  size_t getActiveBranch() const { return activeBranch; }
+  bool switchBranch(size_t branch);
+  bool dropBranch(size_t branch);
+
+  // Estimated memory of the weights, KV cache and compute buffers against the compute buffers the context reserved and
+  // the RSS the process gained in initialize(), mmap'ed weights only become resident as they are used
+  void printMemoryReport() const;
+
+  // Perplexity delta against f16 and generation speed of every KV cache preset on a text file
+  void printKvCacheReport(const std::string &textPath, int nTokens = 512);
+
+  // Perplexity delta against the full context of the KV eviction policies on a long text
+  void printKvEvictReport(const std::string &textPath, int nTokens = 2048, int nWindow = 256, int nSink = 4, int nHeavy = 64);
+
+  // Divergence of the approximate output layer from the exact logits, measured every lmHeadCheckInterval tokens
+  void printLmHeadReport() const;
+
 private:
   // Initialization helpers
   void printCudaStatus();
@@ -83,12 +256,35 @@ private:
   bool loadBackends();
   bool loadModel();
   bool createContext();
+  bool validateKvCachePreset(KvCachePreset preset, bool verbose = true) const;
+  MemoryPlan estimateMemory(int nCtx, int nUbatch, KvCachePreset preset) const;
+  bool planMemory();
+  bool tuneUbatchSize();
+  std::string ubatchTuneKey() const;
+  llama_context_params makeContextParams(KvCachePreset preset) const;
+  int nSeqMax() const;
+  bool setupKvEvict();
   bool setupSampler();
   bool setupSystemMessage(const std::string &systemMessagePath = "");
 
   // Generation helpers
-  std::string buildPromptFromHistory();
-  std::string generateResponse(const std::string &prompt);
+  std::string buildPromptFromHistory(bool addAssistant = true);
+  std::string respondToHistory();
+  bool generateResponse(const std::string &prompt, std::string &response);
+  bool decodeTokens(const llama_token *tokens, int nTokens);
+  llama_sampler *makePenaltySampler() const;
+  void restoreSamplerWindow();
+
+  // Checkpoint and branch helpers
+  void pushCheckpoint();
+  const ChatCheckpoint *findCheckpoint(size_t nMessages) const;
+  void rollbackTo(const ChatCheckpoint &checkpoint);
+  bool forkAt(const ChatCheckpoint &checkpoint);
+  void branchFrom(const ChatCheckpoint &checkpoint);
+  size_t nSystemMessages() const;
+  void saveActiveBranch();
+  void loadBranch(size_t branch);
+  void trackSampledToken(llama_token token);
 
   // Resource management
   void cleanup();
@@ -96,6 +292,7 @@ private:
   // NEW: File reading helper
   std::string readFileContents(const std::string &filePath);
   std::string readSystemMessage(const std::string &filePath);
+  bool tokenizeTextFile(const std::string &textPath, int nTokens, std::vector<llama_token> &tokens);
 
   std::string generateLogFilename();
   void writeToLog(const std::string& role, const std::string& content);